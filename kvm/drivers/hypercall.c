@@ -7,6 +7,9 @@
 #include <linux/ioport.h>
 #include <linux/completion.h>
 #include <linux/interrupt.h>
+#include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include <asm/irq.h>
@@ -15,6 +18,7 @@
 #define HYPERCALL_DRIVER_VERSION "1"
 #define PCI_VENDOR_ID_HYPERCALL	0x5002
 #define PCI_DEVICE_ID_HYPERCALL 0x2258
+#define PCI_DEVICE_ID_BALLOON	0x2259
 
 MODULE_AUTHOR ("Dor Laor <dor.laor@qumranet.com>");
 MODULE_DESCRIPTION (HYPERCALL_DRIVER_NAME);
@@ -40,6 +44,7 @@ MODULE_PARM_DESC (debug, "toggle debug flag");
 
 static struct pci_device_id hypercall_pci_tbl[] = {
 	{PCI_VENDOR_ID_HYPERCALL, PCI_DEVICE_ID_HYPERCALL, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0 },
+	{PCI_VENDOR_ID_HYPERCALL, PCI_DEVICE_ID_BALLOON, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0 },
 	{0,}
 };
 MODULE_DEVICE_TABLE (pci, hypercall_pci_tbl);
@@ -71,6 +76,10 @@ struct hypercall_dev {
 	void __iomem 	*io_addr;
 	unsigned long	base_addr;	/* device I/O address	*/
 	unsigned long 	cmd;
+	/* balloon device only */
+	struct list_head balloon_pages;	/* pages given to the host */
+	u32		balloon_nr;
+	struct work_struct balloon_work;
 };
 
 
@@ -84,6 +93,9 @@ static void __exit hypercall_sysfs_remove(struct hypercall_dev *dev);
 static int hypercall_sysfs_add(struct hypercall_dev *dev);
 
 
+static void balloon_work_fn(void *data);
+static void balloon_deflate_all(struct hypercall_dev *dev);
+
 static int __devinit hypercall_init_board(struct pci_dev *pdev,
 					  struct hypercall_dev **dev_out)
 {
@@ -185,12 +197,19 @@ static int __devinit hypercall_init_one(struct pci_dev *pdev,
 	dev->irq = pdev->irq;
 
 	spin_lock_init(&dev->lock);
+	INIT_LIST_HEAD(&dev->balloon_pages);
+	INIT_WORK(&dev->balloon_work, balloon_work_fn, dev);
         pci_set_drvdata(pdev, dev);
 
 	printk (KERN_INFO "name=%s: base_addr=0x%lx, io_addr=0x%lx, IRQ=%d\n",
 		dev->name, dev->base_addr, (unsigned long)dev->io_addr, dev->irq);
 	hypercall_open(dev);
 
+	if (pdev->device == PCI_DEVICE_ID_BALLOON) {
+		HIO_WRITE8(HCR_REGISTER, HCR_EI, dev->io_addr);
+		schedule_work(&dev->balloon_work);
+	}
+
 	if (hypercall_sysfs_add(dev) != 0)
 		return -1;
 
@@ -204,6 +223,10 @@ static void __devexit hypercall_remove_one(struct pci_dev *pdev)
 	assert(dev != NULL);
 
 	hypercall_close(dev);
+	if (dev->pci_dev->device == PCI_DEVICE_ID_BALLOON) {
+		flush_scheduled_work();
+		balloon_deflate_all(dev);
+	}
 	hypercall_sysfs_remove(dev);
 	hypercall_cleanup_dev(dev);
 	pci_disable_device(pdev);
@@ -248,6 +271,14 @@ static irqreturn_t hypercall_interrupt(int irq, void *dev_instance,
 	status = HIO_READ8(HSR_REGISTER, ioaddr);
 	DPRINTK("irq status is 0x%x\n", status);
 
+	if (dev->pci_dev->device == PCI_DEVICE_ID_BALLOON) {
+		spin_unlock(&dev->lock);
+		if ((status & HSR_BTC) == 0)
+			return IRQ_NONE;
+		schedule_work(&dev->balloon_work);
+		return IRQ_HANDLED;
+	}
+
 	/* shared irq? */
 	if (unlikely((status & HSR_VDR) == 0)) {
 		DPRINTK("not handeling irq, not ours\n");
@@ -283,6 +314,80 @@ static irqreturn_t hypercall_interrupt(int irq, void *dev_instance,
 }
 
 
+/*
+ * The host hands memory back in 2MB chunks whose pages are all in the
+ * balloon, so the balloon takes blocks of that order while it can get
+ * them, and smaller ones after that.
+ */
+#define BALLOON_ORDER	9
+
+/* give the block at page back to the guest, its order is in page_private */
+static void balloon_deflate(struct hypercall_dev *dev, struct page *page)
+{
+	void __iomem *ioaddr = (void __iomem*)dev->io_addr;
+	unsigned int order = page_private(page);
+	unsigned long i;
+
+	list_del(&page->lru);
+	dev->balloon_nr -= 1 << order;
+	for (i = 0; i < 1UL << order; i++)
+		HIO_WRITE32(HBR_DEFLATE, page_to_pfn(page) + i, ioaddr);
+	set_page_private(page, 0);
+	__free_pages(page, order);
+}
+
+/*
+ * Balloon: move guest pages to or from the host until the balloon holds
+ * HBR_TARGET pages. The pfns are written one by one, the write to HCR
+ * hands the batch over. Blocks go back whole, so the balloon may end up
+ * a little below the target.
+ */
+static void balloon_work_fn(void *data)
+{
+	struct hypercall_dev *dev = data;
+	void __iomem *ioaddr = (void __iomem*)dev->io_addr;
+	struct page *page;
+	unsigned int order = BALLOON_ORDER;
+	unsigned long i;
+	u32 target;
+
+	target = HIO_READ32(HBR_TARGET, ioaddr);
+	DPRINTK("balloon has %u pages, target %u\n", dev->balloon_nr, target);
+
+	while (dev->balloon_nr < target) {
+		while (order && dev->balloon_nr + (1 << order) > target)
+			order--;
+		page = alloc_pages(GFP_HIGHUSER | __GFP_NORETRY | __GFP_NOWARN,
+				   order);
+		if (!page) {
+			if (!order)
+				break;
+			order--;
+			continue;
+		}
+		set_page_private(page, order);
+		list_add(&page->lru, &dev->balloon_pages);
+		dev->balloon_nr += 1 << order;
+		for (i = 0; i < 1UL << order; i++)
+			HIO_WRITE32(HBR_INFLATE, page_to_pfn(page) + i, ioaddr);
+	}
+	while (dev->balloon_nr > target)
+		balloon_deflate(dev, list_entry(dev->balloon_pages.next,
+						struct page, lru));
+
+	HIO_WRITE8(HCR_REGISTER, HCR_EI, ioaddr);
+}
+
+static void balloon_deflate_all(struct hypercall_dev *dev)
+{
+	void __iomem *ioaddr = (void __iomem*)dev->io_addr;
+	struct page *page, *next;
+
+	list_for_each_entry_safe(page, next, &dev->balloon_pages, lru)
+		balloon_deflate(dev, page);
+	HIO_WRITE8(HCR_REGISTER, HCR_DI, ioaddr);
+}
+
 static int hypercall_open(struct hypercall_dev *dev)
 {
 	int rc;
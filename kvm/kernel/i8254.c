@@ -0,0 +1,385 @@
+/*
+ * 8253/8254 interval timer emulation
+ *
+ * Copyright (c) 2003-2004 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * Port of qemu's hw/i8254.c and the port 0x61 half of hw/pcspk.c to the
+ * driver.  Instead of following every output transition, channel 0
+ * arms one host timer that pulses irq 0 once per period.  Called with
+ * kvm->lock held, except for the timer callback which takes it.
+ */
+#include <linux/winkvmstab.h>
+
+#include "irq.h"
+
+#include <asm/winkvmmisc.h>
+
+#define PIT_FREQ 1193182
+#define NSEC_PER_SEC 1000000000U
+
+#define RW_STATE_LSB 1
+#define RW_STATE_MSB 2
+#define RW_STATE_WORD0 3
+#define RW_STATE_WORD1 4
+
+/* a * b / c without libgcc's 64 bit division */
+static u64 muldiv64(u64 a, u32 b, u32 c)
+{
+	u64 rl, rh, low;
+	u32 rem;
+
+	rl = (a & 0xffffffff) * b;
+	rh = (a >> 32) * b;
+	rh += rl >> 32;
+	rem = do_div(rh, c);
+	low = ((u64)rem << 32) + (rl & 0xffffffff);
+	do_div(low, c);
+	return (rh << 32) + low;
+}
+
+/* PIT ticks since the count was loaded */
+static u64 pit_elapsed(struct kvm_kpit_channel_state *s)
+{
+	return muldiv64(winkvm_get_ns() - s->count_load_time, PIT_FREQ,
+			NSEC_PER_SEC);
+}
+
+static int pit_get_count(struct kvm_kpit_channel_state *s)
+{
+	u64 d;
+	int counter;
+
+	d = pit_elapsed(s);
+	switch (s->mode) {
+	case 0:
+	case 1:
+	case 4:
+	case 5:
+		counter = (s->count - d) & 0xffff;
+		break;
+	case 3:
+		/* XXX: may be incorrect for odd counts */
+		d *= 2;
+		counter = s->count - do_div(d, s->count);
+		break;
+	default:
+		counter = s->count - do_div(d, s->count);
+		break;
+	}
+	return counter;
+}
+
+/* get pit output bit */
+static int pit_get_out(struct kvm_kpit_channel_state *s)
+{
+	u64 d;
+	u32 rem;
+	int out;
+
+	d = pit_elapsed(s);
+	switch (s->mode) {
+	default:
+	case 0:
+		out = (d >= s->count);
+		break;
+	case 1:
+		out = (d < s->count);
+		break;
+	case 2:
+		out = d != 0 && do_div(d, s->count) == 0;
+		break;
+	case 3:
+		rem = do_div(d, s->count);
+		out = rem < ((s->count + 1) >> 1);
+		break;
+	case 4:
+	case 5:
+		out = (d == s->count);
+		break;
+	}
+	return out;
+}
+
+/* (re)arm the irq 0 timer after a load of channel 0 */
+static void pit_timer_update(struct kvm_pit *pit)
+{
+	struct kvm_kpit_channel_state *s = &pit->channels[0];
+	u64 period;
+
+	period = muldiv64(s->count, NSEC_PER_SEC, PIT_FREQ);
+	switch (s->mode) {
+	case 2:
+	case 3:
+		winkvm_timer_start(pit->timer, period, period);
+		break;
+	default:
+		/* one terminal count */
+		winkvm_timer_start(pit->timer, period, 0);
+		break;
+	}
+}
+
+static void pit_timer_fn(void *data)
+{
+	struct kvm_pit *pit = data;
+	struct kvm *kvm = pit->kvm;
+
+	spin_lock(&kvm->lock);
+	kvm_pic_set_irq(kvm->vpic, 0, 1);
+	kvm_pic_set_irq(kvm->vpic, 0, 0);
+	spin_unlock(&kvm->lock);
+}
+
+/* val must be 0 or 1 */
+static void pit_set_gate(struct kvm_pit *pit, int channel, int val)
+{
+	struct kvm_kpit_channel_state *s = &pit->channels[channel];
+
+	switch (s->mode) {
+	default:
+	case 0:
+	case 4:
+		/* XXX: just disable/enable counting */
+		break;
+	case 1:
+	case 2:
+	case 3:
+	case 5:
+		/* restart counting on rising edge */
+		if (s->gate < val)
+			s->count_load_time = winkvm_get_ns();
+		break;
+	}
+	s->gate = val;
+}
+
+static void pit_load_count(struct kvm_pit *pit, int channel, u32 val)
+{
+	struct kvm_kpit_channel_state *s = &pit->channels[channel];
+
+	if (val == 0)
+		val = 0x10000;
+	s->count_load_time = winkvm_get_ns();
+	s->count = val;
+	if (channel == 0)
+		pit_timer_update(pit);
+}
+
+/* if already latched, do not latch again */
+static void pit_latch_count(struct kvm_kpit_channel_state *s)
+{
+	if (!s->count_latched) {
+		s->latched_count = pit_get_count(s);
+		s->count_latched = s->rw_mode;
+	}
+}
+
+static void pit_ioport_write(struct kvm_pit *pit, u32 addr, u32 val)
+{
+	int channel, access;
+	struct kvm_kpit_channel_state *s;
+
+	addr &= 3;
+	if (addr == 3) {
+		channel = val >> 6;
+		if (channel == 3) {
+			/* read back command */
+			for (channel = 0; channel < 3; channel++) {
+				s = &pit->channels[channel];
+				if (!(val & (2 << channel)))
+					continue;
+				if (!(val & 0x20))
+					pit_latch_count(s);
+				if (!(val & 0x10) && !s->status_latched) {
+					/* status latch */
+					/* XXX: add BCD and null count */
+					s->status = (pit_get_out(s) << 7) |
+						(s->rw_mode << 4) |
+						(s->mode << 1) |
+						s->bcd;
+					s->status_latched = 1;
+				}
+			}
+		} else {
+			s = &pit->channels[channel];
+			access = (val >> 4) & 3;
+			if (access == 0)
+				pit_latch_count(s);
+			else {
+				s->rw_mode = access;
+				s->read_state = access;
+				s->write_state = access;
+
+				s->mode = (val >> 1) & 7;
+				if (s->mode > 5)
+					s->mode -= 4;
+				s->bcd = val & 1;
+				/* the timer is armed by the next count */
+				if (channel == 0)
+					winkvm_timer_cancel(pit->timer);
+			}
+		}
+	} else {
+		s = &pit->channels[addr];
+		switch (s->write_state) {
+		default:
+		case RW_STATE_LSB:
+			pit_load_count(pit, addr, val);
+			break;
+		case RW_STATE_MSB:
+			pit_load_count(pit, addr, val << 8);
+			break;
+		case RW_STATE_WORD0:
+			s->write_latch = val;
+			s->write_state = RW_STATE_WORD1;
+			break;
+		case RW_STATE_WORD1:
+			pit_load_count(pit, addr, s->write_latch | (val << 8));
+			s->write_state = RW_STATE_WORD0;
+			break;
+		}
+	}
+}
+
+static u32 pit_ioport_read(struct kvm_pit *pit, u32 addr)
+{
+	int ret, count;
+	struct kvm_kpit_channel_state *s;
+
+	addr &= 3;
+	if (addr == 3)
+		/* the mode register is write only */
+		return 0xff;
+	s = &pit->channels[addr];
+	if (s->status_latched) {
+		s->status_latched = 0;
+		ret = s->status;
+	} else if (s->count_latched) {
+		switch (s->count_latched) {
+		default:
+		case RW_STATE_LSB:
+			ret = s->latched_count & 0xff;
+			s->count_latched = 0;
+			break;
+		case RW_STATE_MSB:
+			ret = s->latched_count >> 8;
+			s->count_latched = 0;
+			break;
+		case RW_STATE_WORD0:
+			ret = s->latched_count & 0xff;
+			s->count_latched = RW_STATE_MSB;
+			break;
+		}
+	} else {
+		switch (s->read_state) {
+		default:
+		case RW_STATE_LSB:
+			count = pit_get_count(s);
+			ret = count & 0xff;
+			break;
+		case RW_STATE_MSB:
+			count = pit_get_count(s);
+			ret = (count >> 8) & 0xff;
+			break;
+		case RW_STATE_WORD0:
+			count = pit_get_count(s);
+			ret = count & 0xff;
+			s->read_state = RW_STATE_WORD1;
+			break;
+		case RW_STATE_WORD1:
+			count = pit_get_count(s);
+			ret = (count >> 8) & 0xff;
+			s->read_state = RW_STATE_WORD0;
+			break;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Ports 0x40-0x43 of the pit and 0x61, whose gate and output bits of
+ * channel 2 are used by guests to calibrate their delay loops.
+ * Returns 0 if port is not ours.
+ */
+int kvm_pit_pio(struct kvm_pit *pit, u16 port, int in, u32 *val)
+{
+	if (port >= 0x40 && port <= 0x43) {
+		if (in)
+			*val = pit_ioport_read(pit, port);
+		else
+			pit_ioport_write(pit, port, *val & 0xff);
+		return 1;
+	}
+	if (port == 0x61) {
+		if (in) {
+			pit->refresh_clock ^= 1 << 4;
+			*val = pit->channels[2].gate | (pit->speaker_data_on << 1) |
+				pit->refresh_clock |
+				(pit_get_out(&pit->channels[2]) << 5);
+		} else {
+			pit->speaker_data_on = (*val >> 1) & 1;
+			pit_set_gate(pit, 2, *val & 1);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+void kvm_pit_reset(struct kvm_pit *pit)
+{
+	struct kvm_kpit_channel_state *s;
+	int i;
+
+	winkvm_timer_cancel(pit->timer);
+	for (i = 0; i < 3; i++) {
+		s = &pit->channels[i];
+		memset(s, 0, sizeof(*s));
+		s->mode = 3;
+		s->gate = (i != 2);
+		s->count = 0x10000;
+		s->count_load_time = winkvm_get_ns();
+	}
+	pit->speaker_data_on = 0;
+	pit->refresh_clock = 0;
+	pit_timer_update(pit);
+}
+
+struct kvm_pit *kvm_create_pit(struct kvm *kvm)
+{
+	struct kvm_pit *pit;
+
+	pit = kzalloc(sizeof(struct kvm_pit), GFP_KERNEL);
+	if (!pit)
+		return NULL;
+	pit->kvm = kvm;
+	pit->timer = winkvm_timer_create(pit_timer_fn, pit);
+	if (!pit->timer) {
+		kfree(pit);
+		return NULL;
+	}
+	return pit;
+}
+
+void kvm_free_pit(struct kvm_pit *pit)
+{
+	winkvm_timer_destroy(pit->timer);
+	kfree(pit);
+}
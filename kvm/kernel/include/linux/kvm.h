@@ -77,8 +77,15 @@ struct winkvm_mapmem_initialize {
 	__u32 base_gfn;	
 	__u32 npages;
 	__u8  *mapUserVA;	
+	__u32 flags;
 };
 
+/*
+ * for winkvm_mapmem_initialize::flags: back the region with pageable
+ * memory, host pages are locked chunk by chunk when the guest touches them
+ */
+#define WINKVM_MAPMEM_DEMAND  1
+
 struct winkvm_pfmap {	
 	__u64 phys;
 	__u64 virt;	
@@ -91,6 +98,207 @@ struct winkvm_getpvmap {
 	struct winkvm_pfmap maptable[0];	
 };
 
+/* for WINKVM_MAP_RUN: share struct kvm_run page of a vcpu */
+struct winkvm_map_run {
+	int   vcpu_fd;
+	__u32 size;
+	__u8  *mapUserVA;
+};
+
+/*
+ * Elements of a batched string I/O exit are passed in the rest of the
+ * kvm_run page; kvm_run::io.data_offset is relative to struct kvm_run.
+ */
+#define WINKVM_PIO_DATA_OFFSET 512
+#define WINKVM_PIO_DATA_SIZE   (4096 - WINKVM_PIO_DATA_OFFSET)
+
+/* for WINKVM_(UN)REGISTER_COALESCED_MMIO: writes that need no reply */
+struct winkvm_coalesced_mmio_zone {
+	int   vm_fd;
+	__u32 size;
+	__u64 addr;
+};
+
+struct winkvm_coalesced_mmio {
+	__u64 phys_addr;
+	__u32 len;
+	__u32 pad;
+	__u8  data[8];
+};
+
+/*
+ * Writes to a coalesced zone are queued in the second page of the
+ * kvm_run mapping instead of exiting.  The driver only moves last,
+ * user space only moves first; the ring is full when last + 1 == first.
+ */
+struct winkvm_coalesced_mmio_ring {
+	__u32 first;
+	__u32 last;
+	struct winkvm_coalesced_mmio coalesced_mmio[0];
+};
+
+#define WINKVM_COALESCED_MMIO_OFFSET 4096
+#define WINKVM_COALESCED_MMIO_MAX \
+	((4096 - sizeof(struct winkvm_coalesced_mmio_ring)) / \
+	 sizeof(struct winkvm_coalesced_mmio))
+
+/*
+ * Gfns a vcpu dirtied while logging is on, in the pages after the
+ * coalesced mmio ring.  A gfn is queued once until it is write protected
+ * again.  The driver only moves last, user space only moves first;
+ * WINKVM_RESET_DIRTY_RINGS write protects the entries before first, and
+ * the driver does not reuse them until then.
+ */
+struct winkvm_dirty_ring {
+	__u32 first;
+	__u32 last;
+	__u64 gfn[0];
+};
+
+#define WINKVM_DIRTY_RING_OFFSET (WINKVM_COALESCED_MMIO_OFFSET + 4096)
+#define WINKVM_DIRTY_RING_SIZE   (4 * 4096)
+#define WINKVM_DIRTY_RING_MAX \
+	((WINKVM_DIRTY_RING_SIZE - sizeof(struct winkvm_dirty_ring)) / \
+	 sizeof(__u64))
+#define WINKVM_RUN_SIZE (WINKVM_DIRTY_RING_OFFSET + WINKVM_DIRTY_RING_SIZE)
+
+/* for KVM_CREATE_VM (optional): per-vm parameters */
+struct winkvm_create_vm {
+	__u32 n_mmu_pages; /* shadow page pool, 0: sized from guest memory */
+	__u32 padding;
+};
+
+/* for WINKVM_GET_MMU_POOL */
+struct winkvm_mmu_pool {
+	int   vm_fd;
+	__u32 n_alloc_mmu_pages;
+	__u32 n_free_mmu_pages;
+	__u32 n_mmu_page_hash;
+	__u32 mmu_shadow_zapped; /* all zapped shadow pages */
+	__u32 mmu_recycled;      /* zapped because the pool ran short */
+};
+
+/* for WINKVM_IRQ_LINE: a pin of the in-kernel pics */
+struct winkvm_irq_level {
+	int   vm_fd;
+	__u32 irq;
+	__u32 level;
+};
+
+/* for WINKVM_APIC_DELIVER: a message of the user space i/o apic */
+struct winkvm_apic_msg {
+	int   vm_fd;
+	__u8  dest;
+	__u8  dest_mode;
+	__u8  delivery_mode;
+	__u8  vector;
+	__u32 trig_mode;
+};
+
+#define WINKVM_NR_EXIT_REASONS 64
+#define WINKVM_NR_HIST_BUCKETS 16
+
+/*
+ * Exits of one hardware exit reason.  hist[n] counts the handlers that
+ * took less than 256 << n tsc cycles, the last bucket everything above.
+ */
+struct winkvm_exit_stat {
+	__u32 count;
+	__u32 hist[WINKVM_NR_HIST_BUCKETS];
+	__u64 cycles;	/* total spent in the handler */
+};
+
+struct winkvm_vcpu_stat {
+	__u32 pf_fixed;
+	__u32 pf_guest;
+	__u32 pf_prefetch;	/* shadow ptes filled ahead of a fault */
+	__u32 tlb_flush;
+	__u32 invlpg;
+	__u32 mmu_unsync;	/* shadowed guest page tables made writable */
+	__u32 mmu_sync;		/* ... and brought back in sync */
+	__u32 pf_populate;	/* demand-paged guest memory backed by a chunk */
+
+	__u32 exits;
+	__u32 io_exits;
+	__u32 mmio_exits;
+	__u32 mmio_coalesced;
+	__u32 signal_exits;
+	__u32 irq_window_exits;
+	__u32 halt_exits;
+	__u32 request_irq_exits;
+	__u32 irq_exits;
+	/* indexed by the vmx exit reason, empty on svm */
+	struct winkvm_exit_stat exit[WINKVM_NR_EXIT_REASONS];
+};
+
+/* for WINKVM_GET_STATS */
+struct winkvm_stats {
+	int   vm_fd;
+	int   vcpu;	/* slot, or -1 for the sum over the vm */
+	struct winkvm_vcpu_stat stat;
+};
+
+/*
+ * for WINKVM_MARK_DIRTY: guest frames that user space wrote through its
+ * own mapping of guest memory
+ */
+struct winkvm_dirty_gfns {
+	int   vm_fd;
+	__u32 nr;
+	__u32 gfn[0];
+};
+
+/*
+ * for WINKVM_BALLOON: gfns the guest balloon gave up, or with deflate
+ * set took back
+ */
+struct winkvm_balloon {
+	int   vm_fd;
+	__u32 deflate;
+	__u32 released;		/* out: 2MB chunks handed back to the host */
+	__u32 ballooned;	/* out: pages in the balloon now */
+	__u32 nr;
+	__u32 gfn[0];
+};
+
+/* for WINKVM_RESET_DIRTY_RINGS */
+struct winkvm_dirty_reset {
+	int   vm_fd;
+	__u32 reset;		/* out: gfns write protected again */
+	__u32 overflow;		/* out: some dirty gfns are only in the bitmap */
+	__u32 padding;
+};
+
+/* event ids of the trace ring, see winkvm_trace() */
+enum {
+	WINKVM_TRC_FUNC_ENTER = 1,	/* ip */
+	WINKVM_TRC_FUNC_EXIT,		/* ip */
+	WINKVM_TRC_VMENTRY,		/* vcpu */
+	WINKVM_TRC_VMEXIT,		/* vcpu, exit reason, rip */
+	WINKVM_TRC_PAGE_FAULT,		/* vcpu, gva, error code */
+	WINKVM_TRC_PIO,			/* vcpu, port, size, in */
+	WINKVM_TRC_MMIO,		/* vcpu, gpa, len, write */
+	WINKVM_TRC_INJ_IRQ,		/* vcpu, vector */
+};
+
+#define WINKVM_TRACE_BATCH 128
+
+struct winkvm_trace_rec {
+	__u64 tsc;
+	__u32 seq;	/* position in the ring plus one, 0 while written */
+	__u32 event;
+	__u32 args[4];
+};
+
+/* for WINKVM_GET_TRACE, drains up to a batch of one host cpu's ring */
+struct winkvm_trace {
+	int   cpu;
+	__u32 nr;	/* records returned */
+	__u32 lost;	/* records overwritten before they were read */
+	__u32 padding;
+	struct winkvm_trace_rec rec[WINKVM_TRACE_BATCH];
+};
+
 #endif
 
 #pragma pack()
@@ -122,6 +330,7 @@ struct kvm_run {
   int vcpu_fd;
   int _errno;  
   int ioctl_r;  
+  __u32 tlb_gen;  /* out: changes when guest translations may have */
 #endif   
   /* in */
   __u32 emulated;  /* skip current instruction */
@@ -167,6 +376,7 @@ struct kvm_run {
 		__u64 address;
 		__u32 value;
 	  };
+	  __u32 data_offset; /* batched string I/O data, 0 if none */
 	} io;
 	/*
 	struct {
@@ -349,6 +559,18 @@ struct kvm_dirty_log {
 #define WINKVM_WRITE_GUEST     _IO(KVMIO, 36)
 #define WINKVM_MAPMEM_INITIALIZE  _IOWR(KVMIO, 37, struct winkvm_mapmem_initialize)
 #define WINKVM_MAPMEM_RELEASE  _IOWR(KVMIO, 39, struct winkvm_getpvmap)
+#define WINKVM_MAP_RUN         _IOWR(KVMIO, 40, struct winkvm_map_run)
+#define WINKVM_GET_MMU_POOL    _IOWR(KVMIO, 41, struct winkvm_mmu_pool)
+#define WINKVM_REGISTER_COALESCED_MMIO   _IOW(KVMIO, 42, struct winkvm_coalesced_mmio_zone)
+#define WINKVM_UNREGISTER_COALESCED_MMIO _IOW(KVMIO, 43, struct winkvm_coalesced_mmio_zone)
+#define WINKVM_CREATE_IRQCHIP  _IOW(KVMIO, 44, int)
+#define WINKVM_IRQ_LINE        _IOW(KVMIO, 45, struct winkvm_irq_level)
+#define WINKVM_APIC_DELIVER    _IOW(KVMIO, 46, struct winkvm_apic_msg)
+#define WINKVM_GET_STATS       _IOWR(KVMIO, 47, struct winkvm_stats)
+#define WINKVM_GET_TRACE       _IOWR(KVMIO, 48, struct winkvm_trace)
+#define WINKVM_MARK_DIRTY      _IOW(KVMIO, 49, struct winkvm_dirty_gfns)
+#define WINKVM_BALLOON         _IOWR(KVMIO, 50, struct winkvm_balloon)
+#define WINKVM_RESET_DIRTY_RINGS _IOWR(KVMIO, 51, struct winkvm_dirty_reset)
 
 #endif
 
@@ -0,0 +1,272 @@
+/*
+ * Glue between the in-kernel interrupt controllers and the vcpus:
+ * interrupt selection, port i/o dispatch, halting and waking up.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+#include <linux/winkvmstab.h>
+
+#include "irq.h"
+
+/* called with kvm->lock held */
+static int __kvm_cpu_has_interrupt(struct kvm_vcpu *vcpu)
+{
+	struct kvm_pic *s = vcpu->kvm->vpic;
+
+	if (kvm_apic_has_interrupt(vcpu) >= 0)
+		return 1;
+	return kvm_apic_accept_pic_intr(vcpu) && s->output;
+}
+
+int kvm_cpu_has_interrupt(struct kvm_vcpu *vcpu)
+{
+	struct kvm *kvm = vcpu->kvm;
+	int r;
+
+	spin_lock(&kvm->lock);
+	r = __kvm_cpu_has_interrupt(vcpu);
+	spin_unlock(&kvm->lock);
+	return r;
+}
+
+/*
+ * Acknowledge the highest priority interrupt for the vcpu and return
+ * its vector, or -1 if there is none.
+ */
+int kvm_cpu_get_interrupt(struct kvm_vcpu *vcpu)
+{
+	struct kvm *kvm = vcpu->kvm;
+	struct kvm_pic *s = kvm->vpic;
+	int vector;
+
+	spin_lock(&kvm->lock);
+	vector = kvm_apic_get_interrupt(vcpu);
+	if (vector < 0 && kvm_apic_accept_pic_intr(vcpu) && s->output)
+		vector = kvm_pic_read_irq(s);
+	spin_unlock(&kvm->lock);
+	return vector;
+}
+
+/*
+ * Wake the vcpu up if it is halted, or make it exit so that it looks
+ * at its interrupts again if it is running on another processor.
+ */
+void kvm_vcpu_kick(struct kvm_vcpu *vcpu)
+{
+	int cpu = vcpu->cpu;
+
+	if (vcpu->halt_event)
+		winkvm_event_set(vcpu->halt_event);
+	if (cpu != -1 && cpu != raw_smp_processor_id())
+		smp_send_reschedule(cpu);
+}
+
+/* the INTR line of the master pic goes to LINT0 of the bsp */
+void kvm_pic_update_output(struct kvm *kvm)
+{
+	struct kvm_vcpu *vcpu = &kvm->vcpus[0];
+
+	if (vcpu->apic && kvm->vpic->output && kvm_apic_accept_pic_intr(vcpu))
+		kvm_vcpu_kick(vcpu);
+}
+
+/*
+ * Called with kvm->lock held.  Returns 1 if the vcpu may enter the
+ * guest, and moves it to VCPU_MP_STATE_RUNNABLE.
+ */
+static int kvm_vcpu_runnable(struct kvm_vcpu *vcpu, int *sipi)
+{
+	switch (vcpu->mp_state) {
+	case VCPU_MP_STATE_RUNNABLE:
+		return 1;
+	case VCPU_MP_STATE_HALTED:
+		if (!vcpu->irq_summary && !__kvm_cpu_has_interrupt(vcpu))
+			return 0;
+		break;
+	case VCPU_MP_STATE_SIPI_RECEIVED:
+		*sipi = 1;
+		break;
+	default:
+		return 0;
+	}
+	vcpu->mp_state = VCPU_MP_STATE_RUNNABLE;
+	return 1;
+}
+
+/* start the application processor at vector * 4096 in real mode */
+static void kvm_vcpu_sipi(struct kvm_vcpu *vcpu)
+{
+	struct kvm_segment cs;
+
+	kvm_arch_ops->get_segment(vcpu, &cs, VCPU_SREG_CS);
+	cs.selector = vcpu->sipi_vector << 8;
+	cs.base = vcpu->sipi_vector << 12;
+	kvm_arch_ops->set_segment(vcpu, &cs, VCPU_SREG_CS);
+	kvm_arch_ops->cache_regs(vcpu);
+	vcpu->rip = 0;
+	kvm_arch_ops->decache_regs(vcpu);
+}
+
+/*
+ * Called by a loaded vcpu that is not runnable.  Waits on the halt event
+ * outside of the cpu, for at most KVM_HALT_WAIT_NS.  Returns 1 if the
+ * vcpu may enter the guest, 0 if it should go back to user space.
+ */
+int kvm_vcpu_block(struct kvm_vcpu *vcpu)
+{
+	struct kvm *kvm = vcpu->kvm;
+	int sipi = 0;
+	int r;
+
+	spin_lock(&kvm->lock);
+	r = kvm_vcpu_runnable(vcpu, &sipi);
+	spin_unlock(&kvm->lock);
+
+	if (!r) {
+		kvm_arch_ops->vcpu_put(vcpu);
+		winkvm_event_wait(vcpu->halt_event, KVM_HALT_WAIT_NS);
+		kvm_arch_ops->vcpu_load(vcpu);
+
+		spin_lock(&kvm->lock);
+		r = kvm_vcpu_runnable(vcpu, &sipi);
+		spin_unlock(&kvm->lock);
+	}
+
+	if (sipi)
+		kvm_vcpu_sipi(vcpu);
+	return r;
+}
+
+/*
+ * Emulate a non-string in or out on the pic, elcr, pit or port 0x61.
+ * Returns 0 if the port belongs to user space.
+ */
+int kvm_irqchip_pio(struct kvm_vcpu *vcpu, u16 port, int size, int in)
+{
+	struct kvm *kvm = vcpu->kvm;
+	u32 val = vcpu->regs[VCPU_REGS_RAX];
+	u32 mask;
+	int r;
+
+	spin_lock(&kvm->lock);
+	r = kvm_pic_pio(kvm->vpic, port, in, &val) ||
+		kvm_pit_pio(kvm->vpit, port, in, &val);
+	spin_unlock(&kvm->lock);
+
+	if (r && in) {
+		mask = size == 4 ? ~0U : (1U << (size * 8)) - 1;
+		vcpu->regs[VCPU_REGS_RAX] =
+			(vcpu->regs[VCPU_REGS_RAX] & ~(unsigned long)mask) |
+			(val & mask);
+	}
+	return r;
+}
+
+static int kvm_irqchip_alloc_vcpu(struct kvm_vcpu *vcpu)
+{
+	int r;
+
+	if (!vcpu->apic) {
+		r = kvm_create_lapic(vcpu);
+		if (r < 0)
+			return r;
+	}
+	if (!vcpu->halt_event) {
+		vcpu->halt_event = winkvm_event_create();
+		if (!vcpu->halt_event)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+int kvm_irqchip_create_vcpu(struct kvm_vcpu *vcpu)
+{
+	struct kvm *kvm = vcpu->kvm;
+	int r;
+
+	r = kvm_irqchip_alloc_vcpu(vcpu);
+	if (r < 0)
+		return r;
+	spin_lock(&kvm->lock);
+	kvm_lapic_reset(vcpu);
+	spin_unlock(&kvm->lock);
+	return 0;
+}
+
+void kvm_irqchip_free_vcpu(struct kvm_vcpu *vcpu)
+{
+	kvm_free_lapic(vcpu);
+	if (vcpu->halt_event) {
+		winkvm_event_destroy(vcpu->halt_event);
+		vcpu->halt_event = NULL;
+	}
+}
+
+/*
+ * Create the interrupt controllers of the vm, with a local apic for the
+ * vcpus that already exist.  On a vm that has them, reset them instead,
+ * which is what user space does on a system reset.
+ */
+int kvm_create_irqchip(struct kvm *kvm)
+{
+	struct kvm_pic *pic = kvm->vpic;
+	struct kvm_pit *pit = kvm->vpit;
+	int i, r;
+
+	if (!pic) {
+		pic = kvm_create_pic(kvm);
+		if (!pic)
+			return -ENOMEM;
+		pit = kvm_create_pit(kvm);
+		if (!pit) {
+			kfree(pic);
+			return -ENOMEM;
+		}
+		for (i = 0; i < KVM_MAX_VCPUS; ++i) {
+			struct kvm_vcpu *vcpu = &kvm->vcpus[i];
+
+			if (!vcpu->vmcs)
+				continue;
+			r = kvm_irqchip_alloc_vcpu(vcpu);
+			if (r < 0)
+				goto out_free;
+		}
+	}
+
+	spin_lock(&kvm->lock);
+	kvm_pic_reset(pic);
+	kvm_pit_reset(pit);
+	for (i = 0; i < KVM_MAX_VCPUS; ++i)
+		if (kvm->vcpus[i].apic)
+			kvm_lapic_reset(&kvm->vcpus[i]);
+	kvm->vpic = pic;
+	kvm->vpit = pit;
+	spin_unlock(&kvm->lock);
+	return 0;
+
+out_free:
+	for (i = 0; i < KVM_MAX_VCPUS; ++i)
+		kvm_irqchip_free_vcpu(&kvm->vcpus[i]);
+	kvm_free_pit(pit);
+	kfree(pic);
+	return r;
+}
+
+/*
+ * Stops the timers before anything is freed, so that no callback runs
+ * on freed state.
+ */
+void kvm_free_irqchip(struct kvm *kvm)
+{
+	int i;
+
+	if (!kvm->vpic)
+		return;
+	kvm_free_pit(kvm->vpit);
+	kvm->vpit = NULL;
+	for (i = 0; i < KVM_MAX_VCPUS; ++i)
+		kvm_irqchip_free_vcpu(&kvm->vcpus[i]);
+	kfree(kvm->vpic);
+	kvm->vpic = NULL;
+}
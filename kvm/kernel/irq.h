@@ -0,0 +1,141 @@
+/*
+ * In-kernel interrupt controllers of a vm: a pair of i8259, an i8254
+ * and one local apic per vcpu.  They follow qemu's hw/i8259.c,
+ * hw/i8254.c and hw/apic.c, so that timer ticks, EOIs and IPIs are
+ * handled without a round trip through user space.
+ *
+ * All of the state is protected by kvm->lock.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+#ifndef __IRQ_H
+#define __IRQ_H
+
+#include "kvm.h"
+
+#define irqchip_in_kernel(kvm) ((kvm)->vpic != NULL)
+
+/*
+ * A halted vcpu waits at most this long in the driver, so that user
+ * space still gets to run its main loop.
+ */
+#define KVM_HALT_WAIT_NS 10000000ULL
+
+struct kvm_pic;
+
+struct kvm_kpic_state {
+	u8 last_irr;	/* edge detection */
+	u8 irr;		/* interrupt request register */
+	u8 imr;		/* interrupt mask register */
+	u8 isr;		/* interrupt service register */
+	u8 priority_add;	/* highest irq priority */
+	u8 irq_base;
+	u8 read_reg_select;
+	u8 poll;
+	u8 special_mask;
+	u8 init_state;
+	u8 auto_eoi;
+	u8 rotate_on_auto_eoi;
+	u8 special_fully_nested_mode;
+	u8 init4;	/* true if 4 byte init */
+	u8 elcr;	/* PIIX edge/trigger selection */
+	u8 elcr_mask;
+	struct kvm_pic *pics_state;
+};
+
+struct kvm_pic {
+	struct kvm_kpic_state pics[2]; /* 0 is master pic, 1 is slave pic */
+	int output;	/* INTR of the master pic */
+	struct kvm *kvm;
+};
+
+struct kvm_kpit_channel_state {
+	u32 count;	/* can be 65536 */
+	u16 latched_count;
+	u8 count_latched;
+	u8 status_latched;
+	u8 status;
+	u8 read_state;
+	u8 write_state;
+	u8 write_latch;
+	u8 rw_mode;
+	u8 mode;
+	u8 bcd;		/* not supported */
+	u8 gate;	/* timer start */
+	s64 count_load_time;	/* ns */
+};
+
+struct kvm_pit {
+	struct kvm_kpit_channel_state channels[3];
+	int speaker_data_on;
+	int refresh_clock;	/* bit 4 of port 0x61 */
+	struct winkvm_timer *timer;	/* irq 0 of channel 0 */
+	struct kvm *kvm;
+};
+
+#define APIC_LVT_NB 6
+
+struct kvm_lapic {
+	u8 id;
+	u8 arb_id;
+	u8 tpr;
+	u32 spurious_vec;
+	u8 log_dest;
+	u8 dest_mode;
+	u32 isr[8];	/* in service register */
+	u32 tmr[8];	/* trigger mode register */
+	u32 irr[8];	/* interrupt request register */
+	u32 lvt[APIC_LVT_NB];
+	u32 esr;	/* error register */
+	u32 icr[2];
+
+	u32 divide_conf;
+	int count_shift;
+	u32 initial_count;
+	s64 initial_count_load_time;	/* ns */
+	struct winkvm_timer *timer;
+	struct kvm_vcpu *vcpu;
+};
+
+/* irq.c */
+int kvm_create_irqchip(struct kvm *kvm);
+void kvm_free_irqchip(struct kvm *kvm);
+int kvm_irqchip_create_vcpu(struct kvm_vcpu *vcpu);
+void kvm_irqchip_free_vcpu(struct kvm_vcpu *vcpu);
+int kvm_irqchip_pio(struct kvm_vcpu *vcpu, u16 port, int size, int in);
+int kvm_cpu_has_interrupt(struct kvm_vcpu *vcpu);
+int kvm_cpu_get_interrupt(struct kvm_vcpu *vcpu);
+void kvm_vcpu_kick(struct kvm_vcpu *vcpu);
+int kvm_vcpu_block(struct kvm_vcpu *vcpu);
+void kvm_pic_update_output(struct kvm *kvm);
+
+/* i8259.c */
+struct kvm_pic *kvm_create_pic(struct kvm *kvm);
+void kvm_pic_reset(struct kvm_pic *s);
+void kvm_pic_set_irq(struct kvm_pic *s, int irq, int level);
+int kvm_pic_read_irq(struct kvm_pic *s);
+int kvm_pic_pio(struct kvm_pic *s, u16 port, int in, u32 *val);
+
+/* i8254.c */
+struct kvm_pit *kvm_create_pit(struct kvm *kvm);
+void kvm_free_pit(struct kvm_pit *pit);
+void kvm_pit_reset(struct kvm_pit *pit);
+int kvm_pit_pio(struct kvm_pit *pit, u16 port, int in, u32 *val);
+
+/* lapic.c */
+int kvm_create_lapic(struct kvm_vcpu *vcpu);
+void kvm_free_lapic(struct kvm_vcpu *vcpu);
+void kvm_lapic_reset(struct kvm_vcpu *vcpu);
+int kvm_apic_has_interrupt(struct kvm_vcpu *vcpu);
+int kvm_apic_get_interrupt(struct kvm_vcpu *vcpu);
+int kvm_apic_accept_pic_intr(struct kvm_vcpu *vcpu);
+int kvm_apic_mmio_read(struct kvm_vcpu *vcpu, gpa_t gpa, void *val,
+		       int bytes);
+int kvm_apic_mmio_write(struct kvm_vcpu *vcpu, gpa_t gpa, const void *val,
+			int bytes);
+void kvm_apic_set_base(struct kvm_vcpu *vcpu, u64 value);
+void kvm_apic_bus_deliver(struct kvm *kvm, u8 dest, u8 dest_mode,
+			  u8 delivery_mode, u8 vector, u8 trig_mode);
+
+#endif
@@ -21,6 +21,7 @@
 #include "vmx.h"
 
 #define CR0_PE_MASK (1ULL << 0)
+#define CR0_MP_MASK (1ULL << 1)
 #define CR0_TS_MASK (1ULL << 3)
 #define CR0_NE_MASK (1ULL << 5)
 #define CR0_WP_MASK (1ULL << 16)
@@ -43,28 +44,42 @@
 
 #define KVM_GUEST_CR0_MASK \
 	(CR0_PG_MASK | CR0_PE_MASK | CR0_WP_MASK | CR0_NE_MASK \
-	 | CR0_NW_MASK | CR0_CD_MASK)
+	 | CR0_NW_MASK | CR0_CD_MASK | CR0_TS_MASK | CR0_MP_MASK)
 #define KVM_VM_CR0_ALWAYS_ON \
-	(CR0_PG_MASK | CR0_PE_MASK | CR0_WP_MASK | CR0_NE_MASK)
+	(CR0_PG_MASK | CR0_PE_MASK | CR0_WP_MASK | CR0_NE_MASK \
+	 | CR0_TS_MASK | CR0_MP_MASK)
 #define KVM_GUEST_CR4_MASK \
 	(CR4_PSE_MASK | CR4_PAE_MASK | CR4_PGE_MASK | CR4_VMXE_MASK | CR4_VME_MASK)
 #define KVM_PMODE_VM_CR4_ALWAYS_ON (CR4_VMXE_MASK | CR4_PAE_MASK)
 #define KVM_RMODE_VM_CR4_ALWAYS_ON (CR4_VMXE_MASK | CR4_PAE_MASK | CR4_VME_MASK)
 
+#define PFERR_PRESENT_MASK (1U << 0)
+#define PFERR_WRITE_MASK (1U << 1)
+#define PFERR_USER_MASK (1U << 2)
+#define PFERR_FETCH_MASK (1U << 4)
+
 #define INVALID_PAGE (~(hpa_t)0)
 #define UNMAPPED_GVA (~(gpa_t)0)
 
-#define KVM_MAX_VCPUS 1
-#define KVM_MEMORY_SLOTS 4
-#define KVM_NUM_MMU_PAGES 256
+#define KVM_MAX_VCPUS 8
+#define KVM_MEMORY_SLOTS 32 /* must fit in kvm_mmu_page.slot_bitmap */
+#define KVM_COALESCED_MMIO_ZONE_MAX 16
+/* shadow page pool of a vm, see KVM_CREATE_VM */
+#define KVM_MIN_ALLOC_MMU_PAGES 256
+#define KVM_MAX_ALLOC_MMU_PAGES 8192
+#define KVM_PERMILLE_MMU_PAGES 20 /* default: per mille of guest memory */
 #define KVM_MIN_FREE_MMU_PAGES 5
 #define KVM_REFILL_PAGES 25
+#define KVM_PAGES_PER_LPAGE 512 /* gfns behind one 2MB shadow pde */
+#define KVM_DEMAND_CHUNK KVM_PAGES_PER_LPAGE /* gfns backed at once */
+#define KVM_NR_VMCS_CACHE 9
 
 #define FX_IMAGE_SIZE 512
 #define FX_IMAGE_ALIGN 16
 #define FX_BUF_SIZE (2 * FX_IMAGE_SIZE + FX_IMAGE_ALIGN)
 
 #define DE_VECTOR 0
+#define NM_VECTOR 7
 #define DF_VECTOR 8
 #define TS_VECTOR 10
 #define NP_VECTOR 11
@@ -121,6 +136,7 @@ union kvm_mmu_page_role {
 		unsigned quadrant : 2;
 		unsigned pad_for_nice_hex_output : 6;
 		unsigned metaphysical : 1;
+		unsigned tdp : 1;
 	};
 };
 
@@ -142,6 +158,8 @@ struct kvm_mmu_page {
 	int global;              /* Set if all ptes in this page are global */
 	int multimapped;         /* More than one parent_pte? */
 	int root_count;          /* Currently serving as active root */
+	int unsync;              /* Leaf table the guest may write to */
+	struct list_head unsync_link;
 	union {
 		u64 *parent_pte;               /* !multimapped */
 		struct hlist_head parent_ptes; /* multimapped, kvm_pte_chain */
@@ -158,6 +176,16 @@ struct vmcs {
 
 struct kvm_vcpu;
 
+#define KVM_MMU_NR_CACHED_ROOTS 4
+
+/* the shadow root of a guest cr3 that is not loaded */
+struct kvm_mmu_cached_root {
+	unsigned long cr3;
+	u64 pdptrs[4];		/* pae guests only */
+	hpa_t root_hpa;		/* 64-bit shadow root */
+	u64 pae_root[4];	/* or its four pae roots */
+};
+
 /*
  * x86 supports 3 paging modes (4-level 64-bit, 3-level 64-bit, and 2-level
  * 32-bit).  The kvm_mmu structure abstracts the details of the current mmu
@@ -171,7 +199,14 @@ struct kvm_mmu {
 	hpa_t root_hpa;
 	int root_level;
 	int shadow_root_level;
+	int tdp;	/* root_hpa maps gpa to hpa, cr3 is the guest's own */
 	u64 *pae_root;
+
+	/* what root_hpa shadows, and the roots of recent cr3s, newest first */
+	unsigned long root_cr3;
+	u64 root_pdptrs[4];
+	struct kvm_mmu_cached_root cached_roots[KVM_MMU_NR_CACHED_ROOTS];
+	int nr_cached_roots;
 };
 
 /* this is test code for ddk */
@@ -234,6 +269,33 @@ enum {
 	VCPU_SREG_LDTR,
 };
 
+/* vcpu->mp_state, only used with the in-kernel irqchip (irq.h) */
+enum {
+	VCPU_MP_STATE_RUNNABLE,
+	VCPU_MP_STATE_HALTED,
+	VCPU_MP_STATE_WAIT_SIPI,
+	VCPU_MP_STATE_SIPI_RECEIVED,
+};
+
+struct kvm_lapic;
+struct kvm_pic;
+struct kvm_pit;
+
+/*
+ * A string I/O instruction batched through the kvm_run page, finished
+ * by complete_pio() when user space re-enters KVM_RUN.
+ */
+struct kvm_pio_request {
+	int pending;
+	int in;
+	int size;
+	int rep;
+	int last;		/* the transfer finishes the instruction */
+	unsigned long count;	/* elements in this transfer */
+	int ad_bytes;		/* address size of the string op */
+	gva_t guest_addr;
+};
+
 struct kvm_vcpu {
 	struct kvm *kvm;
 	union {
@@ -243,6 +305,8 @@ struct kvm_vcpu {
 	struct mutex mutex;
 	int   cpu;
 	int   launched;
+	int guest_mode;		/* interrupts off, entering or in the guest */
+	int remote_tlb_flush;	/* see kvm_flush_remote_tlbs() */
 	int interrupt_window_open;
 	unsigned long irq_summary; /* bit vector: 1 per word in irq_pending */
 #define NR_IRQ_WORDS KVM_IRQ_BITMAP_SIZE(unsigned long)
@@ -250,6 +314,13 @@ struct kvm_vcpu {
 	unsigned long regs[NR_VCPU_REGS]; /* for rsp: vcpu_load_rsp_rip() */
 	unsigned long rip;      /* needs vcpu_load_rsp_rip() */
 
+	/* vmx: vmcs fields read since the last exit, see vmcs_cache_readl() */
+	struct {
+		u32 avail;
+		u32 dirty;
+		unsigned long val[KVM_NR_VMCS_CACHE];
+	} vmcs_cache;
+
 	unsigned long cr0;
 	unsigned long cr2;
 	unsigned long cr3;
@@ -266,8 +337,6 @@ struct kvm_vcpu {
 	struct vmx_msr_entry *guest_msrs;
 	struct vmx_msr_entry *host_msrs;
 
-	struct list_head free_pages;
-	struct kvm_mmu_page page_header_buf[KVM_NUM_MMU_PAGES];
 	struct kvm_mmu mmu;
 
 	struct kvm_mmu_memory_cache mmu_pte_chain_cache;
@@ -281,6 +350,7 @@ struct kvm_vcpu {
 	char fx_buf[FX_BUF_SIZE];
 	char *host_fx_image;
 	char *guest_fx_image;
+	int fpu_active;		/* guest owns the fpu; CR0.TS is clear */
 
 	int mmio_needed;
 	int mmio_read_completed;
@@ -290,6 +360,27 @@ struct kvm_vcpu {
 	gpa_t mmio_phys_addr;
 	gva_t mmio_fault_cr2;
 
+	struct kvm_run *run_page;	/* mapped by WINKVM_MAP_RUN, or NULL */
+	struct kvm_pio_request pio;
+	struct winkvm_coalesced_mmio_ring *mmio_ring;	/* in the run mapping */
+	struct winkvm_dirty_ring *dirty_ring;		/* in the run mapping */
+	u32 dirty_ring_reset;	/* dirty ring entries before it are reset */
+	u32 tlb_gen;	/* kvm_run::tlb_gen, user space caches gva translations */
+	/*
+	 * A demand-paged gfn without a host page was hit under kvm->lock;
+	 * kvm_mmu_populate() backs it once the lock is dropped.
+	 */
+	int populate_pending;
+	gfn_t populate_gfn;
+
+	struct kvm_lapic *apic;		/* NULL without the in-kernel irqchip */
+	int mp_state;
+	int sipi_vector;
+	struct winkvm_event *halt_event;
+
+	/* only written by the thread running the vcpu */
+	struct winkvm_vcpu_stat stat;
+
 	struct {
 		int active;
 		u8 save_iopl;
@@ -302,12 +393,26 @@ struct kvm_vcpu {
 	} rmode;
 };
 
+/*
+ * One per 2MB guest frame touched by a slot.  A frame may be mapped by
+ * a single large shadow pte only while write_count is zero: it starts
+ * at one when the frame is not fully inside the slot or its host pages
+ * are not one aligned, contiguous run, and every shadowed guest page
+ * table inside the frame holds a count while its shadow page lives.
+ */
+struct kvm_lpage_info {
+	int write_count;
+};
+
 struct kvm_memory_slot {
 	gfn_t base_gfn;
 	unsigned long npages;
 	unsigned long flags;
-	struct page **phys_mem;
+	struct page **phys_mem;	/* NULL entries not backed yet if demand_paged */
 	unsigned long *dirty_bitmap;
+	struct kvm_lpage_info *lpage_info;
+	int demand_paged;
+	unsigned long *balloon_bitmap;	/* gfns the guest gave up, or NULL */
 };
 
 struct kvm {
@@ -315,35 +420,51 @@ struct kvm {
 	int nmemslots;
 	struct kvm_memory_slot memslots[KVM_MEMORY_SLOTS];
 	/*
-	 * Hash table of struct kvm_mmu_page.
+	 * Populated slots sorted by base_gfn, rebuilt under kvm->lock, and
+	 * the last slot found by gfn_to_memslot() (only a hint).
+	 */
+	int nsorted_memslots;
+	int sorted_memslots[KVM_MEMORY_SLOTS];
+	struct kvm_memory_slot *last_memslot;
+	/*
+	 * Shadow page pool shared by all vcpus, allocated with the first
+	 * vcpu.  n_requested_mmu_pages == 0 sizes it from guest memory.
 	 */
+	unsigned int n_requested_mmu_pages;
+	unsigned int n_alloc_mmu_pages;
+	struct kvm_mmu_page *mmu_page_headers;
+	struct list_head free_mmu_pages;
 	struct list_head active_mmu_pages;
+	struct list_head unsync_mmu_pages;
 	int n_free_mmu_pages;
-	struct hlist_head mmu_page_hash[KVM_NUM_MMU_PAGES];
+	u32 mmu_shadow_zapped;
+	u32 mmu_recycled;
+	/*
+	 * Hash table of struct kvm_mmu_page.
+	 */
+	unsigned int n_mmu_page_hash;
+	struct hlist_head *mmu_page_hash;
+	/*
+	 * MMIO ranges whose writes go to the vcpu's coalesced mmio ring
+	 * instead of exiting, under kvm->lock.
+	 */
+	int n_coalesced_mmio_zones;
+	struct winkvm_coalesced_mmio_zone
+		coalesced_mmio_zones[KVM_COALESCED_MMIO_ZONE_MAX];
+	/* in-kernel irqchip, see irq.h; NULL until WINKVM_CREATE_IRQCHIP */
+	struct kvm_pic *vpic;
+	struct kvm_pit *vpit;
 	struct kvm_vcpu vcpus[KVM_MAX_VCPUS];
 	int memory_config_version;
 	int busy;
+	u32 pages_ballooned;
+	/* a gfn went only into the dirty bitmap, not onto a dirty ring */
+	int dirty_ring_overflow;
 	unsigned long rmap_overflow;
 	struct list_head vm_list;
 	struct file *filp;
 };
 
-struct kvm_stat {
-	u32 pf_fixed;
-	u32 pf_guest;
-	u32 tlb_flush;
-	u32 invlpg;
-
-	u32 exits;
-	u32 io_exits;
-	u32 mmio_exits;
-	u32 signal_exits;
-	u32 irq_window_exits;
-	u32 halt_exits;
-	u32 request_irq_exits;
-	u32 irq_exits;
-};
-
 struct descriptor_table {
 	u16 limit;
 	unsigned long base;
@@ -379,6 +500,8 @@ struct kvm_arch_ops {
 	void (*set_cr0_no_modeswitch)(struct kvm_vcpu *vcpu,
 				      unsigned long cr0);
 	void (*set_cr3)(struct kvm_vcpu *vcpu, unsigned long cr3);
+	/* root of the gpa to hpa table, or INVALID_PAGE for shadow paging */
+	void (*set_tdp)(struct kvm_vcpu *vcpu, hpa_t root);
 	void (*set_cr4)(struct kvm_vcpu *vcpu, unsigned long cr4);
 	void (*set_efer)(struct kvm_vcpu *vcpu, u64 efer);
 	void (*get_idt)(struct kvm_vcpu *vcpu, struct descriptor_table *dt);
@@ -407,7 +530,6 @@ struct kvm_arch_ops {
 				unsigned char *hypercall_addr);
 };
 
-extern struct kvm_stat kvm_stat;
 extern struct kvm_arch_ops *kvm_arch_ops;
 
 #define kvm_printf(kvm, fmt ...) printk(KERN_DEBUG fmt)
@@ -418,10 +540,20 @@ void kvm_exit_arch(void);
 
 void kvm_mmu_destroy(struct kvm_vcpu *vcpu);
 int kvm_mmu_create(struct kvm_vcpu *vcpu);
+void kvm_mmu_free_pool(struct kvm *kvm);
 int kvm_mmu_setup(struct kvm_vcpu *vcpu);
 
 int kvm_mmu_reset_context(struct kvm_vcpu *vcpu);
+extern int tdp_enabled;
+void kvm_enable_tdp(void);
+extern int unsync_enabled;
+void kvm_enable_unsync(void);
+void kvm_mmu_invlpg(struct kvm_vcpu *vcpu, gva_t gva);
 void kvm_mmu_slot_remove_write_access(struct kvm_vcpu *vcpu, int slot);
+void kvm_mmu_unmap_pfns(struct kvm_vcpu *vcpu, unsigned long *pfns, int n);
+void kvm_mmu_unshadow_gfns(struct kvm_vcpu *vcpu, gfn_t gfn,
+			   unsigned long npages);
+void kvm_mmu_write_protect_gfn(struct kvm_vcpu *vcpu, gfn_t gfn);
 
 hpa_t gpa_to_hpa(struct kvm_vcpu *vcpu, gpa_t gpa);
 #define HPA_MSB ((sizeof(hpa_t) * 8) - 1)
@@ -440,6 +572,9 @@ static inline struct page *gfn_to_page(struct kvm_memory_slot *slot, gfn_t gfn)
 
 struct kvm_memory_slot *gfn_to_memslot(struct kvm *kvm, gfn_t gfn);
 void mark_page_dirty(struct kvm *kvm, gfn_t gfn);
+void kvm_vcpu_mark_page_dirty(struct kvm_vcpu *vcpu, gfn_t gfn);
+int kvm_populate_gfn(struct kvm *kvm, gfn_t gfn);
+int kvm_mmu_populate(struct kvm_vcpu *vcpu);
 
 enum emulation_result {
 	EMULATE_DONE,       /* no further processing */
@@ -501,6 +636,24 @@ void kvm_mmu_free_some_pages(struct kvm_vcpu *vcpu);
 
 int kvm_hypercall(struct kvm_vcpu *vcpu, struct kvm_run *run);
 
+void kvm_flush_remote_tlbs(struct kvm_vcpu *vcpu);
+void kvm_setup_pio(struct kvm_vcpu *vcpu, struct kvm_run *run, int in,
+		   int size, int string, int down, int rep,
+		   unsigned long count, int ad_bytes, gva_t address);
+void kvm_vcpu_set_run_page(struct kvm_vcpu *vcpu, struct kvm_run *run);
+int kvm_vm_ioctl_register_coalesced_mmio(struct kvm *kvm,
+				 struct winkvm_coalesced_mmio_zone *zone);
+int kvm_vm_ioctl_get_stats(struct kvm *kvm, struct winkvm_stats *stats);
+int kvm_vm_ioctl_mark_dirty(struct kvm *kvm, struct winkvm_dirty_gfns *dirty);
+int kvm_vm_ioctl_balloon(struct kvm *kvm, struct winkvm_balloon *balloon);
+int kvm_vm_ioctl_reset_dirty_rings(struct kvm *kvm,
+				   struct winkvm_dirty_reset *reset);
+int kvm_vm_ioctl_create_irqchip(struct kvm *kvm);
+int kvm_vm_ioctl_irq_line(struct kvm *kvm, struct winkvm_irq_level *irq_level);
+int kvm_vm_ioctl_apic_deliver(struct kvm *kvm, struct winkvm_apic_msg *msg);
+int kvm_vm_ioctl_unregister_coalesced_mmio(struct kvm *kvm,
+				   struct winkvm_coalesced_mmio_zone *zone);
+
 extern __stdcall void DbgBreakPoint(void);
 
 /* for debugging (by ddk) */
@@ -524,6 +677,8 @@ static inline void dump_context(struct kvm_mmu *context)
 static inline int kvm_mmu_page_fault(struct kvm_vcpu *vcpu, gva_t gva,									 
 									 u32 error_code)
 {
+	int r;
+
 #ifndef __WINKVM__
 	if (unlikely(vcpu->kvm->n_free_mmu_pages < KVM_MIN_FREE_MMU_PAGES))
 		kvm_mmu_free_some_pages(vcpu);
@@ -532,8 +687,13 @@ static inline int kvm_mmu_page_fault(struct kvm_vcpu *vcpu, gva_t gva,
 		kvm_mmu_free_some_pages(vcpu);	
 #endif
 	dump_context(&vcpu->mmu);	
+	vcpu->populate_pending = 0;
 	/* vcpu->mmu.page_fault jump to irrigal rip ??? */	
-	return vcpu->mmu.page_fault(vcpu, gva, error_code);	
+	r = vcpu->mmu.page_fault(vcpu, gva, error_code);	
+	/* not mmio: retry once kvm_mmu_populate() has backed the gfn */
+	if (vcpu->populate_pending && r > 0)
+		r = 0;
+	return r;
 }
 
 static inline struct page *_gfn_to_page(struct kvm *kvm, gfn_t gfn)
@@ -673,6 +833,7 @@ static inline u32 get_rdx_init_val(void)
 #define ASM_VMX_VMWRITE_RSP_RDX   ".byte 0x0f, 0x79, 0xd4"
 #define ASM_VMX_VMXOFF            ".byte 0x0f, 0x01, 0xc4"
 #define ASM_VMX_VMXON_RAX         ".byte 0xf3, 0x0f, 0xc7, 0x30"
+#define ASM_VMX_INVEPT            ".byte 0x66, 0x0f, 0x38, 0x80, 0x08"
 
 #define MSR_IA32_TIME_STAMP_COUNTER		0x010
 
@@ -16,6 +16,7 @@
  */
 
 #include "kvm.h"
+#include "irq.h"
 
 #ifndef __WINKVM__
 #include <linux/kvm.h>
@@ -65,27 +66,31 @@ static spinlock_t kvm_lock;
 static LIST_HEAD(vm_list);
 
 struct kvm_arch_ops *kvm_arch_ops;
-struct kvm_stat kvm_stat;
-EXPORT_SYMBOL_GPL(kvm_stat);
+#define STAT_OFFSET(x) offsetof(struct kvm_vcpu, stat.x)
 
 static struct kvm_stats_debugfs_item {
 	const char *name;
-	u32 *data;
+	int offset;
 	struct dentry *dentry;
 } debugfs_entries[] = {
-	{ "pf_fixed", &kvm_stat.pf_fixed },
-	{ "pf_guest", &kvm_stat.pf_guest },
-	{ "tlb_flush", &kvm_stat.tlb_flush },
-	{ "invlpg", &kvm_stat.invlpg },
-	{ "exits", &kvm_stat.exits },
-	{ "io_exits", &kvm_stat.io_exits },
-	{ "mmio_exits", &kvm_stat.mmio_exits },
-	{ "signal_exits", &kvm_stat.signal_exits },
-	{ "irq_window", &kvm_stat.irq_window_exits },
-	{ "halt_exits", &kvm_stat.halt_exits },
-	{ "request_irq", &kvm_stat.request_irq_exits },
-	{ "irq_exits", &kvm_stat.irq_exits },
-	{ NULL, NULL }
+	{ "pf_fixed", STAT_OFFSET(pf_fixed) },
+	{ "pf_guest", STAT_OFFSET(pf_guest) },
+	{ "pf_prefetch", STAT_OFFSET(pf_prefetch) },
+	{ "tlb_flush", STAT_OFFSET(tlb_flush) },
+	{ "invlpg", STAT_OFFSET(invlpg) },
+	{ "mmu_unsync", STAT_OFFSET(mmu_unsync) },
+	{ "mmu_sync", STAT_OFFSET(mmu_sync) },
+	{ "pf_populate", STAT_OFFSET(pf_populate) },
+	{ "exits", STAT_OFFSET(exits) },
+	{ "io_exits", STAT_OFFSET(io_exits) },
+	{ "mmio_exits", STAT_OFFSET(mmio_exits) },
+	{ "mmio_coalesced", STAT_OFFSET(mmio_coalesced) },
+	{ "signal_exits", STAT_OFFSET(signal_exits) },
+	{ "irq_window", STAT_OFFSET(irq_window_exits) },
+	{ "halt_exits", STAT_OFFSET(halt_exits) },
+	{ "request_irq", STAT_OFFSET(request_irq_exits) },
+	{ "irq_exits", STAT_OFFSET(irq_exits) },
+	{ NULL }
 };
 
 static struct dentry *debugfs_dir;
@@ -280,7 +285,7 @@ int kvm_write_guest(struct kvm_vcpu *vcpu, gva_t addr, unsigned long size,
 			break;
 
 		gfn = vcpu->mmu.gva_to_gpa(vcpu, addr) >> PAGE_SHIFT;
-		mark_page_dirty(vcpu->kvm, gfn);
+		kvm_vcpu_mark_page_dirty(vcpu, gfn);
 		guest_buf = (hva_t)kmap_atomic(
 				pfn_to_page(paddr >> PAGE_SHIFT), KM_USER0);
 		offset = addr & ~PAGE_MASK;
@@ -340,7 +345,9 @@ static struct kvm *kvm_create_vm(void)
 		return ERR_PTR(-ENOMEM);
 
 	spin_lock_init(&kvm->lock);
+	INIT_LIST_HEAD(&kvm->free_mmu_pages);
 	INIT_LIST_HEAD(&kvm->active_mmu_pages);
+	INIT_LIST_HEAD(&kvm->unsync_mmu_pages);
 	for (i = 0; i < KVM_MAX_VCPUS; ++i) {
 		struct kvm_vcpu *vcpu = &kvm->vcpus[i];
 
@@ -348,11 +355,10 @@ static struct kvm *kvm_create_vm(void)
 		vcpu->cpu = -1;
 		vcpu->kvm = kvm;
 		vcpu->mmu.root_hpa = INVALID_PAGE;
-		INIT_LIST_HEAD(&vcpu->free_pages);
-		spin_lock(&kvm_lock);
-		list_add(&kvm->vm_list, &vm_list);
-		spin_unlock(&kvm_lock);
 	}
+	spin_lock(&kvm_lock);
+	list_add(&kvm->vm_list, &vm_list);
+	spin_unlock(&kvm_lock);
 	return kvm;
 }
 
@@ -383,9 +389,17 @@ static void kvm_free_physmem_slot(struct kvm_memory_slot *free,
 		vfree(free->dirty_bitmap);
 	}
 
+	if (!dont || free->lpage_info != dont->lpage_info)
+		vfree(free->lpage_info);
+
+	if (!dont || free->balloon_bitmap != dont->balloon_bitmap)
+		vfree(free->balloon_bitmap);
+
 	free->phys_mem = NULL;
 	free->npages = 0;
 	free->dirty_bitmap = NULL;
+	free->lpage_info = NULL;
+	free->balloon_bitmap = NULL;
 
 	function_exit(DBG_RELEASE, __FUNCTION__);	
 }
@@ -412,6 +426,7 @@ static void kvm_free_vcpu(struct kvm_vcpu *vcpu)
 	vcpu_load(vcpu);
 	kvm_mmu_destroy(vcpu);
 	vcpu_put(vcpu);
+	kvm_irqchip_free_vcpu(vcpu);
 	kvm_arch_ops->vcpu_free(vcpu);
 	function_exit(DBG_RELEASE, __FUNCTION__);	
 }
@@ -439,7 +454,9 @@ static void kvm_destroy_vm(struct kvm *kvm)
 	spin_lock(&kvm_lock);
 	list_del(&kvm->vm_list);
 	spin_unlock(&kvm_lock);
+	kvm_free_irqchip(kvm);
 	kvm_free_vcpus(kvm);
+	kvm_mmu_free_pool(kvm);
 	kvm_free_physmem(kvm);
 	kfree(kvm);
 	function_exit(DBG_RELEASE, __FUNCTION__);	
@@ -471,11 +488,20 @@ static int load_pdptrs(struct kvm_vcpu *vcpu, unsigned long cr3)
 	u64 *pdpt;
 	int ret;
 	struct kvm_memory_slot *memslot;
+	struct page *page;
+
+	if (kvm_populate_gfn(vcpu->kvm, pdpt_gfn))
+		return 0;
 
 	spin_lock(&vcpu->kvm->lock);
 	memslot = gfn_to_memslot(vcpu->kvm, pdpt_gfn);
 	/* FIXME: !memslot - emulate? 0xff? */
-	pdpt = kmap_atomic(gfn_to_page(memslot, pdpt_gfn), KM_USER0);
+	page = gfn_to_page(memslot, pdpt_gfn);
+	if (!page) {
+		spin_unlock(&vcpu->kvm->lock);
+		return 0;
+	}
+	pdpt = kmap_atomic(page, KM_USER0);
 
 	ret = 1;
 	for (i = 0; i < 4; ++i) {
@@ -684,12 +710,170 @@ static void do_remove_write_access(struct kvm_vcpu *vcpu, int slot)
 	spin_unlock(&vcpu->kvm->lock);
 }
 
+static int memslot_has_gfn(struct kvm_memory_slot *memslot, gfn_t gfn)
+{
+	return gfn >= memslot->base_gfn
+		&& gfn < memslot->base_gfn + memslot->npages;
+}
+
+/*
+ * Rebuild kvm->sorted_memslots after a slot changed.
+ * Called with kvm->lock held.
+ */
+static void update_sorted_memslots(struct kvm *kvm)
+{
+	int i, j, n = 0;
+
+	for (i = 0; i < kvm->nmemslots; ++i) {
+		gfn_t base_gfn = kvm->memslots[i].base_gfn;
+
+		if (!kvm->memslots[i].npages)
+			continue;
+		for (j = n; j > 0 &&
+			     kvm->memslots[kvm->sorted_memslots[j - 1]].base_gfn > base_gfn;
+		     --j)
+			kvm->sorted_memslots[j] = kvm->sorted_memslots[j - 1];
+		kvm->sorted_memslots[j] = i;
+		++n;
+	}
+	kvm->nsorted_memslots = n;
+	kvm->last_memslot = NULL;
+}
+
 /*
  * Allocate some memory and give it an address in the guest physical address
  * space.
  *
  * Discontiguous memory is allowed, mostly for framebuffers.
  */
+/*
+ * Is the 2MB frame at gfn fully inside the slot and backed by an
+ * aligned run of contiguous host pages?
+ */
+static int kvm_lpage_contiguous(struct kvm_memory_slot *slot, gfn_t gfn)
+{
+	unsigned long pfn, j;
+
+	if (gfn < slot->base_gfn ||
+	    gfn + KVM_PAGES_PER_LPAGE > slot->base_gfn + slot->npages)
+		return 0;
+	for (j = 0; j < KVM_PAGES_PER_LPAGE; ++j)
+		if (!gfn_to_page(slot, gfn + j))
+			return 0;
+	pfn = page_to_pfn(gfn_to_page(slot, gfn));
+	if (pfn & (KVM_PAGES_PER_LPAGE - 1))
+		return 0;
+	for (j = 1; j < KVM_PAGES_PER_LPAGE; ++j)
+		if (page_to_pfn(gfn_to_page(slot, gfn + j)) != pfn + j)
+			return 0;
+	return 1;
+}
+
+/*
+ * Build the large page table of a slot whose pages are allocated.
+ * Only 2MB frames that lie fully inside the slot and are backed by an
+ * aligned run of contiguous host pages start out mappable; the driver
+ * allocates guest ram in such runs when the system lets it.
+ * Frames of a demand-paged slot are checked when they get backed.
+ */
+static int kvm_alloc_lpage_info(struct kvm_memory_slot *slot)
+{
+	unsigned long first, nlpages, i;
+	gfn_t gfn;
+
+	first = slot->base_gfn / KVM_PAGES_PER_LPAGE;
+	nlpages = (slot->base_gfn + slot->npages - 1) / KVM_PAGES_PER_LPAGE
+		- first + 1;
+	slot->lpage_info = vmalloc(nlpages * sizeof(struct kvm_lpage_info));
+	if (!slot->lpage_info)
+		return -ENOMEM;
+
+	for (i = 0; i < nlpages; ++i) {
+		gfn = (first + i) * KVM_PAGES_PER_LPAGE;
+		slot->lpage_info[i].write_count = 1;
+		if (!slot->demand_paged && kvm_lpage_contiguous(slot, gfn))
+			slot->lpage_info[i].write_count = 0;
+	}
+	return 0;
+}
+
+/*
+ * Back the chunk of a demand-paged slot that holds gfn with host pages.
+ * The driver locks them outside kvm->lock, it may have to page them in;
+ * they are then entered in the slot under the lock.  Must not be called
+ * with kvm->lock held.
+ */
+int kvm_populate_gfn(struct kvm *kvm, gfn_t gfn)
+{
+	struct kvm_memory_slot *slot;
+	struct page *page;
+	gfn_t start, end, i;
+	int memory_config_version;
+	int filled = 0;
+
+	spin_lock(&kvm->lock);
+	slot = gfn_to_memslot(kvm, gfn);
+	if (!slot || !slot->demand_paged || gfn_to_page(slot, gfn)) {
+		spin_unlock(&kvm->lock);
+		return 0;
+	}
+	start = gfn & ~(gfn_t)(KVM_DEMAND_CHUNK - 1);
+	if (start < slot->base_gfn)
+		start = slot->base_gfn;
+	end = (gfn | (KVM_DEMAND_CHUNK - 1)) + 1;
+	if (end > slot->base_gfn + slot->npages)
+		end = slot->base_gfn + slot->npages;
+	memory_config_version = kvm->memory_config_version;
+	spin_unlock(&kvm->lock);
+
+	if (wk_populate_pages(start, end - start))
+		return -ENOMEM;
+
+	spin_lock(&kvm->lock);
+	/* the slot went away meanwhile, nothing to fill in */
+	if (memory_config_version != kvm->memory_config_version) {
+		spin_unlock(&kvm->lock);
+		return 0;
+	}
+	for (i = start; i < end; ++i) {
+		if (gfn_to_page(slot, i))
+			continue;
+		page = wk_demand_page(i);
+		if (!page)
+			break;
+		set_page_private(page, 0);
+		slot->phys_mem[i - slot->base_gfn] = page;
+		++filled;
+	}
+	/* drop the reference kvm_alloc_lpage_info() left on the frame */
+	start &= ~(gfn_t)(KVM_PAGES_PER_LPAGE - 1);
+	if (filled && slot->lpage_info && kvm_lpage_contiguous(slot, start))
+		--slot->lpage_info[start / KVM_PAGES_PER_LPAGE -
+				   slot->base_gfn / KVM_PAGES_PER_LPAGE].write_count;
+	spin_unlock(&kvm->lock);
+
+	return i == end ? 0 : -ENOMEM;
+}
+
+/*
+ * A vcpu hit a gfn without host page under kvm->lock, and left the
+ * exit for a retry.  Back the gfn and let the guest run into it again;
+ * whatever mmio exit the emulator set up for it is dropped.
+ */
+int kvm_mmu_populate(struct kvm_vcpu *vcpu)
+{
+	int r;
+
+	vcpu->populate_pending = 0;
+	vcpu->mmio_needed = 0;
+	r = kvm_populate_gfn(vcpu->kvm, vcpu->populate_gfn);
+	if (r)
+		return r;
+	++vcpu->stat.pf_populate;
+	return 1;
+}
+EXPORT_SYMBOL_GPL(kvm_mmu_populate);
+
 int kvm_vm_ioctl_set_memory_region(struct kvm *kvm,
 								   struct kvm_memory_region *mem)  
 {
@@ -756,8 +940,11 @@ raced:
 	spin_unlock(&kvm->lock);
 
 	/* Deallocate if slot is being removed */
-	if (!npages)
+	if (!npages) {
 		new.phys_mem = NULL;
+		new.lpage_info = NULL;
+		new.balloon_bitmap = NULL;
+	}
 
 	/* Free page dirty bitmap if unneeded */
 	if (!(new.flags & KVM_MEM_LOG_DIRTY_PAGES))
@@ -773,7 +960,9 @@ raced:
 			goto out_free;
 
 		memset(new.phys_mem, 0, npages * sizeof(struct page *));
-		for (i = 0; i < npages; ++i) {		  
+		/* backed chunk by chunk by kvm_populate_gfn() */
+		new.demand_paged = wk_demand_paged(new.base_gfn);
+		for (i = 0; i < npages && !new.demand_paged; ++i) {		  
 			/*			new.phys_mem[i] = alloc_page(GFP_HIGHUSER
 						| __GFP_ZERO);
 			*/
@@ -782,6 +971,8 @@ raced:
 				goto out_free;
 			set_page_private(new.phys_mem[i],0);			
 		}
+		if (kvm_alloc_lpage_info(&new) < 0)
+			goto out_free;
 	}
 
 	/* Allocate page dirty bitmap if needed */
@@ -810,6 +1001,7 @@ raced:
 		kvm->nmemslots = mem->slot + 1;
 
 	*memslot = new;
+	update_sorted_memslots(kvm);
 	++kvm->memory_config_version;
 
 	spin_unlock(&kvm->lock);
@@ -822,7 +1014,9 @@ raced:
 			continue;
 		if (new.flags & KVM_MEM_LOG_DIRTY_PAGES)
 			do_remove_write_access(vcpu, mem->slot);
+		spin_lock(&kvm->lock);
 		kvm_mmu_reset_context(vcpu);
+		spin_unlock(&kvm->lock);
 		vcpu_put(vcpu);
 	}
 
@@ -839,6 +1033,558 @@ out:
 	return r;
 }
 
+#ifdef __WINKVM__
+/*
+ * Request the shadow page pool size of a vm.  Only effective before the
+ * first vcpu is created, which allocates the pool.
+ */
+int kvm_vm_ioctl_set_mmu_pages(struct kvm *kvm, unsigned int n_mmu_pages)
+{
+	int r = -EBUSY;
+
+	spin_lock(&kvm->lock);
+	if (!kvm->mmu_page_headers) {
+		kvm->n_requested_mmu_pages = n_mmu_pages;
+		r = 0;
+	}
+	spin_unlock(&kvm->lock);
+	return r;
+}
+
+int kvm_vm_ioctl_get_mmu_pool(struct kvm *kvm, struct winkvm_mmu_pool *pool)
+{
+	spin_lock(&kvm->lock);
+	pool->n_alloc_mmu_pages = kvm->n_alloc_mmu_pages;
+	pool->n_free_mmu_pages  = kvm->n_free_mmu_pages;
+	pool->n_mmu_page_hash   = kvm->n_mmu_page_hash;
+	pool->mmu_shadow_zapped = kvm->mmu_shadow_zapped;
+	pool->mmu_recycled      = kvm->mmu_recycled;
+	spin_unlock(&kvm->lock);
+	return 0;
+}
+
+static void kvm_add_vcpu_stat(struct winkvm_vcpu_stat *sum,
+			      struct winkvm_vcpu_stat *s)
+{
+	u32 *dst = (u32 *)sum;
+	u32 *src = (u32 *)s;
+	int i, j;
+
+	for (i = 0; i < offsetof(struct winkvm_vcpu_stat, exit) / sizeof(u32); ++i)
+		dst[i] += src[i];
+	for (i = 0; i < WINKVM_NR_EXIT_REASONS; ++i) {
+		sum->exit[i].count += s->exit[i].count;
+		for (j = 0; j < WINKVM_NR_HIST_BUCKETS; ++j)
+			sum->exit[i].hist[j] += s->exit[i].hist[j];
+		sum->exit[i].cycles += s->exit[i].cycles;
+	}
+}
+
+/*
+ * The counters of one vcpu, or their sum over the vm.  They are not
+ * locked against the running vcpus, so each counter is exact but the
+ * set is not a snapshot.
+ */
+int kvm_vm_ioctl_get_stats(struct kvm *kvm, struct winkvm_stats *stats)
+{
+	int i;
+
+	if (stats->vcpu < -1 || stats->vcpu >= KVM_MAX_VCPUS)
+		return -EINVAL;
+
+	if (stats->vcpu >= 0) {
+		if (!kvm->vcpus[stats->vcpu].vmcs)
+			return -ENOENT;
+		memcpy(&stats->stat, &kvm->vcpus[stats->vcpu].stat,
+		       sizeof(stats->stat));
+		return 0;
+	}
+
+	memset(&stats->stat, 0, sizeof(stats->stat));
+	for (i = 0; i < KVM_MAX_VCPUS; ++i)
+		if (kvm->vcpus[i].vmcs)
+			kvm_add_vcpu_stat(&stats->stat, &kvm->vcpus[i].stat);
+	return 0;
+}
+
+/*
+ * User space wrote these frames through its mapping of guest memory,
+ * which the dirty log does not see.
+ */
+int kvm_vm_ioctl_mark_dirty(struct kvm *kvm, struct winkvm_dirty_gfns *dirty)
+{
+	u32 i;
+
+	spin_lock(&kvm->lock);
+	for (i = 0; i < dirty->nr; ++i)
+		mark_page_dirty(kvm, dirty->gfn[i]);
+	spin_unlock(&kvm->lock);
+	return 0;
+}
+
+#define BALLOON_PFNS 1024	/* host pages unmapped per shadow mmu walk */
+#define BALLOON_CHUNKS (BALLOON_PFNS / KVM_DEMAND_CHUNK)
+
+/*
+ * Take a ballooned chunk out of its slot.  The caller has dropped the
+ * shadow ptes mapping it, and the driver lets go of the host pages
+ * afterwards.  Called with kvm->lock held.
+ */
+static void detach_chunk(struct kvm_memory_slot *slot, gfn_t start)
+{
+	gfn_t i;
+
+	/* the frame is unbacked again, see kvm_populate_gfn() */
+	if (slot->lpage_info && kvm_lpage_contiguous(slot, start))
+		++slot->lpage_info[start / KVM_PAGES_PER_LPAGE -
+				   slot->base_gfn / KVM_PAGES_PER_LPAGE].write_count;
+	for (i = start; i < start + KVM_DEMAND_CHUNK; ++i)
+		slot->phys_mem[i - slot->base_gfn] = NULL;
+}
+
+/*
+ * Keep every vcpu out of the guest, and the memslots as they are, until
+ * resume_vcpus().  Returns a vcpu to work on the shadow mmu with, or
+ * NULL if there is none yet.
+ */
+static struct kvm_vcpu *stop_vcpus(struct kvm *kvm)
+{
+	struct kvm_vcpu *vcpu = NULL;
+	int i;
+
+	spin_lock(&kvm->lock);
+	++kvm->busy;
+	spin_unlock(&kvm->lock);
+
+	for (i = 0; i < KVM_MAX_VCPUS; ++i) {
+		mutex_lock(&kvm->vcpus[i].mutex);
+		if (!vcpu && kvm->vcpus[i].vmcs)
+			vcpu = &kvm->vcpus[i];
+	}
+	return vcpu;
+}
+
+/*
+ * The mutexes go in the reverse order: a FAST_MUTEX puts back the irql
+ * it was taken at, so only the last release may drop to PASSIVE_LEVEL.
+ */
+static void resume_vcpus(struct kvm *kvm, int flush)
+{
+	struct kvm_vcpu *vcpu;
+	int i;
+
+	for (i = 0; i < KVM_MAX_VCPUS; ++i) {
+		vcpu = &kvm->vcpus[i];
+		if (flush && vcpu->vmcs) {
+			kvm_arch_ops->vcpu_load(vcpu);
+			kvm_arch_ops->tlb_flush(vcpu);
+			kvm_arch_ops->vcpu_put(vcpu);
+		}
+	}
+	for (i = KVM_MAX_VCPUS - 1; i >= 0; --i)
+		mutex_unlock(&kvm->vcpus[i].mutex);
+
+	spin_lock(&kvm->lock);
+	--kvm->busy;
+	spin_unlock(&kvm->lock);
+}
+
+/*
+ * Drop the shadow ptes of the host pages in pfns, then let the driver
+ * unlock the chunks in chunk[], whose pages are all among them.  The
+ * vcpus are stopped.
+ */
+static void unmap_ballooned(struct kvm_vcpu *vcpu, unsigned long *pfns,
+			    int npfns, gfn_t *chunk, int nchunks)
+{
+	struct kvm *kvm = vcpu->kvm;
+	int i;
+
+	kvm_arch_ops->vcpu_load(vcpu);
+	spin_lock(&kvm->lock);
+	for (i = 0; i < nchunks; ++i)
+		kvm_mmu_unshadow_gfns(vcpu, chunk[i], KVM_DEMAND_CHUNK);
+	kvm_mmu_unmap_pfns(vcpu, pfns, npfns);
+	for (i = 0; i < nchunks; ++i)
+		detach_chunk(gfn_to_memslot(kvm, chunk[i]), chunk[i]);
+	spin_unlock(&kvm->lock);
+	kvm_arch_ops->vcpu_put(vcpu);
+
+	for (i = 0; i < nchunks; ++i)
+		wk_release_pages(chunk[i], KVM_DEMAND_CHUNK);
+}
+
+/*
+ * Are all gfns of the chunk at start in the balloon?  Only chunks fully
+ * inside a demand-paged slot count.
+ */
+static int ballooned_chunk(struct kvm_memory_slot *slot, gfn_t start)
+{
+	unsigned long rel = start - slot->base_gfn;
+	unsigned long i;
+
+	if (!slot->demand_paged || !slot->balloon_bitmap ||
+	    start < slot->base_gfn ||
+	    start + KVM_DEMAND_CHUNK > slot->base_gfn + slot->npages)
+		return 0;
+	for (i = 0; i < KVM_DEMAND_CHUNK; ++i)
+		if (!test_bit(rel + i, slot->balloon_bitmap))
+			return 0;
+	return 1;
+}
+
+/*
+ * The guest balloon gave up, or takes back, these gfns.  Each gfn given
+ * up is dropped from the shadow mmu; the guest must not touch it before
+ * it takes it back, and the next access after that maps it again.  A
+ * chunk of a demand-paged slot whose gfns are all in the balloon is
+ * also taken out of the slot and unlocked, and the host may then
+ * discard its contents.  Memory of a slot that is not demand-paged
+ * stays pinned, only the count changes.
+ */
+int kvm_vm_ioctl_balloon(struct kvm *kvm, struct winkvm_balloon *balloon)
+{
+	struct kvm_memory_slot *slot;
+	struct kvm_vcpu *vcpu;
+	struct page *page;
+	unsigned long *pfns;
+	gfn_t chunk[BALLOON_CHUNKS];
+	gfn_t gfn, start, end, last;
+	unsigned long rel, bytes;
+	int npfns = 0, nchunks = 0, release, flush = 0, r = 0;
+	u32 i;
+
+	balloon->released = 0;
+
+	pfns = kmalloc(BALLOON_PFNS * sizeof(*pfns), GFP_KERNEL);
+	if (!pfns)
+		return -ENOMEM;
+
+	vcpu = stop_vcpus(kvm);
+
+	for (i = 0; i < balloon->nr; ++i) {
+		gfn = balloon->gfn[i];
+		slot = gfn_to_memslot(kvm, gfn);
+		if (!slot)
+			continue;
+		if (!slot->balloon_bitmap) {
+			bytes = ALIGN(slot->npages, BITS_PER_LONG) / 8;
+			slot->balloon_bitmap = vmalloc(bytes);
+			r = -ENOMEM;
+			if (!slot->balloon_bitmap)
+				break;
+			memset(slot->balloon_bitmap, 0, bytes);
+			r = 0;
+		}
+		rel = gfn - slot->base_gfn;
+
+		if (balloon->deflate) {
+			if (test_bit(rel, slot->balloon_bitmap)) {
+				clear_bit(rel, slot->balloon_bitmap);
+				--kvm->pages_ballooned;
+			}
+			continue;
+		}
+
+		if (test_bit(rel, slot->balloon_bitmap))
+			continue;
+		set_bit(rel, slot->balloon_bitmap);
+		++kvm->pages_ballooned;
+
+		/* no vcpu, no shadow mmu yet */
+		if (!vcpu)
+			continue;
+
+		start = gfn & ~(gfn_t)(KVM_DEMAND_CHUNK - 1);
+		end = gfn + 1;
+		release = ballooned_chunk(slot, start) &&
+			gfn_to_page(slot, start);
+		if (release) {
+			/* all of it, the guest may have touched a gfn it gave up */
+			gfn = start;
+			end = start + KVM_DEMAND_CHUNK;
+		}
+		if (npfns + (end - gfn) > BALLOON_PFNS ||
+		    (release && nchunks == BALLOON_CHUNKS)) {
+			unmap_ballooned(vcpu, pfns, npfns, chunk, nchunks);
+			balloon->released += nchunks;
+			npfns = nchunks = 0;
+			flush = 1;
+		}
+		for (; gfn < end; ++gfn) {
+			page = gfn_to_page(slot, gfn);
+			if (page)
+				pfns[npfns++] = page_to_pfn(page);
+		}
+		if (release)
+			chunk[nchunks++] = start;
+	}
+	if (npfns) {
+		unmap_ballooned(vcpu, pfns, npfns, chunk, nchunks);
+		balloon->released += nchunks;
+		flush = 1;
+	}
+	balloon->ballooned = kvm->pages_ballooned;
+
+	resume_vcpus(kvm, flush);
+	kfree(pfns);
+
+	/* the guest gave the contents up, the host need not page them out */
+	last = -1;
+	for (i = 0; i < balloon->nr && !balloon->deflate; ++i) {
+		start = balloon->gfn[i] & ~(gfn_t)(KVM_DEMAND_CHUNK - 1);
+		if (start == last)
+			continue;
+		slot = gfn_to_memslot(kvm, start);
+		if (slot && ballooned_chunk(slot, start) &&
+		    !gfn_to_page(slot, start))
+			wk_discard_pages(start, KVM_DEMAND_CHUNK);
+		last = start;
+	}
+	return r;
+}
+
+/*
+ * Write protect again the gfns user space took off the dirty rings, and
+ * let them be queued again on their next write.  Only those gfns are
+ * touched, not whole slots as with KVM_GET_DIRTY_LOG.
+ */
+int kvm_vm_ioctl_reset_dirty_rings(struct kvm *kvm,
+				   struct winkvm_dirty_reset *reset)
+{
+	struct kvm_memory_slot *slot;
+	struct winkvm_dirty_ring *ring;
+	struct kvm_vcpu *vcpu, *v;
+	u32 i, first;
+	gfn_t gfn;
+	int n;
+
+	reset->reset = 0;
+
+	vcpu = stop_vcpus(kvm);
+	if (vcpu) {
+		kvm_arch_ops->vcpu_load(vcpu);
+		spin_lock(&kvm->lock);
+		for (n = 0; n < KVM_MAX_VCPUS; ++n) {
+			v = &kvm->vcpus[n];
+			ring = v->dirty_ring;
+			if (!v->vmcs || !ring)
+				continue;
+			first = ring->first;
+			if (first >= WINKVM_DIRTY_RING_MAX)
+				continue;
+			for (i = v->dirty_ring_reset; i != first;
+			     i = (i + 1) % WINKVM_DIRTY_RING_MAX) {
+				gfn = ring->gfn[i];
+				slot = gfn_to_memslot(kvm, gfn);
+				if (!slot || !slot->dirty_bitmap)
+					continue;
+				clear_bit(gfn - slot->base_gfn,
+					  slot->dirty_bitmap);
+				kvm_mmu_write_protect_gfn(vcpu, gfn);
+				++reset->reset;
+			}
+			v->dirty_ring_reset = first;
+		}
+		spin_unlock(&kvm->lock);
+		kvm_arch_ops->vcpu_put(vcpu);
+	}
+	reset->overflow = kvm->dirty_ring_overflow;
+	kvm->dirty_ring_overflow = 0;
+
+	resume_vcpus(kvm, reset->reset != 0);
+	return 0;
+}
+
+int kvm_vm_ioctl_create_irqchip(struct kvm *kvm)
+{
+	return kvm_create_irqchip(kvm);
+}
+
+int kvm_vm_ioctl_irq_line(struct kvm *kvm, struct winkvm_irq_level *irq_level)
+{
+	if (!irqchip_in_kernel(kvm))
+		return -ENXIO;
+
+	spin_lock(&kvm->lock);
+	kvm_pic_set_irq(kvm->vpic, irq_level->irq, irq_level->level);
+	spin_unlock(&kvm->lock);
+	return 0;
+}
+
+/*
+ * A message of the user space i/o apic to the local apics.
+ */
+int kvm_vm_ioctl_apic_deliver(struct kvm *kvm, struct winkvm_apic_msg *msg)
+{
+	if (!irqchip_in_kernel(kvm))
+		return -ENXIO;
+
+	spin_lock(&kvm->lock);
+	kvm_apic_bus_deliver(kvm, msg->dest, msg->dest_mode,
+			     msg->delivery_mode, msg->vector, msg->trig_mode);
+	spin_unlock(&kvm->lock);
+	return 0;
+}
+
+#ifdef CONFIG_WINKVM_TRACE
+#define TRACE_RING_SIZE 4096	/* records, a power of two */
+
+/*
+ * One ring per host cpu.  Writers reserve a record with a locked add on
+ * head, so a thread preempted in the middle of winkvm_trace() only
+ * delays its own record.  seq is cleared before and set after the
+ * record is written; the reader drops a record whose seq changed while
+ * it was copied.
+ */
+struct trace_ring {
+	u32 head;
+	u32 tail;	/* only touched by the reader, under kvm_lock */
+	struct winkvm_trace_rec rec[TRACE_RING_SIZE];
+};
+
+static struct trace_ring *trace_rings[__WINKVM_CPUNUMS__];
+
+void winkvm_trace(u32 event, u32 a0, u32 a1, u32 a2, u32 a3)
+{
+	struct trace_ring *ring = trace_rings[raw_smp_processor_id()];
+	struct winkvm_trace_rec *rec;
+	u32 pos = 1;
+
+	if (!ring)
+		return;
+
+	asm volatile ("lock; xaddl %0, %1"
+		      : "+r"(pos), "+m"(ring->head) : : "memory");
+	rec = &ring->rec[pos & (TRACE_RING_SIZE - 1)];
+	rec->seq = 0;
+	barrier();
+	rdtscll(rec->tsc);
+	rec->event = event;
+	rec->args[0] = a0;
+	rec->args[1] = a1;
+	rec->args[2] = a2;
+	rec->args[3] = a3;
+	barrier();
+	rec->seq = pos + 1;
+}
+
+static void kvm_init_trace(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		trace_rings[cpu] = vmalloc(sizeof(struct trace_ring));
+		if (trace_rings[cpu])
+			memset(trace_rings[cpu], 0, sizeof(struct trace_ring));
+	}
+}
+
+static void kvm_exit_trace(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		vfree(trace_rings[cpu]);
+		trace_rings[cpu] = NULL;
+	}
+}
+
+/*
+ * Move up to a batch of records of one host cpu to the caller.  A writer
+ * that laps the reader costs the lapped records, counted in lost.
+ */
+int kvm_dev_ioctl_get_trace(struct winkvm_trace *trace)
+{
+	struct trace_ring *ring;
+	struct winkvm_trace_rec *rec;
+	u32 head, tail, seq;
+
+	if (trace->cpu < 0 || trace->cpu >= __WINKVM_CPUNUMS__)
+		return -EINVAL;
+	ring = trace_rings[trace->cpu];
+	if (!ring)
+		return -ENOENT;
+
+	trace->nr = 0;
+	trace->lost = 0;
+
+	spin_lock(&kvm_lock);
+	head = *(volatile u32 *)&ring->head;
+	tail = ring->tail;
+	if (head - tail > TRACE_RING_SIZE) {
+		trace->lost = head - tail - TRACE_RING_SIZE;
+		tail = head - TRACE_RING_SIZE;
+	}
+	while (tail != head && trace->nr < WINKVM_TRACE_BATCH) {
+		rec = &ring->rec[tail & (TRACE_RING_SIZE - 1)];
+		seq = *(volatile u32 *)&rec->seq;
+		barrier();
+		trace->rec[trace->nr] = *rec;
+		barrier();
+		if (seq != tail + 1 || *(volatile u32 *)&rec->seq != seq) {
+			/* still being written: come back for it later */
+			if ((s32)(seq - (tail + 1)) < 0)
+				break;
+			/* overwritten by a writer a lap ahead */
+			++trace->lost;
+			++tail;
+			continue;
+		}
+		++trace->nr;
+		++tail;
+	}
+	ring->tail = tail;
+	spin_unlock(&kvm_lock);
+	return 0;
+}
+#else
+int kvm_dev_ioctl_get_trace(struct winkvm_trace *trace)
+{
+	return -EINVAL;
+}
+#endif /* CONFIG_WINKVM_TRACE */
+
+int kvm_vm_ioctl_register_coalesced_mmio(struct kvm *kvm,
+				 struct winkvm_coalesced_mmio_zone *zone)
+{
+	int r = 0;
+
+	if (!zone->size || zone->addr + zone->size < zone->addr)
+		return -EINVAL;
+
+	spin_lock(&kvm->lock);
+	if (kvm->n_coalesced_mmio_zones < KVM_COALESCED_MMIO_ZONE_MAX)
+		kvm->coalesced_mmio_zones[kvm->n_coalesced_mmio_zones++] = *zone;
+	else
+		r = -ENOBUFS;
+	spin_unlock(&kvm->lock);
+	return r;
+}
+
+/*
+ * Drop every zone that lies inside [zone->addr, zone->addr + zone->size).
+ */
+int kvm_vm_ioctl_unregister_coalesced_mmio(struct kvm *kvm,
+				   struct winkvm_coalesced_mmio_zone *zone)
+{
+	struct winkvm_coalesced_mmio_zone *z;
+	int i;
+
+	spin_lock(&kvm->lock);
+	i = kvm->n_coalesced_mmio_zones;
+	while (--i >= 0) {
+		z = &kvm->coalesced_mmio_zones[i];
+		if (zone->addr <= z->addr &&
+		    z->addr + z->size <= zone->addr + zone->size) {
+			*z = kvm->coalesced_mmio_zones[--kvm->n_coalesced_mmio_zones];
+		}
+	}
+	spin_unlock(&kvm->lock);
+	return 0;
+}
+#endif
+
 /*
  * Get (and clear) the dirty memory log for a memory slot.
  */
@@ -964,48 +1710,92 @@ out:
 
 struct kvm_memory_slot *gfn_to_memslot(struct kvm *kvm, gfn_t gfn)
 {
-	int i;	
+	struct kvm_memory_slot *memslot = kvm->last_memslot;
+	int lo = 0, hi = kvm->nsorted_memslots - 1;
 
-	for (i = 0; i < kvm->nmemslots; ++i) {	  
-		struct kvm_memory_slot *memslot = &kvm->memslots[i];
+	/* most lookups hit the same slot (guest ram) as the previous one */
+	if (memslot && memslot_has_gfn(memslot, gfn))
+		return memslot;
 
-		if (gfn >= memslot->base_gfn
-		    && gfn < memslot->base_gfn + memslot->npages)
+	/* slots never overlap, so a binary search by base_gfn is enough */
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		memslot = &kvm->memslots[kvm->sorted_memslots[mid]];
+		if (gfn < memslot->base_gfn)
+			hi = mid - 1;
+		else if (gfn >= memslot->base_gfn + memslot->npages)
+			lo = mid + 1;
+		else {
+			kvm->last_memslot = memslot;
 			return memslot;
+		}
 	}
 	return NULL;
 }
 EXPORT_SYMBOL_GPL(gfn_to_memslot);
 
-void mark_page_dirty(struct kvm *kvm, gfn_t gfn)
+/*
+ * Returns 1 if gfn is logged and was not dirty yet.
+ */
+static int set_dirty_bit(struct kvm *kvm, gfn_t gfn)
 {
-	int i;
-	struct kvm_memory_slot *memslot = NULL;
+	struct kvm_memory_slot *memslot;
 	unsigned long rel_gfn;
 
+	memslot = gfn_to_memslot(kvm, gfn);
+	if (!memslot || !memslot->dirty_bitmap)
+		return 0;
+
+	rel_gfn = gfn - memslot->base_gfn;
+
+	/* avoid RMW */
+	if (test_bit(rel_gfn, memslot->dirty_bitmap))
+		return 0;
+	set_bit(rel_gfn, memslot->dirty_bitmap);
+	return 1;
+}
+
+/*
+ * Without a vcpu there is no dirty ring to queue the gfn on, so user
+ * space has to read the bitmap to find it.
+ */
+void mark_page_dirty(struct kvm *kvm, gfn_t gfn)
+{
 	FUNCTION_ENTER();	
 
-	for (i = 0; i < kvm->nmemslots; ++i) {
-		memslot = &kvm->memslots[i];
+	if (set_dirty_bit(kvm, gfn))
+		kvm->dirty_ring_overflow = 1;
 
-		if (gfn >= memslot->base_gfn
-		    && gfn < memslot->base_gfn + memslot->npages) {
+	FUNCTION_EXIT();			
+}
 
-			if (!memslot || !memslot->dirty_bitmap) {
-				FUNCTION_EXIT();				
-				return;
-			}
+/*
+ * Queue a newly dirtied gfn on the vcpu's dirty ring.  Only the thread
+ * holding vcpu->mutex adds to the ring.  A full ring leaves the gfn in
+ * the bitmap only.
+ */
+void kvm_vcpu_mark_page_dirty(struct kvm_vcpu *vcpu, gfn_t gfn)
+{
+	struct winkvm_dirty_ring *ring = vcpu->dirty_ring;
+	u32 last;
 
-			rel_gfn = gfn - memslot->base_gfn;
+	FUNCTION_ENTER();	
 
-			/* avoid RMW */
-			if (!test_bit(rel_gfn, memslot->dirty_bitmap))
-				set_bit(rel_gfn, memslot->dirty_bitmap);
-			
-			FUNCTION_EXIT();			
-			return;
-		}
+	if (!set_dirty_bit(vcpu->kvm, gfn))
+		goto out;
+
+	last = ring ? ring->last : 0;
+	if (!ring || last >= WINKVM_DIRTY_RING_MAX ||
+	    (last + 1) % WINKVM_DIRTY_RING_MAX == vcpu->dirty_ring_reset) {
+		vcpu->kvm->dirty_ring_overflow = 1;
+		goto out;
 	}
+	ring->gfn[last] = gfn;
+	smp_wmb();
+	ring->last = (last + 1) % WINKVM_DIRTY_RING_MAX;
+out:
+	FUNCTION_EXIT();			
 }
 
 static int emulator_read_std(unsigned long addr,
@@ -1030,6 +1820,11 @@ static int emulator_read_std(unsigned long addr,
 		memslot = gfn_to_memslot(vcpu->kvm, pfn);
 		if (!memslot)
 			return X86EMUL_UNHANDLEABLE;
+		if (!gfn_to_page(memslot, pfn)) {
+			vcpu->populate_pending = 1;
+			vcpu->populate_gfn = pfn;
+			return X86EMUL_UNHANDLEABLE;
+		}
 		page = kmap_atomic(gfn_to_page(memslot, pfn), KM_USER0);
 
 		memcpy(data, page + offset, tocopy);
@@ -1073,6 +1868,8 @@ static int emulator_read_emulated(unsigned long addr,
 
 		if (gpa == UNMAPPED_GVA)
 			return X86EMUL_PROPAGATE_FAULT;
+		if (kvm_apic_mmio_read(vcpu, gpa, val, bytes))
+			return X86EMUL_CONTINUE;
 		vcpu->mmio_needed = 1;
 		vcpu->mmio_phys_addr = gpa;
 		vcpu->mmio_size = bytes;
@@ -1095,8 +1892,13 @@ static int emulator_write_phys(struct kvm_vcpu *vcpu, gpa_t gpa,
 	if (!m)
 		return 0;
 	page = gfn_to_page(m, gpa >> PAGE_SHIFT);
+	if (!page) {
+		vcpu->populate_pending = 1;
+		vcpu->populate_gfn = gpa >> PAGE_SHIFT;
+		return 0;
+	}
 	kvm_mmu_pre_write(vcpu, gpa, bytes);
-	mark_page_dirty(vcpu->kvm, gpa >> PAGE_SHIFT);
+	kvm_vcpu_mark_page_dirty(vcpu, gpa >> PAGE_SHIFT);
 	virt = kmap_atomic(page, KM_USER0);
 	memcpy(virt + offset_in_page(gpa), &val, bytes);
 	kunmap_atomic(virt, KM_USER0);
@@ -1104,6 +1906,49 @@ static int emulator_write_phys(struct kvm_vcpu *vcpu, gpa_t gpa,
 	return 1;
 }
 
+/*
+ * Queue an mmio write to a coalesced zone on the vcpu's ring, so the
+ * guest continues without an exit.  Called with kvm->lock held.
+ * Returns 0 if the write needs a normal KVM_EXIT_MMIO; a full ring
+ * does, and user space drains the ring before handling it.
+ */
+static int coalesced_mmio_write(struct kvm_vcpu *vcpu, gpa_t gpa,
+				unsigned long val, unsigned int bytes)
+{
+	struct kvm *kvm = vcpu->kvm;
+	struct winkvm_coalesced_mmio_ring *ring = vcpu->mmio_ring;
+	struct winkvm_coalesced_mmio *entry;
+	u32 last;
+	int i;
+
+	if (!ring)
+		return 0;
+
+	for (i = 0; i < kvm->n_coalesced_mmio_zones; ++i) {
+		struct winkvm_coalesced_mmio_zone *z =
+			&kvm->coalesced_mmio_zones[i];
+
+		if (z->addr <= gpa && gpa + bytes <= z->addr + z->size)
+			break;
+	}
+	if (i == kvm->n_coalesced_mmio_zones)
+		return 0;
+
+	last = ring->last;
+	if (last >= WINKVM_COALESCED_MMIO_MAX ||
+	    (last + 1) % WINKVM_COALESCED_MMIO_MAX == ring->first)
+		return 0;
+
+	entry = &ring->coalesced_mmio[last];
+	entry->phys_addr = gpa;
+	entry->len = bytes;
+	memcpy(entry->data, &val, bytes);
+	smp_wmb();
+	ring->last = (last + 1) % WINKVM_COALESCED_MMIO_MAX;
+	++vcpu->stat.mmio_coalesced;
+	return 1;
+}
+
 static int emulator_write_emulated(unsigned long addr,
 				   unsigned long val,
 				   unsigned int bytes,
@@ -1118,6 +1963,12 @@ static int emulator_write_emulated(unsigned long addr,
 	if (emulator_write_phys(vcpu, gpa, val, bytes))
 		return X86EMUL_CONTINUE;
 
+	if (kvm_apic_mmio_write(vcpu, gpa, &val, bytes))
+		return X86EMUL_CONTINUE;
+
+	if (coalesced_mmio_write(vcpu, gpa, val, bytes))
+		return X86EMUL_CONTINUE;
+
 	vcpu->mmio_needed = 1;
 	vcpu->mmio_phys_addr = gpa;
 	vcpu->mmio_size = bytes;
@@ -1173,6 +2024,7 @@ static unsigned long get_segment_base(struct kvm_vcpu *vcpu, int seg)
 
 int emulate_invlpg(struct kvm_vcpu *vcpu, gva_t address)
 {
+	kvm_mmu_invlpg(vcpu, address);
 	return X86EMUL_CONTINUE;
 }
 
@@ -1358,6 +2210,168 @@ int kvm_hypercall(struct kvm_vcpu *vcpu, struct kvm_run *run)
 }
 EXPORT_SYMBOL_GPL(kvm_hypercall);
 
+/*
+ * Under ept every vcpu walks the same gpa table, so dropping or write
+ * protecting one of its entries has to reach the processors the other
+ * vcpus run on.  Each of them flushes before its next vm entry, and
+ * those in the guest right now are kicked out and waited for, so that
+ * the caller may free what the entry pointed to.  vm entry checks the
+ * flag with interrupts off after setting guest_mode, which is only
+ * cleared again before interrupts come back on, so the wait cannot
+ * depend on kvm->lock or on a dpc of the other processor.
+ */
+void kvm_flush_remote_tlbs(struct kvm_vcpu *vcpu)
+{
+	struct kvm *kvm = vcpu->kvm;
+	struct kvm_vcpu *v;
+	int i;
+
+	for (i = 0; i < KVM_MAX_VCPUS; ++i) {
+		v = &kvm->vcpus[i];
+		if (v != vcpu && v->vmcs)
+			v->remote_tlb_flush = 1;
+	}
+	smp_mb();
+	for (i = 0; i < KVM_MAX_VCPUS; ++i) {
+		v = &kvm->vcpus[i];
+		if (v == vcpu || !v->vmcs || !v->guest_mode)
+			continue;
+		smp_send_reschedule(v->cpu);
+		while (v->guest_mode)
+			barrier();
+	}
+}
+EXPORT_SYMBOL_GPL(kvm_flush_remote_tlbs);
+
+static int pio_buffer_mapped(struct kvm_vcpu *vcpu, gva_t addr,
+			     unsigned long bytes)
+{
+	gva_t last = (addr + bytes - 1) & PAGE_MASK;
+
+	for (addr &= PAGE_MASK; ; addr += PAGE_SIZE) {
+		if (is_error_hpa(gva_to_hpa(vcpu, addr)))
+			return 0;
+		if (addr == last)
+			return 1;
+	}
+}
+
+/*
+ * Batch a string I/O instruction through the kvm_run page, so that user
+ * space sees one exit per chunk instead of one exit and one
+ * KVM_TRANSLATE per element.  OUTS data is copied out of the guest here,
+ * INS data is copied in by complete_pio() on the next KVM_RUN.  Backward
+ * (DF=1) strings and buffers that are not mapped take the old path.
+ *
+ * The caller passes the decoded exit, the copy in run->io is only for
+ * user space, which can rewrite it at any time.
+ */
+void kvm_setup_pio(struct kvm_vcpu *vcpu, struct kvm_run *run, int in,
+		   int size, int string, int down, int rep,
+		   unsigned long count, int ad_bytes, gva_t address)
+{
+	struct kvm_pio_request *io = &vcpu->pio;
+	unsigned long n, bytes;
+	void *data;
+
+	run->io.data_offset = 0;
+	if (!string || down || run != vcpu->run_page)
+		return;
+
+	n = rep ? count : 1;
+	if (n > WINKVM_PIO_DATA_SIZE / size)
+		n = WINKVM_PIO_DATA_SIZE / size;
+	if (ad_bytes < sizeof(unsigned long)) {
+		/* stop where si/di wrap, the guest restarts at offset 0 */
+		unsigned long mask = (1UL << (ad_bytes << 3)) - 1;
+		unsigned long off = vcpu->regs[in ? VCPU_REGS_RDI
+					       : VCPU_REGS_RSI] & mask;
+
+		if (n > (mask - off + 1) / size)
+			n = (mask - off + 1) / size;
+	}
+	if (!n)
+		return;
+	bytes = n * size;
+	data = (char *)run + WINKVM_PIO_DATA_OFFSET;
+
+	if (!in) {
+		if (kvm_read_guest(vcpu, address, bytes, data) != bytes)
+			return;
+	} else if (!pio_buffer_mapped(vcpu, address, bytes))
+		return;
+
+	io->pending = 1;
+	io->in = in;
+	io->size = size;
+	io->rep = rep;
+	io->last = !rep || n == count;
+	io->count = n;
+	io->ad_bytes = ad_bytes;
+	io->guest_addr = address;
+
+	run->io.count = n;
+	run->io.data_offset = WINKVM_PIO_DATA_OFFSET;
+}
+EXPORT_SYMBOL_GPL(kvm_setup_pio);
+
+/* si, di and cx are only as wide as the address size of the string op */
+static void pio_register_add(struct kvm_vcpu *vcpu, int reg, long inc)
+{
+	unsigned long mask;
+
+	if (vcpu->pio.ad_bytes == sizeof(unsigned long)) {
+		vcpu->regs[reg] += inc;
+		return;
+	}
+	mask = (1UL << (vcpu->pio.ad_bytes << 3)) - 1;
+	vcpu->regs[reg] = (vcpu->regs[reg] & ~mask)
+		| ((vcpu->regs[reg] + inc) & mask);
+}
+
+/*
+ * Finish a transfer started by kvm_setup_pio().  A partial rep transfer
+ * leaves rip alone, so the guest re-executes the instruction with the
+ * remaining count.
+ */
+static void complete_pio(struct kvm_vcpu *vcpu)
+{
+	struct kvm_pio_request *io = &vcpu->pio;
+	unsigned long bytes = io->count * io->size;
+
+	io->pending = 0;
+	if (io->in) {
+		if (kvm_write_guest(vcpu, io->guest_addr, bytes,
+				    (char *)vcpu->run_page
+				    + WINKVM_PIO_DATA_OFFSET) != bytes)
+			printk(KERN_ERR "%s: short write at gva %lx\n",
+			       __FUNCTION__, io->guest_addr);
+		pio_register_add(vcpu, VCPU_REGS_RDI, bytes);
+	} else
+		pio_register_add(vcpu, VCPU_REGS_RSI, bytes);
+	if (io->rep)
+		pio_register_add(vcpu, VCPU_REGS_RCX, -(long)io->count);
+	if (io->last)
+		kvm_arch_ops->skip_emulated_instruction(vcpu);
+}
+
+/*
+ * Called by the driver when the kvm_run mapping of the vcpu is (re)made
+ * or torn down.  Batched string I/O and the coalesced mmio ring are
+ * only used through that mapping.
+ */
+void kvm_vcpu_set_run_page(struct kvm_vcpu *vcpu, struct kvm_run *run)
+{
+	vcpu->pio.pending = 0;
+	vcpu->run_page = run;
+	vcpu->mmio_ring = run ? (struct winkvm_coalesced_mmio_ring *)
+		((char *)run + WINKVM_COALESCED_MMIO_OFFSET) : NULL;
+	vcpu->dirty_ring = run ? (struct winkvm_dirty_ring *)
+		((char *)run + WINKVM_DIRTY_RING_OFFSET) : NULL;
+	vcpu->dirty_ring_reset = 0;
+}
+EXPORT_SYMBOL_GPL(kvm_vcpu_set_run_page);
+
 static u64 mk_cr_64(u64 curr_cr, u32 new_val)
 {
 	return (curr_cr & ~((1ULL << 32) - 1)) | new_val;
@@ -1449,7 +2463,7 @@ static int vcpu_register_para(struct kvm_vcpu *vcpu, gpa_t para_state_gpa)
 	if (is_error_hpa(para_state_hpa))
 		goto err_gp;
 
-	mark_page_dirty(vcpu->kvm, para_state_gpa >> PAGE_SHIFT);
+	kvm_vcpu_mark_page_dirty(vcpu, para_state_gpa >> PAGE_SHIFT);
 	para_state_page = pfn_to_page(para_state_hpa >> PAGE_SHIFT);
 	para_state = kmap_atomic(para_state_page, KM_USER0);
 
@@ -1479,7 +2493,7 @@ static int vcpu_register_para(struct kvm_vcpu *vcpu, gpa_t para_state_gpa)
 	vcpu->para_state_gpa = para_state_gpa;
 	vcpu->hypercall_gpa = hypercall_gpa;
 
-	mark_page_dirty(vcpu->kvm, hypercall_gpa >> PAGE_SHIFT);
+	kvm_vcpu_mark_page_dirty(vcpu, hypercall_gpa >> PAGE_SHIFT);
 	hypercall = kmap_atomic(pfn_to_page(hypercall_hpa >> PAGE_SHIFT),
 				KM_USER1) + (hypercall_hpa & ~PAGE_MASK);
 	kvm_arch_ops->patch_hypercall(vcpu, hypercall);
@@ -1596,7 +2610,9 @@ int kvm_set_msr_common(struct kvm_vcpu *vcpu, u32 msr, u64 data)
 	case 0x200 ... 0x2ff: /* MTRRs */
 		break;
 	case MSR_IA32_APICBASE:
-		vcpu->apic_base = data;
+		spin_lock(&vcpu->kvm->lock);
+		kvm_apic_set_base(vcpu, data);
+		spin_unlock(&vcpu->kvm->lock);
 		break;
 	case MSR_IA32_MISC_ENABLE:
 		vcpu->ia32_misc_enable_msr = data;
@@ -1667,6 +2683,11 @@ int kvm_vcpu_ioctl_run(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 	/* re-sync apic's tpr */
 	vcpu->cr8 = kvm_run->cr8;
 
+	if (vcpu->pio.pending) {
+		complete_pio(vcpu);
+		kvm_run->emulated = 0;
+	}
+
 	if (kvm_run->emulated) {
 		kvm_arch_ops->skip_emulated_instruction(vcpu);
 		kvm_run->emulated = 0;
@@ -1674,14 +2695,31 @@ int kvm_vcpu_ioctl_run(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 
 	if (kvm_run->mmio_completed) {
 		memcpy(vcpu->mmio_data, kvm_run->mmio.data, 8);
-		vcpu->mmio_read_completed = 1;
-		emulate_instruction(vcpu, kvm_run, vcpu->mmio_fault_cr2, 0);
+		/*
+		 * The other operand may be a gfn that is not backed yet.
+		 * Back it and emulate again with the same mmio data, so
+		 * that the device is not read twice.
+		 */
+		for (;;) {
+			vcpu->mmio_read_completed = 1;
+			vcpu->populate_pending = 0;
+			/* the shadow page tables are shared by all vcpus of the vm */
+			spin_lock(&vcpu->kvm->lock);
+			emulate_instruction(vcpu, kvm_run, vcpu->mmio_fault_cr2, 0);
+			spin_unlock(&vcpu->kvm->lock);
+			if (!vcpu->populate_pending)
+				break;
+			r = kvm_mmu_populate(vcpu);
+			if (r < 0)
+				goto out;
+		}
 	}
 
 	vcpu->mmio_needed = 0;
 
 	r = kvm_arch_ops->run(vcpu, kvm_run);
 
+out:
 	vcpu_put(vcpu);
 
 	FUNCTION_EXIT();	
@@ -1863,7 +2901,9 @@ int kvm_vcpu_ioctl_set_sregs(struct kvm_vcpu *vcpu,
 #ifdef CONFIG_X86_64
 	kvm_arch_ops->set_efer(vcpu, sregs->efer);
 #endif
-	vcpu->apic_base = sregs->apic_base;
+	/* the in-kernel apic owns apic_base, see kvm_apic_set_base() */
+	if (!irqchip_in_kernel(vcpu->kvm))
+		vcpu->apic_base = sregs->apic_base;
 
 	kvm_arch_ops->decache_cr0_cr4_guest_bits(vcpu);
 
@@ -1875,8 +2915,11 @@ int kvm_vcpu_ioctl_set_sregs(struct kvm_vcpu *vcpu,
 	if (!is_long_mode(vcpu) && is_pae(vcpu))
 		load_pdptrs(vcpu, vcpu->cr3);
 
-	if (mmu_reset_needed)
+	if (mmu_reset_needed) {
+		spin_lock(&vcpu->kvm->lock);
 		kvm_mmu_reset_context(vcpu);
+		spin_unlock(&vcpu->kvm->lock);
+	}
 
 	memcpy(vcpu->irq_pending, sregs->interrupt_bitmap,
 	       sizeof vcpu->irq_pending);
@@ -2173,6 +3216,9 @@ int kvm_vm_ioctl_create_vcpu(struct kvm *kvm, int n)
 		r = kvm_arch_ops->vcpu_setup(vcpu);
 	vcpu_put(vcpu);
 
+	if (r >= 0 && irqchip_in_kernel(kvm))
+		r = kvm_irqchip_create_vcpu(vcpu);
+
 	if (r < 0)
 		goto out_free_vcpus;
 
@@ -2608,14 +3654,35 @@ static struct notifier_block kvm_cpu_notifier = {
 	.priority = 20, /* must be > scheduler priority */
 };
 
+static u64 stat_get(void *_offset)
+{
+	unsigned offset = (long)_offset;
+	u64 total = 0;
+	struct kvm *kvm;
+	struct kvm_vcpu *vcpu;
+	int i;
+
+	spin_lock(&kvm_lock);
+	list_for_each_entry(kvm, &vm_list, vm_list)
+		for (i = 0; i < KVM_MAX_VCPUS; ++i) {
+			vcpu = &kvm->vcpus[i];
+			total += *(u32 *)((void *)vcpu + offset);
+		}
+	spin_unlock(&kvm_lock);
+	return total;
+}
+
+DEFINE_SIMPLE_ATTRIBUTE(stat_fops, stat_get, NULL, "%llu\n");
+
 static __init void kvm_init_debug(void)
 {
 	struct kvm_stats_debugfs_item *p;
 
 	debugfs_dir = debugfs_create_dir("kvm", NULL);
 	for (p = debugfs_entries; p->name; ++p)
-		p->dentry = debugfs_create_u32(p->name, 0444, debugfs_dir,
-					       p->data);
+		p->dentry = debugfs_create_file(p->name, 0444, debugfs_dir,
+						(void *)(long)p->offset,
+						&stat_fops);
 }
 
 static void kvm_exit_debug(void)
@@ -2766,6 +3833,10 @@ out:
 	
 	on_each_cpu(kvm_arch_ops->hardware_enable, NULL, 0, 1);	
 
+#ifdef CONFIG_WINKVM_TRACE
+	kvm_init_trace();
+#endif
+
 	printk(KERN_ALERT "end\n");	
 	
 out:		
@@ -2787,6 +3858,9 @@ void kvm_exit_arch(void)
 #else
 	FUNCTION_ENTER();
 	
+#ifdef CONFIG_WINKVM_TRACE
+	kvm_exit_trace();
+#endif
 	on_each_cpu(kvm_arch_ops->hardware_disable, NULL, 0, 1);
 	kvm_arch_ops->hardware_unsetup();
 	kvm_arch_ops = NULL;
@@ -0,0 +1,685 @@
+/*
+ *  APIC support
+ *
+ *  Copyright (c) 2004-2005 Fabrice Bellard
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Port of the local apic half of qemu's hw/apic.c to the driver; the
+ * i/o apic stays in user space and sends its messages through
+ * WINKVM_APIC_DELIVER.  The apic of a vcpu is the one that accesses the
+ * mmio page, and apic ids are vcpu slots.  Called with kvm->lock held,
+ * except for the timer callback which takes it.
+ */
+#include <linux/winkvmstab.h>
+
+#include "irq.h"
+
+#include <asm/winkvmmisc.h>
+
+/* APIC Local Vector Table */
+#define APIC_LVT_TIMER   0
+#define APIC_LVT_THERMAL 1
+#define APIC_LVT_PERFORM 2
+#define APIC_LVT_LINT0   3
+#define APIC_LVT_LINT1   4
+#define APIC_LVT_ERROR   5
+
+/* APIC delivery modes */
+#define APIC_DM_FIXED	0
+#define APIC_DM_LOWPRI	1
+#define APIC_DM_SMI	2
+#define APIC_DM_NMI	4
+#define APIC_DM_INIT	5
+#define APIC_DM_SIPI	6
+#define APIC_DM_EXTINT	7
+
+#define APIC_TRIGGER_EDGE  0
+#define APIC_TRIGGER_LEVEL 1
+
+#define	APIC_LVT_TIMER_PERIODIC		(1<<17)
+#define	APIC_LVT_MASKED			(1<<16)
+
+#define ESR_ILLEGAL_ADDRESS (1 << 7)
+
+#define APIC_SV_ENABLE (1 << 8)
+
+#define MSR_IA32_APICBASE_BSP		(1<<8)
+#define MSR_IA32_APICBASE_ENABLE	(1<<11)
+#define MSR_IA32_APICBASE_BASE		(0xfffff<<12)
+
+#define APIC_DEFAULT_BASE 0xfee00000ULL
+#define APIC_MMIO_LENGTH  4096
+
+/* one bit per vcpu slot */
+typedef u32 apic_mask_t;
+
+static void apic_update_irq(struct kvm_lapic *s);
+
+static inline void apic_set_bit(u32 *tab, int index)
+{
+	tab[index >> 5] |= 1 << (index & 0x1f);
+}
+
+static inline void apic_reset_bit(u32 *tab, int index)
+{
+	tab[index >> 5] &= ~(1 << (index & 0x1f));
+}
+
+/* return -1 if no bit is set */
+static int get_highest_priority_int(u32 *tab)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		if (tab[i] != 0)
+			return i * 32 + fls(tab[i]) - 1;
+	return -1;
+}
+
+static inline struct kvm_lapic *vcpu_apic(struct kvm *kvm, int slot)
+{
+	return kvm->vcpus[slot].apic;
+}
+
+static int apic_get_ppr(struct kvm_lapic *s)
+{
+	int tpr, isrv, ppr;
+
+	tpr = (s->tpr >> 4);
+	isrv = get_highest_priority_int(s->isr);
+	if (isrv < 0)
+		isrv = 0;
+	isrv >>= 4;
+	if (tpr >= isrv)
+		ppr = s->tpr;
+	else
+		ppr = isrv << 4;
+	return ppr;
+}
+
+static int apic_enabled(struct kvm_lapic *s)
+{
+	return (s->vcpu->apic_base & MSR_IA32_APICBASE_ENABLE) &&
+		(s->spurious_vec & APIC_SV_ENABLE);
+}
+
+/* highest vector that is deliverable now, or -1 */
+static int apic_pending_vector(struct kvm_lapic *s)
+{
+	int irrv, ppr;
+
+	if (!apic_enabled(s))
+		return -1;
+	irrv = get_highest_priority_int(s->irr);
+	if (irrv < 0)
+		return -1;
+	ppr = apic_get_ppr(s);
+	if (ppr && (irrv & 0xf0) <= (ppr & 0xf0))
+		return -1;
+	return irrv;
+}
+
+/* signal the CPU if an irq is pending */
+static void apic_update_irq(struct kvm_lapic *s)
+{
+	if (apic_pending_vector(s) >= 0)
+		kvm_vcpu_kick(s->vcpu);
+}
+
+static void apic_set_irq(struct kvm_lapic *s, int vector_num, int trigger_mode)
+{
+	apic_set_bit(s->irr, vector_num);
+	if (trigger_mode)
+		apic_set_bit(s->tmr, vector_num);
+	else
+		apic_reset_bit(s->tmr, vector_num);
+	apic_update_irq(s);
+}
+
+static void apic_eoi(struct kvm_lapic *s)
+{
+	int isrv;
+
+	isrv = get_highest_priority_int(s->isr);
+	if (isrv < 0)
+		return;
+	apic_reset_bit(s->isr, isrv);
+	/*
+	 * XXX: send the EOI packet to the APIC bus to allow the I/O APIC to
+	 * set the remote IRR bit for level triggered interrupts.
+	 */
+	apic_update_irq(s);
+}
+
+static apic_mask_t apic_get_delivery_bitmask(struct kvm *kvm, u8 dest,
+					     u8 dest_mode)
+{
+	struct kvm_lapic *apic_iter;
+	apic_mask_t mask = 0;
+	int i;
+
+	for (i = 0; i < KVM_MAX_VCPUS; i++) {
+		apic_iter = vcpu_apic(kvm, i);
+		if (!apic_iter)
+			continue;
+		if (dest_mode == 0) {
+			if (dest == 0xff || dest == apic_iter->id)
+				mask |= 1 << i;
+		} else if (apic_iter->dest_mode == 0xf) {
+			/* flat */
+			if (dest & apic_iter->log_dest)
+				mask |= 1 << i;
+		} else if (apic_iter->dest_mode == 0x0) {
+			/* cluster */
+			if ((dest & 0xf0) == (apic_iter->log_dest & 0xf0) &&
+			    (dest & apic_iter->log_dest & 0x0f))
+				mask |= 1 << i;
+		}
+	}
+	return mask;
+}
+
+static void apic_init_ipi(struct kvm_lapic *s)
+{
+	int i;
+
+	s->tpr = 0;
+	s->spurious_vec = 0xff;
+	s->log_dest = 0;
+	s->dest_mode = 0xf;
+	memset(s->isr, 0, sizeof(s->isr));
+	memset(s->tmr, 0, sizeof(s->tmr));
+	memset(s->irr, 0, sizeof(s->irr));
+	for (i = 0; i < APIC_LVT_NB; i++)
+		s->lvt[i] = APIC_LVT_MASKED;
+	s->esr = 0;
+	memset(s->icr, 0, sizeof(s->icr));
+	s->divide_conf = 0;
+	s->count_shift = 0;
+	s->initial_count = 0;
+	s->initial_count_load_time = 0;
+	winkvm_timer_cancel(s->timer);
+}
+
+/* an INIT stops the vcpu until a startup ipi */
+static void apic_init(struct kvm_lapic *s)
+{
+	apic_init_ipi(s);
+	s->vcpu->mp_state = VCPU_MP_STATE_WAIT_SIPI;
+	kvm_vcpu_kick(s->vcpu);
+}
+
+/* send a SIPI message to the CPU to start it */
+static void apic_startup(struct kvm_lapic *s, int vector_num)
+{
+	struct kvm_vcpu *vcpu = s->vcpu;
+
+	if (vcpu->mp_state != VCPU_MP_STATE_WAIT_SIPI)
+		return;
+	vcpu->sipi_vector = vector_num;
+	vcpu->mp_state = VCPU_MP_STATE_SIPI_RECEIVED;
+	kvm_vcpu_kick(vcpu);
+}
+
+static void apic_bus_deliver(struct kvm *kvm, apic_mask_t deliver_bitmask,
+			     u8 delivery_mode, u8 vector_num, u8 trigger_mode)
+{
+	struct kvm_lapic *apic_iter;
+	int i;
+
+	switch (delivery_mode) {
+	case APIC_DM_LOWPRI:
+		/* XXX: search for focus processor, arbitration */
+		if (deliver_bitmask) {
+			apic_iter = vcpu_apic(kvm, __ffs(deliver_bitmask));
+			apic_set_irq(apic_iter, vector_num, trigger_mode);
+		}
+		return;
+	case APIC_DM_FIXED:
+		break;
+	case APIC_DM_INIT:
+		/* normal INIT IPI sent to processors */
+		for (i = 0; i < KVM_MAX_VCPUS; i++)
+			if (deliver_bitmask & (1 << i))
+				apic_init(vcpu_apic(kvm, i));
+		return;
+	case APIC_DM_SMI:
+	case APIC_DM_NMI:
+	case APIC_DM_EXTINT:
+		/* ExtINT is the pic output through LINT0 */
+	default:
+		return;
+	}
+
+	for (i = 0; i < KVM_MAX_VCPUS; i++)
+		if (deliver_bitmask & (1 << i))
+			apic_set_irq(vcpu_apic(kvm, i), vector_num,
+				     trigger_mode);
+}
+
+void kvm_apic_bus_deliver(struct kvm *kvm, u8 dest, u8 dest_mode,
+			  u8 delivery_mode, u8 vector, u8 trig_mode)
+{
+	apic_bus_deliver(kvm, apic_get_delivery_bitmask(kvm, dest, dest_mode),
+			 delivery_mode, vector, trig_mode);
+}
+
+static void apic_deliver(struct kvm_lapic *s, u8 dest, u8 dest_mode,
+			 u8 delivery_mode, u8 vector_num, u8 trigger_mode)
+{
+	struct kvm *kvm = s->vcpu->kvm;
+	apic_mask_t deliver_bitmask = 0, all = 0, self;
+	int dest_shorthand = (s->icr[0] >> 18) & 3;
+	int i;
+
+	for (i = 0; i < KVM_MAX_VCPUS; i++)
+		if (vcpu_apic(kvm, i))
+			all |= 1 << i;
+	self = 1 << (s->vcpu - kvm->vcpus);
+
+	switch (dest_shorthand) {
+	case 0:
+		deliver_bitmask = apic_get_delivery_bitmask(kvm, dest, dest_mode);
+		break;
+	case 1:
+		deliver_bitmask = self;
+		break;
+	case 2:
+		deliver_bitmask = all;
+		break;
+	case 3:
+		deliver_bitmask = all & ~self;
+		break;
+	}
+
+	switch (delivery_mode) {
+	case APIC_DM_INIT:
+		{
+			int trig_mode = (s->icr[0] >> 15) & 1;
+			int level = (s->icr[0] >> 14) & 1;
+
+			/* INIT level de-assert only syncs arbitration ids */
+			if (level == 0 && trig_mode == 1) {
+				for (i = 0; i < KVM_MAX_VCPUS; i++)
+					if (deliver_bitmask & (1 << i))
+						vcpu_apic(kvm, i)->arb_id =
+							vcpu_apic(kvm, i)->id;
+				return;
+			}
+		}
+		break;
+
+	case APIC_DM_SIPI:
+		for (i = 0; i < KVM_MAX_VCPUS; i++)
+			if (deliver_bitmask & (1 << i))
+				apic_startup(vcpu_apic(kvm, i), vector_num);
+		return;
+	}
+
+	apic_bus_deliver(kvm, deliver_bitmask, delivery_mode, vector_num,
+			 trigger_mode);
+}
+
+int kvm_apic_has_interrupt(struct kvm_vcpu *vcpu)
+{
+	return apic_pending_vector(vcpu->apic);
+}
+
+int kvm_apic_get_interrupt(struct kvm_vcpu *vcpu)
+{
+	struct kvm_lapic *s = vcpu->apic;
+	int intno;
+
+	intno = apic_pending_vector(s);
+	if (intno < 0)
+		return -1;
+	apic_reset_bit(s->irr, intno);
+	apic_set_bit(s->isr, intno);
+	return intno;
+}
+
+int kvm_apic_accept_pic_intr(struct kvm_vcpu *vcpu)
+{
+	struct kvm_lapic *s = vcpu->apic;
+	u32 lvt0;
+
+	lvt0 = s->lvt[APIC_LVT_LINT0];
+
+	if (s->id == 0 &&
+	    ((vcpu->apic_base & MSR_IA32_APICBASE_ENABLE) == 0 ||
+	     ((lvt0 & APIC_LVT_MASKED) == 0 &&
+	      ((lvt0 >> 8) & 0x7) == APIC_DM_EXTINT)))
+		return 1;
+
+	return 0;
+}
+
+/* timer ticks are ns, as in qemu, divided by 2^count_shift */
+static u64 apic_period(struct kvm_lapic *s)
+{
+	return ((u64)s->initial_count + 1) << s->count_shift;
+}
+
+static u32 apic_get_current_count(struct kvm_lapic *s)
+{
+	u64 d;
+	u32 val;
+
+	d = (winkvm_get_ns() - s->initial_count_load_time) >> s->count_shift;
+	if (s->lvt[APIC_LVT_TIMER] & APIC_LVT_TIMER_PERIODIC) {
+		/* periodic */
+		if (s->initial_count == 0xffffffff)
+			val = s->initial_count - (u32)d;
+		else
+			val = s->initial_count - do_div(d, s->initial_count + 1);
+	} else {
+		if (d >= s->initial_count)
+			val = 0;
+		else
+			val = s->initial_count - d;
+	}
+	return val;
+}
+
+static void apic_timer_update(struct kvm_lapic *s)
+{
+	u64 elapsed, period;
+	u32 rem;
+
+	if ((s->lvt[APIC_LVT_TIMER] & APIC_LVT_MASKED) || !s->initial_count) {
+		winkvm_timer_cancel(s->timer);
+		return;
+	}
+	period = apic_period(s);
+	elapsed = winkvm_get_ns() - s->initial_count_load_time;
+	if (s->lvt[APIC_LVT_TIMER] & APIC_LVT_TIMER_PERIODIC) {
+		/* keep the phase of the count */
+		if (period >> 32)
+			rem = 0;
+		else
+			rem = do_div(elapsed, (u32)period);
+		winkvm_timer_start(s->timer, period - rem, period);
+	} else if (elapsed < period)
+		winkvm_timer_start(s->timer, period - elapsed, 0);
+	else
+		winkvm_timer_cancel(s->timer);
+}
+
+static void apic_timer_fn(void *data)
+{
+	struct kvm_lapic *s = data;
+	struct kvm *kvm = s->vcpu->kvm;
+
+	spin_lock(&kvm->lock);
+	if (!(s->lvt[APIC_LVT_TIMER] & APIC_LVT_MASKED))
+		apic_set_irq(s, s->lvt[APIC_LVT_TIMER] & 0xff,
+			     APIC_TRIGGER_EDGE);
+	spin_unlock(&kvm->lock);
+}
+
+static u32 apic_mem_readl(struct kvm_lapic *s, u32 addr)
+{
+	u32 val;
+	int index;
+
+	index = (addr >> 4) & 0xff;
+	switch (index) {
+	case 0x02: /* id */
+		val = s->id << 24;
+		break;
+	case 0x03: /* version */
+		val = 0x11 | ((APIC_LVT_NB - 1) << 16); /* version 0x11 */
+		break;
+	case 0x08:
+		val = s->tpr;
+		break;
+	case 0x09:
+		/* XXX: arbitration */
+		val = 0;
+		break;
+	case 0x0a:
+		/* ppr */
+		val = apic_get_ppr(s);
+		break;
+	case 0x0d:
+		val = s->log_dest << 24;
+		break;
+	case 0x0e:
+		val = s->dest_mode << 28;
+		break;
+	case 0x0f:
+		val = s->spurious_vec;
+		break;
+	case 0x10 ... 0x17:
+		val = s->isr[index & 7];
+		break;
+	case 0x18 ... 0x1f:
+		val = s->tmr[index & 7];
+		break;
+	case 0x20 ... 0x27:
+		val = s->irr[index & 7];
+		break;
+	case 0x28:
+		val = s->esr;
+		break;
+	case 0x30:
+	case 0x31:
+		val = s->icr[index & 1];
+		break;
+	case 0x32 ... 0x37:
+		val = s->lvt[index - 0x32];
+		break;
+	case 0x38:
+		val = s->initial_count;
+		break;
+	case 0x39:
+		val = apic_get_current_count(s);
+		break;
+	case 0x3e:
+		val = s->divide_conf;
+		break;
+	default:
+		s->esr |= ESR_ILLEGAL_ADDRESS;
+		val = 0;
+		break;
+	}
+	return val;
+}
+
+static void apic_mem_writel(struct kvm_lapic *s, u32 addr, u32 val)
+{
+	int index;
+
+	index = (addr >> 4) & 0xff;
+	switch (index) {
+	case 0x02:
+		s->id = (val >> 24);
+		break;
+	case 0x03:
+		break;
+	case 0x08:
+		s->tpr = val;
+		apic_update_irq(s);
+		break;
+	case 0x09:
+	case 0x0a:
+		break;
+	case 0x0b: /* EOI */
+		apic_eoi(s);
+		break;
+	case 0x0d:
+		s->log_dest = val >> 24;
+		break;
+	case 0x0e:
+		s->dest_mode = val >> 28;
+		break;
+	case 0x0f:
+		s->spurious_vec = val & 0x1ff;
+		apic_update_irq(s);
+		break;
+	case 0x10 ... 0x17:
+	case 0x18 ... 0x1f:
+	case 0x20 ... 0x27:
+	case 0x28:
+		break;
+	case 0x30:
+		s->icr[0] = val;
+		apic_deliver(s, (s->icr[1] >> 24) & 0xff, (s->icr[0] >> 11) & 1,
+			     (s->icr[0] >> 8) & 7, (s->icr[0] & 0xff),
+			     (s->icr[0] >> 15) & 1);
+		break;
+	case 0x31:
+		s->icr[1] = val;
+		break;
+	case 0x32 ... 0x37:
+		{
+			int n = index - 0x32;
+
+			s->lvt[n] = val;
+			if (n == APIC_LVT_TIMER)
+				apic_timer_update(s);
+			if (n == APIC_LVT_LINT0)
+				kvm_pic_update_output(s->vcpu->kvm);
+		}
+		break;
+	case 0x38:
+		s->initial_count = val;
+		s->initial_count_load_time = winkvm_get_ns();
+		apic_timer_update(s);
+		break;
+	case 0x39:
+		break;
+	case 0x3e:
+		{
+			int v;
+
+			s->divide_conf = val & 0xb;
+			v = (s->divide_conf & 3) | ((s->divide_conf >> 1) & 4);
+			s->count_shift = (v + 1) & 7;
+			apic_timer_update(s);
+		}
+		break;
+	default:
+		s->esr |= ESR_ILLEGAL_ADDRESS;
+		break;
+	}
+}
+
+static int apic_mmio_range(struct kvm_vcpu *vcpu, gpa_t gpa, int bytes)
+{
+	gpa_t base = vcpu->apic_base & MSR_IA32_APICBASE_BASE;
+
+	return vcpu->apic && (vcpu->apic_base & MSR_IA32_APICBASE_ENABLE) &&
+		gpa >= base && gpa + bytes <= base + APIC_MMIO_LENGTH;
+}
+
+/*
+ * Registers are 32 bit wide at 16 byte strides; smaller reads see part
+ * of the register, smaller writes are dropped as in qemu.
+ * Return 0 if gpa is not in the apic page of the vcpu.
+ */
+int kvm_apic_mmio_read(struct kvm_vcpu *vcpu, gpa_t gpa, void *val, int bytes)
+{
+	u32 reg;
+
+	if (!apic_mmio_range(vcpu, gpa, bytes))
+		return 0;
+	reg = apic_mem_readl(vcpu->apic, gpa & 0xff0);
+	reg >>= (gpa & 3) * 8;
+	memset(val, 0, bytes);
+	memcpy(val, &reg, bytes < 4 ? bytes : 4);
+	return 1;
+}
+
+int kvm_apic_mmio_write(struct kvm_vcpu *vcpu, gpa_t gpa, const void *val,
+			int bytes)
+{
+	u32 reg;
+
+	if (!apic_mmio_range(vcpu, gpa, bytes))
+		return 0;
+	if (bytes >= 4 && !(gpa & 3)) {
+		memcpy(&reg, val, 4);
+		apic_mem_writel(vcpu->apic, gpa & 0xff0, reg);
+	}
+	return 1;
+}
+
+void kvm_apic_set_base(struct kvm_vcpu *vcpu, u64 value)
+{
+	struct kvm_lapic *s = vcpu->apic;
+
+	if (!s) {
+		vcpu->apic_base = value;
+		return;
+	}
+	vcpu->apic_base = (value & MSR_IA32_APICBASE_BASE) |
+		(vcpu->apic_base &
+		 (MSR_IA32_APICBASE_BSP | MSR_IA32_APICBASE_ENABLE));
+	/* if disabled, cannot be enabled again */
+	if (!(value & MSR_IA32_APICBASE_ENABLE)) {
+		vcpu->apic_base &= ~MSR_IA32_APICBASE_ENABLE;
+		s->spurious_vec &= ~APIC_SV_ENABLE;
+	}
+	kvm_pic_update_output(vcpu->kvm);
+}
+
+void kvm_lapic_reset(struct kvm_vcpu *vcpu)
+{
+	struct kvm_lapic *s = vcpu->apic;
+	int bsp = (vcpu == &vcpu->kvm->vcpus[0]);
+
+	s->id = vcpu - vcpu->kvm->vcpus;
+	s->arb_id = s->id;
+	vcpu->apic_base = APIC_DEFAULT_BASE | MSR_IA32_APICBASE_ENABLE |
+		(bsp ? MSR_IA32_APICBASE_BSP : 0);
+	apic_init_ipi(s);
+	/*
+	 * LINT0 of the bsp is set to ExtINT by the bios in real machines,
+	 * so that pic interrupts still come through an enabled apic.
+	 */
+	if (bsp)
+		s->lvt[APIC_LVT_LINT0] = APIC_DM_EXTINT << 8;
+	vcpu->mp_state = bsp ? VCPU_MP_STATE_RUNNABLE : VCPU_MP_STATE_WAIT_SIPI;
+}
+
+int kvm_create_lapic(struct kvm_vcpu *vcpu)
+{
+	struct kvm_lapic *s;
+
+	s = kzalloc(sizeof(struct kvm_lapic), GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+	s->vcpu = vcpu;
+	s->timer = winkvm_timer_create(apic_timer_fn, s);
+	if (!s->timer) {
+		kfree(s);
+		return -ENOMEM;
+	}
+	vcpu->apic = s;
+	return 0;
+}
+
+void kvm_free_lapic(struct kvm_vcpu *vcpu)
+{
+	struct kvm_lapic *s = vcpu->apic;
+
+	if (!s)
+		return;
+	winkvm_timer_destroy(s->timer);
+	kfree(s);
+	vcpu->apic = NULL;
+}
@@ -148,11 +148,6 @@ static int dbg = 1;
 	(PAGE_MASK & ~((1ULL << (PAGE_SHIFT + PT32_LEVEL_BITS)) - 1))
 
 
-#define PFERR_PRESENT_MASK (1U << 0)
-#define PFERR_WRITE_MASK (1U << 1)
-#define PFERR_USER_MASK (1U << 2)
-#define PFERR_FETCH_MASK (1U << 4)
-
 #define PT64_ROOT_LEVEL 4
 #define PT32_ROOT_LEVEL 2
 #define PT32E_ROOT_LEVEL 3
@@ -160,8 +155,29 @@ static int dbg = 1;
 #define PT_DIRECTORY_LEVEL 2
 #define PT_PAGE_TABLE_LEVEL 1
 
+/*
+ * Entries of the gpa to hpa table walked by the processor when
+ * two-dimensional paging is on.  Read and write sit where present and
+ * writable sit in a pte, so rmap and write protection work unchanged.
+ */
+#define TDP_READABLE_MASK PT_PRESENT_MASK
+#define TDP_WRITABLE_MASK PT_WRITABLE_MASK
+#define TDP_EXECUTABLE_MASK (1ULL << 2)
+#define TDP_MT_WB (6ULL << 3)
+#define TDP_IGNORE_PAT_MASK (1ULL << 6)
+
+#define TDP_DIR_BITS \
+	(TDP_READABLE_MASK | TDP_WRITABLE_MASK | TDP_EXECUTABLE_MASK)
+#define TDP_PTE_BITS (TDP_DIR_BITS | TDP_MT_WB | TDP_IGNORE_PAT_MASK)
+
+/* set by the arch module when the processor can walk a gpa to hpa table */
+int tdp_enabled;
+
 #define RMAP_EXT 4
 
+/* aligned block of leaf shadow ptes filled together on a fault */
+#define PTE_PREFETCH_NUM 8
+
 struct kvm_rmap_desc {
 	u64 *shadow_ptes[RMAP_EXT];
 	struct kvm_rmap_desc *more;
@@ -203,6 +219,15 @@ static int is_rmap_pte(u64 pte)
 		== (PT_WRITABLE_MASK | PT_PRESENT_MASK);
 }
 
+/*
+ * Only meaningful for a present directory level shadow pte; shadow
+ * directory entries and 4k shadow ptes never carry the bit.
+ */
+static int is_large_pte(u64 pte)
+{
+	return pte & PT_PAGE_SIZE_MASK;
+}
+
 static int mmu_topup_memory_cache(struct kvm_mmu_memory_cache *cache,
 				  size_t objsize, int min)
 {
@@ -247,7 +272,7 @@ static int mmu_topup_memory_caches(struct kvm_vcpu *vcpu)
 	if (r)
 		goto out;
 	r = mmu_topup_memory_cache(&vcpu->mmu_rmap_desc_cache,
-				   sizeof(struct kvm_rmap_desc), 1);
+				   sizeof(struct kvm_rmap_desc), PTE_PREFETCH_NUM);
 out:
 	FUNCTION_EXIT();	
 	return r;
@@ -454,6 +479,90 @@ static void rmap_write_protect(struct kvm_vcpu *vcpu, u64 gfn)
 	}
 }
 
+static struct kvm_lpage_info *lpage_info_of(struct kvm_memory_slot *slot,
+					     gfn_t gfn)
+{
+	return &slot->lpage_info[gfn / KVM_PAGES_PER_LPAGE -
+				 slot->base_gfn / KVM_PAGES_PER_LPAGE];
+}
+
+/*
+ * Can the 2MB frame holding gfn be mapped by one large shadow pte?
+ * Dirty logging needs 4k granularity, so logged slots never can.
+ */
+static int mmu_lpage_allowed(struct kvm_vcpu *vcpu, gfn_t gfn)
+{
+	struct kvm_memory_slot *slot;
+
+	slot = gfn_to_memslot(vcpu->kvm, gfn);
+	if (!slot || !slot->lpage_info || slot->dirty_bitmap)
+		return 0;
+	return lpage_info_of(slot, gfn)->write_count == 0;
+}
+
+/*
+ * A guest page table in gfn is about to be shadowed.  Large mappings
+ * of its frame are forbidden from now on, and the ones already made
+ * are dropped: a writable one sits in the rmap of the first page of
+ * the frame, where rmap_write_protect(gfn) would not find it.
+ */
+static void account_shadowed(struct kvm_vcpu *vcpu, gfn_t gfn)
+{
+	struct kvm_memory_slot *slot;
+	struct kvm_rmap_desc *desc;
+	struct page *page;
+	gfn_t base;
+	u64 *spte;
+	int i;
+
+	slot = gfn_to_memslot(vcpu->kvm, gfn);
+	if (!slot || !slot->lpage_info)
+		return;
+	++lpage_info_of(slot, gfn)->write_count;
+
+	base = gfn & ~(gfn_t)(KVM_PAGES_PER_LPAGE - 1);
+	if (base < slot->base_gfn)
+		return;
+	page = gfn_to_page(slot, base);
+	if (!page)
+		return;
+
+again:
+	if (!page_private(page))
+		return;
+	if (!(page_private(page) & 1)) {
+		spte = (u64 *)page_private(page);
+		if (is_large_pte(*spte))
+			goto zap;
+		return;
+	}
+	desc = (struct kvm_rmap_desc *)(page_private(page) & ~1ul);
+	for (; desc; desc = desc->more)
+		for (i = 0; i < RMAP_EXT && desc->shadow_ptes[i]; ++i) {
+			spte = desc->shadow_ptes[i];
+			if (is_large_pte(*spte))
+				goto zap;
+		}
+	return;
+
+zap:
+	rmap_printk("account_shadowed: spte %p %llx\n", spte, *spte);
+	rmap_remove(vcpu, spte);
+	*spte = 0;
+	kvm_arch_ops->tlb_flush(vcpu);
+	goto again;
+}
+
+static void unaccount_shadowed(struct kvm_vcpu *vcpu, gfn_t gfn)
+{
+	struct kvm_memory_slot *slot;
+
+	slot = gfn_to_memslot(vcpu->kvm, gfn);
+	if (!slot || !slot->lpage_info)
+		return;
+	--lpage_info_of(slot, gfn)->write_count;
+}
+
 static int is_empty_shadow_page(hpa_t page_hpa)
 {
 	u64 *pos;
@@ -476,7 +585,7 @@ static void kvm_mmu_free_page(struct kvm_vcpu *vcpu, hpa_t page_hpa)
 	ASSERT(is_empty_shadow_page(page_hpa));
 	list_del(&page_head->link);
 	page_head->page_hpa = page_hpa;
-	list_add(&page_head->link, &vcpu->free_pages);
+	list_add(&page_head->link, &vcpu->kvm->free_mmu_pages);
 	++vcpu->kvm->n_free_mmu_pages;
 }
 
@@ -490,16 +599,17 @@ static struct kvm_mmu_page *kvm_mmu_alloc_page(struct kvm_vcpu *vcpu,
 {
 	struct kvm_mmu_page *page;
 
-	if (list_empty(&vcpu->free_pages))
+	if (list_empty(&vcpu->kvm->free_mmu_pages))
 		return NULL;
 
-	page = list_entry(vcpu->free_pages.next, struct kvm_mmu_page, link);
+	page = list_entry(vcpu->kvm->free_mmu_pages.next, struct kvm_mmu_page, link);
 	list_del(&page->link);
 	list_add(&page->link, &vcpu->kvm->active_mmu_pages);
 	ASSERT(is_empty_shadow_page(page->page_hpa));
 	page->slot_bitmap = 0;
 	page->global = 1;
 	page->multimapped = 0;
+	page->unsync = 0;
 	page->parent_pte = parent_pte;
 	--vcpu->kvm->n_free_mmu_pages;
 	return page;
@@ -590,7 +700,7 @@ static struct kvm_mmu_page *kvm_mmu_lookup_page(struct kvm_vcpu *vcpu,
 	struct hlist_node *node;
 
 	pgprintk("%s: looking for gfn %lx\n", __FUNCTION__, gfn);
-	index = kvm_page_table_hashfn(gfn) % KVM_NUM_MMU_PAGES;
+	index = kvm_page_table_hashfn(gfn) % vcpu->kvm->n_mmu_page_hash;
 	bucket = &vcpu->kvm->mmu_page_hash[index];
 	hlist_for_each_entry(page, node, bucket, hash_link)
 		if (page->gfn == gfn && !page->role.metaphysical) {
@@ -601,6 +711,31 @@ static struct kvm_mmu_page *kvm_mmu_lookup_page(struct kvm_vcpu *vcpu,
 	return NULL;
 }
 
+/*
+ * Out of sync shadow pages.
+ *
+ * The tlb does not follow guest pte writes either: the guest has to
+ * invlpg, reload cr3 or otherwise flush before it relies on a change.
+ * So a guest page table that is shadowed only by leaf pages need not
+ * stay write protected.  Its shadow pages are marked unsync and the
+ * guest writes it directly; at the next flush point every shadow pte
+ * of the page is checked against the guest pte it came from.
+ */
+static void mmu_mark_unsync(struct kvm_vcpu *vcpu, struct kvm_mmu_page *page)
+{
+	page->unsync = 1;
+	list_add(&page->unsync_link, &vcpu->kvm->unsync_mmu_pages);
+	++vcpu->stat.mmu_unsync;
+}
+
+static void mmu_clear_unsync(struct kvm_mmu_page *page)
+{
+	page->unsync = 0;
+	list_del(&page->unsync_link);
+}
+
+static void mmu_sync_gfn(struct kvm_vcpu *vcpu, gfn_t gfn);
+
 static struct kvm_mmu_page *kvm_mmu_get_page(struct kvm_vcpu *vcpu,
 					     gfn_t gfn,
 					     gva_t gaddr,
@@ -618,17 +753,18 @@ static struct kvm_mmu_page *kvm_mmu_get_page(struct kvm_vcpu *vcpu,
 	FUNCTION_ENTER();	
 
 	role.word = 0;
-	role.glevels = vcpu->mmu.root_level;
+	role.glevels = vcpu->mmu.tdp ? 0 : vcpu->mmu.root_level;
 	role.level = level;
 	role.metaphysical = metaphysical;
-	if (vcpu->mmu.root_level <= PT32_ROOT_LEVEL) {
+	role.tdp = vcpu->mmu.tdp;
+	if (!vcpu->mmu.tdp && vcpu->mmu.root_level <= PT32_ROOT_LEVEL) {
 		quadrant = gaddr >> (PAGE_SHIFT + (PT64_PT_BITS * level));
 		quadrant &= (1 << ((PT32_PT_BITS - PT64_PT_BITS) * level)) - 1;
 		role.quadrant = quadrant;
 	}
 	pgprintk("%s: looking gfn %lx role %x\n", __FUNCTION__,
 		 gfn, role.word);
-	index = kvm_page_table_hashfn(gfn) % KVM_NUM_MMU_PAGES;
+	index = kvm_page_table_hashfn(gfn) % vcpu->kvm->n_mmu_page_hash;
 	bucket = &vcpu->kvm->mmu_page_hash[index];
 	hlist_for_each_entry(page, node, bucket, hash_link)
 		if (page->gfn == gfn && page->role.word == role.word) {
@@ -637,6 +773,9 @@ static struct kvm_mmu_page *kvm_mmu_get_page(struct kvm_vcpu *vcpu,
 			FUNCTION_EXIT();			
 			return page;
 		}
+	/* a directory must be write protected: end any unsync leaf use */
+	if (!metaphysical && level > PT_PAGE_TABLE_LEVEL)
+		mmu_sync_gfn(vcpu, gfn);
 	page = kvm_mmu_alloc_page(vcpu, parent_pte);
 	if (!page) {
 		FUNCTION_EXIT();		
@@ -646,8 +785,10 @@ static struct kvm_mmu_page *kvm_mmu_get_page(struct kvm_vcpu *vcpu,
 	page->gfn = gfn;
 	page->role = role;
 	hlist_add_head(&page->hash_link, bucket);
-	if (!metaphysical)
+	if (!metaphysical) {
+		account_shadowed(vcpu, gfn);
 		rmap_write_protect(vcpu, gfn);
+	}
 	FUNCTION_EXIT();	
 	return page;
 }
@@ -658,6 +799,7 @@ static void kvm_mmu_page_unlink_children(struct kvm_vcpu *vcpu,
 	unsigned i;
 	u64 *pt;
 	u64 ent;
+	int large = 0;
 
 	pt = __va(page->page_hpa);
 
@@ -674,12 +816,22 @@ static void kvm_mmu_page_unlink_children(struct kvm_vcpu *vcpu,
 	for (i = 0; i < PT64_ENT_PER_PAGE; ++i) {
 		ent = pt[i];
 
-		pt[i] = 0;
-		if (!(ent & PT_PRESENT_MASK))
+		if (!(ent & PT_PRESENT_MASK)) {
+			pt[i] = 0;
+			continue;
+		}
+		if (is_large_pte(ent)) {
+			rmap_remove(vcpu, &pt[i]);
+			pt[i] = 0;
+			large = 1;
 			continue;
+		}
+		pt[i] = 0;
 		ent &= PT64_BASE_ADDR_MASK;
 		mmu_page_remove_parent_pte(vcpu, page_header(ent), &pt[i]);
 	}
+	if (large)
+		kvm_arch_ops->tlb_flush(vcpu);
 }
 
 static void kvm_mmu_put_page(struct kvm_vcpu *vcpu,
@@ -709,7 +861,14 @@ static void kvm_mmu_zap_page(struct kvm_vcpu *vcpu,
 		*parent_pte = 0;
 	}
 	kvm_mmu_page_unlink_children(vcpu, page);
+	if (page->role.tdp)
+		kvm_arch_ops->tlb_flush(vcpu);
+	if (page->unsync)
+		mmu_clear_unsync(page);
+	++vcpu->kvm->mmu_shadow_zapped;
 	if (!page->root_count) {
+		if (!page->role.metaphysical)
+			unaccount_shadowed(vcpu, page->gfn);
 		hlist_del(&page->hash_link);
 		kvm_mmu_free_page(vcpu, page->page_hpa);
 	} else {
@@ -728,7 +887,7 @@ static int kvm_mmu_unprotect_page(struct kvm_vcpu *vcpu, gfn_t gfn)
 
 	pgprintk("%s: looking for gfn %lx\n", __FUNCTION__, gfn);
 	r = 0;
-	index = kvm_page_table_hashfn(gfn) % KVM_NUM_MMU_PAGES;
+	index = kvm_page_table_hashfn(gfn) % vcpu->kvm->n_mmu_page_hash;
 	bucket = &vcpu->kvm->mmu_page_hash[index];
 	hlist_for_each_entry_safe(page, node, n, bucket, hash_link)
 		if (page->gfn == gfn && !page->role.metaphysical) {
@@ -740,6 +899,178 @@ static int kvm_mmu_unprotect_page(struct kvm_vcpu *vcpu, gfn_t gfn)
 	return r;
 }
 
+/*
+ * The guest is about to be given write access to gfn.  Returns 1 if
+ * gfn holds a shadowed page table that must stay write protected.
+ * Otherwise any leaf shadow pages of gfn go out of sync.
+ */
+static int mmu_need_write_protect(struct kvm_vcpu *vcpu, gfn_t gfn)
+{
+	unsigned index;
+	struct hlist_head *bucket;
+	struct kvm_mmu_page *page;
+	struct hlist_node *node;
+	int shadowed = 0;
+
+	index = kvm_page_table_hashfn(gfn) % vcpu->kvm->n_mmu_page_hash;
+	bucket = &vcpu->kvm->mmu_page_hash[index];
+	hlist_for_each_entry(page, node, bucket, hash_link) {
+		if (page->gfn != gfn || page->role.metaphysical)
+			continue;
+		if (!unsync_enabled || page->role.level != PT_PAGE_TABLE_LEVEL)
+			return 1;
+		shadowed = 1;
+	}
+	if (!shadowed)
+		return 0;
+
+	hlist_for_each_entry(page, node, bucket, hash_link)
+		if (page->gfn == gfn && !page->role.metaphysical &&
+		    !page->unsync) {
+			pgprintk("%s: unsync gfn %lx role %x\n", __FUNCTION__,
+				 gfn, page->role.word);
+			mmu_mark_unsync(vcpu, page);
+		}
+	return 0;
+}
+
+/*
+ * Is spte of an unsync page still what gpte would give?  Anything the
+ * guest changed or took away drops it; rights the guest added are
+ * caught in FNAME(fetch), on the fault the stale spte causes.
+ */
+static int mmu_spte_in_sync(struct kvm_vcpu *vcpu, u64 spte, u64 gpte,
+			    u64 copy_mask)
+{
+	hpa_t paddr;
+
+	if ((spte ^ gpte) & copy_mask & ~PT_DIRTY_MASK)
+		return 0;
+	if ((spte & PT_WRITABLE_MASK) && !(gpte & PT_DIRTY_MASK))
+		return 0;
+	if ((spte & PT_SHADOW_WRITABLE_MASK) && !(gpte & PT_WRITABLE_MASK))
+		return 0;
+	if ((spte & PT_SHADOW_USER_MASK) && !(gpte & PT_USER_MASK))
+		return 0;
+	paddr = gpa_to_hpa(vcpu, gpte & PT64_BASE_ADDR_MASK);
+	return !is_error_hpa(paddr) && (spte & PT64_BASE_ADDR_MASK) == paddr;
+}
+
+static void kvm_mmu_sync_page(struct kvm_vcpu *vcpu,
+			      struct kvm_mmu_page *page)
+{
+	struct page *gpage;
+	void *gpt;
+	u64 *pt;
+	u64 gpte;
+	u64 copy_mask;
+	unsigned first;
+	unsigned i;
+	int flush = 0;
+
+	gpage = _gfn_to_page(vcpu->kvm, page->gfn);
+	if (!gpage) {
+		kvm_mmu_zap_page(vcpu, page);
+		return;
+	}
+	mmu_clear_unsync(page);
+	++vcpu->stat.mmu_sync;
+
+	/* a 32-bit guest table is shadowed by two pages, see role.quadrant */
+	first = page->role.quadrant * PT64_ENT_PER_PAGE;
+	copy_mask = page->role.glevels == PT32_ROOT_LEVEL ?
+		PT32_PTE_COPY_MASK : PT64_PTE_COPY_MASK;
+	pt = __va(page->page_hpa);
+	gpt = kmap_atomic(gpage, KM_USER1);
+	for (i = 0; i < PT64_ENT_PER_PAGE; ++i) {
+		if (!pt[i])
+			continue;
+		if (page->role.glevels == PT32_ROOT_LEVEL)
+			gpte = ((u32 *)gpt)[first + i];
+		else
+			gpte = ((u64 *)gpt)[i];
+		if (is_present_pte(pt[i]) &&
+		    mmu_spte_in_sync(vcpu, pt[i], gpte, copy_mask))
+			continue;
+		rmap_remove(vcpu, &pt[i]);
+		pt[i] = 0;
+		flush = 1;
+	}
+	kunmap_atomic(gpt, KM_USER1);
+
+	rmap_write_protect(vcpu, page->gfn);
+	if (flush)
+		kvm_arch_ops->tlb_flush(vcpu);
+}
+
+static void mmu_sync_gfn(struct kvm_vcpu *vcpu, gfn_t gfn)
+{
+	unsigned index;
+	struct hlist_head *bucket;
+	struct kvm_mmu_page *page;
+	struct hlist_node *node, *n;
+
+	index = kvm_page_table_hashfn(gfn) % vcpu->kvm->n_mmu_page_hash;
+	bucket = &vcpu->kvm->mmu_page_hash[index];
+	hlist_for_each_entry_safe(page, node, n, bucket, hash_link)
+		if (page->gfn == gfn && page->unsync)
+			kvm_mmu_sync_page(vcpu, page);
+}
+
+/* a flush point: cr3 load or a paging mode change */
+static void kvm_mmu_sync_pages(struct kvm_vcpu *vcpu)
+{
+	struct kvm_mmu_page *page, *next;
+
+	list_for_each_entry_safe(page, next, &vcpu->kvm->unsync_mmu_pages,
+				 unsync_link)
+		kvm_mmu_sync_page(vcpu, page);
+}
+
+/*
+ * The guest flushed the tlb entry of gva: bring the leaf shadow page
+ * that maps it back in sync.  Called with kvm->lock held.
+ */
+void kvm_mmu_invlpg(struct kvm_vcpu *vcpu, gva_t gva)
+{
+	hpa_t shadow_addr = vcpu->mmu.root_hpa;
+	int level = vcpu->mmu.shadow_root_level;
+	struct kvm_mmu_page *page;
+	u64 ent;
+
+	++vcpu->stat.invlpg;
+	++vcpu->tlb_gen;
+	if (!unsync_enabled || vcpu->mmu.tdp || !is_paging(vcpu) ||
+	    !VALID_PAGE(shadow_addr))
+		return;
+
+	if (level == PT32E_ROOT_LEVEL) {
+		shadow_addr = vcpu->mmu.pae_root[(gva >> 30) & 3];
+		if (!(shadow_addr & PT_PRESENT_MASK))
+			return;
+		shadow_addr &= PT64_BASE_ADDR_MASK;
+		--level;
+	}
+	for (; level > PT_PAGE_TABLE_LEVEL; --level) {
+		ent = ((u64 *)__va(shadow_addr))[PT64_INDEX(gva, level)];
+		if (!is_present_pte(ent) || is_large_pte(ent))
+			return;
+		shadow_addr = ent & PT64_BASE_ADDR_MASK;
+	}
+	page = page_header(shadow_addr);
+	if (page->unsync)
+		kvm_mmu_sync_page(vcpu, page);
+}
+
+/* set by the arch module when it lets invlpg exit to us */
+int unsync_enabled;
+
+void kvm_enable_unsync(void)
+{
+	unsync_enabled = 1;
+}
+EXPORT_SYMBOL_GPL(kvm_enable_unsync);
+
 static void page_header_update_slot(struct kvm *kvm, void *pte, gpa_t gpa)
 {
 	FUNCTION_ENTER();
@@ -769,6 +1100,12 @@ hpa_t gpa_to_hpa(struct kvm_vcpu *vcpu, gpa_t gpa)
 	if (!slot)
 		return gpa | HPA_ERR_MASK;
 	page = gfn_to_page(slot, gpa >> PAGE_SHIFT);
+	if (!page) {
+		/* demand-paged and not backed yet, see kvm_mmu_populate() */
+		vcpu->populate_pending = 1;
+		vcpu->populate_gfn = gpa >> PAGE_SHIFT;
+		return gpa | HPA_ERR_MASK;
+	}
 	return ((hpa_t)page_to_pfn(page) << PAGE_SHIFT)
 		| (gpa & (PAGE_SIZE-1));
 }
@@ -807,7 +1144,7 @@ static int nonpaging_map(struct kvm_vcpu *vcpu, gva_t v, hpa_t p)
 				FUNCTION_EXIT();				
 				return 0;
 			}			
-			mark_page_dirty(vcpu->kvm, v >> PAGE_SHIFT);
+			kvm_vcpu_mark_page_dirty(vcpu, v >> PAGE_SHIFT);
 			page_header_update_slot(vcpu->kvm, table, v);
 			table[index] = p | PT_PRESENT_MASK | PT_WRITABLE_MASK |
 								PT_USER_MASK;
@@ -873,6 +1210,8 @@ static void mmu_alloc_roots(struct kvm_vcpu *vcpu)
 	struct kvm_mmu_page *page;
 
 	root_gfn = vcpu->cr3 >> PAGE_SHIFT;
+	vcpu->mmu.root_cr3 = vcpu->cr3 & PAGE_MASK;
+	memcpy(vcpu->mmu.root_pdptrs, vcpu->pdptrs, sizeof(vcpu->pdptrs));
 
 #ifdef CONFIG_X86_64
 	if (vcpu->mmu.shadow_root_level == PT64_ROOT_LEVEL) {
@@ -905,6 +1244,114 @@ static void mmu_alloc_roots(struct kvm_vcpu *vcpu)
 	vcpu->mmu.root_hpa = __pa(vcpu->mmu.pae_root);
 }
 
+/*
+ * The shadow roots of the last few guest cr3s are kept with their
+ * root_count held, so that a guest switching back to a recent process
+ * finds its shadow hierarchy still built.  While cached, the shadow
+ * pages stay hashed and their guest tables write protected, so guest
+ * updates keep them in sync exactly as for the loaded root.
+ */
+static void mmu_free_cached_root(struct kvm_mmu_cached_root *cached)
+{
+	int i;
+
+#ifdef CONFIG_X86_64
+	if (VALID_PAGE(cached->root_hpa)) {
+		--page_header(cached->root_hpa)->root_count;
+		return;
+	}
+#endif
+	for (i = 0; i < 4; ++i)
+		--page_header(cached->pae_root[i] & PT64_BASE_ADDR_MASK)
+			->root_count;
+}
+
+static void mmu_free_cached_roots(struct kvm_vcpu *vcpu)
+{
+	struct kvm_mmu *mmu = &vcpu->mmu;
+
+	while (mmu->nr_cached_roots)
+		mmu_free_cached_root(&mmu->cached_roots[--mmu->nr_cached_roots]);
+}
+
+/* move the loaded root to the head of the cache, keeping its root_count */
+static void mmu_cache_root(struct kvm_vcpu *vcpu)
+{
+	struct kvm_mmu *mmu = &vcpu->mmu;
+	struct kvm_mmu_cached_root *cached;
+	int i;
+
+	if (mmu->nr_cached_roots == KVM_MMU_NR_CACHED_ROOTS)
+		mmu_free_cached_root(&mmu->cached_roots[--mmu->nr_cached_roots]);
+	for (i = mmu->nr_cached_roots; i > 0; --i)
+		mmu->cached_roots[i] = mmu->cached_roots[i - 1];
+	++mmu->nr_cached_roots;
+
+	cached = &mmu->cached_roots[0];
+	cached->cr3 = mmu->root_cr3;
+	memcpy(cached->pdptrs, mmu->root_pdptrs, sizeof(cached->pdptrs));
+	cached->root_hpa = INVALID_PAGE;
+#ifdef CONFIG_X86_64
+	if (mmu->shadow_root_level == PT64_ROOT_LEVEL) {
+		cached->root_hpa = mmu->root_hpa;
+		mmu->root_hpa = INVALID_PAGE;
+		return;
+	}
+#endif
+	for (i = 0; i < 4; ++i) {
+		cached->pae_root[i] = mmu->pae_root[i];
+		mmu->pae_root[i] = INVALID_PAGE;
+	}
+	mmu->root_hpa = INVALID_PAGE;
+}
+
+/* was the cached root built for the guest's current cr3 and pdptrs? */
+static int cached_root_matches(struct kvm_vcpu *vcpu,
+			       struct kvm_mmu_cached_root *cached)
+{
+	int i;
+
+	if (cached->cr3 != (vcpu->cr3 & PAGE_MASK))
+		return 0;
+	if (vcpu->mmu.root_level != PT32E_ROOT_LEVEL)
+		return 1;
+	for (i = 0; i < 4; ++i)
+		if (cached->pdptrs[i] != vcpu->pdptrs[i])
+			return 0;
+	return 1;
+}
+
+/* load the cached root of the guest's cr3, if there is one */
+static int mmu_load_cached_root(struct kvm_vcpu *vcpu)
+{
+	struct kvm_mmu *mmu = &vcpu->mmu;
+	struct kvm_mmu_cached_root *cached = NULL;
+	int i;
+
+	for (i = 0; i < mmu->nr_cached_roots; ++i)
+		if (cached_root_matches(vcpu, &mmu->cached_roots[i])) {
+			cached = &mmu->cached_roots[i];
+			break;
+		}
+	if (!cached)
+		return 0;
+
+	mmu->root_cr3 = cached->cr3;
+	memcpy(mmu->root_pdptrs, cached->pdptrs, sizeof(mmu->root_pdptrs));
+#ifdef CONFIG_X86_64
+	if (mmu->shadow_root_level == PT64_ROOT_LEVEL)
+		mmu->root_hpa = cached->root_hpa;
+	else
+#endif
+	{
+		memcpy(mmu->pae_root, cached->pae_root, sizeof(cached->pae_root));
+		mmu->root_hpa = __pa(mmu->pae_root);
+	}
+	for (--mmu->nr_cached_roots; i < mmu->nr_cached_roots; ++i)
+		mmu->cached_roots[i] = mmu->cached_roots[i + 1];
+	return 1;
+}
+
 gpa_t nonpaging_gva_to_gpa(struct kvm_vcpu *vcpu, gva_t vaddr)	
 {
 	return vaddr;
@@ -971,16 +1418,25 @@ static int nonpaging_init_context(struct kvm_vcpu *vcpu)
 
 static void kvm_mmu_flush_tlb(struct kvm_vcpu *vcpu)
 {
-	++kvm_stat.tlb_flush;
+	++vcpu->stat.tlb_flush;
 	kvm_arch_ops->tlb_flush(vcpu);
 }
 
 static void paging_new_cr3(struct kvm_vcpu *vcpu)
 {
 	pgprintk("%s: cr3 %lx\n", __FUNCTION__, vcpu->cr3);
-	mmu_free_roots(vcpu);
-	if (unlikely(vcpu->kvm->n_free_mmu_pages < KVM_MIN_FREE_MMU_PAGES))
+	++vcpu->tlb_gen;
+	kvm_mmu_sync_pages(vcpu);
+	mmu_cache_root(vcpu);
+	if (mmu_load_cached_root(vcpu)) {
+		/* still in sync with the guest tables, nothing to flush */
+		kvm_arch_ops->set_cr3(vcpu, vcpu->mmu.root_hpa);
+		return;
+	}
+	if (unlikely(vcpu->kvm->n_free_mmu_pages < KVM_MIN_FREE_MMU_PAGES)) {
+		mmu_free_cached_roots(vcpu);
 		kvm_mmu_free_some_pages(vcpu);
+	}
 	mmu_alloc_roots(vcpu);
 	kvm_mmu_flush_tlb(vcpu);
 	kvm_arch_ops->set_cr3(vcpu, vcpu->mmu.root_hpa);
@@ -1006,6 +1462,12 @@ static inline void set_pte_common(struct kvm_vcpu *vcpu,
 
 	paddr = gpa_to_hpa(vcpu, gaddr & PT64_BASE_ADDR_MASK);
 
+	/* not an io pte, the fault is retried once the gfn is backed */
+	if (is_error_hpa(paddr) && vcpu->populate_pending) {
+		*shadow_pte = 0;
+		return;
+	}
+
 	*shadow_pte |= access_bits;
 
 	if (!(*shadow_pte & PT_GLOBAL_MASK))
@@ -1021,10 +1483,7 @@ static inline void set_pte_common(struct kvm_vcpu *vcpu,
 	*shadow_pte |= paddr;
 
 	if (access_bits & PT_WRITABLE_MASK) {
-		struct kvm_mmu_page *shadow;
-
-		shadow = kvm_mmu_lookup_page(vcpu, gfn);
-		if (shadow) {
+		if (mmu_need_write_protect(vcpu, gfn)) {
 			pgprintk("%s: found shadow page for %lx, marking ro\n",
 				 __FUNCTION__, gfn);
 			access_bits &= ~PT_WRITABLE_MASK;
@@ -1036,7 +1495,7 @@ static inline void set_pte_common(struct kvm_vcpu *vcpu,
 	}
 
 	if (access_bits & PT_WRITABLE_MASK)
-		mark_page_dirty(vcpu->kvm, gaddr >> PAGE_SHIFT);
+		kvm_vcpu_mark_page_dirty(vcpu, gaddr >> PAGE_SHIFT);
 
 	page_header_update_slot(vcpu->kvm, shadow_pte, gaddr);
 	rmap_add(vcpu, shadow_pte);
@@ -1068,6 +1527,7 @@ static inline int fix_read_pf(u64 *shadow_ent)
 
 static void paging_free(struct kvm_vcpu *vcpu)
 {
+	mmu_free_cached_roots(vcpu);
 	nonpaging_free(vcpu);
 }
 
@@ -1134,12 +1594,162 @@ static int paging32E_init_context(struct kvm_vcpu *vcpu)
 	return paging64_init_context_common(vcpu, PT32E_ROOT_LEVEL);
 }
 
+/*
+ * Two-dimensional paging: the processor walks the guest's own page
+ * tables with its own cr3, and then root_hpa to translate the result.
+ * root_hpa is a four level table indexed by gpa, so guest page faults,
+ * invlpg and cr3 loads no longer exit; page_fault is only called for
+ * gpas that are missing from it.
+ */
+static int tdp_map(struct kvm_vcpu *vcpu, gpa_t gpa, hpa_t p, int write)
+{
+	int level = PT64_ROOT_LEVEL;
+	hpa_t table_addr = vcpu->mmu.root_hpa;
+	gfn_t gfn = gpa >> PAGE_SHIFT;
+
+	for (; ; level--) {
+		u32 index = PT64_INDEX(gpa, level);
+		u64 *table;
+		u64 pte;
+
+		ASSERT(VALID_PAGE(table_addr));
+		table = __va(table_addr);
+
+		if (level == PT_PAGE_TABLE_LEVEL) {
+			pte = table[index];
+			if (is_present_pte(pte) &&
+			    (is_writeble_pte(pte) || !write))
+				return 0;
+			/*
+			 * Reads map the page read only, so that the write
+			 * fault that follows is what marks it dirty.
+			 */
+			page_header_update_slot(vcpu->kvm, table, gpa);
+			if (write) {
+				kvm_vcpu_mark_page_dirty(vcpu, gfn);
+				table[index] = p | TDP_PTE_BITS;
+			} else
+				table[index] = (p | TDP_PTE_BITS)
+					& ~TDP_WRITABLE_MASK;
+			rmap_add(vcpu, &table[index]);
+			return 0;
+		}
+
+		if (table[index] == 0) {
+			struct kvm_mmu_page *new_table;
+			gfn_t pseudo_gfn;
+
+			pseudo_gfn = gfn & ~(((gfn_t)1 <<
+					      (PT64_LEVEL_BITS * (level - 1))) - 1);
+			new_table = kvm_mmu_get_page(vcpu, pseudo_gfn,
+						     0, level - 1,
+						     1, &table[index]);
+			if (!new_table) {
+				pgprintk("tdp_map: ENOMEM\n");
+				return -ENOMEM;
+			}
+
+			table[index] = new_table->page_hpa | TDP_DIR_BITS;
+		}
+		table_addr = table[index] & PT64_BASE_ADDR_MASK;
+	}
+}
+
+static int tdp_page_fault(struct kvm_vcpu *vcpu, gva_t gpa, u32 error_code)
+{
+	hpa_t paddr;
+	int r;
+
+	r = mmu_topup_memory_caches(vcpu);
+	if (r)
+		return r;
+
+	ASSERT(VALID_PAGE(vcpu->mmu.root_hpa));
+
+	paddr = gpa_to_hpa(vcpu, gpa & PT64_BASE_ADDR_MASK);
+	if (is_error_hpa(paddr))
+		return 1;
+
+	return tdp_map(vcpu, gpa & PAGE_MASK, paddr,
+		       error_code & PFERR_WRITE_MASK);
+}
+
+static void tdp_alloc_root(struct kvm_vcpu *vcpu)
+{
+	struct kvm_mmu_page *page;
+
+	ASSERT(!VALID_PAGE(vcpu->mmu.root_hpa));
+	page = kvm_mmu_get_page(vcpu, 0, 0, PT64_ROOT_LEVEL, 1, NULL);
+	++page->root_count;
+	vcpu->mmu.root_hpa = page->page_hpa;
+}
+
+static void tdp_free(struct kvm_vcpu *vcpu)
+{
+	struct kvm_mmu_page *page;
+
+	ASSERT(VALID_PAGE(vcpu->mmu.root_hpa));
+	page = page_header(vcpu->mmu.root_hpa);
+	--page->root_count;
+	vcpu->mmu.root_hpa = INVALID_PAGE;
+}
+
+/* the root stays, but the vmcs has to see the guest's new cr3 */
+static void tdp_new_cr3(struct kvm_vcpu *vcpu)
+{
+	kvm_arch_ops->set_tdp(vcpu, vcpu->mmu.root_hpa);
+}
+
+static int tdp_init_context(struct kvm_vcpu *vcpu)
+{
+	struct kvm_mmu *context = &vcpu->mmu;
+
+	context->new_cr3 = tdp_new_cr3;
+	context->page_fault = tdp_page_fault;
+	context->free = tdp_free;
+	context->tdp = 1;
+	context->shadow_root_level = PT64_ROOT_LEVEL;
+	if (is_long_mode(vcpu)) {
+		context->gva_to_gpa = paging64_gva_to_gpa;
+		context->root_level = PT64_ROOT_LEVEL;
+	} else if (is_pae(vcpu)) {
+		context->gva_to_gpa = paging64_gva_to_gpa;
+		context->root_level = PT32E_ROOT_LEVEL;
+	} else {
+		context->gva_to_gpa = paging32_gva_to_gpa;
+		context->root_level = PT32_ROOT_LEVEL;
+	}
+	tdp_alloc_root(vcpu);
+	kvm_arch_ops->set_tdp(vcpu, context->root_hpa);
+	return 0;
+}
+
+void kvm_enable_tdp(void)
+{
+	tdp_enabled = 1;
+}
+EXPORT_SYMBOL_GPL(kvm_enable_tdp);
+
 static int init_kvm_mmu(struct kvm_vcpu *vcpu)
 {
 	FUNCTION_ENTER();	
 	ASSERT(vcpu);
 	ASSERT(!VALID_PAGE(vcpu->mmu.root_hpa));
 
+	vcpu->mmu.tdp = 0;
+	if (tdp_enabled) {
+		/*
+		 * Without unrestricted guest support the processor
+		 * still needs a shadow table while the guest has
+		 * paging off.
+		 */
+		if (is_paging(vcpu)) {
+			FUNCTION_EXIT();
+			return tdp_init_context(vcpu);
+		}
+		kvm_arch_ops->set_tdp(vcpu, INVALID_PAGE);
+	}
+
 	if (!is_paging(vcpu)) {
 		FUNCTION_EXIT();
 		return nonpaging_init_context(vcpu);
@@ -1172,6 +1782,8 @@ int kvm_mmu_reset_context(struct kvm_vcpu *vcpu)
 
 	FUNCTION_ENTER();	
 
+	++vcpu->tlb_gen;
+	kvm_mmu_sync_pages(vcpu);
 	destroy_kvm_mmu(vcpu);
 	r = init_kvm_mmu(vcpu);
 	if (r < 0)
@@ -1191,7 +1803,8 @@ static void mmu_pre_write_zap_pte(struct kvm_vcpu *vcpu,
 
 	pte = *spte;
 	if (is_present_pte(pte)) {
-		if (page->role.level == PT_PAGE_TABLE_LEVEL)
+		if (page->role.level == PT_PAGE_TABLE_LEVEL ||
+		    is_large_pte(pte))
 			rmap_remove(vcpu, spte);
 		else {
 			child = page_header(pte & PT64_BASE_ADDR_MASK);
@@ -1226,7 +1839,7 @@ void kvm_mmu_pre_write(struct kvm_vcpu *vcpu, gpa_t gpa, int bytes)
 		vcpu->last_pt_write_gfn = gfn;
 		vcpu->last_pt_write_count = 1;
 	}
-	index = kvm_page_table_hashfn(gfn) % KVM_NUM_MMU_PAGES;
+	index = kvm_page_table_hashfn(gfn) % vcpu->kvm->n_mmu_page_hash;
 	bucket = &vcpu->kvm->mmu_page_hash[index];
 	hlist_for_each_entry_safe(page, node, n, bucket, hash_link) {
 		if (page->gfn != gfn || page->role.metaphysical)
@@ -1294,6 +1907,7 @@ void kvm_mmu_free_some_pages(struct kvm_vcpu *vcpu)
 		page = container_of(vcpu->kvm->active_mmu_pages.prev,
 				    struct kvm_mmu_page, link);
 		kvm_mmu_zap_page(vcpu, page);
+		++vcpu->kvm->mmu_recycled;
 	}
 	FUNCTION_EXIT();   
 }
@@ -1309,38 +1923,137 @@ static void free_mmu_pages(struct kvm_vcpu *vcpu)
 				    struct kvm_mmu_page, link);
 		kvm_mmu_zap_page(vcpu, page);
 	}
-	while (!list_empty(&vcpu->free_pages)) {
-		page = list_entry(vcpu->free_pages.next,
-				  struct kvm_mmu_page, link);
-		list_del(&page->link);
-		__free_page(pfn_to_page(page->page_hpa >> PAGE_SHIFT));
-		page->page_hpa = INVALID_PAGE;
-	}
 	free_page((unsigned long)vcpu->mmu.pae_root);
 	function_exit(DBG_RELEASE, __FUNCTION__);	
 }
 
-static int alloc_mmu_pages(struct kvm_vcpu *vcpu)
+static void free_mmu_pool_pages(struct kvm_mmu_page *headers, unsigned int n)
 {
-	struct page *page;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (VALID_PAGE(headers[i].page_hpa))
+			__free_page(pfn_to_page(headers[i].page_hpa >> PAGE_SHIFT));
+}
+
+/*
+ * Called when the vm is destroyed, after all vcpus zapped their
+ * shadow pages back into the pool.
+ */
+void kvm_mmu_free_pool(struct kvm *kvm)
+{
+	if (!kvm->mmu_page_headers)
+		return;
+
+	free_mmu_pool_pages(kvm->mmu_page_headers, kvm->n_alloc_mmu_pages);
+	kfree(kvm->mmu_page_headers);
+	kfree(kvm->mmu_page_hash);
+	kvm->mmu_page_headers = NULL;
+	kvm->mmu_page_hash = NULL;
+	kvm->n_alloc_mmu_pages = 0;
+	kvm->n_mmu_page_hash = 0;
+	kvm->n_free_mmu_pages = 0;
+	INIT_LIST_HEAD(&kvm->free_mmu_pages);
+}
+
+static unsigned int mmu_pool_size(struct kvm *kvm)
+{
+	unsigned long npages = 0;
+	unsigned int n;
 	int i;
 
-	ASSERT(vcpu);
+	n = kvm->n_requested_mmu_pages;
+	if (!n) {
+		for (i = 0; i < kvm->nmemslots; ++i)
+			npages += kvm->memslots[i].npages;
+		n = npages * KVM_PERMILLE_MMU_PAGES / 1000;
+	}
+	if (n < KVM_MIN_ALLOC_MMU_PAGES)
+		n = KVM_MIN_ALLOC_MMU_PAGES;
+	if (n > KVM_MAX_ALLOC_MMU_PAGES)
+		n = KVM_MAX_ALLOC_MMU_PAGES;
+	return n;
+}
 
-	FUNCTION_ENTER();	
+/*
+ * The pool is allocated outside the lock by the first vcpu; if another
+ * vcpu won the race, ours is thrown away.
+ */
+static int alloc_mmu_pool(struct kvm *kvm)
+{
+	struct kvm_mmu_page *headers;
+	struct hlist_head *hash;
+	struct page *page;
+	unsigned int i, n;
+
+	if (kvm->mmu_page_headers)
+		return 0;
 
-	for (i = 0; i < KVM_NUM_MMU_PAGES; i++) {
-		struct kvm_mmu_page *page_header = &vcpu->page_header_buf[i];
+	n = mmu_pool_size(kvm);
+	/* headers are touched under kvm->lock, so not vmalloc (paged pool) */
+	headers = kzalloc(n * sizeof(struct kvm_mmu_page), GFP_KERNEL);
+	hash = kzalloc(n * sizeof(struct hlist_head), GFP_KERNEL);
+	if (!headers || !hash)
+		goto error_1;
+
+	for (i = 0; i < n; i++)
+		headers[i].page_hpa = INVALID_PAGE;
+
+	for (i = 0; i < n; i++) {
+		struct kvm_mmu_page *page_header = &headers[i];
 
-		INIT_LIST_HEAD(&page_header->link);
 		if ((page = alloc_page(GFP_KERNEL)) == NULL)
-			goto error_1;
+			goto error_2;
 		set_page_private(page, (unsigned long)page_header);
 		page_header->page_hpa = (hpa_t)page_to_pfn(page) << PAGE_SHIFT;
 		/* bug is here */		
 		memset(__va(page_header->page_hpa), 0, PAGE_SIZE);		
-		list_add(&page_header->link, &vcpu->free_pages);
-		++vcpu->kvm->n_free_mmu_pages;
+	}
+
+	spin_lock(&kvm->lock);
+	if (kvm->mmu_page_headers) {
+		spin_unlock(&kvm->lock);
+		free_mmu_pool_pages(headers, n);
+		kfree(headers);
+		kfree(hash);
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		INIT_LIST_HEAD(&headers[i].link);
+		list_add(&headers[i].link, &kvm->free_mmu_pages);
+	}
+	for (i = 0; i < n; i++)
+		INIT_HLIST_HEAD(&hash[i]);
+	kvm->n_free_mmu_pages = n;
+	kvm->n_alloc_mmu_pages = n;
+	kvm->n_mmu_page_hash = n;
+	kvm->mmu_page_hash = hash;
+	kvm->mmu_page_headers = headers;
+	spin_unlock(&kvm->lock);
+
+	printk(KERN_ALERT "kvm: %d shadow pages\n", n);
+	return 0;
+
+error_2:
+	free_mmu_pool_pages(headers, n);
+error_1:
+	kfree(headers);
+	kfree(hash);
+	return -ENOMEM;
+}
+
+static int alloc_mmu_pages(struct kvm_vcpu *vcpu)
+{
+	struct page *page;
+	int i;
+
+	ASSERT(vcpu);
+
+	FUNCTION_ENTER();	
+
+	if (alloc_mmu_pool(vcpu->kvm) < 0) {
+		FUNCTION_EXIT();
+		return -ENOMEM;
 	}
 
 	/*
@@ -1367,7 +2080,6 @@ int kvm_mmu_create(struct kvm_vcpu *vcpu)
 {
 	ASSERT(vcpu);
 	ASSERT(!VALID_PAGE(vcpu->mmu.root_hpa));
-	ASSERT(list_empty(&vcpu->free_pages));
 
 	return alloc_mmu_pages(vcpu);
 }
@@ -1376,7 +2088,7 @@ int kvm_mmu_setup(struct kvm_vcpu *vcpu)
 {
 	ASSERT(vcpu);
 	ASSERT(!VALID_PAGE(vcpu->mmu.root_hpa));
-	ASSERT(!list_empty(&vcpu->free_pages));
+	ASSERT(!list_empty(&vcpu->kvm->free_mmu_pages));
 
 	return init_kvm_mmu(vcpu);
 }
@@ -1405,13 +2117,113 @@ void kvm_mmu_slot_remove_write_access(struct kvm_vcpu *vcpu, int slot)
 			continue;
 
 		pt = __va(page->page_hpa);
-		for (i = 0; i < PT64_ENT_PER_PAGE; ++i)
+		for (i = 0; i < PT64_ENT_PER_PAGE; ++i) {
+			if (page->role.level != PT_PAGE_TABLE_LEVEL) {
+				/* logging needs 4k ptes: drop large ones */
+				if ((pt[i] & PT_PRESENT_MASK) &&
+				    is_large_pte(pt[i])) {
+					rmap_remove(vcpu, &pt[i]);
+					pt[i] = 0;
+				}
+				continue;
+			}
 			/* avoid RMW */
 			if (pt[i] & PT_WRITABLE_MASK) {
 				rmap_remove(vcpu, &pt[i]);
 				pt[i] &= ~PT_WRITABLE_MASK;
 			}
+		}
+	}
+}
+
+/*
+ * Make every shadow pte of gfn read-only again, so the next guest write
+ * to it faults and marks it dirty.  Called with kvm->lock held.
+ */
+void kvm_mmu_write_protect_gfn(struct kvm_vcpu *vcpu, gfn_t gfn)
+{
+	struct kvm_memory_slot *slot;
+
+	slot = gfn_to_memslot(vcpu->kvm, gfn);
+	if (!slot || !gfn_to_page(slot, gfn))
+		return;
+	rmap_write_protect(vcpu, gfn);
+}
+
+static void sort_pfns(unsigned long *pfns, int n)
+{
+	unsigned long pfn;
+	int gap, i, j;
+
+	for (gap = n / 2; gap > 0; gap /= 2)
+		for (i = gap; i < n; ++i) {
+			pfn = pfns[i];
+			for (j = i; j >= gap && pfns[j - gap] > pfn; j -= gap)
+				pfns[j] = pfns[j - gap];
+			pfns[j] = pfn;
+		}
+}
+
+/*
+ * Does [pfn, pfn + npages) hold one of the n sorted pfns?
+ */
+static int pfns_hit(unsigned long *pfns, int n, unsigned long pfn,
+		    unsigned long npages)
+{
+	int lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (pfns[mid] < pfn)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return lo < n && pfns[lo] - pfn < npages;
+}
+
+/*
+ * Drop every shadow pte that maps one of the n host pages in pfns,
+ * which get sorted.  Read-only sptes are not in the rmap, so all shadow
+ * pages are looked at.  The caller flushes the tlb of the other vcpus.
+ */
+void kvm_mmu_unmap_pfns(struct kvm_vcpu *vcpu, unsigned long *pfns, int n)
+{
+	struct kvm_mmu_page *page;
+	unsigned long pfn;
+	u64 *pt;
+	int i;
+
+	sort_pfns(pfns, n);
+
+	list_for_each_entry(page, &vcpu->kvm->active_mmu_pages, link) {
+		pt = __va(page->page_hpa);
+		for (i = 0; i < PT64_ENT_PER_PAGE; ++i) {
+			if (!(pt[i] & PT_PRESENT_MASK))
+				continue;
+			pfn = (pt[i] & PT64_BASE_ADDR_MASK) >> PAGE_SHIFT;
+			if (page->role.level == PT_PAGE_TABLE_LEVEL) {
+				if (!pfns_hit(pfns, n, pfn, 1))
+					continue;
+			} else if (!is_large_pte(pt[i]) ||
+				   !pfns_hit(pfns, n, pfn, KVM_PAGES_PER_LPAGE))
+				continue;
+			rmap_remove(vcpu, &pt[i]);
+			pt[i] = 0;
+		}
+	}
+	kvm_arch_ops->tlb_flush(vcpu);
+}
+
+/*
+ * gfn ... gfn + npages - 1 are about to lose their host pages: zap the
+ * shadow pages of the guest page tables that sit there.
+ */
+void kvm_mmu_unshadow_gfns(struct kvm_vcpu *vcpu, gfn_t gfn,
+			   unsigned long npages)
+{
+	while (npages--)
+		kvm_mmu_unprotect_page(vcpu, gfn++);
 }
 
 #ifdef AUDIT
@@ -129,7 +129,7 @@ static int FNAME(walk_addr)(struct guest_walker *walker,
 #endif
 
 		if (!(*ptep & PT_ACCESSED_MASK)) {
-			mark_page_dirty(vcpu->kvm, table_gfn);
+			kvm_vcpu_mark_page_dirty(vcpu, table_gfn);
 			*ptep |= PT_ACCESSED_MASK;
 		}
 
@@ -187,10 +187,10 @@ static void FNAME(release_walker)(struct guest_walker *walker)
 		kunmap_atomic(walker->table, KM_USER0);
 }
 
-static void FNAME(mark_pagetable_dirty)(struct kvm *kvm,
+static void FNAME(mark_pagetable_dirty)(struct kvm_vcpu *vcpu,
 					struct guest_walker *walker)
 {
-	mark_page_dirty(kvm, walker->table_gfn[walker->level - 1]);
+	kvm_vcpu_mark_page_dirty(vcpu, walker->table_gfn[walker->level - 1]);
 }
 
 static void FNAME(set_pte)(struct kvm_vcpu *vcpu, u64 guest_pte,
@@ -219,6 +219,95 @@ static void FNAME(set_pde)(struct kvm_vcpu *vcpu, u64 guest_pde,
 		       guest_pde & PT_DIRTY_MASK, access_bits, gfn);
 }
 
+/*
+ * Map the 2MB frame starting at gfn with a single shadow pde.  The
+ * caller has checked that the frame may be mapped large, so the host
+ * pages behind it are one contiguous, aligned run.
+ */
+static void FNAME(set_large_pde)(struct kvm_vcpu *vcpu, u64 guest_pde,
+				 u64 *shadow_pte, u64 access_bits, gfn_t gfn)
+{
+	ASSERT(*shadow_pte == 0);
+	access_bits &= guest_pde;
+	*shadow_pte = (guest_pde & PT_PTE_COPY_MASK) | PT_PAGE_SIZE_MASK;
+	set_pte_common(vcpu, shadow_pte, (gpa_t)gfn << PAGE_SHIFT,
+		       guest_pde & PT_DIRTY_MASK, access_bits, gfn);
+}
+
+/*
+ * Can the guest large page found by the walker be shadowed by a large
+ * pde?  A 32-bit pse36 page lies above 4GB, where guest ram never is.
+ */
+static int FNAME(large_pde_allowed)(struct kvm_vcpu *vcpu,
+				    struct guest_walker *walker)
+{
+	if (walker->level != PT_DIRECTORY_LEVEL)
+		return 0;
+#if PTTYPE == 32
+	if (is_cpuid_PSE36() && (*walker->ptep & PT32_DIR_PSE36_MASK))
+		return 0;
+#endif
+	return mmu_lpage_allowed(vcpu, walker->gfn);
+}
+
+/*
+ * Fill the empty shadow ptes around a faulting 4k pte from the guest
+ * page table the walker has mapped.  Only guest ptes that are present
+ * and already accessed are copied, since the guest would see no fault
+ * and no accessed bit update for them; set_pte leaves them read only
+ * unless dirty and write protects shadowed page tables as usual.
+ */
+static void FNAME(prefetch)(struct kvm_vcpu *vcpu, gva_t addr,
+			    struct guest_walker *walker, u64 *shadow_ent)
+{
+	unsigned index = SHADOW_PT_INDEX(addr, PT_PAGE_TABLE_LEVEL);
+	unsigned first = index & ~(PTE_PREFETCH_NUM - 1);
+	u64 *spte = shadow_ent - index + first;
+	pt_element_t *gpte;
+	unsigned i;
+
+	gpte = walker->ptep - index + first;
+	for (i = 0; i < PTE_PREFETCH_NUM; ++i, ++spte, ++gpte) {
+		if (spte == shadow_ent || *spte)
+			continue;
+		if ((*gpte & (PT_PRESENT_MASK | PT_ACCESSED_MASK)) !=
+		    (PT_PRESENT_MASK | PT_ACCESSED_MASK))
+			continue;
+		FNAME(set_pte)(vcpu, *gpte, spte, walker->inherited_ar,
+			       (*gpte & PT_BASE_ADDR_MASK) >> PAGE_SHIFT);
+		/* not backed yet: left to a fault of its own */
+		if (vcpu->populate_pending) {
+			vcpu->populate_pending = 0;
+			continue;
+		}
+		++vcpu->stat.pf_prefetch;
+	}
+}
+
+/*
+ * A shadow pte of an unsync page may lag behind the guest pte the
+ * walker just read, also in rights the guest has since added and
+ * would otherwise fault on forever.
+ */
+static int FNAME(spte_stale)(struct kvm_vcpu *vcpu, u64 *shadow_ent,
+			     struct guest_walker *walker)
+{
+	u64 access;
+
+	if (walker->level != PT_PAGE_TABLE_LEVEL ||
+	    !page_header(__pa(shadow_ent))->unsync)
+		return 0;
+	if (!is_present_pte(*shadow_ent))
+		return 1;
+	access = *walker->ptep & walker->inherited_ar &
+		(PT_WRITABLE_MASK | PT_USER_MASK);
+	if (((*shadow_ent >> PT_SHADOW_BITS_OFFSET) ^ access) &
+	    (PT_WRITABLE_MASK | PT_USER_MASK))
+		return 1;
+	return !mmu_spte_in_sync(vcpu, *shadow_ent, *walker->ptep,
+				 PT_PTE_COPY_MASK);
+}
+
 /*
  * Fetch a shadow pte for a specific level in the paging hierarchy.
  */
@@ -250,11 +339,19 @@ static u64 *FNAME(fetch)(struct kvm_vcpu *vcpu, gva_t addr,
 		gfn_t table_gfn;
 
 		if (is_present_pte(*shadow_ent) || is_io_pte(*shadow_ent)) {
-			if (level == PT_PAGE_TABLE_LEVEL)
+			if (level != PT_PAGE_TABLE_LEVEL) {
+				if (level == PT_DIRECTORY_LEVEL &&
+				    is_large_pte(*shadow_ent))
+					return shadow_ent;
+				shadow_addr = *shadow_ent & PT64_BASE_ADDR_MASK;
+				prev_shadow_ent = shadow_ent;
+				continue;
+			}
+			if (!FNAME(spte_stale)(vcpu, shadow_ent, walker))
 				return shadow_ent;
-			shadow_addr = *shadow_ent & PT64_BASE_ADDR_MASK;
-			prev_shadow_ent = shadow_ent;
-			continue;
+			rmap_remove(vcpu, shadow_ent);
+			*shadow_ent = 0;
+			kvm_arch_ops->tlb_flush(vcpu);
 		}
 
 		if (level == PT_PAGE_TABLE_LEVEL) {
@@ -270,10 +367,22 @@ static u64 *FNAME(fetch)(struct kvm_vcpu *vcpu, gva_t addr,
 				FNAME(set_pte)(vcpu, *guest_ent, shadow_ent,
 					       walker->inherited_ar,
 					       walker->gfn);
+				if (!vcpu->populate_pending)
+					FNAME(prefetch)(vcpu, addr, walker,
+							shadow_ent);
 			}
 			return shadow_ent;
 		}
 
+		if (level == PT_DIRECTORY_LEVEL
+		    && FNAME(large_pde_allowed)(vcpu, walker)) {
+			FNAME(set_large_pde)(vcpu, *guest_ent, shadow_ent,
+					     walker->inherited_ar,
+					     walker->gfn &
+					     ~(gfn_t)(KVM_PAGES_PER_LPAGE - 1));
+			return shadow_ent;
+		}
+
 		if (level - 1 == PT_PAGE_TABLE_LEVEL
 		    && walker->level == PT_DIRECTORY_LEVEL) {
 			metaphysical = 1;
@@ -315,6 +424,18 @@ static int FNAME(fix_write_pf)(struct kvm_vcpu *vcpu,
 	if (is_writeble_pte(*shadow_ent))
 		return !user || (*shadow_ent & PT_USER_MASK);
 
+	if (is_large_pte(*shadow_ent) &&
+	    !mmu_lpage_allowed(vcpu, walker->gfn)) {
+		/*
+		 * A guest page table has been shadowed inside the frame
+		 * since it was mapped large: refault on 4k ptes.  A read
+		 * only large pte is not in any rmap.
+		 */
+		*shadow_ent = 0;
+		kvm_arch_ops->tlb_flush(vcpu);
+		return 0;
+	}
+
 	writable_shadow = *shadow_ent & PT_SHADOW_WRITABLE_MASK;
 	if (user) {
 		/*
@@ -353,18 +474,18 @@ static int FNAME(fix_write_pf)(struct kvm_vcpu *vcpu,
 				 __FUNCTION__, gfn, page->role.word);
 			kvm_mmu_zap_page(vcpu, page);
 		}
-	} else if (kvm_mmu_lookup_page(vcpu, gfn)) {
+	} else if (mmu_need_write_protect(vcpu, gfn)) {
 		pgprintk("%s: found shadow page for %lx, marking ro\n",
 			 __FUNCTION__, gfn);
-		mark_page_dirty(vcpu->kvm, gfn);
-		FNAME(mark_pagetable_dirty)(vcpu->kvm, walker);
+		kvm_vcpu_mark_page_dirty(vcpu, gfn);
+		FNAME(mark_pagetable_dirty)(vcpu, walker);
 		*guest_ent |= PT_DIRTY_MASK;
 		*write_pt = 1;
 		return 0;
 	}
-	mark_page_dirty(vcpu->kvm, gfn);
+	kvm_vcpu_mark_page_dirty(vcpu, gfn);
 	*shadow_ent |= PT_WRITABLE_MASK;
-	FNAME(mark_pagetable_dirty)(vcpu->kvm, walker);
+	FNAME(mark_pagetable_dirty)(vcpu, walker);
 	*guest_ent |= PT_DIRTY_MASK;
 	rmap_add(vcpu, shadow_ent);
 
@@ -414,8 +535,11 @@ static int FNAME(page_fault)(struct kvm_vcpu *vcpu, gva_t addr,
 	 * The page is not mapped by the guest.  Let the guest handle it.
 	 */
 	if (!r) {
-		pgprintk("%s: guest page fault\n", __FUNCTION__);
-		inject_page_fault(vcpu, addr, walker.error_code);
+		/* or a guest page table sits in a gfn not backed yet */
+		if (!vcpu->populate_pending) {
+			pgprintk("%s: guest page fault\n", __FUNCTION__);
+			inject_page_fault(vcpu, addr, walker.error_code);
+		}
 		FNAME(release_walker)(&walker);
 		return 0;
 	}
@@ -424,6 +548,11 @@ static int FNAME(page_fault)(struct kvm_vcpu *vcpu, gva_t addr,
 	pgprintk("%s: shadow pte %p %llx\n", __FUNCTION__,
 		 shadow_pte, *shadow_pte);
 
+	if (vcpu->populate_pending) {
+		FNAME(release_walker)(&walker);
+		return 0;
+	}
+
 	/*
 	 * Update the shadow pte.
 	 */
@@ -444,7 +573,7 @@ static int FNAME(page_fault)(struct kvm_vcpu *vcpu, gva_t addr,
 	if (is_io_pte(*shadow_pte))
 		return 1;
 
-	++kvm_stat.pf_fixed;
+	++vcpu->stat.pf_fixed;
 	kvm_mmu_audit(vcpu, "post page fault (fixed)");
 
 	return write_pt;
@@ -16,6 +16,7 @@
  */
 
 #include "kvm.h"
+#include "irq.h"
 #include "vmx.h"
 #include "kvm_vmx.h"
 #ifndef __WINKVM__
@@ -24,6 +25,7 @@
 #include <linux/mm.h>
 #include <linux/highmem.h>
 #include <linux/profile.h>
+#include <linux/bitops.h>
 #include <asm/io.h>
 #include <asm/desc.h>
 #else
@@ -53,6 +55,10 @@ static struct vmcs *g_current_vmcs_[__WINKVM_CPUNUMS__];
 #define HOST_IS_64 0
 #endif
 
+/* the processor walks gpa to hpa tables, see hardware_setup() */
+static int vmx_ept;
+static int vmx_ept_extent;
+
 static struct vmcs_descriptor {
 	int size;
 	int order;
@@ -98,6 +104,13 @@ static inline int is_page_fault(u32 intr_info)
 		(INTR_TYPE_EXCEPTION | PF_VECTOR | INTR_INFO_VALID_MASK);
 }
 
+static inline int is_no_device(u32 intr_info)
+{
+	return (intr_info & (INTR_INFO_INTR_TYPE_MASK | INTR_INFO_VECTOR_MASK |
+			     INTR_INFO_VALID_MASK)) ==
+		(INTR_TYPE_EXCEPTION | NM_VECTOR | INTR_INFO_VALID_MASK);
+}
+
 static inline int is_external_interrupt(u32 intr_info)
 {
 	FUNCTION_ENTER();
@@ -216,6 +229,99 @@ static void vmcs_write64(unsigned long field, u64 value)
 #endif
 }
 
+/*
+ * The exit path reads the same few vmcs fields again and again, and a
+ * vmread costs tens of cycles.  They are kept in vcpu->vmcs_cache from
+ * the first read after an exit until the next entry.  The exit
+ * information fields that every exit needs are read ahead, and guest
+ * rip, rsp and rflags writes are held back until just before entry.
+ * All accesses to these fields must go through the cache.
+ */
+enum {
+	VMCS_CACHE_EXIT_REASON,
+	VMCS_CACHE_EXIT_QUALIFICATION,
+	VMCS_CACHE_EXIT_INTR_INFO,
+	VMCS_CACHE_EXIT_INTR_ERROR_CODE,
+	VMCS_CACHE_EXIT_INSTRUCTION_LEN,
+	VMCS_CACHE_IDT_VECTORING_INFO,
+	VMCS_CACHE_GUEST_RIP,
+	VMCS_CACHE_GUEST_RSP,
+	VMCS_CACHE_GUEST_RFLAGS,
+};
+
+static const unsigned long vmcs_cache_field[KVM_NR_VMCS_CACHE] = {
+	[VMCS_CACHE_EXIT_REASON]          = VM_EXIT_REASON,
+	[VMCS_CACHE_EXIT_QUALIFICATION]   = EXIT_QUALIFICATION,
+	[VMCS_CACHE_EXIT_INTR_INFO]       = VM_EXIT_INTR_INFO,
+	[VMCS_CACHE_EXIT_INTR_ERROR_CODE] = VM_EXIT_INTR_ERROR_CODE,
+	[VMCS_CACHE_EXIT_INSTRUCTION_LEN] = VM_EXIT_INSTRUCTION_LEN,
+	[VMCS_CACHE_IDT_VECTORING_INFO]   = IDT_VECTORING_INFO_FIELD,
+	[VMCS_CACHE_GUEST_RIP]            = GUEST_RIP,
+	[VMCS_CACHE_GUEST_RSP]            = GUEST_RSP,
+	[VMCS_CACHE_GUEST_RFLAGS]         = GUEST_RFLAGS,
+};
+
+static inline unsigned long vmcs_cache_readl(struct kvm_vcpu *vcpu, int i)
+{
+	if (!(vcpu->vmcs_cache.avail & (1u << i))) {
+		vcpu->vmcs_cache.val[i] = vmcs_readl(vmcs_cache_field[i]);
+		vcpu->vmcs_cache.avail |= 1u << i;
+	}
+	return vcpu->vmcs_cache.val[i];
+}
+
+static inline void vmcs_cache_writel(struct kvm_vcpu *vcpu, int i,
+				     unsigned long value)
+{
+	vcpu->vmcs_cache.val[i] = value;
+	vcpu->vmcs_cache.avail |= 1u << i;
+	vcpu->vmcs_cache.dirty |= 1u << i;
+}
+
+/* write back the held guest fields, right before entry */
+static void vmcs_cache_flush(struct kvm_vcpu *vcpu)
+{
+	u32 dirty = vcpu->vmcs_cache.dirty;
+	int i;
+
+	for (i = 0; dirty; ++i, dirty >>= 1)
+		if (dirty & 1)
+			vmcs_writel(vmcs_cache_field[i],
+				    vcpu->vmcs_cache.val[i]);
+	vcpu->vmcs_cache.dirty = 0;
+}
+
+/* forget everything after an exit and read ahead what every exit needs */
+static void vmcs_cache_exit(struct kvm_vcpu *vcpu)
+{
+	vcpu->vmcs_cache.avail = 0;
+	vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_REASON);
+	vmcs_cache_readl(vcpu, VMCS_CACHE_IDT_VECTORING_INFO);
+	vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_INSTRUCTION_LEN);
+}
+
+static void __invept(int ext, u64 eptp)
+{
+	struct {
+		u64 eptp, gpa;
+	} operand = { eptp, 0 };
+
+	asm volatile (ASM_VMX_INVEPT
+		      : : "a" (&operand), "c" (ext) : "cc", "memory");
+}
+
+static u64 construct_eptp(hpa_t root)
+{
+	return root | (VMX_EPT_DEFAULT_GAW << VMX_EPT_GAW_EPTP_SHIFT) |
+		VMX_EPT_DEFAULT_MT;
+}
+
+/* drop the gpa translations of the vcpu's table on this processor */
+static void ept_sync_context(struct kvm_vcpu *vcpu)
+{
+	__invept(vmx_ept_extent, construct_eptp(vcpu->mmu.root_hpa));
+}
+
 /*
  * Switches to specified vcpu, until a matching vcpu_put(), but assumes
  * vcpu mutex is already taken.
@@ -260,6 +366,10 @@ static void vmx_vcpu_load(struct kvm_vcpu *vcpu)
 
 		rdmsrl(MSR_IA32_SYSENTER_ESP, sysenter_esp);
 		vmcs_writel(HOST_IA32_SYSENTER_ESP, sysenter_esp); /* 22.2.3 */
+
+		/* this processor may hold stale gpa translations */
+		if (vcpu->mmu.tdp)
+			ept_sync_context(vcpu);
 	}
 
 	FUNCTION_EXIT();	
@@ -277,12 +387,12 @@ static void vmx_vcpu_decache(struct kvm_vcpu *vcpu)
 
 static unsigned long vmx_get_rflags(struct kvm_vcpu *vcpu)
 {
-	return vmcs_readl(GUEST_RFLAGS);
+	return vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RFLAGS);
 }
 
 static void vmx_set_rflags(struct kvm_vcpu *vcpu, unsigned long rflags)
 {
-	vmcs_writel(GUEST_RFLAGS, rflags);
+	vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RFLAGS, rflags);
 }
 
 static void skip_emulated_instruction(struct kvm_vcpu *vcpu)
@@ -290,9 +400,9 @@ static void skip_emulated_instruction(struct kvm_vcpu *vcpu)
 	unsigned long rip;
 	u32 interruptibility;
 
-	rip = vmcs_readl(GUEST_RIP);
-	rip += vmcs_read32(VM_EXIT_INSTRUCTION_LEN);
-	vmcs_writel(GUEST_RIP, rip);
+	rip = vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RIP);
+	rip += vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_INSTRUCTION_LEN);
+	vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RIP, rip);
 
 	/*
 	 * We emulated an instruction, so temporary interrupt blocking
@@ -308,7 +418,7 @@ static void skip_emulated_instruction(struct kvm_vcpu *vcpu)
 static void vmx_inject_gp(struct kvm_vcpu *vcpu, unsigned error_code)
 {
 	printk(KERN_DEBUG "inject_general_protection: rip 0x%lx\n",
-	       vmcs_readl(GUEST_RIP));
+	       vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RIP));
 	vmcs_write32(VM_ENTRY_EXCEPTION_ERROR_CODE, error_code);
 	vmcs_write32(VM_ENTRY_INTR_INFO_FIELD,
 		     GP_VECTOR |
@@ -461,8 +571,8 @@ static int vmx_set_msr(struct kvm_vcpu *vcpu, u32 msr_index, u64 data)
  */
 static void vcpu_load_rsp_rip(struct kvm_vcpu *vcpu)
 {
-	vcpu->regs[VCPU_REGS_RSP] = vmcs_readl(GUEST_RSP);
-	vcpu->rip = vmcs_readl(GUEST_RIP);
+	vcpu->regs[VCPU_REGS_RSP] = vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RSP);
+	vcpu->rip = vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RIP);
 }
 
 /*
@@ -471,17 +581,31 @@ static void vcpu_load_rsp_rip(struct kvm_vcpu *vcpu)
  */
 static void vcpu_put_rsp_rip(struct kvm_vcpu *vcpu)
 {
-	vmcs_writel(GUEST_RSP, vcpu->regs[VCPU_REGS_RSP]);
-	vmcs_writel(GUEST_RIP, vcpu->rip);
+	vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RSP, vcpu->regs[VCPU_REGS_RSP]);
+	vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RIP, vcpu->rip);
+}
+
+static void update_exception_bitmap(struct kvm_vcpu *vcpu)
+{
+	u32 eb;
+
+	eb = 0;
+	if (!vcpu->mmu.tdp)
+		eb |= 1u << PF_VECTOR;
+	if (!vcpu->fpu_active)
+		eb |= 1u << NM_VECTOR;
+	if (vcpu->guest_debug.enabled)
+		eb |= 1u << 1;	/* Trap debug exceptions */
+	if (vcpu->rmode.active)
+		eb = ~0;
+	vmcs_write32(EXCEPTION_BITMAP, eb);
 }
 
 static int set_guest_debug(struct kvm_vcpu *vcpu, struct kvm_debug_guest *dbg)
 {
 	unsigned long dr7 = 0x400;
-	u32 exception_bitmap;
 	int old_singlestep;
 
-	exception_bitmap = vmcs_read32(EXCEPTION_BITMAP);
 	old_singlestep = vcpu->guest_debug.singlestep;
 
 	vcpu->guest_debug.enabled = dbg->enabled;
@@ -497,23 +621,20 @@ static int set_guest_debug(struct kvm_vcpu *vcpu, struct kvm_debug_guest *dbg)
 			dr7 |= 0 << (i*4+16); /* execution breakpoint */
 		}
 
-		exception_bitmap |= (1u << 1);  /* Trap debug exceptions */
-
 		vcpu->guest_debug.singlestep = dbg->singlestep;
 	} else {
-		exception_bitmap &= ~(1u << 1); /* Ignore debug exceptions */
 		vcpu->guest_debug.singlestep = 0;
 	}
 
 	if (old_singlestep && !vcpu->guest_debug.singlestep) {
 		unsigned long flags;
 
-		flags = vmcs_readl(GUEST_RFLAGS);
+		flags = vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RFLAGS);
 		flags &= ~(X86_EFLAGS_TF | X86_EFLAGS_RF);
-		vmcs_writel(GUEST_RFLAGS, flags);
+		vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RFLAGS, flags);
 	}
 
-	vmcs_write32(EXCEPTION_BITMAP, exception_bitmap);
+	update_exception_bitmap(vcpu);
 	vmcs_writel(GUEST_DR7, dr7);
 
 	return 0;
@@ -675,10 +796,47 @@ static __init int alloc_kvm_area(void)
 	return 0;
 }
 
+/*
+ * EPT is used if the processor can leave cr3 loads and stores alone,
+ * walks four levels, maps write back memory and has invept.
+ */
+static __init void ept_setup(void)
+{
+	u32 low, high;
+	u64 cap;
+
+	rdmsr(MSR_IA32_VMX_PROCBASED_CTLS, low, high);
+	if (!(high & CPU_BASED_ACTIVATE_SECONDARY_CONTROLS))
+		return;
+	if (low & (CPU_BASED_CR3_LOAD_EXITING | CPU_BASED_CR3_STORE_EXITING))
+		return;
+	rdmsr(MSR_IA32_VMX_PROCBASED_CTLS2, low, high);
+	if (!(high & SECONDARY_EXEC_ENABLE_EPT))
+		return;
+	rdmsrl(MSR_IA32_VMX_EPT_VPID_CAP, cap);
+	if (!(cap & VMX_EPT_PAGE_WALK_4_BIT) ||
+	    !(cap & VMX_EPT_MEMTYPE_WB_BIT) ||
+	    !(cap & VMX_EPT_INVEPT_BIT))
+		return;
+	if (cap & VMX_EPT_SINGLE_CONTEXT_BIT)
+		vmx_ept_extent = VMX_EPT_EXTENT_CONTEXT;
+	else if (cap & VMX_EPT_GLOBAL_CONTEXT_BIT)
+		vmx_ept_extent = VMX_EPT_EXTENT_GLOBAL;
+	else
+		return;
+
+	vmx_ept = 1;
+	kvm_enable_tdp();
+	printk(KERN_INFO "kvm: using ept\n");
+}
+
 static __init int hardware_setup(void)
 {
 	printk(KERN_ALERT "%s\n", __FUNCTION__);
 	setup_vmcs_descriptor();
+	ept_setup();
+	/* invlpg exits under shadow paging, see vcpu_setup() */
+	kvm_enable_unsync();
 	return alloc_kvm_area();
 }
 
@@ -687,12 +845,28 @@ static __exit void hardware_unsetup(void)
 	free_kvm_area();
 }
 
-static void update_exception_bitmap(struct kvm_vcpu *vcpu)
+/*
+ * The guest fpu state is switched lazily.  While fpu_active is clear
+ * GUEST_CR0.TS is forced on and #NM is intercepted, so vmx_vcpu_run()
+ * leaves the host fpu registers alone until the guest touches them.
+ */
+static void vmx_fpu_activate(struct kvm_vcpu *vcpu)
 {
-	if (vcpu->rmode.active)
-		vmcs_write32(EXCEPTION_BITMAP, ~0);
-	else
-		vmcs_write32(EXCEPTION_BITMAP, 1 << PF_VECTOR);
+	if (vcpu->fpu_active)
+		return;
+	vcpu->fpu_active = 1;
+	vmcs_writel(GUEST_CR0, (vmcs_readl(GUEST_CR0) & ~CR0_TS_MASK) |
+		    (vcpu->cr0 & CR0_TS_MASK));
+	update_exception_bitmap(vcpu);
+}
+
+static void vmx_fpu_deactivate(struct kvm_vcpu *vcpu)
+{
+	if (!vcpu->fpu_active)
+		return;
+	vcpu->fpu_active = 0;
+	vmcs_writel(GUEST_CR0, vmcs_readl(GUEST_CR0) | CR0_TS_MASK);
+	update_exception_bitmap(vcpu);
 }
 
 static void fix_pmode_dataseg(int seg, struct kvm_save_segment *save)
@@ -721,10 +895,10 @@ static void enter_pmode(struct kvm_vcpu *vcpu)
 	vmcs_write32(GUEST_TR_LIMIT, vcpu->rmode.tr.limit);
 	vmcs_write32(GUEST_TR_AR_BYTES, vcpu->rmode.tr.ar);
 
-	flags = vmcs_readl(GUEST_RFLAGS);
+	flags = vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RFLAGS);
 	flags &= ~(IOPL_MASK | X86_EFLAGS_VM);
 	flags |= (vcpu->rmode.save_iopl << IOPL_SHIFT);
-	vmcs_writel(GUEST_RFLAGS, flags);
+	vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RFLAGS, flags);
 
 	vmcs_writel(GUEST_CR4, (vmcs_readl(GUEST_CR4) & ~CR4_VME_MASK) |
 			(vmcs_readl(CR4_READ_SHADOW) & CR4_VME_MASK));
@@ -778,12 +952,12 @@ static void enter_rmode(struct kvm_vcpu *vcpu)
 	vcpu->rmode.tr.ar = vmcs_read32(GUEST_TR_AR_BYTES);
 	vmcs_write32(GUEST_TR_AR_BYTES, 0x008b);
 
-	flags = vmcs_readl(GUEST_RFLAGS);
+	flags = vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RFLAGS);
 	vcpu->rmode.save_iopl = (flags & IOPL_MASK) >> IOPL_SHIFT;
 
 	flags |= IOPL_MASK | X86_EFLAGS_VM;
 
-	vmcs_writel(GUEST_RFLAGS, flags);
+	vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RFLAGS, flags);
 	vmcs_writel(GUEST_CR4, vmcs_readl(GUEST_CR4) | CR4_VME_MASK);
 	update_exception_bitmap(vcpu);
 
@@ -835,6 +1009,27 @@ static void exit_lmode(struct kvm_vcpu *vcpu)
 
 #endif
 
+/*
+ * The shadow page tables are always pae and always write protected;
+ * under ept the processor walks the guest's own tables instead, so
+ * GUEST_CR0.WP and GUEST_CR4.PAE must be the guest's.
+ */
+static void vmx_fixup_paging_bits(struct kvm_vcpu *vcpu)
+{
+	unsigned long cr0 = vmcs_readl(GUEST_CR0) & ~CR0_WP_MASK;
+	unsigned long cr4 = vmcs_readl(GUEST_CR4) & ~CR4_PAE_MASK;
+
+	if (vcpu->mmu.tdp) {
+		cr0 |= vcpu->cr0 & CR0_WP_MASK;
+		cr4 |= vcpu->cr4 & CR4_PAE_MASK;
+	} else {
+		cr0 |= CR0_WP_MASK;
+		cr4 |= CR4_PAE_MASK;
+	}
+	vmcs_writel(GUEST_CR0, cr0);
+	vmcs_writel(GUEST_CR4, cr4);
+}
+
 static void vmx_decache_cr0_cr4_guest_bits(struct kvm_vcpu *vcpu)
 {
 	vcpu->cr0 &= KVM_GUEST_CR0_MASK;
@@ -846,6 +1041,8 @@ static void vmx_decache_cr0_cr4_guest_bits(struct kvm_vcpu *vcpu)
 
 static void vmx_set_cr0(struct kvm_vcpu *vcpu, unsigned long cr0)
 {
+	vmx_fpu_deactivate(vcpu);
+
 	if (vcpu->rmode.active && (cr0 & CR0_PE_MASK))
 		enter_pmode(vcpu);
 
@@ -865,6 +1062,10 @@ static void vmx_set_cr0(struct kvm_vcpu *vcpu, unsigned long cr0)
 	vmcs_writel(GUEST_CR0,
 		    (cr0 & ~KVM_GUEST_CR0_MASK) | KVM_VM_CR0_ALWAYS_ON);
 	vcpu->cr0 = cr0;
+	vmx_fixup_paging_bits(vcpu);
+
+	if (!(cr0 & CR0_TS_MASK) || !(cr0 & CR0_PE_MASK))
+		vmx_fpu_activate(vcpu);
 }
 
 /*
@@ -872,6 +1073,8 @@ static void vmx_set_cr0(struct kvm_vcpu *vcpu, unsigned long cr0)
  */
 static void vmx_set_cr0_no_modeswitch(struct kvm_vcpu *vcpu, unsigned long cr0)
 {
+	vmx_fpu_deactivate(vcpu);
+
 	if (!vcpu->rmode.active && !(cr0 & CR0_PE_MASK))
 		enter_rmode(vcpu);
 
@@ -881,6 +1084,10 @@ static void vmx_set_cr0_no_modeswitch(struct kvm_vcpu *vcpu, unsigned long cr0)
 	vmcs_writel(GUEST_CR0,
 		    (cr0 & ~KVM_GUEST_CR0_MASK) | KVM_VM_CR0_ALWAYS_ON);
 	vcpu->cr0 = cr0;
+	vmx_fixup_paging_bits(vcpu);
+
+	if (!(cr0 & CR0_TS_MASK) || !(cr0 & CR0_PE_MASK))
+		vmx_fpu_activate(vcpu);
 }
 
 static void vmx_set_cr3(struct kvm_vcpu *vcpu, unsigned long cr3)
@@ -894,6 +1101,44 @@ static void vmx_set_cr4(struct kvm_vcpu *vcpu, unsigned long cr4)
 	vmcs_writel(GUEST_CR4, cr4 | (vcpu->rmode.active ?
 		    KVM_RMODE_VM_CR4_ALWAYS_ON : KVM_PMODE_VM_CR4_ALWAYS_ON));
 	vcpu->cr4 = cr4;
+	vmx_fixup_paging_bits(vcpu);
+}
+
+/*
+ * Switch between the guest's own cr3 walked through the gpa to hpa
+ * table at root, and shadow paging (root == INVALID_PAGE), in which
+ * case the caller loads the shadow root with set_cr3 next.
+ */
+static void vmx_set_tdp(struct kvm_vcpu *vcpu, hpa_t root)
+{
+	u32 exec = vmcs_read32(CPU_BASED_VM_EXEC_CONTROL);
+	u32 exec2 = vmcs_read32(SECONDARY_VM_EXEC_CONTROL);
+
+	if (root != INVALID_PAGE) {
+		vmcs_write64(EPT_POINTER, construct_eptp(root));
+		exec &= ~(CPU_BASED_CR3_LOAD_EXITING |
+			  CPU_BASED_CR3_STORE_EXITING |
+			  CPU_BASED_INVDPG_EXITING);
+		exec2 |= SECONDARY_EXEC_ENABLE_EPT;
+		vmcs_writel(GUEST_CR3, vcpu->cr3);
+		if (is_pae(vcpu) && !is_long_mode(vcpu)) {
+			vmcs_write64(GUEST_PDPTR0, vcpu->pdptrs[0]);
+			vmcs_write64(GUEST_PDPTR1, vcpu->pdptrs[1]);
+			vmcs_write64(GUEST_PDPTR2, vcpu->pdptrs[2]);
+			vmcs_write64(GUEST_PDPTR3, vcpu->pdptrs[3]);
+		}
+	} else {
+		exec |= CPU_BASED_CR3_LOAD_EXITING |
+			CPU_BASED_CR3_STORE_EXITING |
+			CPU_BASED_INVDPG_EXITING;
+		exec2 &= ~SECONDARY_EXEC_ENABLE_EPT;
+	}
+	vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, exec);
+	vmcs_write32(SECONDARY_VM_EXEC_CONTROL, exec2);
+	vmx_fixup_paging_bits(vcpu);
+	update_exception_bitmap(vcpu);
+	if (root != INVALID_PAGE)
+		ept_sync_context(vcpu);
 }
 
 #ifdef CONFIG_X86_64
@@ -1016,6 +1261,12 @@ static int init_rmode_tss(struct kvm* kvm)
 
 	FUNCTION_ENTER();	
 
+	/* the tss may sit in demand-paged memory */
+	if (kvm_populate_gfn(kvm, fn) || kvm_populate_gfn(kvm, fn + 2)) {
+		FUNCTION_EXIT();
+		return 0;
+	}
+
 	p1 = _gfn_to_page(kvm, fn++);
 	p2 = _gfn_to_page(kvm, fn++);
 	p3 = _gfn_to_page(kvm, fn);
@@ -1127,9 +1378,10 @@ static int vmx_vcpu_setup(struct kvm_vcpu *vcpu)
 	vmcs_writel(GUEST_SYSENTER_ESP, 0);
 	vmcs_writel(GUEST_SYSENTER_EIP, 0);
 
-	vmcs_writel(GUEST_RFLAGS, 0x02);
-	vmcs_writel(GUEST_RIP, 0xfff0);
-	vmcs_writel(GUEST_RSP, 0);
+	vcpu->vmcs_cache.avail = vcpu->vmcs_cache.dirty = 0;
+	vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RFLAGS, 0x02);
+	vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RIP, 0xfff0);
+	vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RSP, 0);
 
 	//todo: dr0 = dr1 = dr2 = dr3 = 0; dr6 = 0xffff0ff0
 	vmcs_writel(GUEST_DR7, 0x400);
@@ -1168,10 +1420,16 @@ static int vmx_vcpu_setup(struct kvm_vcpu *vcpu)
 			       | CPU_BASED_CR8_STORE_EXITING   /* 20.6.2 */
 			       | CPU_BASED_UNCOND_IO_EXITING   /* 20.6.2 */
 			       | CPU_BASED_MOV_DR_EXITING
+			       | CPU_BASED_INVDPG_EXITING  /* unsync shadow */
 			       | CPU_BASED_USE_TSC_OFFSETING   /* 21.3 */
+			       | (vmx_ept ?
+				  CPU_BASED_ACTIVATE_SECONDARY_CONTROLS : 0)
 			);
+	if (vmx_ept)
+		vmcs_write32(SECONDARY_VM_EXEC_CONTROL, 0);
 
-	vmcs_write32(EXCEPTION_BITMAP, 1 << PF_VECTOR);
+	vcpu->fpu_active = 0;
+	update_exception_bitmap(vcpu);
 	vmcs_write32(PAGE_FAULT_ERROR_CODE_MASK, 0);
 	vmcs_write32(PAGE_FAULT_ERROR_CODE_MATCH, 0);
 	vmcs_write32(CR3_TARGET_COUNT, 0);           /* 22.2.1 */
@@ -1297,13 +1555,13 @@ static void inject_rmode_irq(struct kvm_vcpu *vcpu, int irq)
 	u16 ip;
 	unsigned long flags;
 	unsigned long ss_base = vmcs_readl(GUEST_SS_BASE);
-	u16 sp =  vmcs_readl(GUEST_RSP);
+	u16 sp =  vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RSP);
 	u32 ss_limit = vmcs_read32(GUEST_SS_LIMIT);
 
 	if (sp > ss_limit || sp - 6 > sp) {
 		vcpu_printf(vcpu, "%s: #SS, rsp 0x%lx ss 0x%lx limit 0x%x\n",
 			    __FUNCTION__,
-			    vmcs_readl(GUEST_RSP),
+			    vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RSP),
 			    vmcs_readl(GUEST_SS_BASE),
 			    vmcs_read32(GUEST_SS_LIMIT));
 		return;
@@ -1315,9 +1573,9 @@ static void inject_rmode_irq(struct kvm_vcpu *vcpu, int irq)
 		return;
 	}
 
-	flags =  vmcs_readl(GUEST_RFLAGS);
+	flags =  vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RFLAGS);
 	cs =  vmcs_readl(GUEST_CS_BASE) >> 4;
-	ip =  vmcs_readl(GUEST_RIP);
+	ip =  vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RIP);
 
 
 	if (kvm_write_guest(vcpu, ss_base + sp - 2, 2, &flags) != 2 ||
@@ -1327,12 +1585,12 @@ static void inject_rmode_irq(struct kvm_vcpu *vcpu, int irq)
 		return;
 	}
 
-	vmcs_writel(GUEST_RFLAGS, flags &
+	vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RFLAGS, flags &
 		    ~( X86_EFLAGS_IF | X86_EFLAGS_AC | X86_EFLAGS_TF));
 	vmcs_write16(GUEST_CS_SELECTOR, ent[1]) ;
 	vmcs_writel(GUEST_CS_BASE, ent[1] << 4);
-	vmcs_writel(GUEST_RIP, ent[0]);
-	vmcs_writel(GUEST_RSP, (vmcs_readl(GUEST_RSP) & ~0xffff) | (sp - 6));
+	vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RIP, ent[0]);
+	vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RSP, (vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RSP) & ~0xffff) | (sp - 6));
 }
 
 static void kvm_do_inject_irq(struct kvm_vcpu *vcpu)
@@ -1347,6 +1605,8 @@ static void kvm_do_inject_irq(struct kvm_vcpu *vcpu)
 	if (!vcpu->irq_pending[word_index])
 		clear_bit(word_index, &vcpu->irq_summary);
 
+	WINKVM_TRACE(WINKVM_TRC_INJ_IRQ, vcpu - vcpu->kvm->vcpus, irq, 0, 0);
+
 	if (vcpu->rmode.active) {
 		inject_rmode_irq(vcpu, irq);
 		FUNCTION_EXIT();		
@@ -1367,9 +1627,22 @@ static void do_interrupt_requests(struct kvm_vcpu *vcpu,
 	FUNCTION_ENTER();	
 
 	vcpu->interrupt_window_open =
-		((vmcs_readl(GUEST_RFLAGS) & X86_EFLAGS_IF) &&
+		((vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RFLAGS) & X86_EFLAGS_IF) &&
 		 (vmcs_read32(GUEST_INTERRUPTIBILITY_INFO) & 3) == 0);
 
+	/* take the next vector from the in-kernel pic or apic */
+	if (irqchip_in_kernel(vcpu->kvm) &&
+	    vcpu->interrupt_window_open &&
+	    !vcpu->irq_summary &&
+	    !(vmcs_read32(VM_ENTRY_INTR_INFO_FIELD) & INTR_INFO_VALID_MASK)) {
+		int vector = kvm_cpu_get_interrupt(vcpu);
+
+		if (vector >= 0) {
+			set_bit(vector, vcpu->irq_pending);
+			set_bit(vector / BITS_PER_LONG, &vcpu->irq_summary);
+		}
+	}
+
 	if (vcpu->interrupt_window_open &&
 	    vcpu->irq_summary &&
 	    !(vmcs_read32(VM_ENTRY_INTR_INFO_FIELD) & INTR_INFO_VALID_MASK))
@@ -1380,7 +1653,8 @@ static void do_interrupt_requests(struct kvm_vcpu *vcpu,
 
 	cpu_based_vm_exec_control = vmcs_read32(CPU_BASED_VM_EXEC_CONTROL);
 	if (!vcpu->interrupt_window_open &&
-	    (vcpu->irq_summary || kvm_run->request_interrupt_window))
+	    (vcpu->irq_summary || kvm_run->request_interrupt_window ||
+	     (irqchip_in_kernel(vcpu->kvm) && kvm_cpu_has_interrupt(vcpu))))
 		/*
 		 * Interrupts blocked.  Wait for unblock.
 		 */
@@ -1404,9 +1678,9 @@ static void kvm_guest_debug_pre(struct kvm_vcpu *vcpu)
 	if (dbg->singlestep) {
 		unsigned long flags;
 
-		flags = vmcs_readl(GUEST_RFLAGS);
+		flags = vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RFLAGS);
 		flags |= X86_EFLAGS_TF | X86_EFLAGS_RF;
-		vmcs_writel(GUEST_RFLAGS, flags);
+		vmcs_cache_writel(vcpu, VMCS_CACHE_GUEST_RFLAGS, flags);
 	}
 }
 
@@ -1420,7 +1694,18 @@ static int handle_rmode_exception(struct kvm_vcpu *vcpu,
 	}
 
 	if (vec == GP_VECTOR && err_code == 0) {		
-		if (emulate_instruction(vcpu, NULL, 0, 0) == EMULATE_DONE) {
+		int er;
+
+		vcpu->populate_pending = 0;
+		spin_lock(&vcpu->kvm->lock);
+		er = emulate_instruction(vcpu, NULL, 0, 0);
+		spin_unlock(&vcpu->kvm->lock);
+		/* back the gfn and let the guest fault on it again */
+		if (vcpu->populate_pending) {
+			FUNCTION_EXIT();
+			return kvm_mmu_populate(vcpu);
+		}
+		if (er == EMULATE_DONE) {
 			FUNCTION_EXIT();			
 			return 1;
 		}
@@ -1440,8 +1725,8 @@ static int handle_exception(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 
 	FUNCTION_ENTER();	
 
-	vect_info = vmcs_read32(IDT_VECTORING_INFO_FIELD);
-	intr_info = vmcs_read32(VM_EXIT_INTR_INFO);
+	vect_info = vmcs_cache_readl(vcpu, VMCS_CACHE_IDT_VECTORING_INFO);
+	intr_info = vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_INTR_INFO);
 
 	if ((vect_info & VECTORING_INFO_VALID_MASK) &&
 						!is_page_fault(intr_info)) {
@@ -1461,12 +1746,21 @@ static int handle_exception(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 		FUNCTION_EXIT();		
 		return 1;
 	}
+
+	if (is_no_device(intr_info)) {
+		vmx_fpu_activate(vcpu);
+		FUNCTION_EXIT();
+		return 1;
+	}
+
 	error_code = 0;
-	rip = vmcs_readl(GUEST_RIP);
+	rip = vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RIP);
 	if (intr_info & INTR_INFO_DELIEVER_CODE_MASK)
-		error_code = vmcs_read32(VM_EXIT_INTR_ERROR_CODE);
+		error_code = vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_INTR_ERROR_CODE);
 	if (is_page_fault(intr_info)) {
-		cr2 = vmcs_readl(EXIT_QUALIFICATION);
+		cr2 = vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_QUALIFICATION);
+		WINKVM_TRACE(WINKVM_TRC_PAGE_FAULT, vcpu - vcpu->kvm->vcpus,
+			     cr2, error_code, 0);
 
 		spin_lock(&vcpu->kvm->lock);
 		/* here is bug point */
@@ -1479,18 +1773,25 @@ static int handle_exception(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 		if (!r) {
 			spin_unlock(&vcpu->kvm->lock);
 			FUNCTION_EXIT();			
-			return 1;
+			return vcpu->populate_pending ? kvm_mmu_populate(vcpu) : 1;
 		}
 
 		er = emulate_instruction(vcpu, kvm_run, cr2, error_code);
 		spin_unlock(&vcpu->kvm->lock);		
+		if (vcpu->populate_pending) {
+			FUNCTION_EXIT();
+			return kvm_mmu_populate(vcpu);
+		}
 
 		switch (er) {
 		case EMULATE_DONE:
 			FUNCTION_EXIT();			
 			return 1;
 		case EMULATE_DO_MMIO:
-			++kvm_stat.mmio_exits;
+			++vcpu->stat.mmio_exits;
+			WINKVM_TRACE(WINKVM_TRC_MMIO, vcpu - vcpu->kvm->vcpus,
+				     vcpu->mmio_phys_addr, vcpu->mmio_size,
+				     vcpu->mmio_is_write);
 			kvm_run->exit_reason = KVM_EXIT_MMIO;
 			FUNCTION_EXIT();			
 			return 0;
@@ -1502,11 +1803,14 @@ static int handle_exception(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 		}
 	}
 
-	if (vcpu->rmode.active &&
-	    handle_rmode_exception(vcpu, intr_info & INTR_INFO_VECTOR_MASK,
-							   error_code)) {
-		FUNCTION_EXIT();		
-		return 1;		
+	if (vcpu->rmode.active) {
+		r = handle_rmode_exception(vcpu,
+					   intr_info & INTR_INFO_VECTOR_MASK,
+					   error_code);
+		if (r) {
+			FUNCTION_EXIT();
+			return r;
+		}
 	}	
 
 	if ((intr_info & (INTR_INFO_INTR_TYPE_MASK | INTR_INFO_VECTOR_MASK)) == (INTR_TYPE_EXCEPTION | 1)) {
@@ -1521,10 +1825,78 @@ static int handle_exception(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 	return 0;
 }
 
+/*
+ * A gpa missing from the ept table: either guest ram that is not mapped
+ * yet, or mmio, which is emulated like a shadow page fault on mmio.
+ */
+static int handle_ept_violation(struct kvm_vcpu *vcpu,
+				struct kvm_run *kvm_run)
+{
+	unsigned long qual = vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_QUALIFICATION);
+	gpa_t gpa = vmcs_read64(GUEST_PHYSICAL_ADDRESS);
+	unsigned long cr2 = 0;
+	u32 error_code = 0;
+	enum emulation_result er;
+	int r;
+
+	if (qual & EPT_VIOLATION_WRITE)
+		error_code |= PFERR_WRITE_MASK;
+	if (qual & EPT_VIOLATION_FETCH)
+		error_code |= PFERR_FETCH_MASK;
+	if (qual & EPT_VIOLATION_READABLE)
+		error_code |= PFERR_PRESENT_MASK;
+	if (qual & EPT_VIOLATION_GLA_VALID)
+		cr2 = vmcs_readl(GUEST_LINEAR_ADDRESS);
+
+	spin_lock(&vcpu->kvm->lock);
+	r = kvm_mmu_page_fault(vcpu, gpa, error_code);
+	if (r <= 0) {
+		spin_unlock(&vcpu->kvm->lock);
+		if (!r && vcpu->populate_pending)
+			return kvm_mmu_populate(vcpu);
+		return r < 0 ? r : 1;
+	}
+
+	er = emulate_instruction(vcpu, kvm_run, cr2, error_code);
+	spin_unlock(&vcpu->kvm->lock);
+	if (vcpu->populate_pending)
+		return kvm_mmu_populate(vcpu);
+
+	switch (er) {
+	case EMULATE_DONE:
+		return 1;
+	case EMULATE_DO_MMIO:
+		++vcpu->stat.mmio_exits;
+		WINKVM_TRACE(WINKVM_TRC_MMIO, vcpu - vcpu->kvm->vcpus,
+			     vcpu->mmio_phys_addr, vcpu->mmio_size,
+			     vcpu->mmio_is_write);
+		kvm_run->exit_reason = KVM_EXIT_MMIO;
+		return 0;
+	case EMULATE_FAIL:
+		vcpu_printf(vcpu, "%s: emulate fail\n", __FUNCTION__);
+		break;
+	default:
+		BUG();
+	}
+	kvm_run->exit_reason = KVM_EXIT_UNKNOWN;
+	kvm_run->hw.hardware_exit_reason = EXIT_REASON_EPT_VIOLATION;
+	return 0;
+}
+
+static int handle_ept_misconfig(struct kvm_vcpu *vcpu,
+				struct kvm_run *kvm_run)
+{
+	printk(KERN_ERR "kvm: ept misconfiguration at gpa 0x%llx\n",
+	       vmcs_read64(GUEST_PHYSICAL_ADDRESS));
+	kvm_run->exit_reason = KVM_EXIT_UNKNOWN;
+	kvm_run->hw.hardware_exit_reason = EXIT_REASON_EPT_MISCONFIG;
+	return 0;
+}
+
 static int handle_external_interrupt(struct kvm_vcpu *vcpu,
 				     struct kvm_run *kvm_run)
 {
-	++kvm_stat.irq_exits;
+	++vcpu->stat.irq_exits;
 	return 1;
 }
 
@@ -1534,14 +1906,14 @@ static int handle_triple_fault(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 	return 0;
 }
 
-static int get_io_count(struct kvm_vcpu *vcpu, u64 *count)
+static int get_io_count(struct kvm_vcpu *vcpu, u64 *count, int *ad_bytes)
 {
 	u64 inst;
 	gva_t rip;
 	int countr_size;
 	int i, n;
 
-	if ((vmcs_readl(GUEST_RFLAGS) & X86_EFLAGS_VM)) {
+	if ((vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RFLAGS) & X86_EFLAGS_VM)) {
 		countr_size = 2;
 	} else {
 		u32 cs_ar = vmcs_read32(GUEST_CS_AR_BYTES);
@@ -1550,7 +1922,7 @@ static int get_io_count(struct kvm_vcpu *vcpu, u64 *count)
 			      (cs_ar & AR_DB_MASK) ? 4: 2;
 	}
 
-	rip =  vmcs_readl(GUEST_RIP);
+	rip =  vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RIP);
 	if (countr_size != 8)
 		rip += vmcs_readl(GUEST_CS_BASE);
 
@@ -1577,6 +1949,7 @@ static int get_io_count(struct kvm_vcpu *vcpu, u64 *count)
 	}
 	return 0;
 done:
+	*ad_bytes = countr_size;
 	countr_size *= 8;
 	*count = vcpu->regs[VCPU_REGS_RCX] & (~0ULL >> (64 - countr_size));
 	return 1;
@@ -1585,26 +1958,44 @@ done:
 static int handle_io(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 {
 	u64 exit_qualification;
+	u64 count = 1;
+	int in, size, string, down, rep;
+	int ad_bytes = sizeof(unsigned long);
+	gva_t address = 0;
+
+	++vcpu->stat.io_exits;
+	exit_qualification = vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_QUALIFICATION);
+	in = (exit_qualification & 8) != 0;
+	size = (exit_qualification & 7) + 1;
+	string = (exit_qualification & 16) != 0;
+	down = (vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RFLAGS)
+		& X86_EFLAGS_DF) != 0;
+	rep = (exit_qualification & 32) != 0;
 
-	++kvm_stat.io_exits;
-	exit_qualification = vmcs_read64(EXIT_QUALIFICATION);
 	kvm_run->exit_reason = KVM_EXIT_IO;
-	if (exit_qualification & 8)
-		kvm_run->io.direction = KVM_EXIT_IO_IN;
-	else
-		kvm_run->io.direction = KVM_EXIT_IO_OUT;
-	kvm_run->io.size = (exit_qualification & 7) + 1;
-	kvm_run->io.string = (exit_qualification & 16) != 0;
-	kvm_run->io.string_down
-		= (vmcs_readl(GUEST_RFLAGS) & X86_EFLAGS_DF) != 0;
-	kvm_run->io.rep = (exit_qualification & 32) != 0;
+	kvm_run->io.direction = in ? KVM_EXIT_IO_IN : KVM_EXIT_IO_OUT;
+	kvm_run->io.size = size;
+	kvm_run->io.string = string;
+	kvm_run->io.string_down = down;
+	kvm_run->io.rep = rep;
 	kvm_run->io.port = exit_qualification >> 16;
-	if (kvm_run->io.string) {
-		if (!get_io_count(vcpu, &kvm_run->io.count))
+	WINKVM_TRACE(WINKVM_TRC_PIO, vcpu - vcpu->kvm->vcpus,
+		     exit_qualification >> 16, size, in);
+	if (!string && irqchip_in_kernel(vcpu->kvm) &&
+	    kvm_irqchip_pio(vcpu, exit_qualification >> 16, size, in)) {
+		skip_emulated_instruction(vcpu);
+		return 1;
+	}
+	if (string) {
+		if (!get_io_count(vcpu, &count, &ad_bytes))
 			return 1;
-		kvm_run->io.address = vmcs_readl(GUEST_LINEAR_ADDRESS);
+		address = vmcs_readl(GUEST_LINEAR_ADDRESS);
+		kvm_run->io.count = count;
+		kvm_run->io.address = address;
 	} else
 		kvm_run->io.value = vcpu->regs[VCPU_REGS_RAX]; /* rax */
+	kvm_setup_pio(vcpu, kvm_run, in, size, string, down, rep, count,
+		      ad_bytes, address);
 	return 0;
 }
 
@@ -1625,7 +2016,7 @@ static int handle_cr(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 	int cr;
 	int reg;
 
-	exit_qualification = vmcs_read64(EXIT_QUALIFICATION);
+	exit_qualification = vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_QUALIFICATION);
 	cr = exit_qualification & 15;
 	reg = (exit_qualification >> 8) & 15;
 	switch ((exit_qualification >> 4) & 3) {
@@ -1671,6 +2062,14 @@ static int handle_cr(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 			return 1;
 		}
 		break;
+	case 2: /* clts */
+		vcpu_load_rsp_rip(vcpu);
+		vmx_fpu_deactivate(vcpu);
+		vcpu->cr0 &= ~CR0_TS_MASK;
+		vmcs_writel(CR0_READ_SHADOW, vcpu->cr0);
+		vmx_fpu_activate(vcpu);
+		skip_emulated_instruction(vcpu);
+		return 1;
 	case 3: /* lmsw */
 		lmsw(vcpu, (exit_qualification >> LMSW_SOURCE_DATA_SHIFT) & 0x0f);
 
@@ -1695,7 +2094,7 @@ static int handle_dr(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 	 * FIXME: this code assumes the host is debugging the guest.
 	 *        need to deal with guest debugging itself too.
 	 */
-	exit_qualification = vmcs_read64(EXIT_QUALIFICATION);
+	exit_qualification = vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_QUALIFICATION);
 	dr = exit_qualification & 7;
 	reg = (exit_qualification >> 8) & 15;
 	vcpu_load_rsp_rip(vcpu);
@@ -1762,11 +2161,15 @@ static void post_kvm_run_save(struct kvm_vcpu *vcpu,
 			      struct kvm_run *kvm_run)
 {
 	FUNCTION_ENTER();	
-	kvm_run->if_flag = (vmcs_readl(GUEST_RFLAGS) & X86_EFLAGS_IF) != 0;
+	kvm_run->if_flag = (vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RFLAGS) & X86_EFLAGS_IF) != 0;
 	kvm_run->cr8 = vcpu->cr8;
 	kvm_run->apic_base = vcpu->apic_base;
 	kvm_run->ready_for_interrupt_injection = (vcpu->interrupt_window_open &&
 						  vcpu->irq_summary == 0);
+	/* with ept the guest switches cr3 and flushes without exiting */
+	if (vcpu->mmu.tdp)
+		++vcpu->tlb_gen;
+	kvm_run->tlb_gen = vcpu->tlb_gen;
 	FUNCTION_EXIT();	
 }
 
@@ -1780,20 +2183,38 @@ static int handle_interrupt_window(struct kvm_vcpu *vcpu,
 	if (kvm_run->request_interrupt_window &&
 	    !vcpu->irq_summary) {
 		kvm_run->exit_reason = KVM_EXIT_IRQ_WINDOW_OPEN;
-		++kvm_stat.irq_window_exits;
+		++vcpu->stat.irq_window_exits;
 		return 0;
 	}
 	return 1;
 }
 
+static int handle_invlpg(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
+{
+	u64 exit_qualification = vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_QUALIFICATION);
+
+	spin_lock(&vcpu->kvm->lock);
+	kvm_mmu_invlpg(vcpu, exit_qualification);
+	spin_unlock(&vcpu->kvm->lock);
+	skip_emulated_instruction(vcpu);
+	return 1;
+}
+
 static int handle_halt(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 {
 	skip_emulated_instruction(vcpu);
 	if (vcpu->irq_summary)
 		return 1;
 
+	/* wait in the driver, see kvm_vcpu_block() */
+	if (irqchip_in_kernel(vcpu->kvm)) {
+		vcpu->mp_state = VCPU_MP_STATE_HALTED;
+		++vcpu->stat.halt_exits;
+		return 1;
+	}
+
 	kvm_run->exit_reason = KVM_EXIT_HLT;
-	++kvm_stat.halt_exits;
+	++vcpu->stat.halt_exits;
 	return 0;
 }
 
@@ -1821,35 +2242,67 @@ static int (*kvm_vmx_exit_handlers[])(struct kvm_vcpu *vcpu,
 	[EXIT_REASON_MSR_WRITE]               = handle_wrmsr,
 	[EXIT_REASON_PENDING_INTERRUPT]       = handle_interrupt_window,
 	[EXIT_REASON_HLT]                     = handle_halt,
+	[EXIT_REASON_INVLPG]                  = handle_invlpg,
 	[EXIT_REASON_VMCALL]                  = handle_vmcall,
+	[EXIT_REASON_EPT_VIOLATION]           = handle_ept_violation,
+	[EXIT_REASON_EPT_MISCONFIG]           = handle_ept_misconfig,
 };
 
 static const int kvm_vmx_max_exit_handlers =
 	sizeof(kvm_vmx_exit_handlers) / sizeof(*kvm_vmx_exit_handlers);
 
+/* count the exit and the tsc cycles its handler took */
+static void vmx_account_exit(struct kvm_vcpu *vcpu, u32 exit_reason,
+			     u64 cycles)
+{
+	struct winkvm_exit_stat *s;
+	int bucket;
+
+	if (exit_reason >= WINKVM_NR_EXIT_REASONS)
+		return;
+	s = &vcpu->stat.exit[exit_reason];
+	if ((cycles >> 8) >> 32)
+		bucket = WINKVM_NR_HIST_BUCKETS - 1;
+	else
+		bucket = fls((u32)(cycles >> 8));
+	if (bucket >= WINKVM_NR_HIST_BUCKETS)
+		bucket = WINKVM_NR_HIST_BUCKETS - 1;
+	++s->count;
+	++s->hist[bucket];
+	s->cycles += cycles;
+}
+
 /*
  * The guest has exited.  See if we can fix it or if we need userspace
  * assistance.
  */
 static int kvm_handle_exit(struct kvm_run *kvm_run, struct kvm_vcpu *vcpu)
 {
-	u32 vectoring_info = vmcs_read32(IDT_VECTORING_INFO_FIELD);
-	u32 exit_reason = vmcs_read32(VM_EXIT_REASON);
+	u32 vectoring_info = vmcs_cache_readl(vcpu, VMCS_CACHE_IDT_VECTORING_INFO);
+	u32 exit_reason = vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_REASON);
+	u64 start, end;
 	int r;	
 
 	FUNCTION_ENTER();
 
+	WINKVM_TRACE(WINKVM_TRC_VMEXIT, vcpu - vcpu->kvm->vcpus, exit_reason,
+		     vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RIP), 0);
+
 	if ( (vectoring_info & VECTORING_INFO_VALID_MASK) &&
 				exit_reason != EXIT_REASON_EXCEPTION_NMI )
 		printk(KERN_WARNING "%s: unexpected, valid vectoring info and "
 		       "exit reason is 0x%x\n", __FUNCTION__, exit_reason);
-	kvm_run->instruction_length = vmcs_read32(VM_EXIT_INSTRUCTION_LEN);
+	kvm_run->instruction_length = vmcs_cache_readl(vcpu, VMCS_CACHE_EXIT_INSTRUCTION_LEN);
 	if (exit_reason < kvm_vmx_max_exit_handlers
 	    && kvm_vmx_exit_handlers[exit_reason]) {
+		rdtscll(start);
 		r = kvm_vmx_exit_handlers[exit_reason](vcpu, kvm_run);
+		rdtscll(end);
+		vmx_account_exit(vcpu, exit_reason, end - start);
 		FUNCTION_EXIT();		
 		return r;		
 	} else {		
+		vmx_account_exit(vcpu, exit_reason, 0);
 		kvm_run->exit_reason = KVM_EXIT_UNKNOWN;
 		kvm_run->hw.hardware_exit_reason = exit_reason;
 	}	
@@ -1869,7 +2322,7 @@ static int dm_request_for_irq_injection(struct kvm_vcpu *vcpu,
 	return (!vcpu->irq_summary &&
 		kvm_run->request_interrupt_window &&
 		vcpu->interrupt_window_open &&
-		(vmcs_readl(GUEST_RFLAGS) & X86_EFLAGS_IF));
+		(vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RFLAGS) & X86_EFLAGS_IF));
 }
 
 extern int vm_entry_test(struct kvm_vcpu *vcpu);
@@ -1885,6 +2338,14 @@ int vmx_vcpu_run(struct kvm_vcpu *vcpu, struct kvm_run *kvm_run)
 	FUNCTION_ENTER();	
 
 again:
+	/* a halted vcpu of the in-kernel irqchip, let user space run too */
+	if (vcpu->mp_state != VCPU_MP_STATE_RUNNABLE &&
+	    !kvm_vcpu_block(vcpu)) {
+		post_kvm_run_save(vcpu, kvm_run);
+		FUNCTION_EXIT();
+		return -EINTR;
+	}
+
 	/*
 	 * Set host fs and gs selectors.  Unfortunately, 22.2.3 does not
 	 * allow segment selectors with cpl > 0 or ti == 1.
@@ -1922,8 +2383,10 @@ again:
 	if (vcpu->guest_debug.enabled)
 		kvm_guest_debug_pre(vcpu);
 	
-	fx_save(vcpu->host_fx_image);
-	fx_restore(vcpu->guest_fx_image);
+	if (vcpu->fpu_active) {
+		fx_save(vcpu->host_fx_image);
+		fx_restore(vcpu->guest_fx_image);
+	}
 
 	save_msrs(vcpu->host_msrs, vcpu->nmsrs);
 	load_msrs(vcpu->guest_msrs, NR_BAD_MSRS);	
@@ -1935,6 +2398,19 @@ again:
 	vmcs_writel(HOST_CR4, read_cr4());  /* 22.2.3, 22.2.5 */
 	vmcs_writel(HOST_CR3, read_cr3());  /* 22.2.3  FIXME: shadow tables */	
 #endif	
+
+	vmcs_cache_flush(vcpu);
+	WINKVM_TRACE(WINKVM_TRC_VMENTRY, vcpu - vcpu->kvm->vcpus, 0, 0, 0);
+
+	/* see kvm_flush_remote_tlbs() */
+	local_irq_disable();
+	vcpu->guest_mode = 1;
+	smp_mb();
+	if (vcpu->remote_tlb_flush) {
+		vcpu->remote_tlb_flush = 0;
+		if (vcpu->mmu.tdp)
+			ept_sync_context(vcpu);
+	}
 	
 	asm (
 		/* Store host registers */
@@ -2066,6 +2542,11 @@ again:
 		[cr2]"i"(offsetof(struct kvm_vcpu, cr2))
 	      : "cc", "memory" );	
 
+	vcpu->guest_mode = 0;
+	local_irq_enable();
+
+	vmcs_cache_exit(vcpu);
+
 #undef __WINKVM__	
 #ifdef __WINKVM__
 	printk(KERN_ALERT "return to guest OS\n");
@@ -2075,7 +2556,7 @@ again:
 	printk("cr2 = 0x%lx\n", vcpu->cr2);
 	printk("cr3 = 0x%lx\n", vmcs_readl(GUEST_CR3));
 	printk("cr4 = 0x%lx\n", vmcs_readl(GUEST_CR4));
-	printk("rip = 0x%lx\n", vmcs_readl(GUEST_RIP));
+	printk("rip = 0x%lx\n", vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RIP));
 	printk("***********************************************************\n");
 
 #define REG_DUMP(reg)													\
@@ -2116,15 +2597,28 @@ again:
 
 		reload_tss();
 	}
-	++kvm_stat.exits;
+	++vcpu->stat.exits;
 
 	save_msrs(vcpu->guest_msrs, NR_BAD_MSRS);	
 	load_msrs(vcpu->host_msrs, NR_BAD_MSRS);	
 
-	fx_save(vcpu->guest_fx_image);
-	fx_restore(vcpu->host_fx_image);
+	if (vcpu->fpu_active) {
+		fx_save(vcpu->guest_fx_image);
+		fx_restore(vcpu->host_fx_image);
+	}
 	vcpu->interrupt_window_open = (vmcs_read32(GUEST_INTERRUPTIBILITY_INFO) & 3) == 0;	
 
+	/* the guest loads cr3 without exiting under ept */
+	if (vcpu->mmu.tdp) {
+		vcpu->cr3 = vmcs_readl(GUEST_CR3);
+		if (is_pae(vcpu) && !is_long_mode(vcpu)) {
+			vcpu->pdptrs[0] = vmcs_read64(GUEST_PDPTR0);
+			vcpu->pdptrs[1] = vmcs_read64(GUEST_PDPTR1);
+			vcpu->pdptrs[2] = vmcs_read64(GUEST_PDPTR2);
+			vcpu->pdptrs[3] = vmcs_read64(GUEST_PDPTR3);
+		}
+	}
+
 #ifndef __WINKVM__
 	asm ("mov %0, %%ds; mov %0, %%es" : : "r"(__USER_DS));
 #else
@@ -2144,7 +2638,7 @@ again:
 		 */		
 #ifndef __WINKVM__
 		if (unlikely(prof_on == KVM_PROFILING))
-			profile_hit(KVM_PROFILING, (void *)vmcs_readl(GUEST_RIP));		
+			profile_hit(KVM_PROFILING, (void *)vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RIP));		
 #endif		
 		
 		vcpu->launched = 1;
@@ -2155,14 +2649,14 @@ again:
 
 /* #ifndef __WINKVM__ */
 			if (signal_pending(current)) {
-				++kvm_stat.signal_exits;
+				++vcpu->stat.signal_exits;
 				post_kvm_run_save(vcpu, kvm_run);
 				FUNCTION_EXIT();				
 				return -EINTR;
 			}
 /* #endif			 */			
 			if (dm_request_for_irq_injection(vcpu, kvm_run)) {
-				++kvm_stat.request_irq_exits;
+				++vcpu->stat.request_irq_exits;
 				post_kvm_run_save(vcpu, kvm_run);
 				FUNCTION_EXIT();				
 				return -EINTR;				
@@ -2180,21 +2674,25 @@ again:
 
 static void vmx_flush_tlb(struct kvm_vcpu *vcpu)
 {
-	vmcs_writel(GUEST_CR3, vmcs_readl(GUEST_CR3));	
+	if (vcpu->mmu.tdp) {
+		ept_sync_context(vcpu);
+		kvm_flush_remote_tlbs(vcpu);
+	} else
+		vmcs_writel(GUEST_CR3, vmcs_readl(GUEST_CR3));	
 }
 
 static void vmx_inject_page_fault(struct kvm_vcpu *vcpu,
 								  unsigned long addr,
 								  u32 err_code)	
 {
-	u32 vect_info = vmcs_read32(IDT_VECTORING_INFO_FIELD);
+	u32 vect_info = vmcs_cache_readl(vcpu, VMCS_CACHE_IDT_VECTORING_INFO);
 
-	++kvm_stat.pf_guest;
+	++vcpu->stat.pf_guest;
 
 	if (is_page_fault(vect_info)) {
 		printk(KERN_DEBUG "inject_page_fault: "
 		       "double fault 0x%lx @ 0x%lx\n",
-		       addr, vmcs_readl(GUEST_RIP));
+		       addr, vmcs_cache_readl(vcpu, VMCS_CACHE_GUEST_RIP));
 		vmcs_write32(VM_ENTRY_EXCEPTION_ERROR_CODE, 0);
 		vmcs_write32(VM_ENTRY_INTR_INFO_FIELD,
 			     DF_VECTOR |
@@ -2291,6 +2789,7 @@ static struct kvm_arch_ops vmx_arch_ops = {
 	.set_cr0 = vmx_set_cr0,
 	.set_cr0_no_modeswitch = vmx_set_cr0_no_modeswitch,
 	.set_cr3 = vmx_set_cr3,
+	.set_tdp = vmx_set_tdp,
 	.set_cr4 = vmx_set_cr4,
 #ifdef CONFIG_X86_64
 	.set_efer = vmx_set_efer,
@@ -32,6 +32,8 @@
 #define CPU_BASED_MWAIT_EXITING         0x00000400
 #define CPU_BASED_RDPMC_EXITING         0x00000800
 #define CPU_BASED_RDTSC_EXITING         0x00001000
+#define CPU_BASED_CR3_LOAD_EXITING      0x00008000
+#define CPU_BASED_CR3_STORE_EXITING     0x00010000
 #define CPU_BASED_CR8_LOAD_EXITING      0x00080000
 #define CPU_BASED_CR8_STORE_EXITING     0x00100000
 #define CPU_BASED_TPR_SHADOW            0x00200000
@@ -41,6 +43,9 @@
 #define CPU_BASED_MSR_BITMAPS           0x10000000
 #define CPU_BASED_MONITOR_EXITING       0x20000000
 #define CPU_BASED_PAUSE_EXITING         0x40000000
+#define CPU_BASED_ACTIVATE_SECONDARY_CONTROLS 0x80000000
+
+#define SECONDARY_EXEC_ENABLE_EPT       0x00000002
 
 #define PIN_BASED_EXT_INTR_MASK 0x1
 #define PIN_BASED_NMI_EXITING   0x8
@@ -82,10 +87,22 @@ enum vmcs_field {
 	TSC_OFFSET_HIGH                 = 0x00002011,
 	VIRTUAL_APIC_PAGE_ADDR          = 0x00002012,
 	VIRTUAL_APIC_PAGE_ADDR_HIGH     = 0x00002013,
+	EPT_POINTER                     = 0x0000201a,
+	EPT_POINTER_HIGH                = 0x0000201b,
+	GUEST_PHYSICAL_ADDRESS          = 0x00002400,
+	GUEST_PHYSICAL_ADDRESS_HIGH     = 0x00002401,
 	VMCS_LINK_POINTER               = 0x00002800,
 	VMCS_LINK_POINTER_HIGH          = 0x00002801,
 	GUEST_IA32_DEBUGCTL             = 0x00002802,
 	GUEST_IA32_DEBUGCTL_HIGH        = 0x00002803,
+	GUEST_PDPTR0                    = 0x0000280a,
+	GUEST_PDPTR0_HIGH               = 0x0000280b,
+	GUEST_PDPTR1                    = 0x0000280c,
+	GUEST_PDPTR1_HIGH               = 0x0000280d,
+	GUEST_PDPTR2                    = 0x0000280e,
+	GUEST_PDPTR2_HIGH               = 0x0000280f,
+	GUEST_PDPTR3                    = 0x00002810,
+	GUEST_PDPTR3_HIGH               = 0x00002811,
 	PIN_BASED_VM_EXEC_CONTROL       = 0x00004000,
 	CPU_BASED_VM_EXEC_CONTROL       = 0x00004002,
 	EXCEPTION_BITMAP                = 0x00004004,
@@ -206,6 +223,17 @@ enum vmcs_field {
 #define EXIT_REASON_MSR_READ            31
 #define EXIT_REASON_MSR_WRITE           32
 #define EXIT_REASON_MWAIT_INSTRUCTION   36
+#define EXIT_REASON_EPT_VIOLATION       48
+#define EXIT_REASON_EPT_MISCONFIG       49
+
+/*
+ * Exit Qualifications for EPT Violations
+ */
+#define EPT_VIOLATION_READ              (1 << 0)
+#define EPT_VIOLATION_WRITE             (1 << 1)
+#define EPT_VIOLATION_FETCH             (1 << 2)
+#define EPT_VIOLATION_READABLE          (1 << 3)  /* the gpa was mapped */
+#define EPT_VIOLATION_GLA_VALID         (1 << 7)
 
 /*
  * Interruption-information format
@@ -293,5 +321,22 @@ enum vmcs_field {
 #define MSR_IA32_VMX_PROCBASED_CTLS		0x482
 #define MSR_IA32_VMX_EXIT_CTLS		0x483
 #define MSR_IA32_VMX_ENTRY_CTLS		0x484
+#define MSR_IA32_VMX_PROCBASED_CTLS2	0x48b
+#define MSR_IA32_VMX_EPT_VPID_CAP	0x48c
+
+/* MSR_IA32_VMX_EPT_VPID_CAP */
+#define VMX_EPT_PAGE_WALK_4_BIT		(1ull << 6)
+#define VMX_EPT_MEMTYPE_WB_BIT		(1ull << 14)
+#define VMX_EPT_INVEPT_BIT		(1ull << 20)
+#define VMX_EPT_SINGLE_CONTEXT_BIT	(1ull << 25)
+#define VMX_EPT_GLOBAL_CONTEXT_BIT	(1ull << 26)
+
+/* eptp: write back paging structures, 4 level walk */
+#define VMX_EPT_DEFAULT_MT		6ull
+#define VMX_EPT_DEFAULT_GAW		3ull
+#define VMX_EPT_GAW_EPTP_SHIFT		3
+
+#define VMX_EPT_EXTENT_CONTEXT		1
+#define VMX_EPT_EXTENT_GLOBAL		2
 
 #endif
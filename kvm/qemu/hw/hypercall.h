@@ -42,4 +42,14 @@
 
 #define HP_MEM_SIZE    0xE0
 
+// Memory balloon, Qumranet device id 0x2259. HCR and HSR as above.
+#define HB_DEVICE_ID    0x2259
+#define HBR_TARGET      0x08  // pages the host wants in the balloon RD
+#define HBR_ACTUAL      0x0c  // pages the host has in the balloon RD
+#define HBR_INFLATE     0x10  // pfn the guest gave up WR
+#define HBR_DEFLATE     0x14  // pfn the guest took back WR
+
+// Bits in HSR_REGISTER for the balloon
+#define HSR_BTC		0x02  // balloon target changed
+
 
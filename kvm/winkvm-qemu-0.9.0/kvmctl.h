@@ -66,9 +66,18 @@ struct kvm_callbacks {
     int (__cdecl *halt)(void *opaque, int vcpu);
     int (__cdecl *shutdown)(void *opaque, int vcpu);
     int (__cdecl *io_window)(void *opaque);
-    int (__cdecl *try_push_interrupts)(void *opaque);
-    void (__cdecl *post_kvm_run)(void *opaque, struct kvm_run *kvm_run);
-    void (__cdecl *pre_kvm_run)(void *opaque, struct kvm_run *kvm_run);
+    int (__cdecl *try_push_interrupts)(void *opaque, int vcpu);
+    void (__cdecl *post_kvm_run)(void *opaque, int vcpu, struct kvm_run *kvm_run);
+    void (__cdecl *pre_kvm_run)(void *opaque, int vcpu, struct kvm_run *kvm_run);
+	/*!
+	 * \brief Called once for a batch of string I/O (rep ins/outs)
+	 *
+	 * \a data holds \a count elements of \a size bytes. For \a in the
+	 * callback fills it, otherwise it holds the data the guest writes.
+	 * May be NULL, then inb/inw/... are called once per element.
+	 */
+    int (__cdecl *pio_string)(void *opaque, uint16_t addr, int size,
+							  int count, void *data, int in);
 };
 
 #pragma pack()
@@ -116,6 +125,147 @@ int __cdecl kvm_create(kvm_context_t kvm,
 		       unsigned long phys_mem_bytes,
 		       void **phys_mem);
 
+/*!
+ * \brief Create an additional VCPU
+ *
+ * kvm_create() creates VCPU 0. Call this for each further VCPU of an SMP
+ * guest. Each VCPU gets its own device handle, so kvm_run() may be called
+ * for different VCPUs from different threads at the same time.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param slot VCPU number, 0 <= slot < 8
+ * \return 0 on success
+ */
+int __cdecl kvm_create_vcpu(kvm_context_t kvm, int slot);
+
+/*!
+ * \brief Set the size of the shadow page table pool
+ *
+ * Must be called before kvm_create(). The pool is shared by all VCPUs of
+ * the VM. By default it is sized from the guest memory.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param n_mmu_pages Number of shadow pages, 0 for the default
+ */
+void __cdecl kvm_set_mmu_pages(kvm_context_t kvm, unsigned int n_mmu_pages);
+
+/*!
+ * \brief Allocate guest memory when it is first touched
+ *
+ * Must be called before kvm_create(). Guest memory is then ordinary
+ * pageable memory of the process, and the driver locks it in 2MB chunks
+ * as the guest touches them, instead of pinning all of it up front.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param enable Non-zero to allocate guest memory on demand
+ */
+void __cdecl kvm_set_demand_paging(kvm_context_t kvm, int enable);
+
+/*!
+ * \brief Read the shadow page table pool statistics
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param pool Pool size, free pages and zap counters are returned here
+ * \return 0 on success
+ */
+int __cdecl kvm_get_mmu_pool(kvm_context_t kvm, struct winkvm_mmu_pool *pool);
+
+/*!
+ * \brief Read the exit counters of a vcpu
+ *
+ * The exit[] array is indexed by the VMX exit reason and holds a
+ * histogram of the TSC cycles spent in the handler of each reason.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param vcpu Which virtual CPU, or -1 for the sum over the VM
+ * \param stat The counters are returned here
+ * \return 0 on success
+ */
+int __cdecl kvm_get_stats(kvm_context_t kvm, int vcpu,
+						  struct winkvm_vcpu_stat *stat);
+
+/*!
+ * \brief Drain the trace ring of a host cpu
+ *
+ * Returns up to WINKVM_TRACE_BATCH records in trace->rec[]; call again
+ * while trace->nr is non-zero.  Fails unless the driver was built with
+ * CONFIG_WINKVM_TRACE.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param cpu Host cpu number
+ * \param trace The records and the count of lost ones are returned here
+ * \return 0 on success
+ */
+int __cdecl kvm_get_trace(kvm_context_t kvm, int cpu,
+						  struct winkvm_trace *trace);
+
+/*!
+ * \brief Coalesce MMIO writes to a guest physical range
+ *
+ * Writes to the range no longer exit; the driver queues them and they are
+ * replayed through the write callbacks by kvm_flush_coalesced_mmio().
+ * Only for devices whose writes need no immediate side effect, like a
+ * framebuffer.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param addr Guest physical start address
+ * \param size Length of the range in bytes
+ * \return 0 on success
+ */
+int __cdecl kvm_register_coalesced_mmio(kvm_context_t kvm, uint64_t addr,
+									   uint32_t size);
+
+/*!
+ * \brief Stop coalescing every range inside [addr, addr + size)
+ */
+int __cdecl kvm_unregister_coalesced_mmio(kvm_context_t kvm, uint64_t addr,
+										 uint32_t size);
+
+/*!
+ * \brief Replay the queued coalesced MMIO writes of all VCPUs
+ *
+ * kvm_run() does this before handling each exit. Call it also before
+ * looking at the state of a coalesced device, e.g. on a display refresh.
+ */
+void __cdecl kvm_flush_coalesced_mmio(kvm_context_t kvm);
+
+/*!
+ * \brief Emulate the PIC, PIT and local APICs in the driver
+ *
+ * Timer interrupts, EOIs and IPIs are then handled without leaving the
+ * driver, and kvm_run() stops pushing interrupts through the callbacks.
+ * Called again on a created irqchip, it resets it (for a system reset).
+ * The I/O APIC stays in user space, see kvm_apic_deliver().
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \return 0 on success
+ */
+int __cdecl kvm_create_irqchip(kvm_context_t kvm);
+
+/*!
+ * \brief Is the in-kernel irqchip in use
+ */
+int __cdecl kvm_irqchip_in_kernel(kvm_context_t kvm);
+
+/*!
+ * \brief Set the level of an input pin of the in-kernel PICs
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param irq Pin, 0 to 15
+ * \param level 0 or 1
+ * \return 0 on success
+ */
+int __cdecl kvm_set_irq_level(kvm_context_t kvm, int irq, int level);
+
+/*!
+ * \brief Send an interrupt message of the I/O APIC to the local APICs
+ *
+ * \return 0 on success
+ */
+int __cdecl kvm_apic_deliver(kvm_context_t kvm, uint8_t dest, uint8_t dest_mode,
+							 uint8_t delivery_mode, uint8_t vector,
+							 uint8_t trig_mode);
+
 /*!
  * \brief Start the VCPU
  *
@@ -261,6 +411,23 @@ void __cdecl kvm_destroy_phys_mem(kvm_context_t kvm, unsigned long phys_start,
 
 int __cdecl kvm_get_dirty_pages(kvm_context_t kvm, int slot, void *buf);
 
+/*!
+ * \brief Pass on the pages the VCPUs dirtied since the last call
+ *
+ * Reads the dirty gfn ring of every VCPU and calls \a dirty for each
+ * entry, then has the driver write protect those pages again. Unlike
+ * kvm_get_dirty_pages(), pages nobody wrote are not touched.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param dirty Called with each dirty guest frame number
+ * \param opaque Passed to \a dirty
+ * \return 0 on success, 1 if a ring ran full and the rest of the dirty
+ * pages has to be read with kvm_get_dirty_pages(), -1 on error
+ */
+int __cdecl kvm_harvest_dirty_rings(kvm_context_t kvm,
+									void (__cdecl *dirty)(void *opaque, uint64_t gfn),
+									void *opaque);
+
 /*!
  * \brief get a bitmap of guest ram pages which are allocated to the guest.
  *
@@ -305,6 +472,71 @@ int __cdecl winkvm_cpu_inl(void *env, int addr);
 int _cdecl test_write_guest(kvm_context_t kvm, unsigned long addr,
 			    unsigned long size, void *data);
 
+/*!
+ * \brief Translate a guest virtual address
+ *
+ * Translations are cached per vcpu until the driver reports, through
+ * kvm_run::tlb_gen, that the guest may have changed them.  Call it from
+ * the thread that runs the vcpu, or while the vcpu is stopped.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param vcpu Which virtual CPU's page tables to use
+ * \param gva Guest virtual address
+ * \param gpa The guest physical address is returned here
+ * \return 0 on success, -1 if gva is not mapped
+ */
+int __cdecl kvm_translate_gva(kvm_context_t kvm, int vcpu, unsigned long gva,
+			      uint64_t *gpa);
+
+/*!
+ * \brief Where guest physical memory is mapped in this process
+ *
+ * \return NULL if gpa is not in guest ram
+ */
+void * __cdecl kvm_gpa_to_hva(kvm_context_t kvm, uint64_t gpa);
+
+/*!
+ * \brief Tell the dirty log about frames written through kvm_gpa_to_hva()
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param gfns Guest frame numbers
+ * \param n Number of frames
+ * \return 0 on success
+ */
+int __cdecl kvm_mark_dirty(kvm_context_t kvm, const uint32_t *gfns, int n);
+
+/*!
+ * \brief Pass on frames the guest balloon gave up or took back
+ *
+ * Frames given up are unmapped from the guest. With
+ * kvm_set_demand_paging(), every 2MB chunk of guest memory that is
+ * wholly in the balloon also goes back to the host. The guest must not
+ * touch a frame it gave up before taking it back.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param gfns Guest frame numbers
+ * \param n Number of frames
+ * \param deflate Non-zero if the guest takes the frames back
+ * \param ballooned If not NULL, the pages now in the balloon are returned here
+ * \return 0 on success
+ */
+int __cdecl kvm_balloon(kvm_context_t kvm, const uint32_t *gfns, int n,
+						int deflate, uint32_t *ballooned);
+
+/*!
+ * \brief Copy from or to guest virtual memory without a driver round trip
+ *
+ * Writes mark the frames they touch dirty in one batch.
+ *
+ * \return The number of bytes copied, short at the first unmapped page
+ */
+unsigned long __cdecl kvm_read_guest_virt(kvm_context_t kvm, int vcpu,
+					  unsigned long gva, unsigned long size,
+					  void *dest);
+unsigned long __cdecl kvm_write_guest_virt(kvm_context_t kvm, int vcpu,
+					   unsigned long gva, unsigned long size,
+					   const void *data);
+
 int __cdecl winkvm_read_guest(kvm_context_t kvm, unsigned long addr,
 			      unsigned long size, void *dest);
 
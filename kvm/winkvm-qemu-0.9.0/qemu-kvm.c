@@ -429,7 +429,7 @@ static void save_regs(CPUState *env)
 #include <signal.h>
 
 
-static int try_push_interrupts(void *opaque)
+static int try_push_interrupts(void *opaque, int vcpu)
 {
     CPUState **envs = opaque, *env;
     env = envs[0];
@@ -445,7 +445,7 @@ static int try_push_interrupts(void *opaque)
     return (env->interrupt_request & CPU_INTERRUPT_HARD) != 0;
 }
 
-static void post_kvm_run(void *opaque, struct kvm_run *kvm_run)
+static void post_kvm_run(void *opaque, int vcpu, struct kvm_run *kvm_run)
 {
     CPUState **envs = opaque, *env;
     env = envs[0];
@@ -456,7 +456,7 @@ static void post_kvm_run(void *opaque, struct kvm_run *kvm_run)
     cpu_set_apic_base(env, kvm_run->apic_base);
 }
 
-static void pre_kvm_run(void *opaque, struct kvm_run *kvm_run)
+static void pre_kvm_run(void *opaque, int vcpu, struct kvm_run *kvm_run)
 {
     CPUState **envs = opaque, *env;
     env = envs[0];
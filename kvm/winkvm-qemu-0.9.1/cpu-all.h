@@ -891,6 +891,13 @@ static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+void cpu_physical_memory_set_dirty_bitmap(ram_addr_t start,
+                                          const unsigned long *bitmap,
+                                          unsigned long nr_pages,
+                                          int dirty_flags);
+unsigned long cpu_physical_memory_count_dirty(ram_addr_t start,
+                                              ram_addr_t end,
+                                              int dirty_flags);
 void cpu_tlb_update_dirty(CPUState *env);
 
 int cpu_physical_memory_set_dirty_tracking(int enable);
@@ -32,6 +32,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <inttypes.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "cpu.h"
 #include "exec-all.h"
@@ -1235,6 +1238,10 @@ void cpu_interrupt(CPUState *env, int mask)
         tb_reset_jump_recursive(tb);
         interrupt_lock = 0;
     }
+#ifdef USE_KVM
+    if (kvm_allowed)
+        kvm_vcpu_kick(env);
+#endif
 }
 
 void cpu_reset_interrupt(CPUState *env, int mask)
@@ -1570,6 +1577,102 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
 #endif
 }
 
+/* 0x01 in byte i for bit i of b */
+static inline uint64_t dirty_spread_bits(unsigned int b)
+{
+    uint64_t x = b;
+
+    x = (x | (x << 28)) & 0x0000000f0000000fULL;
+    x = (x | (x << 14)) & 0x0003000300030003ULL;
+    x = (x | (x << 7)) & 0x0101010101010101ULL;
+    return x;
+}
+
+/* OR a bitmap of nr_pages pages from start into their dirty flags. Clear
+   words are skipped with one compare, each byte of the others sets eight
+   pages with one 64 bit OR. */
+void cpu_physical_memory_set_dirty_bitmap(ram_addr_t start,
+                                          const unsigned long *bitmap,
+                                          unsigned long nr_pages,
+                                          int dirty_flags)
+{
+    unsigned long i, j, w, page, total;
+    uint64_t *p;
+
+    page = start >> TARGET_PAGE_BITS;
+    total = phys_ram_size >> TARGET_PAGE_BITS;
+    if (page >= total)
+        return;
+    if (nr_pages > total - page)
+        nr_pages = total - page;
+
+    for (i = 0; i * HOST_LONG_BITS < nr_pages; i++, page += HOST_LONG_BITS) {
+        w = bitmap[i];
+        if (!w)
+            continue;
+        if (nr_pages - i * HOST_LONG_BITS < HOST_LONG_BITS)
+            w &= (1UL << (nr_pages - i * HOST_LONG_BITS)) - 1;
+        for (j = 0; w; j += 8, w >>= 8) {
+            if (!(w & 0xff))
+                continue;
+            if (page + j + 8 <= total) {
+                p = (uint64_t *)(phys_ram_dirty + page + j);
+                *p |= dirty_spread_bits(w & 0xff) * (uint8_t)dirty_flags;
+            } else {
+                int k;
+                for (k = 0; k < 8; k++)
+                    if (w & (1 << k))
+                        phys_ram_dirty[page + j + k] |= dirty_flags;
+            }
+        }
+    }
+}
+
+/* number of pages in [start, end) with one of dirty_flags set */
+unsigned long cpu_physical_memory_count_dirty(ram_addr_t start,
+                                              ram_addr_t end,
+                                              int dirty_flags)
+{
+    uint8_t *p, *e;
+    uint64_t v, mask = 0x0101010101010101ULL * (uint8_t)dirty_flags;
+    unsigned long n = 0;
+
+    p = phys_ram_dirty + (start >> TARGET_PAGE_BITS);
+    e = phys_ram_dirty + (TARGET_PAGE_ALIGN(end) >> TARGET_PAGE_BITS);
+
+#ifdef __SSE2__
+    {
+        __m128i m = _mm_set1_epi8((char)dirty_flags);
+        __m128i zero = _mm_setzero_si128();
+        __m128i one = _mm_set1_epi8(1);
+        __m128i x, s;
+
+        for (; p + 16 <= e; p += 16) {
+            x = _mm_and_si128(_mm_loadu_si128((__m128i *)p), m);
+            /* 1 in each byte whose page has a flag set, summed */
+            x = _mm_andnot_si128(_mm_cmpeq_epi8(x, zero), one);
+            s = _mm_sad_epu8(x, zero);
+            n += _mm_cvtsi128_si32(s) + _mm_extract_epi16(s, 4);
+        }
+    }
+#endif
+    for (; p + 8 <= e; p += 8) {
+        v = *(uint64_t *)p & mask;
+        if (!v)
+            continue;
+        /* fold each byte onto its low bit, then add up the bytes */
+        v |= v >> 4;
+        v |= v >> 2;
+        v |= v >> 1;
+        v &= 0x0101010101010101ULL;
+        n += (v * 0x0101010101010101ULL) >> 56;
+    }
+    for (; p < e; p++)
+        if (*p & dirty_flags)
+            n++;
+    return n;
+}
+
 int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int r=0;
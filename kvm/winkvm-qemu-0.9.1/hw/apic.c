@@ -20,6 +20,11 @@
 #include "hw.h"
 #include "pc.h"
 #include "qemu-timer.h"
+#ifdef USE_KVM
+#include "qemu-kvm.h"
+extern int kvm_allowed;
+extern kvm_context_t kvm_context;
+#endif
 
 //#define DEBUG_APIC
 //#define DEBUG_IOAPIC
@@ -412,6 +417,10 @@ static void apic_startup(APICState *s, int vector_num)
     cpu_x86_load_seg_cache(env, R_CS, vector_num << 8, vector_num << 12,
                            0xffff, 0);
     env->hflags &= ~HF_HALTED_MASK;
+#ifdef USE_KVM
+    if (kvm_allowed)
+        kvm_load_registers(env);
+#endif
 }
 
 static void apic_deliver(APICState *s, uint8_t dest, uint8_t dest_mode,
@@ -899,6 +908,14 @@ static void ioapic_service(IOAPICState *s)
                 polarity = (entry >> 13) & 1;
                 if (trig_mode == APIC_TRIGGER_EDGE)
                     s->irr &= ~mask;
+                /* ExtINT is LINT0 of the driver's bsp, not a message */
+                if (kvm_irqchip) {
+                    if (delivery_mode != APIC_DM_EXTINT)
+                        kvm_apic_deliver(kvm_context, dest, dest_mode,
+                                         delivery_mode, entry & 0xff,
+                                         trig_mode);
+                    continue;
+                }
                 if (delivery_mode == APIC_DM_EXTINT)
                     vector = pic_read_irq(isa_pic);
                 else
@@ -0,0 +1,263 @@
+/*
+ * QEMU-KVM memory balloon on the hypercall PCI transport
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The host sets a target, the guest driver gets HSR_BTC and writes the
+ * pfns it gave up to HBR_INFLATE (or took back to HBR_DEFLATE). They are
+ * handed to the WinKVM driver in batches. It unmaps every pfn given up
+ * from the shadow MMU. With demand paging it also releases the host pages
+ * of each 2MB chunk that is wholly ballooned; other VMs only count the
+ * pages. A deflated pfn refaults on its next guest access.
+ */
+
+#include "hw.h"
+#include "pc.h"
+#include "pci.h"
+#include "sysemu.h"
+#include "console.h"
+#include "hypercall.h"
+
+#ifdef USE_KVM
+#include "qemu-kvm.h"
+extern kvm_context_t kvm_context;
+extern int kvm_allowed;
+#endif
+
+//#define BALLOON_DEBUG 1
+
+#define BALLOON_BATCH 256
+
+typedef struct BalloonState {
+    PCIDevice dev;
+    uint32_t hcr;
+    uint32_t hsr;
+    uint32_t target;            /* pages wanted in the balloon */
+    uint32_t actual;            /* pages in the balloon */
+    uint32_t npages;            /* guest pages */
+    uint8_t *bitmap;            /* pfns in the balloon */
+    uint32_t batch[BALLOON_BATCH];
+    int nbatch;
+    int deflate;
+} BalloonState;
+
+static BalloonState *balloon_state;
+
+static void balloon_update_irq(BalloonState *s)
+{
+    qemu_set_irq(s->dev.irq[0], !(s->hcr & HCR_DI) && (s->hsr & HSR_BTC));
+}
+
+static void balloon_flush(BalloonState *s)
+{
+    uint32_t ballooned = s->actual;
+
+    if (s->nbatch == 0)
+        return;
+
+#ifdef BALLOON_DEBUG
+    printf("%s: %s %d pfns\n", __FUNCTION__,
+           s->deflate ? "deflate" : "inflate", s->nbatch);
+#endif
+
+#ifdef USE_KVM
+    if (kvm_allowed) {
+        if (kvm_balloon(kvm_context, s->batch, s->nbatch, s->deflate,
+                        &ballooned) < 0)
+            fprintf(stderr, "balloon: kvm_balloon failed\n");
+        s->actual = ballooned;
+    }
+#endif
+    s->nbatch = 0;
+}
+
+static void balloon_add(BalloonState *s, uint32_t pfn, int deflate)
+{
+    int in;
+
+    if (pfn >= s->npages) {
+        printf("balloon: pfn 0x%x is not guest memory\n", pfn);
+        return;
+    }
+
+    in = (s->bitmap[pfn >> 3] >> (pfn & 7)) & 1;
+    if (in != deflate)
+        return;
+    if (deflate) {
+        s->bitmap[pfn >> 3] &= ~(1 << (pfn & 7));
+        --s->actual;
+    } else {
+        s->bitmap[pfn >> 3] |= 1 << (pfn & 7);
+        ++s->actual;
+    }
+
+    if (s->nbatch && s->deflate != deflate)
+        balloon_flush(s);
+    s->deflate = deflate;
+    s->batch[s->nbatch++] = pfn;
+    if (s->nbatch == BALLOON_BATCH)
+        balloon_flush(s);
+}
+
+/* take every page back, the guest forgets what it gave up on reset */
+static void balloon_reset(void *opaque)
+{
+    BalloonState *s = opaque;
+    uint32_t pfn;
+
+    balloon_flush(s);
+    for (pfn = 0; pfn < s->npages; pfn++) {
+        if (s->bitmap[pfn >> 3] & (1 << (pfn & 7)))
+            balloon_add(s, pfn, 1);
+    }
+    balloon_flush(s);
+
+    s->hcr = HCR_DI;
+    s->hsr = 0;
+    s->target = 0;
+    s->actual = 0;
+    balloon_update_irq(s);
+}
+
+static void balloon_ioport_write(void *opaque, uint32_t addr, uint32_t val)
+{
+    BalloonState *s = opaque;
+
+#ifdef BALLOON_DEBUG
+    printf("%s: addr=0x%x, val=0x%x\n", __FUNCTION__, addr, val);
+#endif
+    addr &= 0xff;
+
+    switch (addr) {
+    case HCR_REGISTER:
+        /* the guest writes HCR when it is done with a batch */
+        balloon_flush(s);
+        s->hcr = val & (HCR_DI | HCR_EI);
+        balloon_update_irq(s);
+        break;
+    case HBR_INFLATE:
+        balloon_add(s, val, 0);
+        break;
+    case HBR_DEFLATE:
+        balloon_add(s, val, 1);
+        break;
+    default:
+        printf("balloon_ioport_write to unhandled address 0x%x\n", addr);
+        break;
+    }
+}
+
+static uint32_t balloon_ioport_read(void *opaque, uint32_t addr)
+{
+    BalloonState *s = opaque;
+    uint32_t ret;
+
+    addr &= 0xff;
+
+    switch (addr) {
+    case HSR_REGISTER:
+        ret = s->hsr;
+        s->hsr &= ~HSR_BTC;
+        balloon_update_irq(s);
+        break;
+    case HBR_TARGET:
+        ret = s->target;
+        break;
+    case HBR_ACTUAL:
+        balloon_flush(s);
+        ret = s->actual;
+        break;
+    default:
+        ret = 0;
+        break;
+    }
+    return ret;
+}
+
+static void balloon_map(PCIDevice *pci_dev, int region_num,
+                        uint32_t addr, uint32_t size, int type)
+{
+    BalloonState *s = (BalloonState *)pci_dev;
+
+    /* HCR and HSR are byte wide, the pfn registers dword wide */
+    register_ioport_write(addr, 0x20, 1, balloon_ioport_write, s);
+    register_ioport_read(addr, 0x20, 1, balloon_ioport_read, s);
+    register_ioport_write(addr, 0x20, 4, balloon_ioport_write, s);
+    register_ioport_read(addr, 0x20, 4, balloon_ioport_read, s);
+}
+
+void pci_balloon_init(PCIBus *bus)
+{
+    BalloonState *s;
+    uint8_t *pci_conf;
+
+    s = (BalloonState *)pci_register_device(bus,
+                                            "Balloon", sizeof(BalloonState),
+                                            -1,
+                                            NULL, NULL);
+    pci_conf = s->dev.config;
+    pci_conf[0x00] = 0x02; /* Qumranet vendor ID 0x5002 */
+    pci_conf[0x01] = 0x50;
+    pci_conf[0x02] = HB_DEVICE_ID & 0xff;
+    pci_conf[0x03] = HB_DEVICE_ID >> 8;
+    pci_conf[0x0a] = 0x80; /* other memory controller */
+    pci_conf[0x0b] = 0x05;
+    pci_conf[0x0e] = 0x00; /* header_type */
+    pci_conf[0x3d] = 1;    /* interrupt pin 0 */
+
+    pci_register_io_region(&s->dev, 0, 0x20,
+                           PCI_ADDRESS_SPACE_IO, balloon_map);
+
+    s->npages = ram_size >> TARGET_PAGE_BITS;
+    s->bitmap = qemu_mallocz((s->npages + 7) / 8);
+    s->hcr = HCR_DI;
+    balloon_state = s;
+    qemu_register_reset(balloon_reset, s);
+}
+
+/* ask the guest to shrink to 'mb' MB */
+int balloon_set_target(uint32_t mb)
+{
+    BalloonState *s = balloon_state;
+    uint32_t pages = mb << (20 - TARGET_PAGE_BITS);
+
+    if (!s)
+        return -1;
+    s->target = pages < s->npages ? s->npages - pages : 0;
+    s->hsr |= HSR_BTC;
+    balloon_update_irq(s);
+    return 0;
+}
+
+void balloon_info(void)
+{
+    BalloonState *s = balloon_state;
+
+    if (!s) {
+        term_printf("no balloon device\n");
+        return;
+    }
+    balloon_flush(s);
+    term_printf("guest=%u MB target=%u MB ballooned=%u MB\n",
+                (s->npages - s->actual) >> (20 - TARGET_PAGE_BITS),
+                (s->npages - s->target) >> (20 - TARGET_PAGE_BITS),
+                s->actual >> (20 - TARGET_PAGE_BITS));
+}
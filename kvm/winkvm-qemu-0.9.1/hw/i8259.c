@@ -25,6 +25,9 @@
 #include "pc.h"
 #include "isa.h"
 #include "console.h"
+#include "qemu-kvm.h"
+
+extern kvm_context_t kvm_context;
 
 /* debug PIC */
 //#define DEBUG_PIC
@@ -199,6 +202,13 @@ static void i8259_set_irq(void *opaque, int irq, int level)
         irq_time[irq] = qemu_get_clock(vm_clock);
     }
 #endif
+    /* the pics in the driver take the irq, this one stays idle */
+    if (kvm_irqchip) {
+        kvm_set_irq_level(kvm_context, irq, level);
+        if (s->alt_irq_func)
+            s->alt_irq_func(s->alt_irq_opaque, irq, level);
+        return;
+    }
     pic_set_irq1(&s->pics[irq >> 3], irq & 7, level);
     /* used for IOAPIC irqs */
     if (s->alt_irq_func)
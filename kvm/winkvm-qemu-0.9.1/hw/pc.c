@@ -959,8 +959,11 @@ static void pc_init1(int ram_size, int vga_ram_size,
     if (pci_enabled) {
         ioapic = ioapic_init();
     }
-    pit = pit_init(0x40, i8259[0]);
-    pcspk_init(pit);
+    /* the driver has its own pit, with port 0x61 */
+    if (!kvm_irqchip) {
+        pit = pit_init(0x40, i8259[0]);
+        pcspk_init(pit);
+    }
     if (pci_enabled) {
         pic_set_alt_irq_func(isa_pic, ioapic_set_irq, ioapic);
     }
@@ -1056,6 +1059,12 @@ static void pc_init1(int ram_size, int vga_ram_size,
         }
     }
 
+#ifdef USE_KVM
+    if (pci_enabled && kvm_balloon_enabled) {
+        pci_balloon_init(pci_bus);
+    }
+#endif
+
     if (i440fx_state) {
         i440fx_init_memory_mappings(i440fx_state);
     }
@@ -142,4 +142,10 @@ void pci_piix4_ide_init(PCIBus *bus, BlockDriverState **hd_table, int devfn,
 
 void isa_ne2000_init(int base, qemu_irq irq, NICInfo *nd);
 
+/* balloon.c */
+
+void pci_balloon_init(PCIBus *bus);
+int balloon_set_target(uint32_t mb);
+void balloon_info(void);
+
 #endif
@@ -275,22 +275,20 @@ static int migrate_write_buffer(MigrationState *s)
 
 static int migrate_check_convergence(MigrationState *s)
 {
-    target_ulong addr;
-    int dirty_count = 0;
+    unsigned long dirty_count;
 
     if ((s->iteration >= MAX_ITERATIONS) ||
         (s->rapid_writes >= MAX_RAPID_WRITES) ) {
         return 1;
     }
 
-    for (addr = 0; addr < phys_ram_size; addr += TARGET_PAGE_SIZE) {
+    dirty_count = cpu_physical_memory_count_dirty(0, phys_ram_size,
+                                                  MIGRATION_DIRTY_FLAG);
 #ifdef USE_KVM
-        if (kvm_allowed && (addr>=0xa0000) && (addr<0xc0000)) /* do not access video-addresses */
-            continue;
+    if (kvm_allowed) /* do not access video-addresses */
+        dirty_count -= cpu_physical_memory_count_dirty(0xa0000, 0xc0000,
+                                                       MIGRATION_DIRTY_FLAG);
 #endif
-	if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
-	    dirty_count++;
-    }
 
     return ((dirty_count * TARGET_PAGE_SIZE) < MIN_FINALIZE_SIZE);
 }
@@ -1125,6 +1125,12 @@ static void mem_info(void)
         }
     }
 }
+
+static void do_balloon(int mb)
+{
+    if (balloon_set_target(mb) < 0)
+        term_printf("no balloon device (use -kvm-balloon)\n");
+}
 #endif
 
 static void do_info_kqemu(void)
@@ -1337,6 +1343,10 @@ static term_cmd_t term_cmds[] = {
       "", "cancel the current VM migration" },
     { "migrate_set_speed", "s", do_migrate_set_speed,
       "value", "set maximum speed (in bytes) for migrations" },
+#if defined(TARGET_I386)
+    { "balloon", "i", do_balloon,
+      "target", "ask the guest to shrink to 'target' MB" },
+#endif
     { NULL, NULL, },
 };
 
@@ -1366,6 +1376,8 @@ static term_cmd_t info_cmds[] = {
       "", "show virtual to physical memory mappings", },
     { "mem", "", mem_info,
       "", "show the active virtual memory mappings", },
+    { "balloon", "", balloon_info,
+      "", "show the memory balloon state", },
 #endif
     { "jit", "", do_info_jit,
       "", "show dynamic compiler info", },
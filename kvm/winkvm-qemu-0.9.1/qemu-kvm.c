@@ -5,6 +5,7 @@
 #ifdef USE_KVM
 
 #include "exec.h"
+#include "sysemu.h"
 
 #include "qemu-kvm.h"
 #include "kvmctl.h"
@@ -12,6 +13,7 @@
 /* #include <stdio.h> */
 /* #include <stdlib.h> */
 #include <sys/time.h>
+#include <windows.h>
 
 #define MSR_IA32_TSC		0x10
 
@@ -31,6 +33,10 @@
 extern void perror(const char *s);
 
 int kvm_allowed = 1;
+/* pic, pit and local apics in the driver (-kvm-irqchip) */
+int kvm_irqchip = 0;
+/* balloon device, guest memory backed on demand (-kvm-balloon) */
+int kvm_balloon_enabled = 0;
 kvm_context_t kvm_context;
 /* FIXME!!: kvm_msr_list size is fixed num */
 static struct kvm_msr_list *kvm_msr_list = NULL;
@@ -41,6 +47,24 @@ static double migrate_global_t1 = 0;
 #define NR_CPU 16
 static CPUState *saved_env[NR_CPU];
 
+/*
+ * Each vcpu runs KVM_RUN on its own thread.  Everything in qemu
+ * (devices, timers, env of the other cpus) is protected by qemu_mutex,
+ * which is dropped only while a vcpu is inside the driver or while the
+ * io thread sleeps in main_loop_wait().
+ */
+static CRITICAL_SECTION qemu_mutex;
+static int kvm_vcpu_threads;
+
+struct vcpu_info {
+    CPUState *env;
+    HANDLE thread;
+    HANDLE wakeup;
+    int reload;
+};
+static struct vcpu_info vcpu_info[NR_CPU];
+static DWORD vcpu_tls = TLS_OUT_OF_INDEXES;
+
 static double gettimeofday_sec(void)
 {
   struct timeval tv;
@@ -192,8 +216,8 @@ static void load_regs(CPUState *env)
     int rc, n;
 
     /* hack: save env */
-    if (!saved_env[0])
-	saved_env[0] = env;
+    if (!saved_env[env->cpu_index])
+	saved_env[env->cpu_index] = env;
 
     regs.rax = env->regs[R_EAX];
     regs.rbx = env->regs[R_EBX];
@@ -217,7 +241,7 @@ static void load_regs(CPUState *env)
     regs.rflags = env->eflags;
     regs.rip = env->eip;
     
-    kvm_set_regs(kvm_context, 0, &regs);
+    kvm_set_regs(kvm_context, env->cpu_index, &regs);
 
     memcpy(sregs.interrupt_bitmap, env->kvm_interrupt_bitmap, sizeof(sregs.interrupt_bitmap));
 
@@ -269,7 +293,7 @@ static void load_regs(CPUState *env)
     sregs.efer = env->efer;
     sregs.cr8 = cpu_get_apic_tpr(env);
 
-    kvm_set_sregs(kvm_context, 0, &sregs);
+    kvm_set_sregs(kvm_context, env->cpu_index, &sregs);
 
     /* msrs */
     n = 0;
@@ -286,7 +310,7 @@ static void load_regs(CPUState *env)
     set_msr_entry(&msrs[n++], MSR_LSTAR  ,           env->lstar);
 #endif
 
-    rc = kvm_set_msrs(kvm_context, 0, msrs, n);
+    rc = kvm_set_msrs(kvm_context, env->cpu_index, msrs, n);
     if (rc == -1)
         perror("kvm_set_msrs FAILED");
 }
@@ -300,7 +324,7 @@ static void save_regs(CPUState *env)
     uint32_t hflags;
     uint32_t i, n, rc;	
 
-    kvm_get_regs(kvm_context, 0, &regs);
+    kvm_get_regs(kvm_context, env->cpu_index, &regs);
 
     env->regs[R_EAX] = regs.rax;
     env->regs[R_EBX] = regs.rbx;
@@ -324,7 +348,7 @@ static void save_regs(CPUState *env)
     env->eflags = regs.rflags;
     env->eip = regs.rip;
 
-    kvm_get_sregs(kvm_context, 0, &sregs);
+    kvm_get_sregs(kvm_context, env->cpu_index, &sregs);
 
     memcpy(env->kvm_interrupt_bitmap, sregs.interrupt_bitmap, sizeof(env->kvm_interrupt_bitmap));
 
@@ -413,7 +437,7 @@ static void save_regs(CPUState *env)
     msrs[n++].index = MSR_FMASK;
     msrs[n++].index = MSR_LSTAR;
 #endif
-    rc = kvm_get_msrs(kvm_context, 0, msrs, n);
+    rc = kvm_get_msrs(kvm_context, env->cpu_index, msrs, n);
     if (rc == -1) {
       perror("kvm_get_msrs FAILED");
     }
@@ -429,27 +453,31 @@ static void save_regs(CPUState *env)
 #include <signal.h>
 
 
-static int try_push_interrupts(void *opaque)
+static int try_push_interrupts(void *opaque, int vcpu)
 {
     CPUState **envs = opaque, *env;
-    env = envs[0];    
+    env = envs[vcpu];
 
     if (env->ready_for_interrupt_injection &&
         (env->interrupt_request & CPU_INTERRUPT_HARD) &&
         (env->eflags & IF_MASK)) {
             env->interrupt_request &= ~CPU_INTERRUPT_HARD;
-            // for now using cpu 0	    
 	    unsigned irq = cpu_get_pic_interrupt(env);
-            kvm_inject_irq(kvm_context, 0, irq);
+            kvm_inject_irq(kvm_context, vcpu, irq);
     }
 
     return (env->interrupt_request & CPU_INTERRUPT_HARD) != 0;
 }
 
-static void post_kvm_run(void *opaque, struct kvm_run *kvm_run)
+static void post_kvm_run(void *opaque, int vcpu, struct kvm_run *kvm_run)
 {
     CPUState **envs = opaque, *env;
-    env = envs[0];
+    env = envs[vcpu];
+
+    if (kvm_vcpu_threads) {
+        EnterCriticalSection(&qemu_mutex);
+        cpu_single_env = env;
+    }
 
     env->eflags = (kvm_run->if_flag) ? env->eflags | IF_MASK:env->eflags & ~IF_MASK;
     env->ready_for_interrupt_injection = kvm_run->ready_for_interrupt_injection;
@@ -457,16 +485,39 @@ static void post_kvm_run(void *opaque, struct kvm_run *kvm_run)
     cpu_set_apic_base(env, kvm_run->apic_base);
 }
 
-static void pre_kvm_run(void *opaque, struct kvm_run *kvm_run)
+static void pre_kvm_run(void *opaque, int vcpu, struct kvm_run *kvm_run)
 {
     CPUState **envs = opaque, *env;
-    env = envs[0];
+    env = envs[vcpu];
+
+    /* registers changed by another thread (reset, INIT/SIPI) */
+    if (vcpu_info[vcpu].reload) {
+        vcpu_info[vcpu].reload = 0;
+        load_regs(env);
+        kvm_run->emulated = 0;
+        kvm_run->mmio_completed = 0;
+    }
 
     kvm_run->cr8 = cpu_get_apic_tpr(env);
+
+    if (kvm_vcpu_threads) {
+        cpu_single_env = NULL;
+        LeaveCriticalSection(&qemu_mutex);
+    }
 }
 
 void kvm_load_registers(CPUState *env)
 {
+    /*
+     * the vcpu fd may be busy in KVM_RUN on its own thread; let that
+     * thread load the registers the next time it enters the guest.
+     */
+    if (kvm_vcpu_threads &&
+        TlsGetValue(vcpu_tls) != &vcpu_info[env->cpu_index]) {
+        vcpu_info[env->cpu_index].reload = 1;
+        kvm_vcpu_kick(env);
+        return;
+    }
     load_regs(env);
 }
 
@@ -489,10 +540,10 @@ int kvm_cpu_exec(CPUState *env)
     }
 
     
-    if (!saved_env[0])
-	saved_env[0] = env;
+    if (!saved_env[env->cpu_index])
+	saved_env[env->cpu_index] = env;
 
-    r = kvm_run(kvm_context, 0);
+    r = kvm_run(kvm_context, env->cpu_index);
     if (r < 0) {
         printf("kvm_run returned %d\n", r);
         exit(1);
@@ -521,7 +572,7 @@ static int __cdecl kvm_cpuid(void *opaque, uint64_t *rax, uint64_t *rbx,
     uint32_t eax = *rax;
 
     saved_env = env;
-    env = envs[0];   
+    env = cpu_single_env ? cpu_single_env : envs[0];
 
     env->regs[R_EAX] = *rax;
     env->regs[R_EBX] = *rbx;
@@ -596,7 +647,7 @@ static int __cdecl kvm_debug(void *opaque, int vcpu)
 {
     CPUState **envs = opaque;
 
-    env = envs[0];
+    env = envs[vcpu];
     env->exception_index = EXCP_DEBUG;
     return 1;
 }
@@ -668,6 +719,37 @@ static int __cdecl kvm_outl(void *opaque, uint16_t addr, uint32_t data)
     return 0;
 }
 
+static int __cdecl kvm_pio_string(void *opaque, uint16_t addr, int size,
+				  int count, void *data, int in)
+{
+    uint8_t *p = data;
+    int i;
+
+    for (i = 0; i < count; i++, p += size) {
+	switch (size) {
+	case 1:
+	    if (in)
+		*p = cpu_inb(0, addr);
+	    else
+		cpu_outb(0, addr, *p);
+	    break;
+	case 2:
+	    if (in)
+		*(uint16_t *)p = cpu_inw(0, addr);
+	    else
+		cpu_outw(0, addr, *(uint16_t *)p);
+	    break;
+	case 4:
+	    if (in)
+		*(uint32_t *)p = cpu_inl(0, addr);
+	    else
+		cpu_outl(0, addr, *(uint32_t *)p);
+	    break;
+	}
+    }
+    return 0;
+}
+
 static int __cdecl kvm_readb(void *opaque, uint64_t addr, uint8_t *data)
 {
     *data = ldub_phys(addr);
@@ -725,7 +807,7 @@ static int __cdecl kvm_halt(void *opaque, int vcpu)
 {
     CPUState **envs = opaque, *env;
 
-    env = envs[0];
+    env = envs[vcpu];
     if (!((env->interrupt_request & CPU_INTERRUPT_HARD) &&
 	  (env->eflags & IF_MASK))) {
 	    env->hflags |= HF_HALTED_MASK;
@@ -764,6 +846,7 @@ static struct kvm_callbacks qemu_kvm_ops = {
     .try_push_interrupts = try_push_interrupts,
     .post_kvm_run = post_kvm_run,
     .pre_kvm_run = pre_kvm_run,
+    .pio_string = kvm_pio_string,
 };
 
 int kvm_qemu_init()
@@ -778,12 +861,21 @@ int kvm_qemu_init()
     return 0;
 }
 
+static void kvm_irqchip_reset(void *opaque)
+{
+    kvm_create_irqchip(kvm_context);
+}
+
 int kvm_qemu_create_context(void)
 {
     int i;
 
 	printf("Call %s\n", __FUNCTION__);	
 
+    /* only demand-paged memory goes back to the host */
+    if (kvm_balloon_enabled)
+        kvm_set_demand_paging(kvm_context, 1);
+
     if (kvm_create(kvm_context, phys_ram_size, (void**)&phys_ram_base) < 0) {
 	kvm_qemu_destroy();
 	return -1;
@@ -791,6 +883,18 @@ int kvm_qemu_create_context(void)
 
 	printf("phys_ram_base: 0x%p\n", phys_ram_base);	
 	
+    if (smp_cpus > NR_CPU) {
+	fprintf(stderr, "kvm: too many cpus (%d)\n", smp_cpus);
+	kvm_qemu_destroy();
+	return -1;
+    }
+    for (i = 1; i < smp_cpus; ++i)
+	if (kvm_create_vcpu(kvm_context, i) < 0) {
+	    fprintf(stderr, "kvm: failed to create vcpu %d\n", i);
+	    kvm_qemu_destroy();
+	    return -1;
+	}
+
     kvm_msr_list = kvm_get_msr_list(kvm_context);	
     if (!kvm_msr_list) {
 	kvm_qemu_destroy();
@@ -799,6 +903,17 @@ int kvm_qemu_create_context(void)
     for (i = 0; i < kvm_msr_list->nmsrs; ++i)
 	if (kvm_msr_list->indices[i] == MSR_STAR)
 	    kvm_has_msr_star = 1;
+
+    /* legacy vga window: plain framebuffer writes need no reply */
+    kvm_register_coalesced_mmio(kvm_context, 0xa0000, 0x20000);
+
+    if (kvm_irqchip) {
+        if (kvm_create_irqchip(kvm_context) < 0) {
+            fprintf(stderr, "kvm: no in-kernel irqchip, using qemu's\n");
+            kvm_irqchip = 0;
+        } else
+            qemu_register_reset(kvm_irqchip_reset, NULL);
+    }
     return 0;
 }
 
@@ -821,15 +936,120 @@ int kvm_update_debugger(CPUState *env)
 	}
 	dbg.singlestep = env->singlestep_enabled;
     }
-    return kvm_guest_debug(kvm_context, 0, &dbg);
+    return kvm_guest_debug(kvm_context, env->cpu_index, &dbg);
+}
+
+static int vcpu_runnable(CPUState *env)
+{
+    if (!vm_running)
+        return 0;
+    /* halted and waiting-for-SIPI vcpus block in the driver */
+    if (kvm_irqchip)
+        return 1;
+    if (!(env->hflags & HF_HALTED_MASK))
+        return 1;
+    if ((env->interrupt_request & CPU_INTERRUPT_HARD) &&
+        (env->eflags & IF_MASK)) {
+        env->hflags &= ~HF_HALTED_MASK;
+        return 1;
+    }
+    return 0;
+}
+
+static DWORD WINAPI vcpu_thread_fn(LPVOID arg)
+{
+    struct vcpu_info *vi = arg;
+    int r;
+
+    env = vi->env;
+    TlsSetValue(vcpu_tls, vi);
+
+    EnterCriticalSection(&qemu_mutex);
+    cpu_single_env = env;
+    for (;;) {
+        if (!vcpu_runnable(env)) {
+            cpu_single_env = NULL;
+            LeaveCriticalSection(&qemu_mutex);
+            WaitForSingleObject(vi->wakeup, 10);
+            EnterCriticalSection(&qemu_mutex);
+            cpu_single_env = env;
+            continue;
+        }
+        r = kvm_run(kvm_context, env->cpu_index);
+        if (r < 0) {
+            printf("kvm_run returned %d\n", r);
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Start one host thread per vcpu.  The caller (the io thread) keeps
+ * qemu_mutex from here on and releases it only in kvm_sleep_begin().
+ * Returns 0 when the vcpus run on their own threads.
+ */
+int kvm_start_vcpu_threads(void)
+{
+    CPUState *penv;
+    struct vcpu_info *vi;
+
+    if (kvm_vcpu_threads)
+        return 0;
+
+    InitializeCriticalSection(&qemu_mutex);
+    EnterCriticalSection(&qemu_mutex);
+    vcpu_tls = TlsAlloc();
+    if (vcpu_tls == TLS_OUT_OF_INDEXES)
+        goto fail;
+
+    kvm_vcpu_threads = 1;
+    for (penv = first_cpu; penv != NULL; penv = penv->next_cpu) {
+        vi = &vcpu_info[penv->cpu_index];
+        saved_env[penv->cpu_index] = penv;
+        vi->env = penv;
+        vi->reload = 1;
+        vi->wakeup = CreateEvent(NULL, FALSE, FALSE, NULL);
+        vi->thread = CreateThread(NULL, 0, vcpu_thread_fn, vi, 0, NULL);
+        if (!vi->wakeup || !vi->thread) {
+            fprintf(stderr, "kvm: failed to start vcpu %d\n",
+                    penv->cpu_index);
+            exit(1);
+        }
+    }
+    return 0;
+
+fail:
+    LeaveCriticalSection(&qemu_mutex);
+    DeleteCriticalSection(&qemu_mutex);
+    return -1;
+}
+
+void kvm_vcpu_kick(CPUState *env)
+{
+    if (kvm_vcpu_threads && vcpu_info[env->cpu_index].wakeup)
+        SetEvent(vcpu_info[env->cpu_index].wakeup);
+}
+
+void kvm_sleep_begin(void)
+{
+    if (kvm_vcpu_threads)
+        LeaveCriticalSection(&qemu_mutex);
+}
+
+void kvm_sleep_end(void)
+{
+    if (kvm_vcpu_threads)
+        EnterCriticalSection(&qemu_mutex);
+    /* vga writes queued while we slept, before the timers redraw */
+    kvm_flush_coalesced_mmio(kvm_context);
 }
 
 
 /*
  * dirty pages logging
  */
-/* FIXME: use unsigned long pointer instead of unsigned char */
-unsigned char *kvm_dirty_bitmap = NULL;
+unsigned long *kvm_dirty_bitmap = NULL;
 int kvm_physical_memory_set_dirty_tracking(int enable)
 {
     int r = 0;
@@ -862,15 +1082,11 @@ int kvm_physical_memory_set_dirty_tracking(int enable)
 
 /* get kvm's dirty pages bitmap and update qemu's */
 int kvm_get_dirty_pages_log_slot(int slot, 
-                                 unsigned char *bitmap,
+                                 unsigned long *bitmap,
                                  unsigned int offset,
                                  unsigned int len)
 {
-	/* here is bug point */
     int r;
-    unsigned int i, j, n=0;
-    unsigned char c;
-    unsigned page_number, addr, addr1;
 
     memset(bitmap, 0, len);
     r = kvm_get_dirty_pages(kvm_context, slot, bitmap);
@@ -879,33 +1095,32 @@ int kvm_get_dirty_pages_log_slot(int slot,
         return r;
 	}
 
-    /* 
-     * bitmap-traveling is faster than memory-traveling (for addr...) 
-     * especially when most of the memory is not dirty.
-     */
-    for (i=0; i<len; i++) {
-        c = bitmap[i];
-        while (c>0) {
-            j = ffsl(c) - 1;
-            c &= ~(1u<<j);
-            page_number = i * 8 + j;
-            addr1 = page_number * TARGET_PAGE_SIZE;
-            addr  = offset + addr1;
-            cpu_physical_memory_set_dirty(addr);
-            n++;
-        }
-    }
+    /* a word at a time, most of the memory is not dirty */
+    cpu_physical_memory_set_dirty_bitmap(offset, bitmap, len * 8, 0xff);
     return 0;
 }
 
+static void __cdecl kvm_dirty_gfn(void *opaque, uint64_t gfn)
+{
+    uint64_t addr = gfn << TARGET_PAGE_BITS;
+
+    if (addr < phys_ram_size)
+        cpu_physical_memory_set_dirty(addr);
+}
+
 /* 
- * get kvm's dirty pages bitmap and update qemu's
- * we only care about physical ram, which resides in slots 0 and 3
+ * take the pages the vcpus dirtied off their rings and update qemu's
+ * dirty bits; only when a ring ran full, read kvm's dirty pages bitmaps
+ * as well. we only care about physical ram, which resides in slots 0 and 3
  */
 int kvm_update_dirty_pages_log(void)
 {
     int r = 0, len;
 
+    r = kvm_harvest_dirty_rings(kvm_context, kvm_dirty_gfn, NULL);
+    if (r <= 0)
+        return r;
+
     len = BITMAP_SIZE(0xa0000);
     r =      kvm_get_dirty_pages_log_slot(3, kvm_dirty_bitmap, 0      , len);
     len = BITMAP_SIZE(phys_ram_size - 0xc0000);
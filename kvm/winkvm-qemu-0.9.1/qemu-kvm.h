@@ -11,6 +11,14 @@ void kvm_save_registers(CPUState *env);
 int kvm_cpu_exec(CPUState *env);
 int kvm_update_debugger(CPUState *env);
 
+extern int kvm_irqchip;
+extern int kvm_balloon_enabled;
+
+int kvm_start_vcpu_threads(void);
+void kvm_vcpu_kick(CPUState *env);
+void kvm_sleep_begin(void);
+void kvm_sleep_end(void);
+
 int kvm_physical_memory_set_dirty_tracking(int enable);
 int kvm_update_dirty_pages_log(void);
 int kvm_get_phys_ram_page_bitmap(unsigned char *bitmap);
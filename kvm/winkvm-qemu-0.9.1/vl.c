@@ -7827,7 +7827,15 @@ void main_loop_wait(int timeout)
         int err;
         WaitObjects *w = &wait_objects;
 
+#ifdef USE_KVM
+        if (kvm_allowed)
+            kvm_sleep_begin();
+#endif
         ret = WaitForMultipleObjects(w->num, w->events, FALSE, timeout);
+#ifdef USE_KVM
+        if (kvm_allowed)
+            kvm_sleep_end();
+#endif
         if (WAIT_OBJECT_0 + 0 <= ret && ret <= WAIT_OBJECT_0 + w->num - 1) {
             if (w->func[ret - WAIT_OBJECT_0])
                 w->func[ret - WAIT_OBJECT_0](w->opaque[ret - WAIT_OBJECT_0]);
@@ -7958,6 +7966,13 @@ static int main_loop(void)
     for(;;) {
         if (vm_running) {
 
+#ifdef USE_KVM
+            /* the vcpus run on their own threads, only do io here */
+            if (kvm_allowed && kvm_start_vcpu_threads() == 0) {
+                env = cur_cpu;
+                ret = EXCP_HALTED;
+            } else
+#endif
             for(;;) {
                 /* get next cpu */
                 env = next_cpu;
@@ -7997,7 +8012,9 @@ static int main_loop(void)
 #ifdef USE_KVM
                 if (kvm_allowed) {
 					fprintf(stderr, "kvm_load_registers() in %s\n", __FUNCTION__);
-                    kvm_load_registers(env);
+                    for (env = first_cpu; env != NULL; env = env->next_cpu)
+                        kvm_load_registers(env);
+                    env = cur_cpu;
 				}
 #endif
                 ret = EXCP_INTERRUPT;
@@ -8147,6 +8164,8 @@ static void help(int exitcode)
 #endif
 #ifdef USE_KVM
        "-no-kvm         disable KVM hardware virtualization\n"
+       "-kvm-irqchip    emulate the PIC, PIT and local APIC in the KVM driver\n"
+       "-kvm-balloon    add a memory balloon, back guest memory on demand\n"
 #endif
 #ifdef USE_CODE_COPY
            "-no-code-copy   disable code copy acceleration\n"
@@ -8261,6 +8280,8 @@ enum {
     QEMU_OPTION_vnc,
     QEMU_OPTION_no_acpi,
     QEMU_OPTION_no_kvm,
+    QEMU_OPTION_kvm_irqchip,
+    QEMU_OPTION_kvm_balloon,
     QEMU_OPTION_no_reboot,
     QEMU_OPTION_show_cursor,
     QEMU_OPTION_daemonize,
@@ -8339,6 +8360,8 @@ const QEMUOption qemu_options[] = {
 #endif
 #ifdef USE_KVM
     { "no-kvm", 0, QEMU_OPTION_no_kvm },
+    { "kvm-irqchip", 0, QEMU_OPTION_kvm_irqchip },
+    { "kvm-balloon", 0, QEMU_OPTION_kvm_balloon },
 #endif
 #if defined(TARGET_PPC) || defined(TARGET_SPARC)
     { "g", 1, QEMU_OPTION_g },
@@ -9135,6 +9158,12 @@ int main(int argc, char **argv)
             case QEMU_OPTION_no_kvm:
                 kvm_allowed = 0;
                 break;
+            case QEMU_OPTION_kvm_irqchip:
+                kvm_irqchip = 1;
+                break;
+            case QEMU_OPTION_kvm_balloon:
+                kvm_balloon_enabled = 1;
+                break;
 #endif
             case QEMU_OPTION_usb:
                 usb_enabled = 1;
@@ -9301,6 +9330,10 @@ int main(int argc, char **argv)
             kvm_allowed = 0;
         }
     }
+    if (!kvm_allowed) {
+        kvm_irqchip = 0;
+        kvm_balloon_enabled = 0;
+    }
 #endif
 
     if (pid_file && qemu_create_pidfile(pid_file) != 0) {
@@ -45,12 +45,17 @@ struct inode {
 	int i_count;	
 };
 
+/*
+ * The driver keeps its synchronisation objects in place, see
+ * vcproj/kernel/smp.c: a KSPIN_LOCK, which is unlocked when zero, and
+ * a FAST_MUTEX, which needs mutex_init().
+ */
 typedef struct {  
-  	int spinlock_number;	
+	unsigned long lock;
 } spinlock_t;
 
 struct mutex {	
-	int mutex_number;	
+	unsigned long fast_mutex[8];
 };
 
 enum private_data_type {	
@@ -19,37 +19,333 @@
 #include "MapMem.h"
 #include "kernel.h"
 
+#include <linux/kvm.h>
+
 #include <Ntstrsafe.h>
 
 #define MEM_PHYSICAL 0x400000
 
+/*
+ * Guest ram is backed in chunks of this size when the system can
+ * give us physically contiguous, aligned memory, so that the mmu can
+ * map 2MB guest pages with a single shadow pde.
+ */
+#define LARGE_CHUNK_PAGES  512
+#define LARGE_CHUNK_BYTES  (LARGE_CHUNK_PAGES << PAGE_SHIFT)
+
+#ifndef MM_ALLOCATE_FULLY_REQUIRED
+#define MM_ALLOCATE_FULLY_REQUIRED            0x00000004
+#endif
+#ifndef MM_ALLOCATE_REQUIRE_CONTIGUOUS_CHUNKS
+#define MM_ALLOCATE_REQUIRE_CONTIGUOUS_CHUNKS 0x00000020
+#endif
+
+/* from ntifs.h, which the driver does not include */
+NTSYSAPI NTSTATUS NTAPI
+ZwAllocateVirtualMemory(IN HANDLE ProcessHandle,
+						IN OUT PVOID *BaseAddress,
+						IN ULONG_PTR ZeroBits,
+						IN OUT PSIZE_T RegionSize,
+						IN ULONG AllocationType,
+						IN ULONG Protect);
+
+NTSYSAPI NTSTATUS NTAPI
+ZwFreeVirtualMemory(IN HANDLE ProcessHandle,
+					IN OUT PVOID *BaseAddress,
+					IN OUT PSIZE_T RegionSize,
+					IN ULONG FreeType);
+
+typedef PMDL (NTAPI *PMM_ALLOCATE_PAGES_FOR_MDL_EX)(
+	PHYSICAL_ADDRESS    LowAddress,
+	PHYSICAL_ADDRESS    HighAddress,
+	PHYSICAL_ADDRESS    SkipBytes,
+	SIZE_T              TotalBytes,
+	MEMORY_CACHING_TYPE CacheType,
+	ULONG               Flags);
+
+/*
+ * Try to allocate the pages of a slot as contiguous 2MB chunks.
+ * MmAllocatePagesForMdlEx only exists on newer systems, so it is
+ * looked up at run time.  The chunks are laid out on the guest's
+ * 2MB boundaries: *skip is set to the number of leading pages of
+ * the returned Mdl that sit below base_gfn and must not be mapped.
+ * The core checks the resulting pfns again before it installs a
+ * large mapping, so an allocator that ignores the chunk request
+ * only costs the large pages, never correctness.
+ */
+static PMDL
+AllocateLargePageMdl(IN unsigned long base_gfn,
+					 IN SIZE_T        npages,
+					 OUT SIZE_T       *skip)
+{
+	static PMM_ALLOCATE_PAGES_FOR_MDL_EX allocEx = NULL;
+	static int                           looked_up = 0;
+	UNICODE_STRING     name;
+	PMDL               mdl;
+	PHYSICAL_ADDRESS   lowAddress;
+	PHYSICAL_ADDRESS   highAddress;
+	PHYSICAL_ADDRESS   skipBytes;
+	SIZE_T             chunks;
+	SIZE_T             totalBytes;
+
+	if (!looked_up) {
+		RtlInitUnicodeString(&name, L"MmAllocatePagesForMdlEx");
+		allocEx = (PMM_ALLOCATE_PAGES_FOR_MDL_EX)
+			MmGetSystemRoutineAddress(&name);
+		looked_up = 1;
+	}
+	if (!allocEx)
+		return NULL;
+
+	/* too small to ever hold a whole guest large page */
+	if (npages < LARGE_CHUNK_PAGES)
+		return NULL;
+
+	*skip  = base_gfn & (LARGE_CHUNK_PAGES - 1);
+	chunks = (*skip + npages + LARGE_CHUNK_PAGES - 1) / LARGE_CHUNK_PAGES;
+	totalBytes = chunks * LARGE_CHUNK_BYTES;
+
+	lowAddress.QuadPart  = 0x0;
+	highAddress.QuadPart = 0xFFFFFFFFFFFFFFFFull;
+	skipBytes.QuadPart   = LARGE_CHUNK_BYTES;
+
+	mdl = allocEx(lowAddress, highAddress, skipBytes, totalBytes,
+				  MmCached,
+				  MM_ALLOCATE_REQUIRE_CONTIGUOUS_CHUNKS |
+				  MM_ALLOCATE_FULLY_REQUIRED);
+	if (!mdl)
+		return NULL;
+
+	if (MmGetMdlByteCount(mdl) < totalBytes) {
+		MmFreePagesFromMdl(mdl);
+		IoFreeMdl(mdl);
+		return NULL;
+	}
+
+	return mdl;
+}
+
+/*
+ * Reserve guest ram as demand-zero memory of the calling process.
+ * Nothing is allocated until it is touched: by user space through the
+ * returned address, by the guest through LockDemandChunk().
+ */
+static NTSTATUS
+CreateDemandMapping(IN SIZE_T        npages,
+					IN unsigned long base_gfn,
+					OUT MAPMEM       *mapMemInfo)
+{
+	PVOID              userVA = NULL;
+	SIZE_T             size = npages << PAGE_SHIFT;
+	unsigned long      nchunks;
+	NTSTATUS           status;
+
+	nchunks = (unsigned long)((base_gfn + npages + DEMAND_CHUNK_PAGES - 1) /
+							  DEMAND_CHUNK_PAGES - base_gfn / DEMAND_CHUNK_PAGES);
+
+	mapMemInfo->apChunkMdl = ExAllocatePoolWithTag(NonPagedPool,
+												   nchunks * sizeof(PMDL),
+												   MEM_TAG);
+	if (!mapMemInfo->apChunkMdl)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	RtlZeroMemory(mapMemInfo->apChunkMdl, nchunks * sizeof(PMDL));
+
+	status = ZwAllocateVirtualMemory(NtCurrentProcess(), &userVA, 0, &size,
+									 MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!NT_SUCCESS(status)) {
+		printk(KERN_ALERT 
+			"%s: could not reserve %d [mbytes]: 0x%08x\n",
+			__FUNCTION__, (npages << PAGE_SHIFT) / 1024 / 1024, status);
+		ExFreePoolWithTag(mapMemInfo->apChunkMdl, MEM_TAG);
+		mapMemInfo->apChunkMdl = NULL;
+		return status;
+	}
+
+	mapMemInfo->userVAaddress = userVA;
+	mapMemInfo->nChunks       = nchunks;
+	mapMemInfo->pProcess      = PsGetCurrentProcess();
+	ObReferenceObject(mapMemInfo->pProcess);
+
+	printk(KERN_ALERT "%s: %d [mbytes] demand-paged UserVA = 0x%0x\n", 
+		__FUNCTION__,
+		(npages << PAGE_SHIFT) / 1024 / 1024,
+		userVA);
+
+	return STATUS_SUCCESS;
+}
+
+/*
+ * Lock a chunk of a demand-paged mapping, paging it in as needed, and
+ * give its frames their struct page.  Runs in the process that created
+ * the mapping at IRQL <= APC_LEVEL; the caller serialises the calls.
+ */
+NTSTATUS
+LockDemandChunk(IN MAPMEM *mapMemInfo, IN unsigned long chunk)
+{
+	PMDL               mdl;
+	PCHAR              va;
+	unsigned long      first, last;
+	NTSTATUS           status;
+
+	if (chunk >= mapMemInfo->nChunks)
+		return STATUS_INVALID_PARAMETER;
+	if (mapMemInfo->apChunkMdl[chunk])
+		return STATUS_SUCCESS;
+	if (PsGetCurrentProcess() != mapMemInfo->pProcess)
+		return STATUS_ACCESS_DENIED;
+
+	first = (mapMemInfo->base_gfn & ~(DEMAND_CHUNK_PAGES - 1)) +
+		chunk * DEMAND_CHUNK_PAGES;
+	last  = first + DEMAND_CHUNK_PAGES;
+	if (first < mapMemInfo->base_gfn)
+		first = mapMemInfo->base_gfn;
+	if (last > mapMemInfo->base_gfn + mapMemInfo->npages)
+		last = mapMemInfo->base_gfn + mapMemInfo->npages;
+
+	va  = (PCHAR)mapMemInfo->userVAaddress +
+		((first - mapMemInfo->base_gfn) << PAGE_SHIFT);
+	mdl = IoAllocateMdl(va, (last - first) << PAGE_SHIFT, FALSE, FALSE, NULL);
+	if (!mdl)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	/* user space may have freed or protected the memory */
+	__try {
+		MmProbeAndLockPages(mdl, UserMode, IoWriteAccess);
+	} __except (EXCEPTION_EXECUTE_HANDLER) {
+		status = GetExceptionCode();
+		IoFreeMdl(mdl);
+		printk(KERN_ALERT "%s: could not lock chunk %d: 0x%08x\n",
+			__FUNCTION__, chunk, status);
+		return status;
+	}
+
+	if (!MmGetSystemAddressForMdlSafe(mdl, HighPagePriority) ||
+		!NT_SUCCESS(populate_page_slots(mdl))) {
+		MmUnlockPages(mdl);
+		IoFreeMdl(mdl);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	mapMemInfo->apChunkMdl[chunk] = mdl;
+	return STATUS_SUCCESS;
+}
+
+/*
+ * Undo LockDemandChunk().  The memory stays with the process, with
+ * whatever the guest left in it, and is pageable again.  The core must
+ * no longer map any of the frames.
+ */
+void
+UnlockDemandChunk(IN MAPMEM *mapMemInfo, IN unsigned long chunk)
+{
+	PMDL               mdl = mapMemInfo->apChunkMdl[chunk];
+
+	if (!mdl)
+		return;
+	mapMemInfo->apChunkMdl[chunk] = NULL;
+	clear_page_slots(mdl);
+	MmUnlockPages(mdl);
+	IoFreeMdl(mdl);
+}
+
+/*
+ * Tell the memory manager that the contents of unlocked pages are not
+ * needed any more, so that it drops them instead of paging them out.
+ * They read back as zeroes or as before.  PASSIVE_LEVEL, in the process
+ * that created the mapping.
+ */
+void
+DiscardDemandPages(IN MAPMEM *mapMemInfo, IN unsigned long gfn,
+				   IN unsigned long npages)
+{
+	PVOID              va;
+	SIZE_T             size = npages << PAGE_SHIFT;
+	NTSTATUS           status;
+
+	if (PsGetCurrentProcess() != mapMemInfo->pProcess)
+		return;
+
+	va = (PCHAR)mapMemInfo->userVAaddress +
+		((gfn - mapMemInfo->base_gfn) << PAGE_SHIFT);
+	status = ZwAllocateVirtualMemory(NtCurrentProcess(), &va, 0, &size,
+									 MEM_RESET, PAGE_READWRITE);
+	if (!NT_SUCCESS(status))
+		printk(KERN_ALERT "%s: could not reset gfn 0x%08x: 0x%08x\n",
+			__FUNCTION__, gfn, status);
+}
+
+static void
+CloseDemandMapping(IN MAPMEM *mapMemInfo)
+{
+	unsigned long      i;
+	PVOID              userVA = mapMemInfo->userVAaddress;
+	SIZE_T             size = 0;
+
+	for (i = 0 ; i < mapMemInfo->nChunks ; i++)
+		UnlockDemandChunk(mapMemInfo, i);
+	ExFreePoolWithTag(mapMemInfo->apChunkMdl, MEM_TAG);
+
+	/* otherwise the memory goes away with the process */
+	if (PsGetCurrentProcess() == mapMemInfo->pProcess)
+		ZwFreeVirtualMemory(NtCurrentProcess(), &userVA, &size, MEM_RELEASE);
+	ObDereferenceObject(mapMemInfo->pProcess);
+}
+
 /*
  * CreateMapSection
  */
 //L"\\BaseNamedObjects\\UserKernelSharedSection"
 
 NTSTATUS
-CreateUserMapping(IN SIZE_T npages,
-				  IN int    slot,
-				  OUT MAPMEM *mapMemInfo)
+CreateUserMapping(IN SIZE_T        npages,
+				  IN int           slot,
+				  IN unsigned long base_gfn,
+				  IN ULONG         flags,
+				  OUT MAPMEM       *mapMemInfo)
 {
 	PMDL               mdl;
+	PMDL               backing;
 	PVOID              userVAToReturn;
+	PVOID              va;
 	PHYSICAL_ADDRESS   lowAddress;
 	PHYSICAL_ADDRESS   highAddress;
 	SIZE_T             totalBytes;
+	SIZE_T             skip = 0;
 
 	/* initialize the physical addresses need for MmAllocatePagesForMdl */
 	lowAddress.QuadPart = 0x0;
 	highAddress.QuadPart = 0xFFFFFFFFFFFFFFFFull;
 	totalBytes = npages << PAGE_SHIFT;
 
+	if (flags & WINKVM_MAPMEM_DEMAND)
+		return CreateDemandMapping(npages, base_gfn, mapMemInfo);
+
+	/*
+	 * Prefer 2MB chunks.  The slot is then described by a partial
+	 * Mdl over the chunked one, which stays around as apMdl[1]
+	 * until the pages are freed.
+	 */
+	mdl     = NULL;
+	backing = AllocateLargePageMdl(base_gfn, npages, &skip);
+	if (backing) {
+		va  = (PCHAR)MmGetMdlVirtualAddress(backing) + (skip << PAGE_SHIFT);
+		mdl = IoAllocateMdl(va, (ULONG)totalBytes, FALSE, FALSE, NULL);
+		if (mdl) {
+			IoBuildPartialMdl(backing, mdl, va, (ULONG)totalBytes);
+		} else {
+			MmFreePagesFromMdl(backing);
+			IoFreeMdl(backing);
+			backing = NULL;
+		}
+	}
+
 	/* Allocate a 4K buffer to share with the application */
-	mdl = MmAllocatePagesForMdl(
-		       lowAddress,
-			   highAddress,
-			   lowAddress,
-			   totalBytes);
+	if (!mdl)
+		mdl = MmAllocatePagesForMdl(
+			       lowAddress,
+				   highAddress,
+				   lowAddress,
+				   totalBytes);
 	if (!mdl) {
 		printk(KERN_ALERT 
 			"%s: Could not allocate pages for Mdl\n",
@@ -67,23 +363,42 @@ CreateUserMapping(IN SIZE_T npages,
 				NormalPagePriority); // Priority
 
 	if (!userVAToReturn) {
-		MmFreePagesFromMdl(mdl);
-		IoFreeMdl(mdl);
 		printk(KERN_ALERT 
 			"%s: failed to call MmMapLockedPagesSpecifyCache()\n",
 			__FUNCTION__);
-		return STATUS_INSUFFICIENT_RESOURCES;
+		goto free_mdl;
+	}
+
+	/* the frames may sit anywhere, set up their struct pages now */
+	if (!NT_SUCCESS(populate_page_slots(mdl))) {
+		printk(KERN_ALERT 
+			"%s: could not allocate the page map\n",
+			__FUNCTION__);
+		MmUnmapLockedPages(userVAToReturn, mdl);
+		goto free_mdl;
 	}
 
 	mapMemInfo->userVAaddress = userVAToReturn;
 	mapMemInfo->apMdl[0]      = mdl;
+	mapMemInfo->apMdl[1]      = backing;
+	mapMemInfo->cMdls         = backing ? 2 : 1;
 
-	printk(KERN_ALERT "%s: %d [mbytes] mapping UserVA = 0x%0x\n", 
+	printk(KERN_ALERT "%s: %d [mbytes] mapping UserVA = 0x%0x%s\n", 
 		__FUNCTION__,
 		totalBytes / 1024 / 1024,
-		userVAToReturn);
+		userVAToReturn,
+		backing ? " (2MB chunks)" : "");
 
 	return STATUS_SUCCESS;
+
+free_mdl:
+	if (backing) {
+		IoFreeMdl(mdl);
+		mdl = backing;
+	}
+	MmFreePagesFromMdl(mdl);
+	IoFreeMdl(mdl);
+	return STATUS_INSUFFICIENT_RESOURCES;
 }
 
 
@@ -96,11 +411,19 @@ CloseUserMapping(IN SIZE_T npages,
 				 IN int    slot,
 				 IN MAPMEM *mapMemInfo)
 {
-	if (!mapMemInfo->apMdl[0] || mapMemInfo->npages <= 0)
+	if ((!mapMemInfo->apMdl[0] && !mapMemInfo->apChunkMdl) ||
+		mapMemInfo->npages <= 0)
 		return STATUS_UNSUCCESSFUL;
 
 	printk(KERN_ALERT "Call Close User Mapping\n");
 
+	if (mapMemInfo->apChunkMdl) {
+		CloseDemandMapping(mapMemInfo);
+		RtlZeroMemory(mapMemInfo, sizeof(MAPMEM));
+		flush_memtable();
+		return STATUS_SUCCESS;
+	}
+
 	/* Unmap userVA pages */
 	MmUnmapLockedPages(
 		mapMemInfo->userVAaddress, 
@@ -111,6 +434,14 @@ CloseUserMapping(IN SIZE_T npages,
 		mapMemInfo->kernelVAaddress,
 		mapMemInfo->apMdl[0]);
 
+	clear_page_slots(mapMemInfo->apMdl[0]);
+
+	/* A partial Mdl over 2MB chunks: the pages belong to apMdl[1] */
+	if (mapMemInfo->cMdls > 1) {
+		IoFreeMdl(mapMemInfo->apMdl[0]);
+		mapMemInfo->apMdl[0] = mapMemInfo->apMdl[1];
+	}
+
 	/* Free the pages from the MDL */
 	MmFreePagesFromMdl(mapMemInfo->apMdl[0]);
 
@@ -123,3 +454,105 @@ CloseUserMapping(IN SIZE_T npages,
 
 	return STATUS_SUCCESS;
 } /* Close CreateMapSection */
+
+
+/*
+ * Allocate non-paged pages for struct kvm_run of a vcpu and map them
+ * into both the calling process and the system address space.
+ * KVM_RUN uses the kernel side, and kvmctl reads the exit data in place.
+ */
+NTSTATUS
+CreateRunMapping(OUT MAPMEM *runMapInfo, IN ULONG size)
+{
+	PMDL               mdl;
+	PVOID              userVA;
+	PVOID              kernelVA;
+	PHYSICAL_ADDRESS   lowAddress;
+	PHYSICAL_ADDRESS   highAddress;
+
+	lowAddress.QuadPart = 0x0;
+	highAddress.QuadPart = 0xFFFFFFFFFFFFFFFFull;
+
+	mdl = MmAllocatePagesForMdl(
+		       lowAddress,
+			   highAddress,
+			   lowAddress,
+			   size);
+	if (!mdl) {
+		printk(KERN_ALERT 
+			"%s: Could not allocate pages for Mdl\n",
+			__FUNCTION__);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	/* MmAllocatePagesForMdl may return fewer pages than asked for */
+	if (MmGetMdlByteCount(mdl) < size) {
+		MmFreePagesFromMdl(mdl);
+		IoFreeMdl(mdl);
+		printk(KERN_ALERT 
+			"%s: Could not allocate %lu bytes for Mdl\n",
+			__FUNCTION__, size);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	kernelVA = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+	if (!kernelVA) {
+		MmFreePagesFromMdl(mdl);
+		IoFreeMdl(mdl);
+		printk(KERN_ALERT 
+			"%s: failed to get system address for Mdl\n",
+			__FUNCTION__);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	userVA = MmMapLockedPagesSpecifyCache(
+		        mdl,
+				UserMode,
+				MmCached,
+				NULL,
+				FALSE,
+				NormalPagePriority);
+	if (!userVA) {
+		MmFreePagesFromMdl(mdl);
+		IoFreeMdl(mdl);
+		printk(KERN_ALERT 
+			"%s: failed to call MmMapLockedPagesSpecifyCache()\n",
+			__FUNCTION__);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlZeroMemory(kernelVA, size);
+
+	runMapInfo->npages          = size >> PAGE_SHIFT;
+	runMapInfo->base_gfn        = 0;
+	runMapInfo->userVAaddress   = userVA;
+	runMapInfo->kernelVAaddress = kernelVA;
+	runMapInfo->apMdl[0]        = mdl;
+
+	return STATUS_SUCCESS;
+}
+
+/*
+ * Release the kvm_run page made by CreateRunMapping.
+ */
+NTSTATUS
+CloseRunMapping(IN MAPMEM *runMapInfo)
+{
+	if (!runMapInfo->apMdl[0] || runMapInfo->npages <= 0)
+		return STATUS_UNSUCCESSFUL;
+
+	MmUnmapLockedPages(
+		runMapInfo->userVAaddress, 
+		runMapInfo->apMdl[0]);
+
+	MmUnmapLockedPages(
+		runMapInfo->kernelVAaddress,
+		runMapInfo->apMdl[0]);
+
+	MmFreePagesFromMdl(runMapInfo->apMdl[0]);
+	IoFreeMdl(runMapInfo->apMdl[0]);
+
+	RtlZeroMemory(runMapInfo, sizeof(MAPMEM));
+
+	return STATUS_SUCCESS;
+}
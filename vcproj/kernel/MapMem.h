@@ -9,9 +9,29 @@
 /* #define USE_MDL */
 
 NTSTATUS
-CreateUserMapping(IN SIZE_T npages,
-				  IN int    slot,
-				  OUT MAPMEM *mapMemInfo);
+CreateUserMapping(IN SIZE_T        npages,
+				  IN int           slot,
+				  IN unsigned long base_gfn,
+				  IN ULONG         flags,
+				  OUT MAPMEM       *mapMemInfo);
+
+/*
+ * A demand-paged mapping is locked in chunks of this many gfns, aligned
+ * on the gfn like the core's KVM_DEMAND_CHUNK
+ */
+#define DEMAND_CHUNK_PAGES  512
+#define DEMAND_CHUNK(m, gfn) \
+	(((gfn) - ((m)->base_gfn & ~(DEMAND_CHUNK_PAGES - 1))) / DEMAND_CHUNK_PAGES)
+
+NTSTATUS
+LockDemandChunk(IN MAPMEM *mapMemInfo, IN unsigned long chunk);
+
+void
+UnlockDemandChunk(IN MAPMEM *mapMemInfo, IN unsigned long chunk);
+
+void
+DiscardDemandPages(IN MAPMEM *mapMemInfo, IN unsigned long gfn,
+				   IN unsigned long npages);
 
 NTSTATUS
 CloseUserMapping(IN SIZE_T npages,
@@ -34,6 +54,17 @@ CreateUserMappingSectionWithMdl(PMDL     *pMemMdl,
 void
 UnMapAndFreeMemory(PMDL PMdl, PVOID UserVA);
 
+/*
+ * Per-vcpu struct kvm_run pages shared with kvmctl
+ */
+NTSTATUS
+CreateRunMapping(OUT MAPMEM *runMapInfo, IN ULONG size);
+
+NTSTATUS
+CloseRunMapping(IN MAPMEM *runMapInfo);
+
 void flush_memtable(void);
+NTSTATUS populate_page_slots(PMDL mdl);
+void clear_page_slots(PMDL mdl);
 
 #endif
\ No newline at end of file
@@ -26,21 +26,11 @@ struct fd_slot {
 	struct file *file;
 };
 
-#define MAX_MUTEX_COUNT    50
-#define MAX_SPINLOCK_COUNT 50
+/* one slot per host cpu, must match __WINKVM_CPUNUMS__ */
+#define SMPF_SLOTNUM 32
 
-#define SMPF_SLOTNUM 20
-
-struct mutex_emulater_slot {	
-	int used;
-	FAST_MUTEX mutex;	
-};
-
-struct spinlock_emulater_slot {
-	int used;
-	KIRQL IrqL;
-	KSPIN_LOCK spinlock;	
-};
+/* spinlocks one cpu may hold at once */
+#define SPIN_NEST_MAX 8
 
 /*
  * for smp_call_function;
@@ -50,6 +40,16 @@ struct smpf_data {
 	void (_cdecl *func)(void *info);
 	void *info;
 	int mycpu_num;
+	KDPC dpc;
+	/* queued by smp_send_reschedule(), its interrupt makes a guest exit */
+	KDPC kick_dpc;
+	/* held between get_cpu() and put_cpu(), the VMCS of this cpu is ours */
+	FAST_MUTEX owner;
+	/* queue entries of the spinlocks held on this cpu, see spin_lock() */
+	KLOCK_QUEUE_HANDLE lock_queue[SPIN_NEST_MAX];
+	PKSPIN_LOCK lock_held[SPIN_NEST_MAX];
+	int lock_count;
+	KIRQL lock_irql;	/* before the first of them was taken */
 };
 
 #endif
\ No newline at end of file
@@ -7,16 +7,17 @@
 #include "init.h"
 #include "desc_emu.h"
 
-#define MAX_MEMMAP_SLOT  10
+#define MAX_MEMMAP_SLOT  32 /* same as KVM_MEMORY_SLOTS */
 #define MAX_SECTION_NAME 50
 
 //L"\\BaseNamedObjects\\UserKernelSharedSection",
 #define SECTION_BASENAME  L"\\BaseNamedObjects\\wkukss-%d"
 
+/* top level of the pfn -> struct page radix tree, see slab.c */
 typedef struct _MEMALLOCMANTBL {
-	struct page_root  *page_slot_root[1024];
+	struct page_dir   *page_map_root[1024];
 	FAST_MUTEX        page_emulater_mutex;
-	int               page_slot_num;
+	long              page_root_num;
 } MEMALLOCMANTBL;
 
 typedef struct _MAPMEM {
@@ -25,25 +26,27 @@ typedef struct _MAPMEM {
 	PVOID            userVAaddress;
 	PVOID            kernelVAaddress;
 	unsigned long    cMdls;
-	PMDL             apMdl[1];
+	PMDL             apMdl[2]; /* [1]: 2MB chunk backing of a partial [0] */
+	/* demand-paged: process memory locked chunk by chunk, else NULL */
+	PMDL             *apChunkMdl;
+	unsigned long    nChunks;
+	PEPROCESS        pProcess;
 } MAPMEM;
 
 /* extension */
 typedef struct _WINKVM_DEVICE_EXTENSION {
 	MAPMEM          mapMemInfo[MAX_MEMMAP_SLOT];
+	MAPMEM          runMapInfo[MAX_FD_SLOT]; /* kvm_run page per vcpu fd */
 	MEMALLOCMANTBL  globalMemTbl; /* host physical address bitmap */
 	struct inode_slot   inode_slot[MAX_INODE_SLOT];
 	struct file_slot    file_slot[MAX_FILE_SLOT];
 	struct fd_slot      fd_slot[MAX_FD_SLOT];
 	FAST_MUTEX          fd_slot_mutex;
-	/* mutex and spinlock */
-	struct mutex_emulater_slot     mutex_slot[MAX_MUTEX_COUNT];
-	struct spinlock_emulater_slot  spinlock_slot[MAX_SPINLOCK_COUNT];
 	struct smpf_data               smpf_data_slot[SMPF_SLOTNUM];
-	int mutex_emulater_initialized;
-	int spinlock_emulater_initialized;
-	FAST_MUTEX emulater_mutex;
-	FAST_MUTEX emulater_spinlock;
+	FAST_MUTEX                     smpf_mutex;
+	volatile LONG                  smpf_pending;
+	/* kvmctl opens one handle per vcpu thread */
+	LONG open_count;
 } WINKVM_DEVICE_EXTENSION;
 
 typedef WINKVM_DEVICE_EXTENSION* PWINKVM_DEVICE_EXTENSION;
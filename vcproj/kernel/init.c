@@ -183,10 +183,23 @@ __winkvmstab_close(IN PDEVICE_OBJECT DeviceObject,
 
 	FUNCTION_ENTER();
 
+	/* the other vcpu handles are still open */
+	if (InterlockedDecrement(&extension->open_count) > 0) {
+		Irp->IoStatus.Status = STATUS_SUCCESS;
+		Irp->IoStatus.Information = 0;
+		IoCompleteRequest(Irp, IO_NO_INCREMENT);
+		FUNCTION_EXIT();
+		return STATUS_SUCCESS;
+	}
+
 	/* vcpukvmɂ͂ꂼƗfileinoden */
 	for (i = 0 ; i < MAX_FD_SLOT ; ++i) {
 		fds = &extension->fd_slot[i];
 		if (fds->used && fds->type == WINKVM_VCPU) {
+			if (extension->runMapInfo[i].npages > 0) {
+				kvm_vcpu_set_run_page(get_vcpu(i), NULL);
+				CloseRunMapping(&extension->runMapInfo[i]);
+			}
 			fds->file->f_op->release(fds->inode, fds->file);
 			RtlZeroMemory(fds, sizeof(struct fd_slot));
 		}
@@ -227,11 +240,18 @@ __winkvmstab_create(IN PDEVICE_OBJECT DeviceObject,
 
 	FUNCTION_ENTER();
 
-	for (i = 0 ; i < sizeof(initfunc) / sizeof(*initfunc) ; i++)
-		initfunc[i](extension);
-
-	/* currently, only support Intel VT-x only */
-	vmx_init();
+	/*
+	 * Each vcpu thread of kvmctl has its own handle, because Windows
+	 * serializes synchronous requests on one file object.
+	 * Only the first open initializes the emulaters.
+	 */
+	if (InterlockedIncrement(&extension->open_count) == 1) {
+		for (i = 0 ; i < sizeof(initfunc) / sizeof(*initfunc) ; i++)
+			initfunc[i](extension);
+
+		/* currently, only support Intel VT-x only */
+		vmx_init();
+	}
 
 	Irp->IoStatus.Status = STATUS_SUCCESS;
 	Irp->IoStatus.Information = 0;
@@ -281,8 +301,14 @@ __winkvmstab_ioctl(IN PDEVICE_OBJECT DeviceObject,
 		case KVM_CREATE_VM:
 			{
 				int ret;
+				struct winkvm_create_vm create_vm;
 				function_enter(DBG_IOCTL, "KVM_CREATE_VM"); {
 					ret = kvm_dev_ioctl_create_vm();
+					/* old kvmctl passes no parameters */
+					if (ret >= 0 && inBufLen >= sizeof(create_vm)) {
+						RtlCopyMemory(&create_vm, inBuf, sizeof(create_vm));
+						kvm_vm_ioctl_set_mmu_pages(get_kvm(ret), create_vm.n_mmu_pages);
+					}
 					RtlCopyMemory(outBuf, &ret, sizeof(ret));			
 					Irp->IoStatus.Information = sizeof(ret);	   
 					ntStatus = ConvertRetval(ret);
@@ -538,24 +564,49 @@ __winkvmstab_ioctl(IN PDEVICE_OBJECT DeviceObject,
 			{		
 				unsigned int resultvar;
 				struct kvm_run kvm_run;
+				struct kvm_run *run;
 				struct kvm_vcpu *vcpu;
+				int vcpu_fd;
 
 				function_enter(DBG_IOCTL, "KVM_RUN");
-				RtlCopyMemory(&kvm_run, inBuf, sizeof(kvm_run));
-				kvm_run._errno = 0;
 
-				vcpu = get_vcpu(kvm_run.vcpu_fd);
+				/*
+				 * If kvmctl passes only the vcpu fd, exit data is read and
+				 * written in place on the page mapped by WINKVM_MAP_RUN.
+				 * Otherwise whole struct kvm_run is copied in and out.
+				 */
+				if (inBufLen == sizeof(vcpu_fd)) {
+					RtlCopyMemory(&vcpu_fd, inBuf, sizeof(vcpu_fd));
+					if (vcpu_fd < 0 || vcpu_fd >= MAX_FD_SLOT) {
+						Irp->IoStatus.Information = 0;
+						ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+						function_exit(DBG_IOCTL, "KVM_RUN");
+						break;
+					}
+					run = (struct kvm_run*)extension->runMapInfo[vcpu_fd].kernelVAaddress;
+				} else {
+					RtlCopyMemory(&kvm_run, inBuf, sizeof(kvm_run));
+					vcpu_fd = kvm_run.vcpu_fd;
+					run = &kvm_run;
+				}
+
+				vcpu = run ? get_vcpu(vcpu_fd) : NULL;
 				SAFE_ASSERT(vcpu);
 
 				if (vcpu) {
-					resultvar = kvm_vcpu_ioctl_run(vcpu, &kvm_run);
+					run->_errno = 0;
+					resultvar = kvm_vcpu_ioctl_run(vcpu, run);
 					if (INTERNAL_SYSCALL_ERROR_P(resultvar, )) {
-						kvm_run._errno = INTERNAL_SYSCALL_ERRNO(resultvar, );
+						run->_errno = INTERNAL_SYSCALL_ERRNO(resultvar, );
 						resultvar = 0xffffffff;
 					} 
-					kvm_run.ioctl_r = (int)resultvar;
-					RtlCopyMemory(outBuf, &kvm_run, sizeof(kvm_run));
-					Irp->IoStatus.Information = sizeof(kvm_run);
+					run->ioctl_r = (int)resultvar;
+					if (run == &kvm_run) {
+						RtlCopyMemory(outBuf, &kvm_run, sizeof(kvm_run));
+						Irp->IoStatus.Information = sizeof(kvm_run);
+					} else {
+						Irp->IoStatus.Information = 0;
+					}
 					ntStatus = STATUS_SUCCESS;
 				} else {
 					Irp->IoStatus.Information = 0;
@@ -653,7 +704,8 @@ __winkvmstab_ioctl(IN PDEVICE_OBJECT DeviceObject,
 						CloseUserMapping(mapMemInfo->npages, init.slot, mapMemInfo);						
 					}
 
-					ntStatus = CreateUserMapping(init.npages, init.slot, mapMemInfo);
+					ntStatus = CreateUserMapping(init.npages, init.slot, init.base_gfn,
+												 init.flags, mapMemInfo);
 					if (!NT_SUCCESS(ntStatus)) {
 						init.mapUserVA       = NULL;
 						init.npages          = 0;
@@ -701,6 +753,299 @@ __winkvmstab_ioctl(IN PDEVICE_OBJECT DeviceObject,
 				break;
 			} /* end WINKVM_MAPMEM_RELEASE */
 
+		case WINKVM_MAP_RUN:
+			{
+				struct winkvm_map_run map_run;
+				MAPMEM *runMapInfo;
+
+				function_enter(DBG_IOCTL, "WINKVM_MAP_RUN");
+
+				RtlCopyMemory(&map_run, inBuf, sizeof(map_run));
+				if (map_run.vcpu_fd < 0 || map_run.vcpu_fd >= MAX_FD_SLOT ||
+					!get_vcpu(map_run.vcpu_fd)) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_MAP_RUN");
+					break;
+				}
+
+				runMapInfo = &extension->runMapInfo[map_run.vcpu_fd];
+				if (runMapInfo->npages > 0) {
+					kvm_vcpu_set_run_page(get_vcpu(map_run.vcpu_fd), NULL);
+					CloseRunMapping(runMapInfo);
+				}
+
+				ntStatus = CreateRunMapping(runMapInfo, WINKVM_RUN_SIZE);
+				if (NT_SUCCESS(ntStatus)) {
+					((struct kvm_run*)runMapInfo->kernelVAaddress)->vcpu_fd = map_run.vcpu_fd;
+					/* string I/O is batched through the rest of this page */
+					kvm_vcpu_set_run_page(get_vcpu(map_run.vcpu_fd),
+										  (struct kvm_run*)runMapInfo->kernelVAaddress);
+					map_run.mapUserVA = (__u8*)runMapInfo->userVAaddress;
+					map_run.size      = WINKVM_RUN_SIZE;
+				} else {
+					map_run.mapUserVA = NULL;
+					map_run.size      = 0;
+				}
+				RtlCopyMemory(outBuf, &map_run, sizeof(map_run));
+
+				Irp->IoStatus.Information = sizeof(map_run);
+				function_exit(DBG_IOCTL, "WINKVM_MAP_RUN");
+				break;
+			} /* end WINKVM_MAP_RUN */
+
+		case WINKVM_GET_MMU_POOL:
+			{
+				struct winkvm_mmu_pool pool;
+
+				function_enter(DBG_IOCTL, "WINKVM_GET_MMU_POOL");
+
+				RtlCopyMemory(&pool, inBuf, sizeof(pool));
+				if (pool.vm_fd < 0 || pool.vm_fd >= MAX_FD_SLOT) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_GET_MMU_POOL");
+					break;
+				}
+				kvm_vm_ioctl_get_mmu_pool(get_kvm(pool.vm_fd), &pool);
+				RtlCopyMemory(outBuf, &pool, sizeof(pool));
+
+				Irp->IoStatus.Information = sizeof(pool);
+				ntStatus = STATUS_SUCCESS;
+				function_exit(DBG_IOCTL, "WINKVM_GET_MMU_POOL");
+				break;
+			} /* end WINKVM_GET_MMU_POOL */
+
+		case WINKVM_REGISTER_COALESCED_MMIO:
+			{
+				struct winkvm_coalesced_mmio_zone zone;
+				int ret;
+
+				function_enter(DBG_IOCTL, "WINKVM_REGISTER_COALESCED_MMIO");
+
+				RtlCopyMemory(&zone, inBuf, sizeof(zone));
+				if (zone.vm_fd < 0 || zone.vm_fd >= MAX_FD_SLOT) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_REGISTER_COALESCED_MMIO");
+					break;
+				}
+				ret = kvm_vm_ioctl_register_coalesced_mmio(get_kvm(zone.vm_fd), &zone);
+
+				Irp->IoStatus.Information = 0;
+				ntStatus = ret ? STATUS_INSUFFICIENT_RESOURCES : STATUS_SUCCESS;
+				function_exit(DBG_IOCTL, "WINKVM_REGISTER_COALESCED_MMIO");
+				break;
+			} /* end WINKVM_REGISTER_COALESCED_MMIO */
+
+		case WINKVM_UNREGISTER_COALESCED_MMIO:
+			{
+				struct winkvm_coalesced_mmio_zone zone;
+
+				function_enter(DBG_IOCTL, "WINKVM_UNREGISTER_COALESCED_MMIO");
+
+				RtlCopyMemory(&zone, inBuf, sizeof(zone));
+				if (zone.vm_fd < 0 || zone.vm_fd >= MAX_FD_SLOT) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_UNREGISTER_COALESCED_MMIO");
+					break;
+				}
+				kvm_vm_ioctl_unregister_coalesced_mmio(get_kvm(zone.vm_fd), &zone);
+
+				Irp->IoStatus.Information = 0;
+				ntStatus = STATUS_SUCCESS;
+				function_exit(DBG_IOCTL, "WINKVM_UNREGISTER_COALESCED_MMIO");
+				break;
+			} /* end WINKVM_UNREGISTER_COALESCED_MMIO */
+
+		case WINKVM_CREATE_IRQCHIP:
+			{
+				int vm_fd;
+				int ret;
+
+				function_enter(DBG_IOCTL, "WINKVM_CREATE_IRQCHIP");
+
+				RtlCopyMemory(&vm_fd, inBuf, sizeof(vm_fd));
+				if (vm_fd < 0 || vm_fd >= MAX_FD_SLOT) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_CREATE_IRQCHIP");
+					break;
+				}
+				ret = kvm_vm_ioctl_create_irqchip(get_kvm(vm_fd));
+
+				Irp->IoStatus.Information = 0;
+				ntStatus = ret ? STATUS_INSUFFICIENT_RESOURCES : STATUS_SUCCESS;
+				function_exit(DBG_IOCTL, "WINKVM_CREATE_IRQCHIP");
+				break;
+			} /* end WINKVM_CREATE_IRQCHIP */
+
+		case WINKVM_IRQ_LINE:
+			{
+				struct winkvm_irq_level irq_level;
+				int ret;
+
+				function_enter(DBG_IOCTL, "WINKVM_IRQ_LINE");
+
+				RtlCopyMemory(&irq_level, inBuf, sizeof(irq_level));
+				if (irq_level.vm_fd < 0 || irq_level.vm_fd >= MAX_FD_SLOT) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_IRQ_LINE");
+					break;
+				}
+				ret = kvm_vm_ioctl_irq_line(get_kvm(irq_level.vm_fd), &irq_level);
+
+				Irp->IoStatus.Information = 0;
+				ntStatus = ret ? STATUS_INVALID_DEVICE_REQUEST : STATUS_SUCCESS;
+				function_exit(DBG_IOCTL, "WINKVM_IRQ_LINE");
+				break;
+			} /* end WINKVM_IRQ_LINE */
+
+		case WINKVM_APIC_DELIVER:
+			{
+				struct winkvm_apic_msg msg;
+				int ret;
+
+				function_enter(DBG_IOCTL, "WINKVM_APIC_DELIVER");
+
+				RtlCopyMemory(&msg, inBuf, sizeof(msg));
+				if (msg.vm_fd < 0 || msg.vm_fd >= MAX_FD_SLOT) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_APIC_DELIVER");
+					break;
+				}
+				ret = kvm_vm_ioctl_apic_deliver(get_kvm(msg.vm_fd), &msg);
+
+				Irp->IoStatus.Information = 0;
+				ntStatus = ret ? STATUS_INVALID_DEVICE_REQUEST : STATUS_SUCCESS;
+				function_exit(DBG_IOCTL, "WINKVM_APIC_DELIVER");
+				break;
+			} /* end WINKVM_APIC_DELIVER */
+
+		case WINKVM_GET_STATS:
+			{
+				/* too large for the stack, filled in place */
+				struct winkvm_stats *stats = (struct winkvm_stats *)outBuf;
+				int ret;
+
+				function_enter(DBG_IOCTL, "WINKVM_GET_STATS");
+
+				if (inBufLen < sizeof(*stats) || outBufLen < sizeof(*stats) ||
+					stats->vm_fd < 0 || stats->vm_fd >= MAX_FD_SLOT) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_GET_STATS");
+					break;
+				}
+				ret = kvm_vm_ioctl_get_stats(get_kvm(stats->vm_fd), stats);
+
+				Irp->IoStatus.Information = ret ? 0 : sizeof(*stats);
+				ntStatus = ret ? STATUS_INVALID_DEVICE_REQUEST : STATUS_SUCCESS;
+				function_exit(DBG_IOCTL, "WINKVM_GET_STATS");
+				break;
+			} /* end WINKVM_GET_STATS */
+
+		case WINKVM_GET_TRACE:
+			{
+				/* too large for the stack, filled in place */
+				struct winkvm_trace *trace = (struct winkvm_trace *)outBuf;
+				int ret;
+
+				function_enter(DBG_IOCTL, "WINKVM_GET_TRACE");
+
+				if (inBufLen < sizeof(*trace) || outBufLen < sizeof(*trace)) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_GET_TRACE");
+					break;
+				}
+				ret = kvm_dev_ioctl_get_trace(trace);
+
+				Irp->IoStatus.Information = ret ? 0 : sizeof(*trace);
+				ntStatus = ret ? STATUS_INVALID_DEVICE_REQUEST : STATUS_SUCCESS;
+				function_exit(DBG_IOCTL, "WINKVM_GET_TRACE");
+				break;
+			} /* end WINKVM_GET_TRACE */
+
+		case WINKVM_MARK_DIRTY:
+			{
+				struct winkvm_dirty_gfns *dirty = (struct winkvm_dirty_gfns *)inBuf;
+				int ret;
+
+				function_enter(DBG_IOCTL, "WINKVM_MARK_DIRTY");
+
+				if (inBufLen < sizeof(*dirty) ||
+					dirty->nr > (inBufLen - sizeof(*dirty)) / sizeof(dirty->gfn[0]) ||
+					dirty->vm_fd < 0 || dirty->vm_fd >= MAX_FD_SLOT) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_MARK_DIRTY");
+					break;
+				}
+				ret = kvm_vm_ioctl_mark_dirty(get_kvm(dirty->vm_fd), dirty);
+
+				Irp->IoStatus.Information = 0;
+				ntStatus = ConvertRetval(ret);
+				function_exit(DBG_IOCTL, "WINKVM_MARK_DIRTY");
+				break;
+			} /* end WINKVM_MARK_DIRTY */
+
+		case WINKVM_BALLOON:
+			{
+				/* filled in place, in and out share the system buffer */
+				struct winkvm_balloon *balloon = (struct winkvm_balloon *)inBuf;
+				int ret;
+
+				function_enter(DBG_IOCTL, "WINKVM_BALLOON");
+
+				if (inBufLen < sizeof(*balloon) || outBufLen < sizeof(*balloon) ||
+					balloon->nr > (inBufLen - sizeof(*balloon)) / sizeof(balloon->gfn[0]) ||
+					balloon->vm_fd < 0 || balloon->vm_fd >= MAX_FD_SLOT) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_BALLOON");
+					break;
+				}
+				ret = kvm_vm_ioctl_balloon(get_kvm(balloon->vm_fd), balloon);
+
+				Irp->IoStatus.Information = ret ? 0 : sizeof(*balloon);
+				ntStatus = ConvertRetval(ret);
+				function_exit(DBG_IOCTL, "WINKVM_BALLOON");
+				break;
+			} /* end WINKVM_BALLOON */
+
+		case WINKVM_RESET_DIRTY_RINGS:
+			{
+				struct winkvm_dirty_reset reset;
+				int ret;
+
+				function_enter(DBG_IOCTL, "WINKVM_RESET_DIRTY_RINGS");
+
+				if (inBufLen < sizeof(reset) || outBufLen < sizeof(reset)) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_RESET_DIRTY_RINGS");
+					break;
+				}
+				RtlCopyMemory(&reset, inBuf, sizeof(reset));
+				if (reset.vm_fd < 0 || reset.vm_fd >= MAX_FD_SLOT) {
+					Irp->IoStatus.Information = 0;
+					ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+					function_exit(DBG_IOCTL, "WINKVM_RESET_DIRTY_RINGS");
+					break;
+				}
+				ret = kvm_vm_ioctl_reset_dirty_rings(get_kvm(reset.vm_fd), &reset);
+				RtlCopyMemory(outBuf, &reset, sizeof(reset));
+
+				Irp->IoStatus.Information = ret ? 0 : sizeof(reset);
+				ntStatus = ConvertRetval(ret);
+				function_exit(DBG_IOCTL, "WINKVM_RESET_DIRTY_RINGS");
+				break;
+			} /* end WINKVM_RESET_DIRTY_RINGS */
+
 		default:
 			ntStatus = STATUS_UNSUCCESSFUL;
 			printk(KERN_ALERT "ERROR: unreconginzed IOCTL: %x\n", 
@@ -17,11 +17,23 @@ extern void _cdecl vmx_exit(void);
 
 /* dev */
 extern int _cdecl kvm_dev_ioctl_create_vm(void);
+extern int _cdecl kvm_dev_ioctl_get_trace(struct winkvm_trace *trace);
 
 /* vm */
 extern int _cdecl kvm_vm_ioctl_set_memory_region(struct kvm *kvm, struct kvm_memory_region *mem);
 extern int _cdecl kvm_vm_ioctl_create_vcpu(struct kvm *kvm, int n);
 extern int _cdecl kvm_vm_ioctl_get_dirty_log(struct kvm *kvm, struct kvm_dirty_log *log);
+extern int _cdecl kvm_vm_ioctl_set_mmu_pages(struct kvm *kvm, unsigned int n_mmu_pages);
+extern int _cdecl kvm_vm_ioctl_get_mmu_pool(struct kvm *kvm, struct winkvm_mmu_pool *pool);
+extern int _cdecl kvm_vm_ioctl_get_stats(struct kvm *kvm, struct winkvm_stats *stats);
+extern int _cdecl kvm_vm_ioctl_mark_dirty(struct kvm *kvm, struct winkvm_dirty_gfns *dirty);
+extern int _cdecl kvm_vm_ioctl_balloon(struct kvm *kvm, struct winkvm_balloon *balloon);
+extern int _cdecl kvm_vm_ioctl_reset_dirty_rings(struct kvm *kvm, struct winkvm_dirty_reset *reset);
+extern int _cdecl kvm_vm_ioctl_register_coalesced_mmio(struct kvm *kvm, struct winkvm_coalesced_mmio_zone *zone);
+extern int _cdecl kvm_vm_ioctl_unregister_coalesced_mmio(struct kvm *kvm, struct winkvm_coalesced_mmio_zone *zone);
+extern int _cdecl kvm_vm_ioctl_create_irqchip(struct kvm *kvm);
+extern int _cdecl kvm_vm_ioctl_irq_line(struct kvm *kvm, struct winkvm_irq_level *irq_level);
+extern int _cdecl kvm_vm_ioctl_apic_deliver(struct kvm *kvm, struct winkvm_apic_msg *msg);
 extern int _cdecl kvm_read_guest(struct kvm_vcpu *vcpu, gva_t addr, unsigned long size, void *dest);
 extern int _cdecl kvm_write_guest(struct kvm_vcpu *vcpu, gva_t addr, unsigned long size, void *data);
 extern int _cdecl kvm_vm_release(struct inode *inode, struct file *filp);
@@ -34,6 +46,7 @@ extern int _cdecl kvm_vcpu_ioctl_set_sregs(struct kvm_vcpu *vcpu, struct kvm_sre
 extern int _cdecl kvm_vcpu_ioctl_get_sregs(struct kvm_vcpu *vcpu, struct kvm_sregs *sregs);
 extern int _cdecl kvm_vcpu_ioctl_translate(struct kvm_vcpu *vcpu, struct kvm_translation *tr);
 extern int _cdecl kvm_vcpu_ioctl_interrupt(struct kvm_vcpu *vcpu, struct kvm_interrupt *irq);
+extern void _cdecl kvm_vcpu_set_run_page(struct kvm_vcpu *vcpu, struct kvm_run *run);
 extern int _cdecl kvm_vcpu_release(struct inode *inode, struct file *filp);
 
 extern int _cdecl check_function_pointer_test(void);
@@ -25,30 +25,50 @@
 #define PAGE_NOTNEED_FREE    0x2
 #define PAGE_MEMMAPPED       0x3
 
-#define PAGE_PDE(x)         ((x) >> 22)
-#define PAGE_PTE(x)         (((x) >> 12) & 0x3ff)
-#define PAGE_NUM(pde, pte)  (((pde) << 22) | ((pte) << 12))
+/*
+ * Host frames are found through a four level radix tree of 1024
+ * entries per level: page_map_root -> page_dir -> page_dir -> page_root.
+ * That covers 40-bit pfns, i.e. 52-bit physical addresses, so guests
+ * can be backed by whatever MmAllocatePagesForMdl() hands out.
+ * Nodes are published with a compare-exchange and never freed before
+ * release_slab_emulater(), so lookups take no lock.
+ */
+#define PAGE_MAP_SHIFT       10
+#define PAGE_MAP_ENTRIES     (1 << PAGE_MAP_SHIFT)
+#define PAGE_MAP_LEVELS      4
+#define PAGE_MAP_INDEX(pfn, level) \
+	((unsigned int)((pfn) >> ((level) * PAGE_MAP_SHIFT)) & (PAGE_MAP_ENTRIES - 1))
 
-static struct page_root *get_page_rootslot(hva_t pageaddr);
-static struct page *get_page_slot(hpa_t pageaddr);
+static struct page *get_page_slot(hpa_t pageaddr, int create);
 
 /* ToDo: use extern value */
 static PWINKVM_DEVICE_EXTENSION extension = NULL;
 
+/* last hit of get_mapmem_slot(), ranges are checked again before use */
+static MAPMEM *last_mapmem = NULL;
+
 static MAPMEM*
 get_mapmem_slot(unsigned long gfn)
 {
 	int i;
 	unsigned long base_gfn, npages;
+	MAPMEM *mapMemInfo = last_mapmem;
 
 	SAFE_ASSERT(extension != NULL);
 
+	if (mapMemInfo &&
+		mapMemInfo->base_gfn <= gfn && 
+		(mapMemInfo->base_gfn + mapMemInfo->npages) > gfn)
+		return mapMemInfo;
+
 	for (i = 0 ; i < MAX_MEMMAP_SLOT ; i++) {
 		base_gfn = extension->mapMemInfo[i].base_gfn;
 		npages   = extension->mapMemInfo[i].npages;
 
-		if (base_gfn <= gfn && (base_gfn + npages) > gfn)
-			return &extension->mapMemInfo[i];
+		if (base_gfn <= gfn && (base_gfn + npages) > gfn) {
+			last_mapmem = &extension->mapMemInfo[i];
+			return last_mapmem;
+		}
 	}
 
 	return NULL;
@@ -106,20 +126,10 @@ void
 __INIT(init_slab_emulater(PWINKVM_DEVICE_EXTENSION extn))
 {
 	int i;
-	struct page_root *pgr;
-	unsigned long addr;
-	unsigned long cache_size = 0;	
 
 	/* initialize global page allocater */
 	RtlZeroMemory(&extn->globalMemTbl, sizeof(extn->globalMemTbl));
-
-	extn->globalMemTbl.page_slot_num = 
-		sizeof(extn->globalMemTbl.page_slot_root) / sizeof(struct page_root*);
-
 	ExInitializeFastMutex(&extn->globalMemTbl.page_emulater_mutex);
-
-	for (i = 0 ; i < extn->globalMemTbl.page_slot_num ; i++)
-		extn->globalMemTbl.page_slot_root[i] = NULL;
 	/* end */
 
 	/* initialize winkvm shared page allocater */
@@ -127,72 +137,85 @@ __INIT(init_slab_emulater(PWINKVM_DEVICE_EXTENSION extn))
 		RtlZeroMemory(&extn->mapMemInfo[i], sizeof(MAPMEM));
 	/* end */
 
+	last_mapmem = NULL;
+	extension = extn;
+}
+
+/*
+ * Free the pool pages still held by a leaf of the page map.
+ */
+static void free_page_root(struct page_root *pgr)
+{
+	int i;
+	struct page *pd = pgr->page;
 
-	/* allocate global pageallocater cache slot */
-	/* cache_size = 1024 * 1024 * 1; */
-	cache_size = 0;
-	for (addr = 0 ; addr < cache_size ; addr += PAGE_SIZE) {
-		pgr = extn->globalMemTbl.page_slot_root[PAGE_PDE(addr)];
-		if (!pgr) {
-			pgr = (struct page_root*)ExAllocatePoolWithTag(
-				                 NonPagedPool, 
-								 sizeof(struct page_root), 
-								 MEM_TAG);
-			SAFE_ASSERT(pgr);
-			extn->globalMemTbl.page_slot_root[PAGE_PDE(addr)] = pgr;
+	for (i = 0 ; i < PAGE_MAP_ENTRIES ; i++) {
+		if (pd[i].page_type == PAGE_NEED_FREE) {
+			KeFreePageMemory(pd[i].independed.systemVA, pd[i].independed.size);
+			RtlZeroMemory(&pd[i], sizeof(struct page));
 		}
-		RtlZeroMemory(pgr, sizeof(struct page_root));
 	}
-
-	ExInitializeFastMutex(&extn->globalMemTbl.page_emulater_mutex);
-	extension = extn;
 }
 
-void 
-__RELEASE(release_slab_emulater(PWINKVM_DEVICE_EXTENSION extn))
+/*
+ * Visit every leaf of the page map, and free the nodes too when
+ * @release is set.
+ */
+static void walk_page_map(PWINKVM_DEVICE_EXTENSION extn, int release)
 {
-	int i, j;
-	struct page *pd;
-	
-	/* free all global page allocater  */
-	for (i = 0 ; i < extn->globalMemTbl.page_slot_num ; i++) {
-		if (extn->globalMemTbl.page_slot_root[i]) {
-			pd = extn->globalMemTbl.page_slot_root[i]->page;
-			/* bug!! */
-			for (j = 0 ; j < 1024 ; j++)  {
-				if (pd[j].page_type == PAGE_NEED_FREE)
-					KeFreePageMemory(pd[j].independed.systemVA, pd[j].independed.size);
+	int i, j, k;
+	struct page_dir *mid, *low;
+	struct page_root *pgr;
+
+	for (i = 0 ; i < PAGE_MAP_ENTRIES ; i++) {
+		mid = extn->globalMemTbl.page_map_root[i];
+		if (!mid)
+			continue;
+		for (j = 0 ; j < PAGE_MAP_ENTRIES ; j++) {
+			low = mid->slot[j];
+			if (!low)
+				continue;
+			for (k = 0 ; k < PAGE_MAP_ENTRIES ; k++) {
+				pgr = low->slot[k];
+				if (!pgr)
+					continue;
+				free_page_root(pgr);
+				if (release)
+					ExFreePoolWithTag(pgr, MEM_TAG);
 			}
-			ExFreePoolWithTag(extn->globalMemTbl.page_slot_root[i], MEM_TAG);
-			extn->globalMemTbl.page_slot_root[i] = NULL;
+			if (release)
+				ExFreePoolWithTag(low, MEM_TAG);
+		}
+		if (release) {
+			ExFreePoolWithTag(mid, MEM_TAG);
+			extn->globalMemTbl.page_map_root[i] = NULL;
 		}
 	}
 
+	if (release)
+		extn->globalMemTbl.page_root_num = 0;
+}
+
+void 
+__RELEASE(release_slab_emulater(PWINKVM_DEVICE_EXTENSION extn))
+{
+	int i;
+
 	for (i = 0 ; i < MAX_MEMMAP_SLOT ; i++) {
 		CloseUserMapping(extn->mapMemInfo[i].npages, i, &extn->mapMemInfo[i]);
 		RtlZeroMemory(&extn->mapMemInfo[i], sizeof(MAPMEM));
 	}
 
+	/* free all global page allocater  */
+	walk_page_map(extn, 1);
+
+	last_mapmem = NULL;
 	extension = NULL;
 }
 
 void flush_memtable(void)
 {
-	int i, j;
-	struct page *pd;
-	PWINKVM_DEVICE_EXTENSION extn = extension;
-
-	for (i = 0 ; i < extn->globalMemTbl.page_slot_num ; i++) {
-		if (extn->globalMemTbl.page_slot_root[i]) {
-			pd = extn->globalMemTbl.page_slot_root[i]->page;
-			/* bug!! */
-			for (j = 0 ; j < 1024 ; j++)  {
-				if (pd[j].page_type == PAGE_NEED_FREE)
-					KeFreePageMemory(pd[j].independed.systemVA, pd[j].independed.size);
-			}
-			RtlZeroMemory(pd, sizeof(struct page));
-		}
-	}
+	walk_page_map(extension, 0);
 }
 
 int _cdecl check_page_compatible(unsigned long page_size,
@@ -411,7 +434,7 @@ struct page* _cdecl alloc_pages(unsigned int flags, unsigned int order)
 
 	for (i = sysAddr ; i < (sysAddr + actual_size) ; i += PAGE_SIZE) {
 		paAddr = (hpa_t)__pa(i);
-		page = get_page_slot(paAddr);
+		page = get_page_slot(paAddr, 1);
 		SAFE_ASSERT(page);		
 		SAFE_ASSERT(page->page_type == PAGE_NOT_USED);
 
@@ -481,7 +504,7 @@ void _cdecl free_pages(hva_t addr, unsigned long order)
 	hpa_t  phys = __pa(addr);
 	SAFE_ASSERT(phys != 0ull);
 
-	page = get_page_slot(phys);
+	page = get_page_slot(phys, 0);
 	SAFE_ASSERT(page != NULL);
 	SAFE_ASSERT(page->page_type != PAGE_NOT_USED);
 
@@ -491,40 +514,115 @@ void _cdecl free_pages(hva_t addr, unsigned long order)
 /* 
  * for global page allocater table
  */
-static struct page_root *get_page_rootslot(hva_t pageaddr)
+static void *get_page_node(void **slot, SIZE_T size, int create)
 {
-	return extension->globalMemTbl.page_slot_root[PAGE_PDE(pageaddr)];
+	void *node = *slot;
+
+	if (node || !create)
+		return node;
+
+	node = ExAllocatePoolWithTag(NonPagedPool, size, MEM_TAG);
+	if (!node)
+		return NULL;
+	RtlZeroMemory(node, size);
+
+	/* somebody else may have filled the slot meanwhile */
+	if (InterlockedCompareExchangePointer(slot, node, NULL) != NULL) {
+		ExFreePoolWithTag(node, MEM_TAG);
+		return *slot;
+	}
+
+	if (size == sizeof(struct page_root))
+		InterlockedIncrement(&extension->globalMemTbl.page_root_num);
+
+	return node;
 }
 
-static struct page *get_page_slot(hpa_t pageaddr)
+static struct page *get_page_slot(hpa_t pageaddr, int create)
 {
+	u64 pfn = pageaddr >> PAGE_SHIFT;
+	struct page_dir *mid, *low;
 	struct page_root *pgr;
-	struct page *page;
-	hpa_t  addr = pageaddr;
 
 	SAFE_ASSERT(extension != NULL);
 
-	pgr = extension->globalMemTbl.page_slot_root[PAGE_PDE(addr)];
-	if (!pgr) {
-		pgr = (struct page_root*)ExAllocatePoolWithTag(
-			                NonPagedPool, 
-							sizeof(struct page_root), 
-							MEM_TAG);
-		extension->globalMemTbl.page_slot_root[PAGE_PDE(addr)] = pgr;
-		RtlZeroMemory(pgr, sizeof(struct page_root));
+	if (pfn >> (PAGE_MAP_LEVELS * PAGE_MAP_SHIFT)) {
+		printk(KERN_ALERT "%s: physical address 0x%llx is out of range\n",
+			   __FUNCTION__, pageaddr);
+		return NULL;
 	}
 
-	page = &pgr->page[PAGE_PTE(addr)];
-	if (!page)
-		SAFE_ASSERT(0);
+	mid = get_page_node(
+		(void**)&extension->globalMemTbl.page_map_root[PAGE_MAP_INDEX(pfn, 3)],
+		sizeof(struct page_dir), create);
+	if (!mid)
+		return NULL;
+
+	low = get_page_node(&mid->slot[PAGE_MAP_INDEX(pfn, 2)],
+						sizeof(struct page_dir), create);
+	if (!low)
+		return NULL;
+
+	pgr = get_page_node(&low->slot[PAGE_MAP_INDEX(pfn, 1)],
+						sizeof(struct page_root), create);
+	if (!pgr)
+		return NULL;
+
+	return &pgr->page[PAGE_MAP_INDEX(pfn, 0)];
+}
+
+/*
+ * Make sure that every frame described by @mdl has its struct page
+ * before the guest range is handed out, so that wk_alloc_page() and
+ * pfn_to_page() never allocate.
+ */
+NTSTATUS populate_page_slots(PMDL mdl)
+{
+	PPFN_NUMBER pfns = MmGetMdlPfnArray(mdl);
+	SIZE_T npages, i;
+	u64 last = ~0ull;
+
+	npages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(mdl),
+											MmGetMdlByteCount(mdl));
+
+	for (i = 0 ; i < npages ; i++) {
+		/* one lookup per leaf is enough */
+		if (((u64)pfns[i] >> PAGE_MAP_SHIFT) == last)
+			continue;
+		if (!get_page_slot((hpa_t)pfns[i] << PAGE_SHIFT, 1))
+			return STATUS_INSUFFICIENT_RESOURCES;
+		last = (u64)pfns[i] >> PAGE_MAP_SHIFT;
+	}
+
+	return STATUS_SUCCESS;
+}
 
-	return page;
+/*
+ * Forget the struct pages of a guest range before its frames go back
+ * to the system.  The nodes stay, the next mapping will likely reuse them.
+ */
+void clear_page_slots(PMDL mdl)
+{
+	PPFN_NUMBER pfns = MmGetMdlPfnArray(mdl);
+	SIZE_T npages, i;
+	struct page *page;
+
+	npages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(mdl),
+											MmGetMdlByteCount(mdl));
+
+	for (i = 0 ; i < npages ; i++) {
+		page = get_page_slot((hpa_t)pfns[i] << PAGE_SHIFT, 0);
+		if (page && page->page_type == PAGE_MEMMAPPED)
+			RtlZeroMemory(page, sizeof(struct page));
+	}
 }
 
 struct page* _cdecl pfn_to_page(hfn_t pfn)
 {
-	struct page *ret = get_page_slot(pfn << PAGE_SHIFT);
+	struct page *ret = get_page_slot((hpa_t)pfn << PAGE_SHIFT, 0);
 	SAFE_ASSERT(ret != NULL);
+	if (!ret)
+		return NULL;
 	if (ret->page_type == PAGE_NOT_USED) {
 		printk(KERN_ALERT 
 			"%s WARNING You are trying to get a non allocated-page area. "
@@ -609,6 +707,9 @@ struct page* _cdecl wk_alloc_page(unsigned long g_basefn, unsigned long pnum, un
 			return NULL;
 	}
 
+	if (mapMemInfo->apChunkMdl)
+		return wk_demand_page(gfn);
+
 	if (!mapMemInfo->kernelVAaddress)
 		mapMemInfo->kernelVAaddress = MmGetSystemAddressForMdlSafe(
 			                             mapMemInfo->apMdl[0], 
@@ -622,8 +723,11 @@ struct page* _cdecl wk_alloc_page(unsigned long g_basefn, unsigned long pnum, un
 	sysAddr = sysBase + offset;
 	sysPhys = __pa(sysAddr); 
 
-	entry = get_page_slot(sysPhys);
+	/* populate_page_slots() has set up the map for this range */
+	entry = get_page_slot(sysPhys, 0);
 	SAFE_ASSERT(entry);
+	if (!entry)
+		return NULL;
 	SAFE_ASSERT(entry->page_type == PAGE_NOT_USED);
 
 	RtlZeroMemory(entry, sizeof(struct page));
@@ -638,6 +742,131 @@ struct page* _cdecl wk_alloc_page(unsigned long g_basefn, unsigned long pnum, un
 	return entry;
 }
 
+/*
+ * for demand-paged guest memory, see LockDemandChunk()
+ */
+int _cdecl wk_demand_paged(unsigned long gfn)
+{
+	MAPMEM *mapMemInfo = get_mapmem_slot(gfn);
+
+	return mapMemInfo && mapMemInfo->apChunkMdl;
+}
+
+/*
+ * Lock the chunks holding gfn ... gfn + npages - 1.  They are paged in
+ * if need be, so this must run at IRQL <= APC_LEVEL in the process of
+ * the vm.  Returns 0 on success.
+ */
+int _cdecl wk_populate_pages(unsigned long gfn, unsigned long npages)
+{
+	MAPMEM        *mapMemInfo = get_mapmem_slot(gfn);
+	unsigned long chunk, last;
+	NTSTATUS      status = STATUS_SUCCESS;
+
+	if (!mapMemInfo || !mapMemInfo->apChunkMdl || !npages ||
+		gfn + npages > mapMemInfo->base_gfn + mapMemInfo->npages)
+		return -1;
+
+	last = DEMAND_CHUNK(mapMemInfo, gfn + npages - 1);
+
+	ExAcquireFastMutex(&extension->globalMemTbl.page_emulater_mutex);
+	for (chunk = DEMAND_CHUNK(mapMemInfo, gfn) ; chunk <= last ; chunk++) {
+		status = LockDemandChunk(mapMemInfo, chunk);
+		if (!NT_SUCCESS(status))
+			break;
+	}
+	ExReleaseFastMutex(&extension->globalMemTbl.page_emulater_mutex);
+
+	return NT_SUCCESS(status) ? 0 : -1;
+}
+
+/*
+ * Unlock the chunks holding gfn ... gfn + npages - 1 again, once the
+ * core has dropped every mapping of them.  IRQL <= APC_LEVEL.
+ * Returns 0 on success.
+ */
+int _cdecl wk_release_pages(unsigned long gfn, unsigned long npages)
+{
+	MAPMEM        *mapMemInfo = get_mapmem_slot(gfn);
+	unsigned long chunk, last;
+
+	if (!mapMemInfo || !mapMemInfo->apChunkMdl || !npages ||
+		gfn + npages > mapMemInfo->base_gfn + mapMemInfo->npages)
+		return -1;
+
+	last = DEMAND_CHUNK(mapMemInfo, gfn + npages - 1);
+
+	ExAcquireFastMutex(&extension->globalMemTbl.page_emulater_mutex);
+	for (chunk = DEMAND_CHUNK(mapMemInfo, gfn) ; chunk <= last ; chunk++)
+		UnlockDemandChunk(mapMemInfo, chunk);
+	ExReleaseFastMutex(&extension->globalMemTbl.page_emulater_mutex);
+
+	return 0;
+}
+
+/*
+ * The guest gave up the contents of gfn ... gfn + npages - 1, which are
+ * not locked.  PASSIVE_LEVEL, in the process of the vm.
+ */
+void _cdecl wk_discard_pages(unsigned long gfn, unsigned long npages)
+{
+	MAPMEM        *mapMemInfo = get_mapmem_slot(gfn);
+
+	if (!mapMemInfo || !mapMemInfo->apChunkMdl || !npages ||
+		gfn + npages > mapMemInfo->base_gfn + mapMemInfo->npages)
+		return;
+
+	DiscardDemandPages(mapMemInfo, gfn, npages);
+}
+
+/*
+ * The struct page of a gfn in a locked chunk, or NULL.  Safe at
+ * DISPATCH_LEVEL, the core calls it under kvm->lock.
+ */
+struct page* _cdecl wk_demand_page(unsigned long gfn)
+{
+	MAPMEM        *mapMemInfo = get_mapmem_slot(gfn);
+	struct page   *entry;
+	PMDL          mdl;
+	unsigned long chunk, first, idx;
+	hfn_t         pfn;
+
+	if (!mapMemInfo || !mapMemInfo->apChunkMdl)
+		return NULL;
+
+	chunk = DEMAND_CHUNK(mapMemInfo, gfn);
+	mdl   = mapMemInfo->apChunkMdl[chunk];
+	if (!mdl)
+		return NULL;
+
+	first = (mapMemInfo->base_gfn & ~(DEMAND_CHUNK_PAGES - 1)) +
+		chunk * DEMAND_CHUNK_PAGES;
+	if (first < mapMemInfo->base_gfn)
+		first = mapMemInfo->base_gfn;
+	idx = gfn - first;
+	pfn = (hfn_t)MmGetMdlPfnArray(mdl)[idx];
+
+	entry = get_page_slot((hpa_t)pfn << PAGE_SHIFT, 0);
+	SAFE_ASSERT(entry);
+	if (!entry)
+		return NULL;
+
+	/* first use, or handed back by __free_page() of a removed slot */
+	if (entry->page_type == PAGE_NOT_USED) {
+		entry->page_type       = PAGE_MEMMAPPED;
+		entry->mapped.size     = PAGE_SIZE;
+		entry->mapped.systemVA = (PCHAR)MmGetSystemAddressForMdlSafe(
+			                        mdl, HighPagePriority) + (idx << PAGE_SHIFT);
+		entry->mapped.h_pfn    = pfn;
+		entry->mapped.g_pfn    = gfn;
+		entry->mapped.pMdl     = &mapMemInfo->apChunkMdl[chunk];
+		entry->mapped.userVA   = (PCHAR)MmGetMdlVirtualAddress(mdl) +
+			(idx << PAGE_SHIFT);
+	}
+
+	return entry;
+}
+
 void* KeGetPageMemory(unsigned long size)
 {
 	return ExAllocatePoolWithTag(NonPagedPool, size, MEM_TAG);
@@ -13,6 +13,10 @@ struct page_root {
 	struct page page[1024];
 };
 
+struct page_dir {
+	void *slot[1024];
+};
+
 void _cdecl kfree(void *objp);
 void* _cdecl kmalloc(size_t size, int flags);
 void* _cdecl kzalloc(size_t size, int flags);
@@ -49,8 +53,15 @@ void KeFreePageMemory(void *ptr, unsigned long size);
 
 /* winkvm special function */
 struct page* _cdecl wk_alloc_page(unsigned long g_basefn, unsigned long pnum, unsigned int flags);
+int _cdecl wk_demand_paged(unsigned long gfn);
+int _cdecl wk_populate_pages(unsigned long gfn, unsigned long npages);
+struct page* _cdecl wk_demand_page(unsigned long gfn);
+int _cdecl wk_release_pages(unsigned long gfn, unsigned long npages);
+void _cdecl wk_discard_pages(unsigned long gfn, unsigned long npages);
 
 void flush_memtable(void);
+NTSTATUS populate_page_slots(PMDL mdl);
+void clear_page_slots(PMDL mdl);
 
 /* initailizer */
 void init_slab_emulater(WINKVM_DEVICE_EXTENSION *extn);
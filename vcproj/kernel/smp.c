@@ -19,7 +19,10 @@
 #include "kernel.h"
 #include "smp.h"
 
-ULONG_PTR NTAPI smp_call_function_wrapper(IN ULONG_PTR Context);
+static VOID smp_call_function_dpc(IN PKDPC Dpc, IN PVOID Context,
+								  IN PVOID Arg1, IN PVOID Arg2);
+static VOID smp_kick_dpc(IN PKDPC Dpc, IN PVOID Context,
+						 IN PVOID Arg1, IN PVOID Arg2);
 
 /* for mmu.obj */
 unsigned long bad_page_address;
@@ -31,25 +34,22 @@ void
 __INIT(init_smp_emulater(IN WINKVM_DEVICE_EXTENSION *extn))
 {
 	int i;
-	KAFFINITY aps;
-	ULONG cpus = KeQueryActiveProcessorCountCompatible(&aps);
-
-	if (!extn->mutex_emulater_initialized)
-		for (i = 0 ; i < MAX_MUTEX_COUNT ; ++i)
-			extn->mutex_slot[i].used = 0;
-
-	if (!extn->spinlock_emulater_initialized)
-		for (i = 0 ; i < MAX_SPINLOCK_COUNT ; ++i)
-			extn->spinlock_slot[i].used = 0;
 
-	for (i = 0 ; i < SMPF_SLOTNUM ; i++)
-		RtlZeroMemory(&extn->smpf_data_slot[i], sizeof(struct smpf_data));
-
-	ExInitializeFastMutex(&extn->emulater_mutex);
-	ExInitializeFastMutex(&extn->emulater_spinlock);
-
-	extn->mutex_emulater_initialized    = 1;
-	extn->spinlock_emulater_initialized = 1;
+	for (i = 0 ; i < SMPF_SLOTNUM ; i++) {
+		struct smpf_data *smpf = &extn->smpf_data_slot[i];
+
+		RtlZeroMemory(smpf, sizeof(struct smpf_data));
+		smpf->mycpu_num = i;
+		KeInitializeDpc(&smpf->dpc, smp_call_function_dpc, smpf);
+		KeSetTargetProcessorDpc(&smpf->dpc, (CCHAR)i);
+		KeSetImportanceDpc(&smpf->dpc, HighImportance);
+		KeInitializeDpc(&smpf->kick_dpc, smp_kick_dpc, smpf);
+		KeSetTargetProcessorDpc(&smpf->kick_dpc, (CCHAR)i);
+		KeSetImportanceDpc(&smpf->kick_dpc, HighImportance);
+		ExInitializeFastMutex(&smpf->owner);
+	}
+	ExInitializeFastMutex(&extn->smpf_mutex);
+	extn->smpf_pending = 0;
 
 	/* for debug */
 	printk(KERN_ERR "Number Processors: %d\n", get_nr_cpus());
@@ -60,152 +60,91 @@ __INIT(init_smp_emulater(IN WINKVM_DEVICE_EXTENSION *extn))
 void 
 __RELEASE(release_smp_emulater(IN WINKVM_DEVICE_EXTENSION *extn))
 {	
-	int i;
-
-	ExAcquireFastMutex(&extn->emulater_mutex);
-	{
-		if (extn->mutex_emulater_initialized)
-			for (i = 0 ; i < MAX_MUTEX_COUNT ; ++i)
-				extn->mutex_slot[i].used = 0;
-	} ExReleaseFastMutex(&extn->emulater_mutex);
-
-	ExAcquireFastMutex(&extn->emulater_spinlock);
-	{
-		if (extn->spinlock_emulater_initialized)
-			for (i = 0 ; i < MAX_SPINLOCK_COUNT ; ++i)
-				extn->spinlock_slot[i].used = 0;
-	} ExReleaseFastMutex(&extn->emulater_spinlock);
-
 	extension = NULL;
 
 	return;
 }
 
-void _cdecl mutex_init(struct mutex *lock)
-{
-	int i;
-	FAST_MUTEX *get_mutex = NULL;
-
-	FUNCTION_ENTER();
-
-	SAFE_ASSERT(extension->mutex_emulater_initialized);
+/* the core only sees the size of these, see linux/winkvm.h */
+C_ASSERT(sizeof(FAST_MUTEX) <= sizeof(((struct mutex *)0)->fast_mutex));
+C_ASSERT(sizeof(KSPIN_LOCK) == sizeof(((spinlock_t *)0)->lock));
 
-	ExAcquireFastMutex(&extension->emulater_mutex);
-	{
-		for (i = 0 ; i < MAX_MUTEX_COUNT ; ++i) {
-			if(!extension->mutex_slot[i].used) {
-				get_mutex = &extension->mutex_slot[i].mutex;
-				extension->mutex_slot[i].used = 1;
-				lock->mutex_number = i;
-				break;
-			}
-		}
-	} ExReleaseFastMutex(&extension->emulater_mutex);
+#define FAST_MUTEX_OF(m) ((PFAST_MUTEX)(m)->fast_mutex)
+#define KSPIN_LOCK_OF(l) ((PKSPIN_LOCK)&(l)->lock)
 
-	SAFE_ASSERT(get_mutex != NULL);
-	ExInitializeFastMutex(get_mutex);
-
-	FUNCTION_EXIT();
-
-	return;
+void _cdecl mutex_init(struct mutex *lock)
+{
+	ExInitializeFastMutex(FAST_MUTEX_OF(lock));
 }
 
 void _cdecl mutex_lock(struct mutex *lock)
 {
-	FAST_MUTEX *mutex;
-	SAFE_ASSERT(lock->mutex_number < MAX_MUTEX_COUNT);
-	SAFE_ASSERT(extension->mutex_slot[lock->mutex_number].used);
-	FUNCTION_ENTER();
-
-	mutex = &(extension->mutex_slot[lock->mutex_number].mutex);
-
-	ExAcquireFastMutex(mutex);
-
-	FUNCTION_EXIT();
+	ExAcquireFastMutex(FAST_MUTEX_OF(lock));
 }
 
 void _cdecl mutex_unlock(struct mutex *lock)
 {
-	FAST_MUTEX *mutex;
-
-	FUNCTION_ENTER();
-
-	SAFE_ASSERT(lock->mutex_number < MAX_MUTEX_COUNT);
-	SAFE_ASSERT(extension->mutex_slot[lock->mutex_number].used);
-
-	mutex = &(extension->mutex_slot[lock->mutex_number].mutex);
-
-	ExReleaseFastMutex(mutex);
-
-	FUNCTION_EXIT();
+	ExReleaseFastMutex(FAST_MUTEX_OF(lock));
 }
 
 int _cdecl mutex_trylock(struct mutex *lock)
 {
-	FAST_MUTEX *mutex;
-
-	FUNCTION_ENTER();
-
-	SAFE_ASSERT(lock->mutex_number < MAX_MUTEX_COUNT);
-	SAFE_ASSERT(extension->mutex_slot[lock->mutex_number].used == 1);
-
-	mutex = &(extension->mutex_slot[lock->mutex_number].mutex);
-
-	if (ExTryToAcquireFastMutex(mutex)) {
-		FUNCTION_EXIT();
-		return 1;
-	}
-
-	FUNCTION_EXIT();
-	return 0;
+	return ExTryToAcquireFastMutex(FAST_MUTEX_OF(lock)) ? 1 : 0;
 }
 
 void _cdecl spin_lock_init(spinlock_t *lock)
 {
-	int i;
-	struct spinlock_emulater_slot *new_slot = NULL;
-
-	FUNCTION_ENTER();
-
-	ExAcquireFastMutex(&extension->emulater_spinlock); 
-	{
-		for (i = 0 ; i < MAX_SPINLOCK_COUNT ; i++) {
-			if (!extension->spinlock_slot[i].used) {
-				new_slot = &extension->spinlock_slot[lock->spinlock_number]; 
-				lock->spinlock_number = i;
-				extension->spinlock_slot[i].used = 1;
-				break;
-			}
-		}
-	} ExReleaseFastMutex(&extension->emulater_spinlock);
-
-	SAFE_ASSERT(new_slot);
-
-	KeInitializeSpinLock(&new_slot->spinlock);
-
-	FUNCTION_EXIT();
+	KeInitializeSpinLock(KSPIN_LOCK_OF(lock));
 }
 
+/*
+ * Queued spinlocks: each waiter spins on its own queue entry instead of
+ * the lock.  The entry has to live until spin_unlock(), so it is taken
+ * from the current cpu, which cannot change once the irql is raised.
+ * The irql is restored when the last lock held on the cpu is dropped,
+ * so the locks need not be released in reverse order.
+ */
 void _cdecl spin_lock(spinlock_t *lock)
 {   
-	struct spinlock_emulater_slot *slot;
-	FUNCTION_ENTER();
-	SAFE_ASSERT(lock->spinlock_number < MAX_SPINLOCK_COUNT);   	
-	slot = &extension->spinlock_slot[lock->spinlock_number];
-	SAFE_ASSERT(slot->used);
-	KeAcquireSpinLock(&slot->spinlock, &slot->IrqL);
-	FUNCTION_EXIT();
+	struct smpf_data *smpf;
+	KIRQL irql;
+	int i;
+
+	KeRaiseIrql(DISPATCH_LEVEL, &irql);
+	smpf = &extension->smpf_data_slot[KeGetCurrentProcessorNumber()];
+
+	for (i = 0 ; i < SPIN_NEST_MAX ; i++)
+		if (!smpf->lock_held[i])
+			break;
+	/* nowhere to queue: spinning on the lock itself would break the queue */
+	if (i == SPIN_NEST_MAX)
+		KeBugCheckEx(SPIN_LOCK_INIT_FAILURE, (ULONG_PTR)lock, SPIN_NEST_MAX, 0, 0);
+
+	KeAcquireInStackQueuedSpinLockAtDpcLevel(KSPIN_LOCK_OF(lock),
+											 &smpf->lock_queue[i]);
+	smpf->lock_held[i] = KSPIN_LOCK_OF(lock);
+	if (smpf->lock_count++ == 0)
+		smpf->lock_irql = irql;
 }
 
 void _cdecl spin_unlock(spinlock_t *lock)
 {
-	struct spinlock_emulater_slot *slot;
-	FUNCTION_ENTER();
-	SAFE_ASSERT(lock->spinlock_number < MAX_SPINLOCK_COUNT);   
-	slot = &extension->spinlock_slot[lock->spinlock_number];
-	SAFE_ASSERT(slot->used);
-	KeReleaseSpinLock(&slot->spinlock, slot->IrqL);
-	FUNCTION_EXIT();
+	struct smpf_data *smpf;
+	int i;
+
+	smpf = &extension->smpf_data_slot[KeGetCurrentProcessorNumber()];
+
+	for (i = 0 ; i < SPIN_NEST_MAX ; i++)
+		if (smpf->lock_held[i] == KSPIN_LOCK_OF(lock))
+			break;
+	SAFE_ASSERT(i < SPIN_NEST_MAX);
+	if (i == SPIN_NEST_MAX)
+		return;
+
+	KeReleaseInStackQueuedSpinLockFromDpcLevel(&smpf->lock_queue[i]);
+	smpf->lock_held[i] = NULL;
+	if (--smpf->lock_count == 0)
+		KeLowerIrql(smpf->lock_irql);
 }
 
 void _cdecl prefetch(const void *x)
@@ -244,7 +183,10 @@ int _cdecl first_cpu(void)
 int _cdecl get_nr_cpus(void)
 {
 	KAFFINITY aps;
-	return (int)KeQueryActiveProcessorCountCompatible(&aps);
+	int cpus = (int)KeQueryActiveProcessorCountCompatible(&aps);
+
+	/* per_cpu() arrays of kvm have SMPF_SLOTNUM entries */
+	return (cpus < SMPF_SLOTNUM) ? cpus : SMPF_SLOTNUM;
 }
 
 int _cdecl next_cpu(int cpu)
@@ -257,27 +199,108 @@ int _cdecl raw_smp_processor_id(void)
 	return (int)KeGetCurrentProcessorNumber();
 }
 
+/*
+ * We can not disable preemption like linux does.
+ * Instead, the thread is pinned to the cpu it is running on, and it owns
+ * the VMX state of that cpu until put_cpu(), so that another vcpu thread
+ * scheduled on the same cpu can not VMPTRLD its own VMCS in between.
+ * Must be called at IRQL <= APC_LEVEL, and calls must not nest.
+ */
 int _cdecl get_cpu(void)	
 {
-	/* FIXME: smp process */
-	/* This function have to ensure preempt */
-	raw_smp_processor_id();
-	return 1;
+	int cpu;
+
+	KeSetSystemAffinityThread((KAFFINITY)1 << KeGetCurrentProcessorNumber());
+	cpu = raw_smp_processor_id();
+	ExAcquireFastMutex(&extension->smpf_data_slot[cpu].owner);
+
+	return cpu;
 }
 
 int _cdecl put_cpu(void)
 {
-	/* FIXME: smp process */
-	/* This function have to ensure preempt */
-	raw_smp_processor_id();
-	return 1;
+	int cpu = raw_smp_processor_id();
+
+	ExReleaseFastMutex(&extension->smpf_data_slot[cpu].owner);
+	KeRevertToUserAffinityThread();
+
+	return cpu;
 }
 
-ULONG_PTR NTAPI smp_call_function_wrapper(IN ULONG_PTR Context)
+static VOID smp_call_function_dpc(IN PKDPC Dpc, IN PVOID Context,
+								  IN PVOID Arg1, IN PVOID Arg2)
 {
 	struct smpf_data *smpf = (struct smpf_data*)Context;
+
 	smpf->func(smpf->info);
-	return (ULONG_PTR)&smpf->mycpu_num;
+	InterlockedDecrement(&extension->smpf_pending);
+}
+
+static VOID smp_kick_dpc(IN PKDPC Dpc, IN PVOID Context,
+						 IN PVOID Arg1, IN PVOID Arg2)
+{
+	/* nothing to do, the vm exit already happened */
+}
+
+/*
+ * Interrupt cpu, so that a vcpu running there leaves the guest and
+ * looks at its pending interrupts.  Does not wait, callable up to
+ * DISPATCH_LEVEL.
+ */
+void _cdecl smp_send_reschedule(int cpu)
+{
+	if (cpu < 0 || cpu >= get_nr_cpus())
+		return;
+
+	KeInsertQueueDpc(&extension->smpf_data_slot[cpu].kick_dpc, NULL, NULL);
+}
+
+/*
+ * Run func on every cpu in mask.
+ * The other cpus are reached through a DPC targeted at them (XP does not
+ * have KeIpiGenericCall), the current cpu calls func directly.
+ * Always waits for completion, because the DPC slots are shared.
+ */
+static int smp_call_function_mask(KAFFINITY mask, void (_cdecl *func)(void *info),
+								  void *info)
+{
+	KIRQL oldIrql;
+	int i, me;
+
+	SAFE_ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
+
+	mask &= KeQueryActiveProcessors();
+
+	ExAcquireFastMutex(&extension->smpf_mutex);
+
+	KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+	me = raw_smp_processor_id();
+
+	for (i = 0 ; i < get_nr_cpus() ; i++) {
+		struct smpf_data *smpf = &extension->smpf_data_slot[i];
+
+		if (i == me || !(mask & ((KAFFINITY)1 << i)))
+			continue;
+		smpf->func = func;
+		smpf->info = info;
+		InterlockedIncrement(&extension->smpf_pending);
+		KeInsertQueueDpc(&smpf->dpc, NULL, NULL);
+	}
+
+	if (mask & ((KAFFINITY)1 << me)) {
+		local_irq_disable();
+		func(info);
+		local_irq_enable();
+	}
+
+	KeLowerIrql(oldIrql);
+
+	while (extension->smpf_pending)
+		KeStallExecutionProcessor(1);
+
+	ExReleaseFastMutex(&extension->smpf_mutex);
+
+	return 0;
 }
 
 /**
@@ -298,26 +321,9 @@ ULONG_PTR NTAPI smp_call_function_wrapper(IN ULONG_PTR Context)
 int _cdecl smp_call_function(void (_cdecl *func)(void *info), void *info, int nonatomic,
 							 int wait)
 {
-	/*
-	int i;
-	KAFFINITY aps;
-	*/
-
-	/* SAFE_ASSERT(smpf_data_slot); */
-	/* FIX ME!! does not support SMP */	
+	KAFFINITY others = ~((KAFFINITY)1 << raw_smp_processor_id());
 
-	/* Hmm... XP does not support KeIpiGenericCall... */
-	/*
-	for (i = 0 ; i < KeQueryActiveProcessorCountCompatible(&aps) ; i++) {
-		KeIpiGenericCall(smp_call_function_wrapper, (ULONG_PTR)&smpf_data_slot[i]);
-	}
-	*/
-
-	local_irq_disable();
-	func(info);
-	local_irq_enable();
-
-	return 0;
+	return smp_call_function_mask(others, func, info);
 }
 
 /**
@@ -336,7 +342,10 @@ int _cdecl smp_call_function(void (_cdecl *func)(void *info), void *info, int no
 int _cdecl smp_call_function_single(int cpu, void (_cdecl *func)(void *info), void *info,
 									int nonatomic, int wait)
 {	
-	return smp_call_function(func, info, nonatomic, wait);	
+	if (cpu < 0 || cpu >= get_nr_cpus())
+		return -1;
+
+	return smp_call_function_mask((KAFFINITY)1 << cpu, func, info);
 }
 
 /*
@@ -348,6 +357,6 @@ int _cdecl smp_call_function_single(int cpu, void (_cdecl *func)(void *info), vo
  */
 int _cdecl on_each_cpu(void (_cdecl *func)(void *info), void *info, int retry, int wait)
 {
-	return smp_call_function(func, info, retry, wait);	
+	return smp_call_function_mask(~(KAFFINITY)0, func, info);
 }
 
@@ -27,6 +27,7 @@ int _cdecl smp_call_function_single(int cpu, void (_cdecl *func)(void *info), vo
 									int nonatomic, int wait);
 
 int _cdecl raw_smp_processor_id(void);
+void _cdecl smp_send_reschedule(int cpu);
 void _cdecl prefetch(const void *x);
 
 void _cdecl smp_wmb(void);
@@ -0,0 +1,194 @@
+/*
+ * timer.c
+ * Host timers and events for the in-kernel pic, pit and local apic
+ *
+ * Copyright (C) Kazushi Takahashi <kazushi@rvm.jp>, 2009
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "init.h"
+#include "kernel.h"
+#include "timer.h"
+
+/*
+ * A KTIMER whose DPC calls func at DISPATCH_LEVEL.  Periodic timers are
+ * re-armed from the DPC against the ideal expiry time, so that the
+ * period does not drift; ticks that are already late are coalesced
+ * into one.  Times are in 100ns units of KeQueryInterruptTime().
+ */
+struct winkvm_timer {
+	KTIMER timer;
+	KDPC dpc;
+	KSPIN_LOCK lock;
+	void (_cdecl *func)(void *data);
+	void *data;
+	ULONGLONG expires;
+	ULONGLONG period;	/* 0 for a one shot timer */
+	ULONG generation;	/* bumped by start and cancel */
+	int dead;
+};
+
+struct winkvm_event {
+	KEVENT event;
+};
+
+/* under t->lock */
+static void winkvm_timer_arm(struct winkvm_timer *t)
+{
+	ULONGLONG now = KeQueryInterruptTime();
+	LARGE_INTEGER due;
+
+	if (t->expires <= now)
+		due.QuadPart = -1;
+	else
+		due.QuadPart = -(LONGLONG)(t->expires - now);
+	KeSetTimer(&t->timer, due, &t->dpc);
+}
+
+static VOID winkvm_timer_dpc(IN PKDPC Dpc, IN PVOID Context,
+							 IN PVOID Arg1, IN PVOID Arg2)
+{
+	struct winkvm_timer *t = (struct winkvm_timer*)Context;
+	ULONG generation;
+	ULONGLONG now;
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock(&t->lock, &oldIrql);
+	generation = t->generation;
+	KeReleaseSpinLock(&t->lock, oldIrql);
+
+	t->func(t->data);
+
+	/* a start or cancel from func or another cpu wins */
+	KeAcquireSpinLock(&t->lock, &oldIrql);
+	if (t->period && !t->dead && t->generation == generation) {
+		now = KeQueryInterruptTime();
+		t->expires += t->period;
+		if (t->expires <= now)
+			t->expires = now;
+		winkvm_timer_arm(t);
+	}
+	KeReleaseSpinLock(&t->lock, oldIrql);
+}
+
+struct winkvm_timer* _cdecl winkvm_timer_create(void (_cdecl *func)(void *data), void *data)
+{
+	struct winkvm_timer *t;
+
+	t = ExAllocatePoolWithTag(NonPagedPool, sizeof(struct winkvm_timer), MEM_TAG);
+	if (!t)
+		return NULL;
+	RtlZeroMemory(t, sizeof(struct winkvm_timer));
+	KeInitializeTimer(&t->timer);
+	KeInitializeDpc(&t->dpc, winkvm_timer_dpc, t);
+	KeInitializeSpinLock(&t->lock);
+	t->func = func;
+	t->data = data;
+	return t;
+}
+
+/*
+ * (Re)arm the timer to fire after delay_ns, then every period_ns if
+ * period_ns is not 0.  Callable up to DISPATCH_LEVEL.
+ */
+void _cdecl winkvm_timer_start(struct winkvm_timer *t, u64 delay_ns, u64 period_ns)
+{
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock(&t->lock, &oldIrql);
+	if (!t->dead) {
+		t->generation++;
+		t->expires = KeQueryInterruptTime() + delay_ns / 100;
+		t->period = period_ns / 100;
+		/* a period below the clock resolution would only spin */
+		if (period_ns && !t->period)
+			t->period = 1;
+		winkvm_timer_arm(t);
+	}
+	KeReleaseSpinLock(&t->lock, oldIrql);
+}
+
+/* Does not wait for a running DPC, see winkvm_timer_destroy() */
+void _cdecl winkvm_timer_cancel(struct winkvm_timer *t)
+{
+	KIRQL oldIrql;
+
+	KeAcquireSpinLock(&t->lock, &oldIrql);
+	t->generation++;
+	t->period = 0;
+	KeCancelTimer(&t->timer);
+	KeReleaseSpinLock(&t->lock, oldIrql);
+}
+
+/* Must be called at PASSIVE_LEVEL */
+void _cdecl winkvm_timer_destroy(struct winkvm_timer *t)
+{
+	KIRQL oldIrql;
+
+	if (!t)
+		return;
+
+	KeAcquireSpinLock(&t->lock, &oldIrql);
+	t->dead = 1;
+	t->period = 0;
+	KeCancelTimer(&t->timer);
+	KeReleaseSpinLock(&t->lock, oldIrql);
+
+	/* a DPC that was already queued does not re-arm, wait for it */
+	KeFlushQueuedDpcs();
+	KeCancelTimer(&t->timer);
+
+	ExFreePoolWithTag(t, MEM_TAG);
+}
+
+u64 _cdecl winkvm_get_ns(void)
+{
+	return (u64)KeQueryInterruptTime() * 100;
+}
+
+struct winkvm_event* _cdecl winkvm_event_create(void)
+{
+	struct winkvm_event *ev;
+
+	ev = ExAllocatePoolWithTag(NonPagedPool, sizeof(struct winkvm_event), MEM_TAG);
+	if (!ev)
+		return NULL;
+	KeInitializeEvent(&ev->event, SynchronizationEvent, FALSE);
+	return ev;
+}
+
+/* Callable up to DISPATCH_LEVEL */
+void _cdecl winkvm_event_set(struct winkvm_event *ev)
+{
+	KeSetEvent(&ev->event, IO_NO_INCREMENT, FALSE);
+}
+
+/*
+ * Wait until the event is set or timeout_ns elapsed, at or below
+ * APC_LEVEL.  Returns 1 if the event was set.
+ */
+int _cdecl winkvm_event_wait(struct winkvm_event *ev, u64 timeout_ns)
+{
+	LARGE_INTEGER timeout;
+	NTSTATUS status;
+
+	timeout.QuadPart = -(LONGLONG)(timeout_ns / 100);
+	status = KeWaitForSingleObject(&ev->event, Executive, KernelMode,
+								   FALSE, &timeout);
+	return status == STATUS_SUCCESS;
+}
+
+void _cdecl winkvm_event_destroy(struct winkvm_event *ev)
+{
+	if (ev)
+		ExFreePoolWithTag(ev, MEM_TAG);
+}
@@ -0,0 +1,22 @@
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include "init.h"
+#include "kernel.h"
+
+struct winkvm_timer;
+struct winkvm_event;
+
+struct winkvm_timer* _cdecl winkvm_timer_create(void (_cdecl *func)(void *data), void *data);
+void _cdecl winkvm_timer_start(struct winkvm_timer *timer, u64 delay_ns, u64 period_ns);
+void _cdecl winkvm_timer_cancel(struct winkvm_timer *timer);
+void _cdecl winkvm_timer_destroy(struct winkvm_timer *timer);
+u64 _cdecl winkvm_get_ns(void);
+
+struct winkvm_event* _cdecl winkvm_event_create(void);
+void _cdecl winkvm_event_set(struct winkvm_event *event);
+int _cdecl winkvm_event_wait(struct winkvm_event *event, u64 timeout_ns);
+void _cdecl winkvm_event_destroy(struct winkvm_event *event);
+
+#endif
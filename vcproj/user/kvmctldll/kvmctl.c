@@ -21,7 +21,8 @@
 
 #define WINKVM_DEVICE_NAME "\\\\.\\winkvm"
 
-#define KVM_MAX_NUM_MEM_REGIONS 4u
+#define KVM_MAX_NUM_MEM_REGIONS 32u /* KVM_MEMORY_SLOTS of the driver */
+#define MAX_VCPUS 8 /* must not exceed KVM_MAX_VCPUS of the driver */
 
 static int handle_mmio(kvm_context_t kvm, struct kvm_run *kvm_run);
 static int handle_io_window(kvm_context_t kvm, struct kvm_run *kvm_run);
@@ -29,13 +30,14 @@ static int handle_halt(kvm_context_t kvm, struct kvm_run *kvm_run, int vcpu);
 static int handle_shutdown(kvm_context_t kvm, struct kvm_run *kvm_run,
 						   int vcpu);
 
-static void post_kvm_run(kvm_context_t kvm, struct kvm_run *kvm_run);
-static void pre_kvm_run(kvm_context_t kvm, struct kvm_run *kvm_run);
+static void post_kvm_run(kvm_context_t kvm, int vcpu, struct kvm_run *kvm_run);
+static void pre_kvm_run(kvm_context_t kvm, int vcpu, struct kvm_run *kvm_run);
 static int more_io(struct kvm_run *run, int first_time);
 
-int try_push_interrupts(kvm_context_t kvm);
+int try_push_interrupts(kvm_context_t kvm, int vcpu);
 
 static BOOL SetMemmapArea(kvm_context_t kvm, struct winkvm_memmap *map);
+static struct kvm_run *MapRunArea(kvm_context_t kvm, int vcpu_fd);
 
 static LPVOID WkVirtualAlloc(kvm_context_t kvm, struct winkvm_memmap *map);
 static void WkVirtualFree(kvm_context_t kvm, struct winkvm_memmap *map);
@@ -45,6 +47,23 @@ struct winkvm_memmap {
 	struct winkvm_mapmem_initialize init;
 };
 
+#define GTLB_ENTRIES 64	/* a power of two */
+#define GTLB_INVALID ((unsigned long)-1)
+
+/// A guest virtual page and the guest physical page it maps to
+struct gtlb_entry {
+	unsigned long page;
+	uint64_t gpa;
+};
+
+/// The gva translations of a vcpu, valid while kvm_run::tlb_gen is gen
+struct gtlb {
+	__u32 gen;
+	struct gtlb_entry entry[GTLB_ENTRIES];
+};
+
+static void gtlb_flush(struct gtlb *tlb);
+
 /**
  * \brief The KVM context
  *
@@ -56,7 +75,11 @@ struct kvm_context {
 	HANDLE                 hnd;
 
     int     vm_fd;
-    int     vcpu_fd[1];
+    int     vcpu_fd[MAX_VCPUS];
+    /// Handle used by the thread that runs each vcpu
+    HANDLE  vcpu_hnd[MAX_VCPUS];
+    /// struct kvm_run of each vcpu, shared with the driver
+    struct kvm_run *run[MAX_VCPUS];
     /// Callbacks that KVM uses to emulate various unvirtualizable functionality
     struct kvm_callbacks *callbacks;
     void *opaque;
@@ -68,6 +91,14 @@ struct kvm_context {
     struct kvm_memory_region mem_regions[KVM_MAX_NUM_MEM_REGIONS];
 	struct winkvm_memmap mapping[KVM_MAX_NUM_MEM_REGIONS];
 	int current_mapping_slot;
+	/// shadow page pool size passed to KVM_CREATE_VM, 0 for the default
+	unsigned int n_mmu_pages;
+	/// guest memory is allocated when first touched, see kvm_set_demand_paging()
+	int demand_paging;
+	/// the PIC, PIT and local APICs are emulated by the driver
+	int irqchip_in_kernel;
+	/// gva translations of each vcpu, see kvm_translate_gva()
+	struct gtlb tlb[MAX_VCPUS];
 };
 
 struct kvm_context *kvm_context = NULL;
@@ -143,6 +174,11 @@ void kvm_finalize(kvm_context_t kvm)
 			free(kvm->mapping[i].mapping_pvmap);
 	}
 
+	for (i = 0 ; i < MAX_VCPUS ; i++) {
+		if (kvm->vcpu_hnd[i] != INVALID_HANDLE_VALUE)
+			CloseHandle(kvm->vcpu_hnd[i]);
+	}
+
 	CloseHandle(kvm->hnd);	
 
 	kvm_context = NULL;
@@ -185,13 +221,13 @@ int kvm_create(kvm_context_t kvm, unsigned long memory, void **vm_mem)
     unsigned long dosmem = 0xa0000;
     unsigned long exmem = 0xc0000;
     HANDLE  hnd = kvm->hnd;
-	int     fd, retlen, vcpufd;
+	int     fd, retlen;
 //    int zfd;	
 //    int r;
 	struct winkvm_memory_region  low_memory;
 	struct winkvm_memory_region  extended_memory;
 	struct winkvm_memmap         maparea;
-	struct winkvm_create_vcpu    create_vcpu;
+	struct winkvm_create_vm      create_vm;
 	BOOL   ret;
 	
 	kvm_context = kvm;
@@ -208,6 +244,7 @@ int kvm_create(kvm_context_t kvm, unsigned long memory, void **vm_mem)
 	maparea.init.slot      = kvm->current_mapping_slot;
 	maparea.init.base_gfn  = 0 >> PAGE_SHIFT;
 	maparea.init.npages    = memory >> PAGE_SHIFT;
+	maparea.init.flags     = kvm->demand_paging ? WINKVM_MAPMEM_DEMAND : 0;
 
 	if (!SetMemmapArea(kvm, &maparea)) {
 		fprintf(stderr, "Could not initialize Memmap Area: %m\n");
@@ -228,12 +265,15 @@ int kvm_create(kvm_context_t kvm, unsigned long memory, void **vm_mem)
 	
     kvm->vcpu_fd[0] = -1;
 
+	create_vm.n_mmu_pages = kvm->n_mmu_pages;
+	create_vm.padding     = 0;
+
 	fprintf(stderr, "Create VM ... \n");
 	ret = DeviceIoControl(
 		      hnd,			  
 			  KVM_CREATE_VM,
-			  NULL,
-			  0,
+			  &create_vm,
+			  sizeof(create_vm),
 			  &fd,
 			  sizeof(fd),
 			  &retlen,					  
@@ -327,13 +367,27 @@ int kvm_create(kvm_context_t kvm, unsigned long memory, void **vm_mem)
 
 	winkvm_mapping_region_save_params(kvm, &maparea);
 
-	create_vcpu.vm_fd    = fd;
-	create_vcpu.vcpu_fd  = 0;
+	return kvm_create_vcpu(kvm, 0);
+}
+
+int __cdecl kvm_create_vcpu(kvm_context_t kvm, int slot)
+{
+	struct winkvm_create_vcpu create_vcpu;
+	int  vcpufd, retlen;
+	BOOL ret;
+
+	if (slot < 0 || slot >= MAX_VCPUS) {
+		fprintf(stderr, "BUG: %s: invalid parameters\n", __FUNCTION__);
+		return -1;
+	}
+
+	create_vcpu.vm_fd    = kvm->vm_fd;
+	create_vcpu.vcpu_fd  = slot;
 
 	vcpufd = -1;
-	fprintf(stderr, "Create VCPU ... \n");
+	fprintf(stderr, "Create VCPU %d ... \n", slot);
 	ret = DeviceIoControl(
-		      hnd,
+		      kvm->hnd,
 			  KVM_CREATE_VCPU,
 			  &create_vcpu,
 			  sizeof(create_vcpu),
@@ -342,15 +396,276 @@ int kvm_create(kvm_context_t kvm, unsigned long memory, void **vm_mem)
 			  &retlen,
 			  NULL);
 
-     if (vcpufd == -1) {	   
-         fprintf(stderr, " kvm_create_vcpu: %m\n");
-         return -1;
-     }
-	 fprintf(stderr, " vcpu fd : %d\n", vcpufd);
-	 fprintf(stderr, " Done\n");
-	 kvm->vcpu_fd[0] = vcpufd;
+	if (!ret || vcpufd == -1) {	   
+		fprintf(stderr, " kvm_create_vcpu: %m\n");
+		return -1;
+	}
+	fprintf(stderr, " vcpu fd : %d\n", vcpufd);
+	kvm->vcpu_fd[slot] = vcpufd;
+
+	/*
+	 * KVM_RUN blocks while the guest runs. The driver would serialize
+	 * it with the other vcpus on a shared handle, so open our own.
+	 */
+	kvm->vcpu_hnd[slot] = CreateFile(_T(WINKVM_DEVICE_NAME), GENERIC_WRITE,
+									 FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (kvm->vcpu_hnd[slot] == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, " Could not open vcpu handle\n");
+		return -1;
+	}
+
+	kvm->run[slot] = MapRunArea(kvm, vcpufd);
+	if (kvm->run[slot] == NULL) {
+		fprintf(stderr, " Could not map kvm_run area\n");
+		return -1;
+	}
+	fprintf(stderr, " Done\n");
+
+	return 0;
+}
+
+void __cdecl kvm_set_mmu_pages(kvm_context_t kvm, unsigned int n_mmu_pages)
+{
+	kvm->n_mmu_pages = n_mmu_pages;
+}
+
+void __cdecl kvm_set_demand_paging(kvm_context_t kvm, int enable)
+{
+	kvm->demand_paging = enable;
+}
+
+int __cdecl kvm_get_mmu_pool(kvm_context_t kvm, struct winkvm_mmu_pool *pool)
+{
+	BOOL ret;
+	int retlen;
+
+	pool->vm_fd = kvm->vm_fd;
+	ret = DeviceIoControl(
+		      kvm->hnd,
+			  WINKVM_GET_MMU_POOL,
+			  pool,
+			  sizeof(*pool),
+			  pool,
+			  sizeof(*pool),
+			  &retlen,
+			  NULL);
+
+	if (!ret) {
+		fprintf(stderr, "kvm_get_mmu_pool: failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int __cdecl kvm_get_stats(kvm_context_t kvm, int vcpu,
+						  struct winkvm_vcpu_stat *stat)
+{
+	struct winkvm_stats stats;
+	BOOL ret;
+	int retlen;
+
+	stats.vm_fd = kvm->vm_fd;
+	stats.vcpu  = vcpu;
+	ret = DeviceIoControl(
+		      kvm->hnd,
+			  WINKVM_GET_STATS,
+			  &stats,
+			  sizeof(stats),
+			  &stats,
+			  sizeof(stats),
+			  &retlen,
+			  NULL);
+
+	if (!ret) {
+		fprintf(stderr, "kvm_get_stats: failed\n");
+		return -1;
+	}
 
-	 return 0;
+	memcpy(stat, &stats.stat, sizeof(*stat));
+	return 0;
+}
+
+int __cdecl kvm_get_trace(kvm_context_t kvm, int cpu,
+						  struct winkvm_trace *trace)
+{
+	BOOL ret;
+	int retlen;
+
+	trace->cpu = cpu;
+	ret = DeviceIoControl(
+		      kvm->hnd,
+			  WINKVM_GET_TRACE,
+			  trace,
+			  sizeof(*trace),
+			  trace,
+			  sizeof(*trace),
+			  &retlen,
+			  NULL);
+
+	if (!ret) {
+		fprintf(stderr, "kvm_get_trace: failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int coalesced_mmio_ioctl(kvm_context_t kvm, DWORD code,
+								uint64_t addr, uint32_t size)
+{
+	struct winkvm_coalesced_mmio_zone zone;
+	BOOL ret;
+	int retlen;
+
+	zone.vm_fd = kvm->vm_fd;
+	zone.addr  = addr;
+	zone.size  = size;
+	ret = DeviceIoControl(
+		      kvm->hnd,
+			  code,
+			  &zone,
+			  sizeof(zone),
+			  NULL,
+			  0,
+			  &retlen,
+			  NULL);
+
+	return ret ? 0 : -1;
+}
+
+int __cdecl kvm_register_coalesced_mmio(kvm_context_t kvm, uint64_t addr,
+									   uint32_t size)
+{
+	if (coalesced_mmio_ioctl(kvm, WINKVM_REGISTER_COALESCED_MMIO,
+							 addr, size)) {
+		fprintf(stderr, "kvm_register_coalesced_mmio: failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+int __cdecl kvm_unregister_coalesced_mmio(kvm_context_t kvm, uint64_t addr,
+										 uint32_t size)
+{
+	return coalesced_mmio_ioctl(kvm, WINKVM_UNREGISTER_COALESCED_MMIO,
+								addr, size);
+}
+
+int __cdecl kvm_create_irqchip(kvm_context_t kvm)
+{
+	BOOL ret;
+	int retlen;
+
+	ret = DeviceIoControl(
+		      kvm->hnd,
+			  WINKVM_CREATE_IRQCHIP,
+			  &kvm->vm_fd,
+			  sizeof(kvm->vm_fd),
+			  NULL,
+			  0,
+			  &retlen,
+			  NULL);
+
+	if (!ret) {
+		fprintf(stderr, "kvm_create_irqchip: failed\n");
+		return -1;
+	}
+	kvm->irqchip_in_kernel = 1;
+	return 0;
+}
+
+int __cdecl kvm_irqchip_in_kernel(kvm_context_t kvm)
+{
+	return kvm->irqchip_in_kernel;
+}
+
+int __cdecl kvm_set_irq_level(kvm_context_t kvm, int irq, int level)
+{
+	struct winkvm_irq_level irq_level;
+	BOOL ret;
+	int retlen;
+
+	irq_level.vm_fd = kvm->vm_fd;
+	irq_level.irq   = irq;
+	irq_level.level = level;
+	ret = DeviceIoControl(
+		      kvm->hnd,
+			  WINKVM_IRQ_LINE,
+			  &irq_level,
+			  sizeof(irq_level),
+			  NULL,
+			  0,
+			  &retlen,
+			  NULL);
+
+	return ret ? 0 : -1;
+}
+
+int __cdecl kvm_apic_deliver(kvm_context_t kvm, uint8_t dest, uint8_t dest_mode,
+							 uint8_t delivery_mode, uint8_t vector,
+							 uint8_t trig_mode)
+{
+	struct winkvm_apic_msg msg;
+	BOOL ret;
+	int retlen;
+
+	msg.vm_fd         = kvm->vm_fd;
+	msg.dest          = dest;
+	msg.dest_mode     = dest_mode;
+	msg.delivery_mode = delivery_mode;
+	msg.vector        = vector;
+	msg.trig_mode     = trig_mode;
+	ret = DeviceIoControl(
+		      kvm->hnd,
+			  WINKVM_APIC_DELIVER,
+			  &msg,
+			  sizeof(msg),
+			  NULL,
+			  0,
+			  &retlen,
+			  NULL);
+
+	return ret ? 0 : -1;
+}
+
+/*
+ * The ring of each vcpu follows its kvm_run page.  The driver only moves
+ * last, so entries up to it are complete once it is read.
+ */
+void __cdecl kvm_flush_coalesced_mmio(kvm_context_t kvm)
+{
+	struct winkvm_coalesced_mmio_ring *ring;
+	struct winkvm_coalesced_mmio *m;
+	int i;
+
+	for (i = 0 ; i < MAX_VCPUS ; i++) {
+		if (!kvm->run[i])
+			continue;
+		ring = (struct winkvm_coalesced_mmio_ring *)
+			((char *)kvm->run[i] + WINKVM_COALESCED_MMIO_OFFSET);
+		while (ring->first != ring->last) {
+			m = &ring->coalesced_mmio[ring->first];
+			switch (m->len) {
+			case 1:
+				kvm->callbacks->writeb(kvm->opaque, m->phys_addr,
+									   m->data[0]);
+				break;
+			case 2:
+				kvm->callbacks->writew(kvm->opaque, m->phys_addr,
+									   *(uint16_t *)m->data);
+				break;
+			case 4:
+				kvm->callbacks->writel(kvm->opaque, m->phys_addr,
+									   *(uint32_t *)m->data);
+				break;
+			case 8:
+				kvm->callbacks->writeq(kvm->opaque, m->phys_addr,
+									   *(uint64_t *)m->data);
+				break;
+			}
+			ring->first = (ring->first + 1) % WINKVM_COALESCED_MMIO_MAX;
+		}
+	}
 }
 
 void *kvm_create_phys_mem(kvm_context_t kvm, unsigned long phys_start,
@@ -450,6 +765,56 @@ void __cdecl kvm_destroy_phys_mem(kvm_context_t kvm, unsigned long phys_start,
 	exit(1);
 }
 
+/*
+ * String I/O batched by the driver: the elements are in the kvm_run page
+ * and the driver updates rsi/rdi/rcx itself, so no translation and no
+ * register round trip is needed here.
+ */
+static int handle_io_batch(kvm_context_t kvm, struct kvm_run *run)
+{
+	uint16_t addr = run->io.port;
+	int size = run->io.size;
+	int count = (int)run->io.count;
+	int _in = (run->io.direction == KVM_EXIT_IO_IN);
+	uint8_t *data = (uint8_t *)run + run->io.data_offset;
+	int i, r = 0;
+
+	if (kvm->callbacks->pio_string)
+		return kvm->callbacks->pio_string(kvm->opaque, addr, size,
+						  count, data, _in);
+
+	for (i = 0; i < count && !r; i++, data += size) {
+		switch (size) {
+		case 1:
+			if (_in)
+				r = kvm->callbacks->inb(kvm->opaque, addr, data);
+			else
+				r = kvm->callbacks->outb(kvm->opaque, addr, *data);
+			break;
+		case 2:
+			if (_in)
+				r = kvm->callbacks->inw(kvm->opaque, addr,
+							(uint16_t *)data);
+			else
+				r = kvm->callbacks->outw(kvm->opaque, addr,
+							 *(uint16_t *)data);
+			break;
+		case 4:
+			if (_in)
+				r = kvm->callbacks->inl(kvm->opaque, addr,
+							(uint32_t *)data);
+			else
+				r = kvm->callbacks->outl(kvm->opaque, addr,
+							 *(uint32_t *)data);
+			break;
+		default:
+			fprintf(stderr, "bad I/O size %d\n", size);
+			return -EMSGSIZE;
+		}
+	}
+	return r;
+}
+
 static int handle_io(kvm_context_t kvm, struct kvm_run *run, int vcpu)
 {
 	uint16_t addr = run->io.port;
@@ -460,6 +825,9 @@ static int handle_io(kvm_context_t kvm, struct kvm_run *run, int vcpu)
 	int _in = (run->io.direction == KVM_EXIT_IO_IN);
 	int r;
 
+	if (run->io.data_offset)
+		return handle_io_batch(kvm, run);
+
 	translation_cache_init(&tr);
 
 	if (run->io.string || _in) {
@@ -713,6 +1081,7 @@ kvm_context_t __cdecl kvm_init(struct kvm_callbacks *callbacks,
 	SYSTEM_INFO SysInfo;
 	HANDLE hnd;
 	kvm_context_t kvm;
+	int i;
 
 	//For benchmark by kazushi
 	//timeBeginPeriod(1000);
@@ -722,10 +1091,20 @@ kvm_context_t __cdecl kvm_init(struct kvm_callbacks *callbacks,
 	kvm = malloc(sizeof(struct kvm_context));
 	kvm->hnd = hnd;
 	kvm->vm_fd = -1;
+	for (i = 0 ; i < MAX_VCPUS ; i++) {
+		kvm->vcpu_fd[i]  = -1;
+		kvm->vcpu_hnd[i] = INVALID_HANDLE_VALUE;
+		kvm->run[i]      = NULL;
+	}
 	kvm->callbacks = callbacks;
 	kvm->opaque = opaque;	
 	kvm->dirty_pages_log_all = 1;
+	kvm->n_mmu_pages = 0;
+	kvm->demand_paging = 0;
 	memset(&kvm->mem_regions, 0, sizeof(kvm->mem_regions));
+	memset(&kvm->mapping, 0, sizeof(kvm->mapping));
+	for (i = 0 ; i < MAX_VCPUS ; i++)
+		gtlb_flush(&kvm->tlb[i]);
 	kvm_context = kvm;
 
 	GetSystemInfo(&SysInfo);
@@ -853,101 +1232,101 @@ int __cdecl kvm_run(kvm_context_t kvm, int vcpu)
 {
 	int r = 0;
 	int fd = kvm->vcpu_fd[vcpu];
-	struct kvm_run kvm_run;
+	struct kvm_run *run = kvm->run[vcpu];
 	int retlen;
 	BOOL ret = FALSE;
 
-	kvm_run.emulated = 0;
-	kvm_run.mmio_completed = 0;
-	kvm_run.vcpu_fd = fd;
+	run->emulated = 0;
+	run->mmio_completed = 0;
 
 again:
-	kvm_run.request_interrupt_window = try_push_interrupts(kvm);
-	pre_kvm_run(kvm, &kvm_run);
+	/* the driver takes interrupts from its own pic and apics */
+	if (kvm->irqchip_in_kernel)
+		run->request_interrupt_window = 0;
+	else
+		run->request_interrupt_window = try_push_interrupts(kvm, vcpu);
+	pre_kvm_run(kvm, vcpu, run);
 
 /*	r = ioctl(fd, KVM_RUN, &kvm_run); */
+	/* exit data comes back in the shared run page, so pass the fd only */
 	ret = DeviceIoControl(
-		    kvm->hnd,
+		    kvm->vcpu_hnd[vcpu],
 			KVM_RUN,
-			&kvm_run,
-			sizeof(kvm_run),
-			&kvm_run,
-			sizeof(kvm_run),
+			&fd,
+			sizeof(fd),
+			NULL,
+			0,
 			&retlen,
 			NULL);
 
-	if (retlen != sizeof(kvm_run)) {
-		fprintf(stderr, "kvm_run: invalid return value\n");
-		return r;
-	}
-
-	post_kvm_run(kvm, &kvm_run);
-	kvm_run.emulated = 0;
-	kvm_run.mmio_completed = 0;
+	post_kvm_run(kvm, vcpu, run);
+	kvm_flush_coalesced_mmio(kvm);
+	run->emulated = 0;
+	run->mmio_completed = 0;
 
 	if (!ret) {
 		fprintf(stderr, "kvm_run: failed\n");
 		return -1;
 	}
-	if (kvm_run.ioctl_r == -1 && kvm_run._errno != EINTR) {
-		r = -(kvm_run._errno);
-		fprintf(stderr, "kvm_run: %d\n", kvm_run._errno);
+	if (run->ioctl_r == -1 && run->_errno != EINTR) {
+		r = -(run->_errno);
+		fprintf(stderr, "kvm_run: %d\n", run->_errno);
 		return r;
 	}
-	if (kvm_run.ioctl_r == -1) {
-		r = handle_io_window(kvm, &kvm_run);
+	if (run->ioctl_r == -1) {
+		r = handle_io_window(kvm, run);
 		goto more;
 	}
 	/*
-	if (kvm_run.ioctl_r == -EINTR) {
-		r = handle_io_window(kvm, &kvm_run);
+	if (run->ioctl_r == -EINTR) {
+		r = handle_io_window(kvm, run);
 		r = 1;
 		goto more;
 	}
 	*/
-	switch (kvm_run.exit_type) {
+	switch (run->exit_type) {
 	case KVM_EXIT_TYPE_FAIL_ENTRY:
 		fprintf(stderr, "kvm_run: failed entry, reason %u\n", 
-			kvm_run.exit_reason & 0xffff);
+			run->exit_reason & 0xffff);
 		return -ENOEXEC;
 		break;
 	case KVM_EXIT_TYPE_VM_EXIT:
-		switch (kvm_run.exit_reason) {
+		switch (run->exit_reason) {
 		case KVM_EXIT_UNKNOWN:
 			fprintf(stderr, "unhandled vm exit:  0x%x\n", 
-			       kvm_run.hw.hardware_exit_reason);
+			       run->hw.hardware_exit_reason);
 			kvm_show_regs(kvm, vcpu);
 			abort();
 			break;
 		case KVM_EXIT_EXCEPTION:
 			fprintf(stderr, "exception %d (%x)\n", 
-			       kvm_run.ex.exception,
-			       kvm_run.ex.error_code);
+			       run->ex.exception,
+			       run->ex.error_code);
 			kvm_show_regs(kvm, vcpu);
 			abort();
 			break;
 		case KVM_EXIT_IO:
-			r = handle_io(kvm, &kvm_run, vcpu);
+			r = handle_io(kvm, run, vcpu);
 			break;
 		case KVM_EXIT_CPUID:
-			r = handle_cpuid(kvm, &kvm_run, vcpu);
+			r = handle_cpuid(kvm, run, vcpu);
 			break;
 		case KVM_EXIT_DEBUG:
-			r = handle_debug(kvm, &kvm_run, vcpu);
+			r = handle_debug(kvm, run, vcpu);
 			break;
 		case KVM_EXIT_MMIO:
-			r = handle_mmio(kvm, &kvm_run);
+			r = handle_mmio(kvm, run);
 			break;
 		case KVM_EXIT_HLT:
-			r = handle_halt(kvm, &kvm_run, vcpu);
+			r = handle_halt(kvm, run, vcpu);
 			break;
 		case KVM_EXIT_IRQ_WINDOW_OPEN:
 			break;
 		case KVM_EXIT_SHUTDOWN:
-			r = handle_shutdown(kvm, &kvm_run, vcpu);
+			r = handle_shutdown(kvm, run, vcpu);
 			break;
 		default:
-			fprintf(stderr, "unhandled vm exit: 0x%x\n", kvm_run.exit_reason);
+			fprintf(stderr, "unhandled vm exit: 0x%x\n", run->exit_reason);
 			kvm_show_regs(kvm, vcpu);
 			abort();
 			break;
@@ -1032,19 +1411,19 @@ static int handle_shutdown(kvm_context_t kvm, struct kvm_run *kvm_run,
     return kvm->callbacks->shutdown(kvm->opaque, vcpu);
 }
 
-int try_push_interrupts(kvm_context_t kvm)
+int try_push_interrupts(kvm_context_t kvm, int vcpu)
 {
-    return kvm->callbacks->try_push_interrupts(kvm->opaque);
+    return kvm->callbacks->try_push_interrupts(kvm->opaque, vcpu);
 }
 
-static void post_kvm_run(kvm_context_t kvm, struct kvm_run *kvm_run)
+static void post_kvm_run(kvm_context_t kvm, int vcpu, struct kvm_run *kvm_run)
 {
-    kvm->callbacks->post_kvm_run(kvm->opaque, kvm_run);
+    kvm->callbacks->post_kvm_run(kvm->opaque, vcpu, kvm_run);
 }
 
-static void pre_kvm_run(kvm_context_t kvm, struct kvm_run *kvm_run)
+static void pre_kvm_run(kvm_context_t kvm, int vcpu, struct kvm_run *kvm_run)
 {
-    kvm->callbacks->pre_kvm_run(kvm->opaque, kvm_run);
+    kvm->callbacks->pre_kvm_run(kvm->opaque, vcpu, kvm_run);
 }
 
 void __cdecl kvmctl_msgbox(const char *msg)
@@ -1330,8 +1709,46 @@ static int __cdecl kvm_get_map(kvm_context_t kvm, int ioctl_num, int slot, void
 /* This is a most important function to enable live-migration */
 int __cdecl kvm_get_dirty_pages(kvm_context_t kvm, int slot, void *buf)
 {
-//	return kvm_get_map(kvm, KVM_GET_DIRTY_LOG, slot, buf);
-	return 0;
+	return kvm_get_map(kvm, KVM_GET_DIRTY_LOG, slot, buf);
+}
+
+/*
+ * The dirty ring of each vcpu follows its coalesced mmio ring.  The
+ * driver only moves last, so entries up to it are complete once it is
+ * read.  The gfns are write protected again only after they were passed
+ * on, so no write between the two is missed.
+ */
+int __cdecl kvm_harvest_dirty_rings(kvm_context_t kvm,
+									void (__cdecl *dirty)(void *opaque, uint64_t gfn),
+									void *opaque)
+{
+	struct winkvm_dirty_ring *ring;
+	struct winkvm_dirty_reset reset;
+	DWORD retlen;
+	BOOL ret;
+	int i;
+
+	for (i = 0 ; i < MAX_VCPUS ; i++) {
+		if (!kvm->run[i])
+			continue;
+		ring = (struct winkvm_dirty_ring *)
+			((char *)kvm->run[i] + WINKVM_DIRTY_RING_OFFSET);
+		while (ring->first != ring->last) {
+			dirty(opaque, ring->gfn[ring->first]);
+			ring->first = (ring->first + 1) % WINKVM_DIRTY_RING_MAX;
+		}
+	}
+
+	memset(&reset, 0, sizeof(reset));
+	reset.vm_fd = kvm->vm_fd;
+	ret = DeviceIoControl(kvm->hnd, WINKVM_RESET_DIRTY_RINGS,
+						  &reset, sizeof(reset), &reset, sizeof(reset),
+						  &retlen, NULL);
+	if (!ret) {
+		fprintf(stderr, "kvm_harvest_dirty_rings: failed\n");
+		return -1;
+	}
+	return reset.overflow ? 1 : 0;
 }
 
 int __cdecl kvm_get_mem_map(kvm_context_t kvm, int slot, void *buf)
@@ -1391,19 +1808,188 @@ int __cdecl kvm_guest_debug(kvm_context_t kvm, int vcpu, struct kvm_debug_guest
 	return -1;
 }
 
+static void gtlb_flush(struct gtlb *tlb)
+{
+	int i;
+
+	for (i = 0; i < GTLB_ENTRIES; i++)
+		tlb->entry[i].page = GTLB_INVALID;
+}
+
+/*
+ * Guest memory is mapped into this process by WINKVM_MAPMEM_INITIALIZE,
+ * so it is accessed in place.  Only a gva translation missing from the
+ * vcpu's tlb costs a KVM_TRANSLATE, and a write one WINKVM_MARK_DIRTY
+ * for all the frames it touched.
+ */
+int __cdecl kvm_translate_gva(kvm_context_t kvm, int vcpu, unsigned long gva,
+							  uint64_t *gpa)
+{
+	unsigned long page = gva & ~(PAGE_SIZE - 1);
+	struct kvm_translation kvm_tr;
+	struct gtlb_entry *e;
+	struct gtlb *tlb;
+	DWORD retlen;
+
+	if (vcpu < 0 || vcpu >= MAX_VCPUS || kvm->vcpu_fd[vcpu] == -1)
+		return -1;
+
+	tlb = &kvm->tlb[vcpu];
+	if (kvm->run[vcpu] && tlb->gen != kvm->run[vcpu]->tlb_gen) {
+		gtlb_flush(tlb);
+		tlb->gen = kvm->run[vcpu]->tlb_gen;
+	}
+
+	e = &tlb->entry[(page >> PAGE_SHIFT) & (GTLB_ENTRIES - 1)];
+	if (e->page != page) {
+		kvm_tr.linear_address = page;
+		kvm_tr.vcpu_fd = kvm->vcpu_fd[vcpu];
+		if (!DeviceIoControl(kvm->hnd, KVM_TRANSLATE,
+							 &kvm_tr, sizeof(kvm_tr),
+							 &kvm_tr, sizeof(kvm_tr),
+							 &retlen, NULL) || !kvm_tr.valid)
+			return -1;
+		e->page = page;
+		e->gpa  = kvm_tr.physical_address;
+	}
+
+	*gpa = e->gpa + (gva & (PAGE_SIZE - 1));
+	return 0;
+}
+
+void * __cdecl kvm_gpa_to_hva(kvm_context_t kvm, uint64_t gpa)
+{
+	unsigned long gfn = (unsigned long)(gpa >> PAGE_SHIFT);
+	struct winkvm_mapmem_initialize *init;
+	int i;
+
+	for (i = 0; i < KVM_MAX_NUM_MEM_REGIONS; i++) {
+		init = &kvm->mapping[i].init;
+		if (init->mapUserVA && gfn - init->base_gfn < init->npages)
+			return init->mapUserVA +
+				(unsigned long)(gpa - ((uint64_t)init->base_gfn << PAGE_SHIFT));
+	}
+	return NULL;
+}
+
+int __cdecl kvm_mark_dirty(kvm_context_t kvm, const uint32_t *gfns, int n)
+{
+	struct winkvm_dirty_gfns *dirty;
+	DWORD retlen;
+	BOOL ret;
+	int size = sizeof(*dirty) + n * sizeof(dirty->gfn[0]);
+
+	dirty = malloc(size);
+	if (!dirty)
+		return -1;
+	dirty->vm_fd = kvm->vm_fd;
+	dirty->nr    = n;
+	memcpy(dirty->gfn, gfns, n * sizeof(dirty->gfn[0]));
+
+	ret = DeviceIoControl(kvm->hnd, WINKVM_MARK_DIRTY,
+						  dirty, size, NULL, 0, &retlen, NULL);
+	free(dirty);
+	if (!ret) {
+		fprintf(stderr, "kvm_mark_dirty: failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+int __cdecl kvm_balloon(kvm_context_t kvm, const uint32_t *gfns, int n,
+						int deflate, uint32_t *ballooned)
+{
+	struct winkvm_balloon *balloon;
+	DWORD retlen;
+	BOOL ret;
+	int size = sizeof(*balloon) + n * sizeof(balloon->gfn[0]);
+
+	balloon = malloc(size);
+	if (!balloon)
+		return -1;
+	balloon->vm_fd   = kvm->vm_fd;
+	balloon->deflate = deflate;
+	balloon->nr      = n;
+	memcpy(balloon->gfn, gfns, n * sizeof(balloon->gfn[0]));
+
+	ret = DeviceIoControl(kvm->hnd, WINKVM_BALLOON,
+						  balloon, size, balloon, sizeof(*balloon),
+						  &retlen, NULL);
+	if (ret && ballooned)
+		*ballooned = balloon->ballooned;
+	free(balloon);
+	if (!ret) {
+		fprintf(stderr, "kvm_balloon: failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+#define DIRTY_BATCH 64
+
+static unsigned long copy_guest_virt(kvm_context_t kvm, int vcpu,
+									 unsigned long gva, unsigned long size,
+									 unsigned char *buf, int write)
+{
+	uint32_t gfns[DIRTY_BATCH];
+	unsigned long done = 0, now;
+	uint64_t gpa;
+	void *hva;
+	int ngfns = 0;
+
+	while (done < size) {
+		if (kvm_translate_gva(kvm, vcpu, gva + done, &gpa))
+			break;
+		hva = kvm_gpa_to_hva(kvm, gpa);
+		if (!hva)
+			break;
+		now = PAGE_SIZE - (unsigned long)(gpa & (PAGE_SIZE - 1));
+		if (now > size - done)
+			now = size - done;
+		if (write) {
+			memcpy(hva, buf + done, now);
+			if (ngfns == DIRTY_BATCH) {
+				kvm_mark_dirty(kvm, gfns, ngfns);
+				ngfns = 0;
+			}
+			gfns[ngfns++] = (uint32_t)(gpa >> PAGE_SHIFT);
+		} else
+			memcpy(buf + done, hva, now);
+		done += now;
+	}
+
+	if (ngfns)
+		kvm_mark_dirty(kvm, gfns, ngfns);
+	return done;
+}
+
+unsigned long __cdecl kvm_read_guest_virt(kvm_context_t kvm, int vcpu,
+										  unsigned long gva, unsigned long size,
+										  void *dest)
+{
+	return copy_guest_virt(kvm, vcpu, gva, size, dest, 0);
+}
+
+unsigned long __cdecl kvm_write_guest_virt(kvm_context_t kvm, int vcpu,
+										   unsigned long gva, unsigned long size,
+										   const void *data)
+{
+	return copy_guest_virt(kvm, vcpu, gva, size, (unsigned char *)data, 1);
+}
+
+/*
+ * WINKVM_READ_GUEST and WINKVM_WRITE_GUEST are only left for what is not
+ * mapped into this process.
+ */
 static struct winkvm_transfer_mem *trans_mem = NULL;
 static unsigned long tbuf_size = 0;
 
-int _cdecl winkvm_read_guest(kvm_context_t kvm, unsigned long addr, 
-							 unsigned long size, void *dest)
+static int read_guest_ioctl(kvm_context_t kvm, unsigned long addr, 
+							unsigned long size, void *dest)
 {
 	int copyed_bytes = 0;
 	BOOL ret;
 
-	if (kvm == NULL) {
-		kvm = kvm_context;
-	}
-
 	if (size > tbuf_size) {
 		/* 512 bytes buffer */
 		trans_mem = realloc(trans_mem, 
@@ -1436,17 +2022,13 @@ int _cdecl winkvm_read_guest(kvm_context_t kvm, unsigned long addr,
 	return copyed_bytes;
 }
 
-int _cdecl winkvm_write_guest(kvm_context_t kvm, unsigned long addr, 
-							  unsigned long size, void *data)
+static int write_guest_ioctl(kvm_context_t kvm, unsigned long addr, 
+							 unsigned long size, void *data)
 {
 	DWORD retlen = 0;
 	int copyed_bytes = 0;
 	BOOL ret = FALSE;
 
-	if (kvm == NULL) {
-		kvm = kvm_context;
-	}
-
 //	fprintf(stderr, "winkvm_write_guest start\n");
 //	fprintf(stderr, "kara\n");
 
@@ -1488,6 +2070,38 @@ int _cdecl winkvm_write_guest(kvm_context_t kvm, unsigned long addr,
 	return copyed_bytes;
 }
 
+int _cdecl winkvm_read_guest(kvm_context_t kvm, unsigned long addr, 
+							 unsigned long size, void *dest)
+{
+	unsigned long done;
+
+	if (kvm == NULL) {
+		kvm = kvm_context;
+	}
+
+	done = kvm_read_guest_virt(kvm, 0, addr, size, dest);
+	if (done < size)
+		done += read_guest_ioctl(kvm, addr + done, size - done,
+								 (char *)dest + done);
+	return done;
+}
+
+int _cdecl winkvm_write_guest(kvm_context_t kvm, unsigned long addr, 
+							  unsigned long size, void *data)
+{
+	unsigned long done;
+
+	if (kvm == NULL) {
+		kvm = kvm_context;
+	}
+
+	done = kvm_write_guest_virt(kvm, 0, addr, size, data);
+	if (done < size)
+		done += write_guest_ioctl(kvm, addr + done, size - done,
+								  (char *)data + done);
+	return done;
+}
+
 static BOOL SetMemmapArea(kvm_context_t kvm, struct winkvm_memmap *map)
 {
 	BOOL Result;
@@ -1522,6 +2136,35 @@ error:
 	return FALSE;
 }
 
+static struct kvm_run *MapRunArea(kvm_context_t kvm, int vcpu_fd)
+{
+	BOOL Result;
+	ULONG ReturnedLength;
+	struct winkvm_map_run map_run;
+
+	map_run.vcpu_fd   = vcpu_fd;
+	map_run.size      = 0;
+	map_run.mapUserVA = NULL;
+
+	Result = DeviceIoControl(
+		kvm->hnd,
+		WINKVM_MAP_RUN,
+		&map_run,
+		sizeof(map_run),
+		&map_run,
+		sizeof(map_run),
+		&ReturnedLength,
+		NULL);
+
+	if (!Result || map_run.mapUserVA == NULL || 
+		map_run.size < WINKVM_RUN_SIZE) {
+		fprintf(stderr, "Driver can not map kvm_run area\n");
+		return NULL;
+	}
+
+	return (struct kvm_run*)map_run.mapUserVA;
+}
+
 static LPVOID WkVirtualAlloc(kvm_context_t kvm, struct winkvm_memmap *map)
 {
 	return map->init.mapUserVA;
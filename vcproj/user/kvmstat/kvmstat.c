@@ -0,0 +1,287 @@
+/*
+ * kvmstat: print the exit counters of a running vm once per interval,
+ * or with -t drain the trace ring of a host cpu
+ *
+ * The vm is named by its fd slot in the driver, which is global to all
+ * the processes that open it; the first vm created gets slot 0.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <linux/winkvmint.h>
+#include <linux/kvm.h>
+
+#define WINKVM_DEVICE_NAME "\\\\.\\winkvm"
+
+static const struct {
+	int reason;
+	const char *name;
+} exit_names[] = {
+	{  0, "exception_nmi" },
+	{  1, "external_interrupt" },
+	{  2, "triple_fault" },
+	{  7, "pending_interrupt" },
+	{  8, "nmi_window" },
+	{  9, "task_switch" },
+	{ 10, "cpuid" },
+	{ 12, "hlt" },
+	{ 13, "invd" },
+	{ 14, "invlpg" },
+	{ 15, "rdpmc" },
+	{ 16, "rdtsc" },
+	{ 18, "vmcall" },
+	{ 28, "cr_access" },
+	{ 29, "dr_access" },
+	{ 30, "io_instruction" },
+	{ 31, "msr_read" },
+	{ 32, "msr_write" },
+	{ 33, "invalid_guest_state" },
+	{ 36, "mwait" },
+	{ 39, "monitor" },
+	{ 40, "pause" },
+	{ 43, "tpr_below_threshold" },
+	{ 44, "apic_access" },
+	{ 48, "ept_violation" },
+	{ 49, "ept_misconfig" },
+};
+
+static const char *exit_name(int reason)
+{
+	static char buf[16];
+	int i;
+
+	for (i = 0; i < sizeof(exit_names) / sizeof(exit_names[0]); i++)
+		if (exit_names[i].reason == reason)
+			return exit_names[i].name;
+	sprintf(buf, "reason_%d", reason);
+	return buf;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"usage: kvmstat [-f vm_fd] [-c vcpu] [-i seconds] [-n count] [-v]\n"
+			"       kvmstat -t cpu [-i seconds] [-n count]\n"
+			"  -f  fd slot of the vm (default 0)\n"
+			"  -c  vcpu slot (default -1, the sum over the vm)\n"
+			"  -i  seconds between samples (default 1)\n"
+			"  -n  number of samples (default 0, until interrupted)\n"
+			"  -v  print the full cycle histogram of each exit reason\n"
+			"  -t  print the trace records of a host cpu, needs a driver\n"
+			"      built with CONFIG_WINKVM_TRACE\n");
+	exit(1);
+}
+
+static BOOL get_stats(HANDLE hnd, struct winkvm_stats *stats)
+{
+	DWORD retlen;
+
+	return DeviceIoControl(hnd, WINKVM_GET_STATS,
+						   stats, sizeof(*stats),
+						   stats, sizeof(*stats),
+						   &retlen, NULL);
+}
+
+/* upper bound in cycles of the bucket below which pct percent fall */
+static unsigned long hist_percentile(const __u32 *hist, __u32 count, int pct)
+{
+	__u32 sum = 0;
+	int i;
+
+	for (i = 0; i < WINKVM_NR_HIST_BUCKETS - 1; i++) {
+		sum += hist[i];
+		if ((double)sum * 100 >= (double)count * pct)
+			break;
+	}
+	return 256UL << i;
+}
+
+#define COUNTER(x) { #x, offsetof(struct winkvm_vcpu_stat, x) }
+
+static const struct {
+	const char *name;
+	int offset;
+} counters[] = {
+	COUNTER(exits),
+	COUNTER(io_exits),
+	COUNTER(mmio_exits),
+	COUNTER(mmio_coalesced),
+	COUNTER(halt_exits),
+	COUNTER(irq_exits),
+	COUNTER(irq_window_exits),
+	COUNTER(signal_exits),
+	COUNTER(request_irq_exits),
+	COUNTER(pf_fixed),
+	COUNTER(pf_guest),
+	COUNTER(pf_prefetch),
+	COUNTER(tlb_flush),
+	COUNTER(invlpg),
+	COUNTER(mmu_unsync),
+	COUNTER(mmu_sync),
+	COUNTER(pf_populate),
+};
+
+static __u32 counter(const struct winkvm_vcpu_stat *s, int i)
+{
+	return *(const __u32 *)((const char *)s + counters[i].offset);
+}
+
+static void print_delta(const struct winkvm_vcpu_stat *cur,
+						const struct winkvm_vcpu_stat *old,
+						int seconds, int verbose)
+{
+	__u32 total, count, hist[WINKVM_NR_HIST_BUCKETS];
+	__u64 cycles;
+	int i, j;
+
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+		printf("%-20s %10lu %10lu/s\n", counters[i].name,
+			   (unsigned long)counter(cur, i),
+			   (unsigned long)(counter(cur, i) - counter(old, i)) / seconds);
+
+	total = cur->exits - old->exits;
+	printf("\n%-20s %10s %6s %10s %10s %10s\n",
+		   "exit reason", "exits/s", "%", "avg cyc", "p50 <", "p99 <");
+	for (i = 0; i < WINKVM_NR_EXIT_REASONS; i++) {
+		count = cur->exit[i].count - old->exit[i].count;
+		if (!count)
+			continue;
+		cycles = cur->exit[i].cycles - old->exit[i].cycles;
+		for (j = 0; j < WINKVM_NR_HIST_BUCKETS; j++)
+			hist[j] = cur->exit[i].hist[j] - old->exit[i].hist[j];
+		printf("%-20s %10lu %6.1f %10lu %10lu %10lu\n",
+			   exit_name(i), (unsigned long)count / seconds,
+			   total ? count * 100.0 / total : 0.0,
+			   (unsigned long)(cycles / count),
+			   hist_percentile(hist, count, 50),
+			   hist_percentile(hist, count, 99));
+		if (verbose) {
+			for (j = 0; j < WINKVM_NR_HIST_BUCKETS; j++)
+				if (hist[j])
+					printf("    < %-10lu %10lu\n", 256UL << j,
+						   (unsigned long)hist[j]);
+		}
+	}
+	printf("\n");
+}
+
+static const char *trace_names[] = {
+	"?", "enter", "exit", "vmentry", "vmexit", "page_fault", "pio",
+	"mmio", "inj_irq",
+};
+
+static void print_trace(const struct winkvm_trace *trace)
+{
+	const struct winkvm_trace_rec *rec;
+	const char *name;
+	__u32 i;
+
+	if (trace->lost)
+		printf("-- %lu lost\n", (unsigned long)trace->lost);
+	for (i = 0; i < trace->nr; i++) {
+		rec = &trace->rec[i];
+		name = rec->event < sizeof(trace_names) / sizeof(trace_names[0]) ?
+			trace_names[rec->event] : "?";
+		printf("%20I64u %-10s %08lx %08lx %08lx %08lx\n", rec->tsc, name,
+			   (unsigned long)rec->args[0], (unsigned long)rec->args[1],
+			   (unsigned long)rec->args[2], (unsigned long)rec->args[3]);
+	}
+}
+
+static int dump_trace(HANDLE hnd, int cpu, int seconds, int samples)
+{
+	/* too large for the stack */
+	static struct winkvm_trace trace;
+	DWORD retlen;
+	int i;
+
+	for (i = 0; !samples || i < samples; i++) {
+		do {
+			trace.cpu = cpu;
+			if (!DeviceIoControl(hnd, WINKVM_GET_TRACE,
+								 &trace, sizeof(trace),
+								 &trace, sizeof(trace),
+								 &retlen, NULL)) {
+				fprintf(stderr, "kvmstat: no trace ring for cpu %d\n", cpu);
+				return 1;
+			}
+			print_trace(&trace);
+		} while (trace.nr == WINKVM_TRACE_BATCH);
+		Sleep(seconds * 1000);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct winkvm_stats cur, old;
+	HANDLE hnd;
+	int vm_fd = 0, vcpu = -1, seconds = 1, samples = 0, verbose = 0;
+	int trace_cpu = -1;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-v"))
+			verbose = 1;
+		else if (i + 1 < argc && !strcmp(argv[i], "-f"))
+			vm_fd = atoi(argv[++i]);
+		else if (i + 1 < argc && !strcmp(argv[i], "-c"))
+			vcpu = atoi(argv[++i]);
+		else if (i + 1 < argc && !strcmp(argv[i], "-i"))
+			seconds = atoi(argv[++i]);
+		else if (i + 1 < argc && !strcmp(argv[i], "-n"))
+			samples = atoi(argv[++i]);
+		else if (i + 1 < argc && !strcmp(argv[i], "-t"))
+			trace_cpu = atoi(argv[++i]);
+		else
+			usage();
+	}
+	if (seconds <= 0)
+		usage();
+
+	hnd = CreateFileA(WINKVM_DEVICE_NAME, GENERIC_READ | GENERIC_WRITE,
+					  FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+					  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hnd == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "kvmstat: cannot open %s\n", WINKVM_DEVICE_NAME);
+		return 1;
+	}
+
+	if (trace_cpu >= 0) {
+		i = dump_trace(hnd, trace_cpu, seconds, samples);
+		CloseHandle(hnd);
+		return i;
+	}
+
+	memset(&old, 0, sizeof(old));
+	old.vm_fd = vm_fd;
+	old.vcpu = vcpu;
+	if (!get_stats(hnd, &old)) {
+		fprintf(stderr, "kvmstat: no vm %d or vcpu %d\n", vm_fd, vcpu);
+		CloseHandle(hnd);
+		return 1;
+	}
+
+	for (i = 0; !samples || i < samples; i++) {
+		Sleep(seconds * 1000);
+		cur.vm_fd = vm_fd;
+		cur.vcpu = vcpu;
+		if (!get_stats(hnd, &cur)) {
+			fprintf(stderr, "kvmstat: the vm went away\n");
+			break;
+		}
+		print_delta(&cur.stat, &old.stat, seconds, verbose);
+		old = cur;
+	}
+
+	CloseHandle(hnd);
+	return 0;
+}
@@ -129,6 +129,44 @@ static inline unsigned long __ffs(unsigned long word)
 	return word;	
 }
 
+/**
+ * fls - find last set bit in word.
+ * @x: the word to search
+ *
+ * Returns 1 for the least significant bit and 32 for the most
+ * significant, 0 if no bit is set.
+ */
+static inline int fls(int x)
+{
+	int r;
+
+	__asm__("bsrl %1,%0\n\t"
+		"jnz 1f\n\t"
+		"movl $-1,%0\n"
+		"1:" : "=r" (r) : "rm" (x));
+	return r + 1;
+}
+
+/*
+ * do_div - divide the u64 @n in place by the u32 @base and return the
+ * remainder, without pulling in libgcc's 64 bit division.
+ */
+#ifndef do_div
+#define do_div(n,base) ({ \
+	unsigned long __upper, __low, __high, __mod, __base; \
+	__base = (base); \
+	asm("":"=a" (__low), "=d" (__high):"A" (n)); \
+	__upper = __high; \
+	if (__high) { \
+		__upper = __high % (__base); \
+		__high = __high / (__base); \
+	} \
+	asm("divl %2":"=a" (__low), "=d" (__mod):"rm" (__base), "0" (__low), "1" (__upper)); \
+	asm("":"=A" (n):"a" (__low),"d" (__high)); \
+	__mod; \
+})
+#endif
+
 /**
  * clear_bit - Clears a bit in memory
  * @nr: Bit to clear
@@ -368,15 +406,11 @@ static inline unsigned long read_fs_base(void)
 	struct Xgt_desc_struct Xgt_desc;	
 	struct desc_struct *desc;
 
-	FUNCTION_ENTER();   
-
 	store_gdt(&Xgt_desc);
 	desc = (struct desc_struct*)Xgt_desc.address;	
 
 	base_address =  (desc[fs_s].base2 << 24) | (desc[fs_s].base1 << 16) | desc[fs_s].base0;
 	
-	FUNCTION_EXIT();
-	
 	return base_address;
 }
 
@@ -387,15 +421,11 @@ static inline unsigned long read_gs_base(void)
 	struct Xgt_desc_struct Xgt_desc;	
 	struct desc_struct *desc;
 
-	FUNCTION_ENTER();
-	
 	store_gdt(&Xgt_desc);
 	desc = (struct desc_struct*)Xgt_desc.address;
 
 	base_address =  (desc[gs_s].base2 << 24) | (desc[gs_s].base1 << 16) | desc[gs_s].base0;	
 
-	FUNCTION_EXIT();	
-	
 	return base_address;
 }
 
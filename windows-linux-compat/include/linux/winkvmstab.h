@@ -105,8 +105,25 @@ extern struct task_struct *current;
 
 extern int signal_pending(struct task_struct *p);
 
-/* temporary */
-#define __WINKVM_CPUNUMS__ 1
+/* host timers and events of the in-kernel irqchip, see timer.c */
+struct winkvm_timer;
+struct winkvm_event;
+
+extern struct winkvm_timer *winkvm_timer_create(void (*func)(void *data), void *data);
+extern void winkvm_timer_start(struct winkvm_timer *timer, u64 delay_ns, u64 period_ns);
+extern void winkvm_timer_cancel(struct winkvm_timer *timer);
+extern void winkvm_timer_destroy(struct winkvm_timer *timer);
+extern u64 winkvm_get_ns(void);
+
+extern struct winkvm_event *winkvm_event_create(void);
+extern void winkvm_event_set(struct winkvm_event *event);
+extern int winkvm_event_wait(struct winkvm_event *event, u64 timeout_ns);
+extern void winkvm_event_destroy(struct winkvm_event *event);
+
+extern void smp_send_reschedule(int cpu);
+
+/* MAXIMUM_PROCESSORS of x86 windows, same as SMPF_SLOTNUM of the driver */
+#define __WINKVM_CPUNUMS__ 32
 
 /*
  * Error return values for the *_nopage functions 
@@ -207,6 +224,11 @@ extern struct page *alloc_pages_node(int nid, unsigned int gfp_mask,
 
 /* winkvm special function */
 extern struct page *wk_alloc_page(unsigned long g_basefn, unsigned long i, unsigned int flags);
+extern int wk_demand_paged(unsigned long gfn);
+extern int wk_populate_pages(unsigned long gfn, unsigned long npages);
+extern struct page *wk_demand_page(unsigned long gfn);
+extern int wk_release_pages(unsigned long gfn, unsigned long npages);
+extern void wk_discard_pages(unsigned long gfn, unsigned long npages);
 /* end */
 
 extern void __free_page(struct page *page);
@@ -345,8 +367,26 @@ static inline long IS_ERR(const void *ptr)
 extern void function_enter(enum dbgmsg_level, const char*);
 extern void function_exit(enum dbgmsg_level, const char*);
 
-#define FUNCTION_ENTER() function_enter(DBG_MISC, __FUNCTION__);
-#define FUNCTION_EXIT() function_exit(DBG_MISC, __FUNCTION__);
+/*
+ * Build with -DCONFIG_WINKVM_TRACE to record events into a per-cpu
+ * ring that user space drains with WINKVM_GET_TRACE.  Without it the
+ * trace points compile to nothing.  The event ids are in linux/kvm.h.
+ */
+#ifdef CONFIG_WINKVM_TRACE
+extern void winkvm_trace(u32 event, u32 a0, u32 a1, u32 a2, u32 a3);
+
+#ifndef _THIS_IP_
+#define _THIS_IP_ ({ __label__ __here; __here: (unsigned long)&&__here; })
+#endif
+
+#define WINKVM_TRACE(event, a0, a1, a2, a3) \
+	winkvm_trace((event), (u32)(a0), (u32)(a1), (u32)(a2), (u32)(a3))
+#else
+#define WINKVM_TRACE(event, a0, a1, a2, a3) do { } while (0)
+#endif
+
+#define FUNCTION_ENTER() WINKVM_TRACE(WINKVM_TRC_FUNC_ENTER, _THIS_IP_, 0, 0, 0)
+#define FUNCTION_EXIT() WINKVM_TRACE(WINKVM_TRC_FUNC_EXIT, _THIS_IP_, 0, 0, 0)
 
 #endif /* __WINKVM__ */
 